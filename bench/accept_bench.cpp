@@ -0,0 +1,276 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+// Several threads of one process accepting from the same protector
+// connection. A sender thread plays the server, passing descriptors to
+// the client library as fast as the channel takes them, and each
+// consumer thread accepts, optionally busies itself for a while as if
+// serving the connection, and closes it. Two ways of sharing are timed:
+//
+//   locked      socket_protector_create with a mutex around accept, so
+//               the threads funnel through one accept at a time
+//   concurrent  socket_protector_create_concurrent, threads call accept
+//               freely
+//
+// Reports descriptors per second, voluntary context switches per
+// descriptor (how often a thread went to sleep) and the spread of the
+// per-thread counts, min / max over the mean.
+//
+// Usage: accept_bench [-d seconds] [-w usec of work per descriptor]
+
+#include "SocketProtector.h"
+#include "FDPassing.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h>
+#include <vector>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+struct Consumer
+{
+	SocketProtector *protector;
+	pthread_mutex_t *lock;
+	int workUs;
+	pthread_t thread;
+	unsigned long long accepted;
+};
+
+struct Sender
+{
+	int sock;
+	int payload;
+	double until;
+	unsigned long long sent;
+};
+
+double
+now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return double( ts.tv_sec ) + double( ts.tv_nsec ) * 1e-9;
+}
+
+void
+spin( int usec )
+{
+	double end = now() + double( usec ) * 1e-6;
+	while ( now() < end )
+		;
+}
+
+long
+contextSwitches( void )
+{
+	struct rusage ru;
+	getrusage( RUSAGE_SELF, &ru );
+	return ru.ru_nvcsw;
+}
+
+void *
+consume( void *arg )
+{
+	Consumer &c = *reinterpret_cast<Consumer *>( arg );
+	while ( true )
+	{
+		if ( c.lock )
+			pthread_mutex_lock( c.lock );
+		int fd = c.protector->accept();
+		if ( c.lock )
+			pthread_mutex_unlock( c.lock );
+		if ( fd < 0 )
+			break;
+		if ( c.workUs > 0 )
+			spin( c.workUs );
+		close( fd );
+		++c.accepted;
+	}
+	return NULL;
+}
+
+void *
+produce( void *arg )
+{
+	Sender &s = *reinterpret_cast<Sender *>( arg );
+	while ( ( s.sent & 255 ) != 0 || now() < s.until )
+	{
+		if ( FDPassing::send( s.sock, s.payload, 0 ) != 0 )
+			break;
+		++s.sent;
+	}
+	// the consumers drain what's in flight and then see us gone
+	close( s.sock );
+	return NULL;
+}
+
+/// the listening side of the channel the library connects to for port
+int
+listenAs( uint16_t port )
+{
+	int s = socket( PF_LOCAL, SOCK_STREAM, 0 );
+	struct sockaddr_un local;
+	memset( &local, 0, sizeof(local) );
+	local.sun_family = PF_UNIX;
+	snprintf( local.sun_path + 1, sizeof(local.sun_path) - 1, "sock_srv_%u", unsigned( port ) );
+	if ( s < 0 || bind( s, (struct sockaddr *)&local, sizeof(local) ) != 0 || listen( s, 1 ) != 0 )
+	{
+		if ( s >= 0 )
+			close( s );
+		return -1;
+	}
+	return s;
+}
+
+void
+run( bool concurrent, size_t threads, double seconds, int workUs, int payload )
+{
+	// an abstract name nobody else is using
+	uint16_t port = 0;
+	int lsock = -1;
+	for ( uint16_t p = 40000 + getpid() % 20000; lsock < 0; ++p )
+	{
+		port = p;
+		lsock = listenAs( port );
+	}
+
+	SocketProtector protector( port, concurrent );
+	Sender s;
+	s.sock = accept( lsock, NULL, NULL );
+	close( lsock );
+	if ( protector.is_terminated() || s.sock < 0 )
+	{
+		fprintf( stderr, "unable to set up the protector channel\n" );
+		exit( 1 );
+	}
+	s.payload = payload;
+	s.sent = 0;
+
+	pthread_mutex_t lock;
+	pthread_mutex_init( &lock, NULL );
+	std::vector<Consumer> consumers( threads );
+	long csw0 = contextSwitches();
+	double start = now();
+	s.until = start + seconds;
+	for ( size_t i = 0; i != threads; ++i )
+	{
+		consumers[i].protector = &protector;
+		consumers[i].lock = concurrent ? NULL : &lock;
+		consumers[i].workUs = workUs;
+		consumers[i].accepted = 0;
+		pthread_create( &consumers[i].thread, NULL, &consume, &consumers[i] );
+	}
+	pthread_t sthr;
+	pthread_create( &sthr, NULL, &produce, &s );
+
+	pthread_join( sthr, NULL );
+	unsigned long long total = 0, lo = ~0ULL, hi = 0;
+	for ( size_t i = 0; i != threads; ++i )
+	{
+		pthread_join( consumers[i].thread, NULL );
+		total += consumers[i].accepted;
+		lo = std::min( lo, consumers[i].accepted );
+		hi = std::max( hi, consumers[i].accepted );
+	}
+	double elapsed = now() - start;
+	long csw = contextSwitches() - csw0;
+	pthread_mutex_destroy( &lock );
+
+	if ( total != s.sent )
+		fprintf( stderr, "sent %llu descriptors, accepted %llu\n", s.sent, total );
+
+	double mean = double( total ) / double( threads );
+	printf( "%-10s %7zu %12.0f %10.3f %8.2f %8.2f\n",
+			concurrent ? "concurrent" : "locked", threads,
+			double( total ) / elapsed,
+			total ? double( csw ) / double( total ) : 0.0,
+			mean > 0 ? double( lo ) / mean : 0.0,
+			mean > 0 ? double( hi ) / mean : 0.0 );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	openlog( "accept_bench", LOG_PERROR, LOG_USER );
+	( void )setlogmask( LOG_UPTO( LOG_WARNING ) );
+
+	double seconds = 1.0;
+	int workUs = 0;
+	for ( int a = 1; a < argc; ++a )
+	{
+		if ( ! strcmp( argv[a], "-d" ) && a + 1 < argc )
+			seconds = atof( argv[++a] );
+		else if ( ! strcmp( argv[a], "-w" ) && a + 1 < argc )
+			workUs = atoi( argv[++a] );
+		else
+		{
+			fprintf( stderr, "Usage: %s [-d seconds] [-w usec of work per descriptor]\n", argv[0] );
+			return -1;
+		}
+	}
+	if ( seconds <= 0 || workUs < 0 )
+	{
+		fprintf( stderr, "Usage: %s [-d seconds] [-w usec of work per descriptor]\n", argv[0] );
+		return -1;
+	}
+
+	int payload = socket( AF_INET, SOCK_STREAM, 0 );
+	if ( payload < 0 )
+	{
+		perror( "socket" );
+		return -1;
+	}
+
+	printf( "%-10s %7s %12s %10s %8s %8s\n",
+			"mode", "threads", "fds/s", "csw/fd", "min", "max" );
+	static const size_t threadCounts[] = { 1, 2, 4, 8 };
+	for ( int concurrent = 0; concurrent != 2; ++concurrent )
+	{
+		for ( size_t t = 0; t != sizeof(threadCounts) / sizeof(threadCounts[0]); ++t )
+			run( concurrent != 0, threadCounts[t], seconds, workUs, payload );
+	}
+	close( payload );
+	return 0;
+}
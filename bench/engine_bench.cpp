@@ -0,0 +1,286 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+// Compares the run loop engines on the accept and handoff path. Client
+// threads connect to a loopback listener as fast as they can, and the
+// engine under test accepts each connection and passes it over a UNIX
+// socket to a worker thread, which closes it, the same work SocketServer
+// does per connection.
+//
+// Reports accepts per second and the CPU time the accepting thread
+// spent per connection.
+//
+// Usage: engine_bench [seconds [clients]]
+
+#include "EventEngine.h"
+#include "FDPassing.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <vector>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+volatile bool theStop = false;
+struct sockaddr_in theAddr;
+
+double
+now( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return double( tv.tv_sec ) + double( tv.tv_usec ) * 1e-6;
+}
+
+double
+threadCPU( void )
+{
+	struct rusage ru;
+#ifdef RUSAGE_THREAD
+	getrusage( RUSAGE_THREAD, &ru );
+#else
+	getrusage( RUSAGE_SELF, &ru );
+#endif
+	return double( ru.ru_utime.tv_sec + ru.ru_stime.tv_sec ) +
+		double( ru.ru_utime.tv_usec + ru.ru_stime.tv_usec ) * 1e-6;
+}
+
+void *
+client( void * )
+{
+	// reset instead of a normal close, so we don't run out of ports to
+	// TIME_WAIT
+	struct linger lg;
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	while ( ! theStop )
+	{
+		int s = socket( AF_INET, SOCK_STREAM, 0 );
+		if ( s < 0 )
+			break;
+		setsockopt( s, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg) );
+		if ( connect( s, (struct sockaddr *)&theAddr, sizeof(theAddr) ) != 0 )
+			usleep( 1000 );
+		close( s );
+	}
+	return NULL;
+}
+
+void *
+worker( void *arg )
+{
+	int sock = *reinterpret_cast<int *>( arg );
+	while ( true )
+	{
+		char b[64];
+		union
+		{
+			struct cmsghdr align;
+			char buf[CMSG_SPACE(64 * sizeof(int))];
+		} control;
+		struct iovec vec;
+		vec.iov_base = b;
+		vec.iov_len = sizeof(b);
+		struct msghdr msg;
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = &vec;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		ssize_t n = recvmsg( sock, &msg, 0 );
+		if ( n <= 0 )
+			break;
+		for ( struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c) )
+		{
+			if ( c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS )
+				continue;
+			size_t nfd = ( c->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+			int *fds = reinterpret_cast<int *>( CMSG_DATA(c) );
+			for ( size_t i = 0; i != nfd; ++i )
+				close( fds[i] );
+		}
+	}
+	return NULL;
+}
+
+bool
+runEngine( EventEngine::Type type, double seconds, int nClients )
+{
+	static const char *names[] = { "select", "epoll", "io_uring" };
+	const char *name = names[type];
+
+	EventEngine *engine = EventEngine::create( type );
+	if ( engine->type() != type )
+	{
+		printf( "%-10s unavailable\n", name );
+		delete engine;
+		return false;
+	}
+
+	int lsock = socket( AF_INET, SOCK_STREAM, 0 );
+	memset( &theAddr, 0, sizeof(theAddr) );
+	theAddr.sin_family = AF_INET;
+	theAddr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	socklen_t len = sizeof(theAddr);
+	if ( bind( lsock, (struct sockaddr *)&theAddr, sizeof(theAddr) ) != 0 ||
+		 listen( lsock, 1024 ) != 0 ||
+		 getsockname( lsock, (struct sockaddr *)&theAddr, &len ) != 0 )
+	{
+		perror( "listen" );
+		return false;
+	}
+	if ( ! engine->acceptsDirectly() )
+		fcntl( lsock, F_SETFL, fcntl( lsock, F_GETFL, 0 ) | O_NONBLOCK );
+
+	int sv[2];
+	socketpair( AF_UNIX, SOCK_STREAM, 0, sv );
+	pthread_t wthr;
+	pthread_create( &wthr, NULL, &worker, &sv[1] );
+
+	std::vector<int> lsocks( 1, lsock );
+	engine->watchListeners( lsocks );
+
+	theStop = false;
+	std::vector<pthread_t> clients( nClients );
+	for ( int c = 0; c != nClients; ++c )
+		pthread_create( &clients[c], NULL, &client, NULL );
+
+	const size_t kBatch = 64;
+	FDPassing::Message msgs[kBatch];
+	EventEngine::Send sends[kBatch];
+	int fds[kBatch];
+	unsigned long long accepted = 0;
+
+	double cpu0 = threadCPU();
+	double start = now();
+	double end = start + seconds;
+	while ( now() < end )
+	{
+		engine->reset();
+		if ( ! engine->acceptsDirectly() )
+			engine->add( lsock, EventEngine::WantRead );
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		if ( engine->wait( &tv ) < 0 && errno != EINTR )
+			break;
+
+		size_t n = 0;
+		while ( n != kBatch )
+		{
+			size_t l;
+			int fd = -1;
+			if ( engine->acceptsDirectly() )
+			{
+				if ( ! engine->popAccepted( l, fd ) )
+					break;
+			}
+			else if ( engine->ready( lsock, EventEngine::WantRead ) )
+			{
+				fd = accept( lsock, NULL, NULL );
+				if ( fd < 0 )
+					break;
+			}
+			else
+				break;
+			fds[n] = fd;
+			msgs[n].init( fd );
+			sends[n].sock = sv[0];
+			sends[n].msg = &msgs[n].msg;
+			++n;
+		}
+
+		engine->sendBatch( sends, n );
+		for ( size_t i = 0; i != n; ++i )
+		{
+			// the worker fell behind, wait for it
+			if ( sends[i].result == EAGAIN || sends[i].result == EWOULDBLOCK )
+				sendmsg( sv[0], &msgs[i].msg, 0 );
+			close( fds[i] );
+		}
+		accepted += n;
+	}
+	double elapsed = now() - start;
+	double cpu = threadCPU() - cpu0;
+
+	theStop = true;
+	for ( int c = 0; c != nClients; ++c )
+		pthread_join( clients[c], NULL );
+	close( lsock );
+	delete engine;
+	shutdown( sv[0], SHUT_RDWR );
+	pthread_join( wthr, NULL );
+	close( sv[0] );
+	close( sv[1] );
+
+	printf( "%-10s %12.0f %14.2f %10.1f%%\n", name,
+			double( accepted ) / elapsed,
+			accepted ? cpu * 1e6 / double( accepted ) : 0.0,
+			cpu * 100.0 / elapsed );
+	return true;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	openlog( "engine_bench", LOG_PERROR, LOG_USER );
+	( void )setlogmask( LOG_UPTO( LOG_NOTICE ) );
+
+	double seconds = argc > 1 ? atof( argv[1] ) : 3.0;
+	int nClients = argc > 2 ? atoi( argv[2] ) : 4;
+	if ( seconds <= 0 || nClients <= 0 )
+	{
+		fprintf( stderr, "Usage: %s [seconds [clients]]\n", argv[0] );
+		return -1;
+	}
+
+	printf( "%-10s %12s %14s %11s\n", "engine", "accepts/s", "cpu-us/conn", "cpu" );
+	runEngine( EventEngine::EngineSelect, seconds, nClients );
+	runEngine( EventEngine::EngineEpoll, seconds, nClients );
+	runEngine( EventEngine::EngineUring, seconds, nClients );
+	return 0;
+}
+
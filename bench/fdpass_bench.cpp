@@ -0,0 +1,498 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+// Cost of the descriptor passing path on its own: FDPassing::send, as the
+// server hands off a connection, and FDPassing::receive, as the client
+// library picks one up, over a UNIX socketpair with no networking or
+// accepting involved. The same socket is passed over and over, and the
+// receivers close each copy they get.
+//
+//   single     one descriptor per sendmsg, one recvmsg per descriptor
+//   batched    sendmmsg / recvmmsg of one descriptor messages
+//   multi-fd   many descriptors on a single message
+//   receivers  one sender spreading descriptors over several receivers
+//
+// each at a few socket send buffer sizes, which bound how many
+// descriptors can be in flight to a receiver. Reports ns per descriptor
+// and system calls per descriptor on each side (waiting for buffer space
+// included, the receivers' closes not).
+//
+// Then probes the kernel limits: how many descriptors fit in flight
+// before the sender gets EAGAIN, the most descriptors one message can
+// carry (SCM_MAX_FD), and whether in-flight descriptors past
+// RLIMIT_NOFILE fail with ETOOMANYREFS for this user.
+//
+// Usage: fdpass_bench [descriptors]
+
+#include "FDPassing.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <vector>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+const size_t kMaxBatch = 64;
+/// SCM_MAX_FD in the kernel
+const size_t kMaxFDsPerMessage = 253;
+
+struct Receiver
+{
+	int sock;
+	size_t batch;
+	pthread_t thread;
+	unsigned long long received;
+	unsigned long long calls;
+};
+
+struct Config
+{
+	const char *name;
+	size_t receivers;
+	size_t sendBatch;
+	size_t recvBatch;
+	size_t fdsPerMessage;
+	int sndbuf;
+};
+
+double
+now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return double( ts.tv_sec ) + double( ts.tv_nsec ) * 1e-9;
+}
+
+size_t
+closeAll( struct msghdr &msg )
+{
+	size_t n = 0;
+	for ( struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c) )
+	{
+		if ( c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS )
+			continue;
+		size_t nfd = ( c->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+		for ( size_t i = 0; i != nfd; ++i )
+		{
+			int fd;
+			memcpy( &fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int) );
+			close( fd );
+		}
+		n += nfd;
+	}
+	return n;
+}
+
+void *
+receive( void *arg )
+{
+	Receiver &r = *reinterpret_cast<Receiver *>( arg );
+
+	// the library's path
+	if ( r.batch == 0 )
+	{
+		while ( true )
+		{
+			int fd;
+			ssize_t n = FDPassing::receive( r.sock, fd, 0 );
+			++r.calls;
+			if ( n <= 0 )
+				break;
+			if ( fd != -1 )
+			{
+				close( fd );
+				++r.received;
+			}
+		}
+		return NULL;
+	}
+
+	// room for a full message of descriptors in each slot
+	const size_t ctlSize = CMSG_SPACE(kMaxFDsPerMessage * sizeof(int));
+	std::vector<char> control( r.batch * ctlSize );
+	std::vector<char> bytes( r.batch );
+	std::vector<struct iovec> vecs( r.batch );
+	std::vector<struct mmsghdr> msgs( r.batch );
+	while ( true )
+	{
+		for ( size_t i = 0; i != r.batch; ++i )
+		{
+			vecs[i].iov_base = &bytes[i];
+			vecs[i].iov_len = 1;
+			memset( &msgs[i], 0, sizeof(msgs[i]) );
+			msgs[i].msg_hdr.msg_iov = &vecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = &control[i * ctlSize];
+			msgs[i].msg_hdr.msg_controllen = ctlSize;
+		}
+
+		int n = recvmmsg( r.sock, &msgs[0], static_cast<unsigned int>( r.batch ), MSG_WAITFORONE, NULL );
+		++r.calls;
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			break;
+		bool done = false;
+		for ( int i = 0; i != n; ++i )
+		{
+			if ( msgs[i].msg_len == 0 )
+				done = true;
+			r.received += closeAll( msgs[i].msg_hdr );
+		}
+		if ( done )
+			break;
+	}
+	return NULL;
+}
+
+bool
+waitWritable( int sock )
+{
+	struct pollfd p;
+	p.fd = sock;
+	p.events = POLLOUT;
+	return poll( &p, 1, 5000 ) == 1;
+}
+
+void
+run( const Config &cfg, int payload, unsigned long long total )
+{
+	std::vector<int> senders( cfg.receivers );
+	std::vector<Receiver> receivers( cfg.receivers );
+	for ( size_t i = 0; i != cfg.receivers; ++i )
+	{
+		int sv[2];
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 )
+		{
+			perror( "socketpair" );
+			exit( -1 );
+		}
+		if ( cfg.sndbuf > 0 )
+			setsockopt( sv[0], SOL_SOCKET, SO_SNDBUF, &cfg.sndbuf, sizeof(cfg.sndbuf) );
+		senders[i] = sv[0];
+		receivers[i].sock = sv[1];
+		receivers[i].batch = cfg.recvBatch;
+		receivers[i].received = 0;
+		receivers[i].calls = 0;
+	}
+	for ( size_t i = 0; i != cfg.receivers; ++i )
+		pthread_create( &receivers[i].thread, NULL, &receive, &receivers[i] );
+
+	// every message is the same, build them once
+	FDPassing::Message msgs[kMaxBatch];
+	struct mmsghdr vec[kMaxBatch];
+	for ( size_t i = 0; i != kMaxBatch; ++i )
+	{
+		msgs[i].init( payload );
+		memset( &vec[i], 0, sizeof(vec[i]) );
+		vec[i].msg_hdr = msgs[i].msg;
+	}
+
+	std::vector<int> many( cfg.fdsPerMessage, payload );
+	std::vector<char> manyCtl( CMSG_SPACE(cfg.fdsPerMessage * sizeof(int)) );
+	char byte = 'x';
+	struct iovec manyVec;
+	manyVec.iov_base = &byte;
+	manyVec.iov_len = 1;
+	struct msghdr manyMsg;
+	memset( &manyMsg, 0, sizeof(manyMsg) );
+	manyMsg.msg_iov = &manyVec;
+	manyMsg.msg_iovlen = 1;
+	manyMsg.msg_control = &manyCtl[0];
+	manyMsg.msg_controllen = CMSG_LEN(cfg.fdsPerMessage * sizeof(int));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&manyMsg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(cfg.fdsPerMessage * sizeof(int));
+	memcpy( CMSG_DATA(cmsg), &many[0], cfg.fdsPerMessage * sizeof(int) );
+
+	unsigned long long sent = 0, calls = 0;
+	size_t next = 0;
+	int failure = 0;
+	double start = now();
+	while ( sent < total && ! failure )
+	{
+		int sock = senders[next];
+		int err = 0;
+		if ( cfg.fdsPerMessage > 1 )
+		{
+			++calls;
+			if ( sendmsg( sock, &manyMsg, MSG_DONTWAIT ) < 0 )
+				err = errno;
+			else
+				sent += cfg.fdsPerMessage;
+		}
+		else if ( cfg.sendBatch > 1 )
+		{
+			unsigned int n = static_cast<unsigned int>( std::min( (unsigned long long)cfg.sendBatch, total - sent ) );
+			++calls;
+			int rv = sendmmsg( sock, vec, n, MSG_DONTWAIT );
+			if ( rv < 0 )
+				err = errno;
+			else
+				sent += static_cast<unsigned long long>( rv );
+		}
+		else
+		{
+			++calls;
+			err = FDPassing::send( sock, payload, MSG_DONTWAIT );
+			if ( ! err )
+				++sent;
+		}
+
+		if ( err == EAGAIN || err == EWOULDBLOCK )
+		{
+			++calls;
+			if ( ! waitWritable( sock ) )
+				failure = ETIMEDOUT;
+		}
+		else if ( err && err != EINTR )
+			failure = err;
+		else if ( ! err )
+			next = ( next + 1 ) % cfg.receivers;
+	}
+
+	unsigned long long received = 0, recvCalls = 0;
+	for ( size_t i = 0; i != cfg.receivers; ++i )
+	{
+		shutdown( senders[i], SHUT_WR );
+		pthread_join( receivers[i].thread, NULL );
+		received += receivers[i].received;
+		recvCalls += receivers[i].calls;
+		close( senders[i] );
+		close( receivers[i].sock );
+	}
+	double elapsed = now() - start;
+
+	char sndbuf[16];
+	if ( cfg.sndbuf > 0 )
+		snprintf( sndbuf, sizeof(sndbuf), "%dk", cfg.sndbuf / 1024 );
+	else
+		snprintf( sndbuf, sizeof(sndbuf), "default" );
+
+	if ( failure )
+	{
+		printf( "%-10s %4lu %6lu %6lu %8s  failed after %llu: %s\n", cfg.name,
+				(unsigned long)cfg.receivers, (unsigned long)std::max( cfg.sendBatch, cfg.recvBatch ),
+				(unsigned long)cfg.fdsPerMessage, sndbuf, sent, strerror( failure ) );
+		return;
+	}
+
+	printf( "%-10s %4lu %6lu %6lu %8s %10.1f %10.3f %10.3f\n", cfg.name,
+			(unsigned long)cfg.receivers, (unsigned long)std::max( cfg.sendBatch, cfg.recvBatch ),
+			(unsigned long)cfg.fdsPerMessage, sndbuf,
+			received ? elapsed * 1e9 / double( received ) : 0.0,
+			sent ? double( calls ) / double( sent ) : 0.0,
+			received ? double( recvCalls ) / double( received ) : 0.0 );
+}
+
+/// sends to a receiver that never reads until something gives, returns
+/// how many descriptors made it and what stopped the next one
+unsigned long long
+fillInFlight( int payload, int sndbuf, unsigned long long most, int &err )
+{
+	int sv[2];
+	socketpair( AF_UNIX, SOCK_STREAM, 0, sv );
+	if ( sndbuf > 0 )
+		setsockopt( sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf) );
+
+	unsigned long long n = 0;
+	err = 0;
+	while ( n < most )
+	{
+		err = FDPassing::send( sv[0], payload, MSG_DONTWAIT );
+		if ( err )
+			break;
+		++n;
+	}
+	close( sv[0] );
+	close( sv[1] );
+	return n;
+}
+
+const char *
+errName( int err )
+{
+	switch ( err )
+	{
+		case 0: return "no error";
+		case EAGAIN: return "EAGAIN";
+		case ETOOMANYREFS: return "ETOOMANYREFS";
+		case EINVAL: return "EINVAL";
+		case ENOBUFS: return "ENOBUFS";
+		case ENOMEM: return "ENOMEM";
+		default: return strerror( err );
+	}
+}
+
+void
+probeLimits( int payload )
+{
+	printf( "\nkernel limits\n" );
+
+	static const int sndbufs[] = { 0, 16 * 1024, 256 * 1024, 4 * 1024 * 1024 };
+	for ( size_t i = 0; i != sizeof(sndbufs) / sizeof(sndbufs[0]); ++i )
+	{
+		int err;
+		unsigned long long n = fillInFlight( payload, sndbufs[i], 1000000, err );
+		int eff = 0;
+		socklen_t len = sizeof(eff);
+		int probe[2];
+		socketpair( AF_UNIX, SOCK_STREAM, 0, probe );
+		if ( sndbufs[i] > 0 )
+			setsockopt( probe[0], SOL_SOCKET, SO_SNDBUF, &sndbufs[i], sizeof(sndbufs[i]) );
+		getsockopt( probe[0], SOL_SOCKET, SO_SNDBUF, &eff, &len );
+		close( probe[0] );
+		close( probe[1] );
+		char req[16];
+		if ( sndbufs[i] > 0 )
+			snprintf( req, sizeof(req), "%dk", sndbufs[i] / 1024 );
+		else
+			snprintf( req, sizeof(req), "default" );
+		printf( "  in flight, SO_SNDBUF %8s (kernel %7dk): %7llu descriptors, then %s\n",
+				req, eff / 1024, n, errName( err ) );
+	}
+
+	// the largest single message the kernel takes
+	size_t most = 0;
+	int mostErr = 0;
+	for ( size_t k = kMaxFDsPerMessage - 1; k <= kMaxFDsPerMessage + 1; ++k )
+	{
+		int sv[2];
+		socketpair( AF_UNIX, SOCK_STREAM, 0, sv );
+		std::vector<int> fds( k, payload );
+		std::vector<char> ctl( CMSG_SPACE(k * sizeof(int)) );
+		char byte = 'x';
+		struct iovec v;
+		v.iov_base = &byte;
+		v.iov_len = 1;
+		struct msghdr msg;
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = &v;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &ctl[0];
+		msg.msg_controllen = CMSG_LEN(k * sizeof(int));
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(k * sizeof(int));
+		memcpy( CMSG_DATA(c), &fds[0], k * sizeof(int) );
+		bool ok = sendmsg( sv[0], &msg, MSG_DONTWAIT ) >= 0;
+		if ( ok )
+			most = k;
+		else
+			mostErr = errno;
+		close( sv[0] );
+		close( sv[1] );
+		if ( ! ok )
+			break;
+	}
+	printf( "  descriptors per message: %lu, then %s\n", (unsigned long)most, errName( mostErr ) );
+
+	// unprivileged senders are held to RLIMIT_NOFILE descriptors in
+	// flight across all their UNIX sockets, a protector with many busy
+	// workers can hit that long before any buffer fills
+	struct rlimit orig;
+	getrlimit( RLIMIT_NOFILE, &orig );
+	struct rlimit low = orig;
+	low.rlim_cur = std::min<rlim_t>( orig.rlim_cur, 256 );
+	setrlimit( RLIMIT_NOFILE, &low );
+	int err;
+	unsigned long long n = fillInFlight( payload, 4 * 1024 * 1024, 4 * low.rlim_cur, err );
+	setrlimit( RLIMIT_NOFILE, &orig );
+	if ( err == ETOOMANYREFS )
+		printf( "  RLIMIT_NOFILE %lu: ETOOMANYREFS with %llu in flight (limit %llu in production)\n",
+				(unsigned long)low.rlim_cur, n, (unsigned long long)orig.rlim_cur );
+	else
+		printf( "  RLIMIT_NOFILE %lu: %llu in flight, then %s; not enforced for this user (CAP_SYS_RESOURCE?)\n",
+				(unsigned long)low.rlim_cur, n, errName( err ) );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	unsigned long long total = argc > 1 ? strtoull( argv[1], NULL, 10 ) : 200000;
+	if ( total == 0 )
+	{
+		fprintf( stderr, "Usage: %s [descriptors]\n", argv[0] );
+		return -1;
+	}
+
+	int payload = socket( AF_INET, SOCK_STREAM, 0 );
+	if ( payload < 0 )
+	{
+		perror( "socket" );
+		return -1;
+	}
+
+	static const Config configs[] =
+	{
+		{ "single", 1, 1, 0, 1, 0 },
+		{ "single", 1, 1, 0, 1, 16 * 1024 },
+		{ "single", 1, 1, 0, 1, 256 * 1024 },
+		{ "single", 1, 1, 0, 1, 4 * 1024 * 1024 },
+		{ "batched", 1, 8, 8, 1, 0 },
+		{ "batched", 1, 32, 32, 1, 0 },
+		{ "batched", 1, 64, 64, 1, 0 },
+		{ "batched", 1, 64, 64, 1, 4 * 1024 * 1024 },
+		{ "multi-fd", 1, 1, 1, 16, 0 },
+		{ "multi-fd", 1, 1, 1, 64, 0 },
+		{ "multi-fd", 1, 1, 1, 253, 0 },
+		{ "receivers", 2, 1, 0, 1, 0 },
+		{ "receivers", 4, 1, 0, 1, 0 },
+		{ "receivers", 8, 1, 0, 1, 0 },
+		{ "receivers", 8, 64, 64, 1, 0 },
+	};
+
+	printf( "%-10s %4s %6s %6s %8s %10s %10s %10s\n",
+			"config", "rcvr", "batch", "fd/msg", "sndbuf", "ns/fd", "send sc/fd", "recv sc/fd" );
+	for ( size_t i = 0; i != sizeof(configs) / sizeof(configs[0]); ++i )
+		run( configs[i], payload, total );
+
+	probeLimits( payload );
+	close( payload );
+	return 0;
+}
+
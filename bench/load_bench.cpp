@@ -0,0 +1,239 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+// End to end connection throughput through SocketProtector. Starts
+// Build/SocketProtector with Build/EchoServer as its workers, then drives
+// loopback connections, one HTTP request each, through it from client
+// threads, either as fast as a fixed number of them can (closed loop) or
+// at a fixed rate (open loop).
+//
+// Reports as JSON: connections per second, how each connection ended,
+// connect and connect to first byte latency percentiles as the client
+// saw them, accept to handoff percentiles from the protector's stats
+// segment, and the CPU the protector used.
+//
+// Usage: load_bench [-d seconds] [-c threads] [-r rate] [-t timeout]
+//                   [-w workers] [-p port] [-o file] [-v]
+//                   [--protector path] [--backend path]
+//                   [-- protector args...]
+
+#include "load_gen.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include <vector>
+#include <string>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+void
+usage( const char *argv0 )
+{
+	fprintf( stderr, "Usage: %s [-d seconds] [-c threads] [-r rate] [-t timeout] [-w workers] [-p port] [-o file] [-v] [--protector path] [--backend path] [-- protector args...]\n", argv0 );
+	exit( -1 );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	double seconds = 5.0;
+	int threads = 8;
+	double rate = 0.0;
+	double timeout = 1.0;
+	int workers = 2;
+	int port = 0;
+	bool verbose = false;
+	std::string outFile;
+	std::string protector = LoadGen::siblingProgram( argv[0], "SocketProtector" );
+	std::string backend = LoadGen::siblingProgram( argv[0], "EchoServer" );
+	std::vector<std::string> protArgs;
+
+	for ( int a = 1; a < argc; ++a )
+	{
+		std::string curarg = argv[a];
+		if ( curarg == "--" )
+		{
+			for ( ++a; a < argc; ++a )
+				protArgs.push_back( argv[a] );
+			break;
+		}
+		else if ( curarg == "-v" )
+			verbose = true;
+		else if ( a + 1 == argc )
+			usage( argv[0] );
+		else if ( curarg == "-d" )
+			seconds = atof( argv[++a] );
+		else if ( curarg == "-c" )
+			threads = atoi( argv[++a] );
+		else if ( curarg == "-r" )
+			rate = atof( argv[++a] );
+		else if ( curarg == "-t" )
+			timeout = atof( argv[++a] );
+		else if ( curarg == "-w" )
+			workers = atoi( argv[++a] );
+		else if ( curarg == "-p" )
+			port = atoi( argv[++a] );
+		else if ( curarg == "-o" )
+			outFile = argv[++a];
+		else if ( curarg == "--protector" )
+			protector = argv[++a];
+		else if ( curarg == "--backend" )
+			backend = argv[++a];
+		else
+			usage( argv[0] );
+	}
+	if ( seconds <= 0 || threads <= 0 || rate < 0 || timeout <= 0 ||
+		 workers <= 0 || port < 0 || port > 65535 )
+		usage( argv[0] );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	char wbuf[16];
+	snprintf( wbuf, sizeof(wbuf), "%d", workers );
+	std::vector<std::string> args;
+	args.push_back( "-w" );
+	args.push_back( wbuf );
+	args.insert( args.end(), protArgs.begin(), protArgs.end() );
+
+	LoadGen::Protector prot;
+	std::vector<LoadGen::Sample> samples;
+	StatsPage before, after;
+	double cpu = 0.0, elapsed = 0.0;
+	try
+	{
+		prot.start( protector, backend, port ? static_cast<uint16_t>( port ) : LoadGen::freePort(), args, verbose );
+
+		// let the workers and caches settle
+		LoadGen::Driver warm;
+		warm.start( prot.port(), threads, rate, timeout );
+		usleep( 300000 );
+		std::vector<LoadGen::Sample> ignored;
+		warm.stop( ignored );
+
+		if ( ! prot.freshStats( before, 1.0 ) )
+			throw std::runtime_error( "Protector isn't publishing stats" );
+		double cpu0 = prot.cpuSeconds();
+		double start = LoadGen::now();
+
+		LoadGen::Driver driver;
+		driver.start( prot.port(), threads, rate, timeout );
+		usleep( static_cast<useconds_t>( seconds * 1e6 ) );
+		driver.stop( samples );
+
+		elapsed = LoadGen::now() - start;
+		cpu = prot.cpuSeconds() - cpu0;
+		if ( ! prot.freshStats( after, 1.0 ) )
+			throw std::runtime_error( "Protector stopped publishing stats" );
+		prot.stop();
+	}
+	catch ( const std::exception &e )
+	{
+		fprintf( stderr, "%s: %s\n", argv[0], e.what() );
+		return -1;
+	}
+
+	size_t outcomes[LoadGen::kOutcomes] = { 0 };
+	std::vector<double> connectUs, firstByteUs;
+	connectUs.reserve( samples.size() );
+	firstByteUs.reserve( samples.size() );
+	for ( size_t i = 0; i != samples.size(); ++i )
+	{
+		const LoadGen::Sample &s = samples[i];
+		++outcomes[s.outcome];
+		if ( s.outcome == LoadGen::Completed )
+		{
+			connectUs.push_back( s.connectUs );
+			firstByteUs.push_back( s.firstByteUs );
+		}
+	}
+	size_t completed = outcomes[LoadGen::Completed];
+
+	uint64_t handoffs = 0;
+	for ( size_t b = 0; b != StatsPage::kWaitBuckets; ++b )
+		handoffs += after.waitHist[b] - before.waitHist[b];
+
+	FILE *f = stdout;
+	if ( ! outFile.empty() )
+	{
+		f = fopen( outFile.c_str(), "w" );
+		if ( ! f )
+		{
+			perror( outFile.c_str() );
+			return -1;
+		}
+	}
+
+	fprintf( f, "{\n  \"benchmark\": \"load\",\n  \"version\": 1,\n" );
+	fprintf( f, "  \"config\": {\n    \"protector\": " );
+	LoadGen::jsonString( f, protector );
+	fprintf( f, ",\n    \"backend\": " );
+	LoadGen::jsonString( f, backend );
+	fprintf( f, ",\n    \"args\": [" );
+	for ( size_t i = 0; i != args.size(); ++i )
+	{
+		fprintf( f, i ? ", " : " " );
+		LoadGen::jsonString( f, args[i] );
+	}
+	fprintf( f, " ],\n    \"threads\": %d,\n    \"rate\": %.1f,\n    \"duration_s\": %.3f,\n    \"timeout_s\": %.3f\n  },\n",
+			 threads, rate, seconds, timeout );
+
+	fprintf( f, "  \"elapsed_s\": %.3f,\n", elapsed );
+	fprintf( f, "  \"connections\": " );
+	LoadGen::jsonOutcomes( f, outcomes );
+	fprintf( f, ",\n" );
+	fprintf( f, "  \"conn_per_s\": %.1f,\n", double( completed ) / elapsed );
+
+	fprintf( f, "  \"latency_us\": {\n" );
+	LoadGen::jsonPercentiles( f, "connect", connectUs, false );
+	LoadGen::jsonPercentiles( f, "first_byte", firstByteUs, false );
+	fprintf( f, "    \"accept_to_handoff\": { \"count\": %llu, \"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"p999\": %.0f }\n",
+			 static_cast<unsigned long long>( handoffs ),
+			 LoadGen::waitPercentile( before, after, 0.5 ),
+			 LoadGen::waitPercentile( before, after, 0.9 ),
+			 LoadGen::waitPercentile( before, after, 0.99 ),
+			 LoadGen::waitPercentile( before, after, 0.999 ) );
+	fprintf( f, "  },\n" );
+
+	fprintf( f, "  \"protector_cpu\": { \"seconds\": %.3f, \"percent\": %.1f, \"us_per_conn\": %.2f }\n}\n",
+			 cpu, cpu * 100.0 / elapsed, completed ? cpu * 1e6 / double( completed ) : 0.0 );
+
+	if ( f != stdout )
+		fclose( f );
+	return 0;
+}
+
@@ -0,0 +1,601 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#include "load_gen.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+const char theRequest[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+std::string
+portString( uint16_t port )
+{
+	char buf[16];
+	snprintf( buf, sizeof(buf), "%u", unsigned(port) );
+	return std::string( buf );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace LoadGen
+{
+
+const char *
+outcomeName( Outcome o )
+{
+	static const char *names[] = { "completed", "refused", "reset", "closed", "timed_out", "failed" };
+	return o < kOutcomes ? names[o] : "unknown";
+}
+
+
+////////////////////////////////////////
+
+
+double
+now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return double( ts.tv_sec ) + double( ts.tv_nsec ) * 1e-9;
+}
+
+
+////////////////////////////////////////
+
+
+std::string
+siblingProgram( const char *argv0, const char *name )
+{
+	std::string self( argv0 );
+	std::string::size_type slash = self.rfind( '/' );
+	if ( slash == std::string::npos )
+		return std::string( name );
+	return self.substr( 0, slash + 1 ) + name;
+}
+
+
+////////////////////////////////////////
+
+
+uint16_t
+freePort( void )
+{
+	int s = socket( AF_INET, SOCK_STREAM, 0 );
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	socklen_t len = sizeof(addr);
+	if ( s < 0 || bind( s, (struct sockaddr *)&addr, sizeof(addr) ) != 0 ||
+		 getsockname( s, (struct sockaddr *)&addr, &len ) != 0 )
+		throw std::runtime_error( "Unable to find a free port" );
+	close( s );
+	return ntohs( addr.sin_port );
+}
+
+
+////////////////////////////////////////
+
+
+Outcome
+connectOnce( const struct sockaddr_in &addr, double timeout, double start, Sample &s )
+{
+	s.start = start;
+	s.connectUs = 0;
+	s.firstByteUs = 0;
+	s.outcome = Failed;
+
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if ( fd < 0 )
+		return Failed;
+
+	struct timeval tv;
+	tv.tv_sec = static_cast<time_t>( timeout );
+	tv.tv_usec = static_cast<suseconds_t>( ( timeout - double( tv.tv_sec ) ) * 1e6 );
+	setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+	setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+	struct linger lg;
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	setsockopt( fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg) );
+
+	Outcome o = Completed;
+	double t0 = now();
+	if ( connect( fd, (const struct sockaddr *)&addr, sizeof(addr) ) != 0 )
+	{
+		switch ( errno )
+		{
+			case ECONNREFUSED: o = Refused; break;
+			case ECONNRESET: o = Reset; break;
+			case EINPROGRESS:
+			case EAGAIN:
+			case ETIMEDOUT: o = TimedOut; break;
+			default: o = Failed; break;
+		}
+	}
+	else
+	{
+		s.connectUs = static_cast<float>( ( now() - t0 ) * 1e6 );
+
+		char b;
+		ssize_t n = send( fd, theRequest, sizeof(theRequest) - 1, MSG_NOSIGNAL );
+		if ( n == ssize_t( sizeof(theRequest) - 1 ) )
+		{
+			do
+			{
+				n = read( fd, &b, 1 );
+			} while ( n < 0 && errno == EINTR );
+		}
+		else if ( n >= 0 )
+		{
+			n = -1;
+			errno = EAGAIN;
+		}
+
+		if ( n == 1 )
+			s.firstByteUs = static_cast<float>( ( now() - start ) * 1e6 );
+		else if ( n == 0 )
+			o = Closed;
+		else if ( errno == ECONNRESET || errno == EPIPE )
+			o = Reset;
+		else if ( errno == EAGAIN || errno == EWOULDBLOCK )
+			o = TimedOut;
+		else
+			o = Failed;
+	}
+	close( fd );
+
+	s.outcome = static_cast<uint8_t>( o );
+	return o;
+}
+
+
+////////////////////////////////////////
+
+
+Protector::Protector( void )
+		: myPid( -1 ), myPort( 0 ), myStats( NULL )
+{
+}
+
+
+////////////////////////////////////////
+
+
+Protector::~Protector( void )
+{
+	stop();
+}
+
+
+////////////////////////////////////////
+
+
+void
+Protector::start( const std::string &exe, const std::string &backend, uint16_t port,
+				  const std::vector<std::string> &args, bool verbose )
+{
+	if ( myPid != -1 )
+		throw std::runtime_error( "Protector already started" );
+
+	std::string portStr = portString( port );
+
+	std::vector<std::string> cmd;
+	cmd.push_back( exe );
+	cmd.push_back( "-f" );
+	cmd.push_back( "--stats" );
+	cmd.insert( cmd.end(), args.begin(), args.end() );
+	cmd.push_back( portStr );
+	cmd.push_back( "--" );
+	cmd.push_back( backend );
+	cmd.push_back( portStr );
+
+	std::vector<char *> argv;
+	for ( size_t i = 0; i != cmd.size(); ++i )
+		argv.push_back( const_cast<char *>( cmd[i].c_str() ) );
+	argv.push_back( NULL );
+
+	myPort = port;
+	myPid = fork();
+	if ( myPid < 0 )
+		throw std::runtime_error( "Unable to fork protector" );
+	if ( myPid == 0 )
+	{
+		if ( ! verbose )
+		{
+			int nul = open( "/dev/null", O_WRONLY );
+			dup2( nul, 1 );
+			dup2( nul, 2 );
+			close( nul );
+		}
+		execv( argv[0], &argv[0] );
+		_exit( 127 );
+	}
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	addr.sin_port = htons( port );
+
+	std::string name = StatsSegment::nameForPort( port );
+	double deadline = now() + 10.0;
+	while ( now() < deadline )
+	{
+		int status;
+		if ( waitpid( myPid, &status, WNOHANG ) == myPid )
+		{
+			myPid = -1;
+			throw std::runtime_error( "Protector exited during startup" );
+		}
+
+		// a protector that crashed earlier may have left its segment
+		// behind, only trust one with our pid in it
+		StatsPage page;
+		if ( ! myStats )
+			myStats = StatsSegment::attach( name );
+		if ( myStats && StatsSegment::read( myStats, page ) && page.pid != myPid )
+		{
+			StatsSegment::detach( myStats );
+			myStats = NULL;
+		}
+
+		if ( myStats && StatsSegment::read( myStats, page ) && page.nWorkers > 0 )
+		{
+			uint32_t ready = 0;
+			for ( uint32_t w = 0; w != page.nWorkers; ++w )
+				ready += page.workers[w].connected ? 1 : 0;
+
+			Sample s;
+			if ( ready == page.nWorkers && connectOnce( addr, 1.0, now(), s ) == Completed )
+				return;
+		}
+		usleep( 50000 );
+	}
+
+	stop();
+	throw std::runtime_error( "Protector didn't become ready" );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Protector::stop( void )
+{
+	if ( myStats )
+	{
+		StatsSegment::detach( myStats );
+		myStats = NULL;
+	}
+	if ( myPid == -1 )
+		return;
+
+	kill( myPid, SIGTERM );
+	double deadline = now() + 5.0;
+	int status;
+	while ( waitpid( myPid, &status, WNOHANG ) == 0 )
+	{
+		if ( now() > deadline )
+		{
+			kill( myPid, SIGKILL );
+			waitpid( myPid, &status, 0 );
+			break;
+		}
+		usleep( 10000 );
+	}
+	myPid = -1;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Protector::stats( StatsPage &page ) const
+{
+	return myStats && StatsSegment::read( myStats, page );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Protector::freshStats( StatsPage &page, double timeout ) const
+{
+	StatsPage first;
+	if ( ! stats( first ) )
+		return false;
+
+	double deadline = now() + timeout;
+	while ( now() < deadline )
+	{
+		usleep( 10000 );
+		if ( stats( page ) && page.updated != first.updated )
+			return true;
+	}
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+double
+Protector::cpuSeconds( void ) const
+{
+	char path[64];
+	snprintf( path, sizeof(path), "/proc/%d/stat", int(myPid) );
+	FILE *f = fopen( path, "r" );
+	if ( ! f )
+		return 0.0;
+
+	char buf[1024];
+	size_t n = fread( buf, 1, sizeof(buf) - 1, f );
+	fclose( f );
+	buf[n] = '\0';
+
+	// the command name can hold anything, fields start after its ')'
+	const char *p = strrchr( buf, ')' );
+	if ( ! p )
+		return 0.0;
+	unsigned long utime = 0, stime = 0;
+	if ( sscanf( p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime ) != 2 )
+		return 0.0;
+	return double( utime + stime ) / double( sysconf( _SC_CLK_TCK ) );
+}
+
+
+////////////////////////////////////////
+
+
+Driver::Driver( void )
+		: myInterval( 0 ), myTimeout( 1 ), myStart( 0 ), myStop( false )
+{
+	memset( &myAddr, 0, sizeof(myAddr) );
+}
+
+
+////////////////////////////////////////
+
+
+Driver::~Driver( void )
+{
+	std::vector<Sample> ignored;
+	stop( ignored );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Driver::start( uint16_t port, int threads, double rate, double timeout )
+{
+	if ( ! myThreads.empty() )
+		throw std::runtime_error( "Driver already started" );
+
+	myAddr.sin_family = AF_INET;
+	myAddr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	myAddr.sin_port = htons( port );
+	myInterval = rate > 0 ? double( threads ) / rate : 0.0;
+	myTimeout = timeout;
+	myStop = false;
+	myStart = now();
+
+	for ( int i = 0; i != threads; ++i )
+	{
+		Thread *t = new Thread;
+		t->driver = this;
+		t->offset = rate > 0 ? double( i ) / rate : 0.0;
+		t->samples.reserve( 65536 );
+		if ( pthread_create( &t->thread, NULL, &threadEntry, t ) != 0 )
+		{
+			delete t;
+			throw std::runtime_error( "Unable to start client thread" );
+		}
+		myThreads.push_back( t );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+Driver::stop( std::vector<Sample> &samples )
+{
+	__atomic_store_n( &myStop, true, __ATOMIC_RELAXED );
+	for ( size_t i = 0; i != myThreads.size(); ++i )
+	{
+		Thread *t = myThreads[i];
+		pthread_join( t->thread, NULL );
+		samples.insert( samples.end(), t->samples.begin(), t->samples.end() );
+		delete t;
+	}
+	myThreads.clear();
+}
+
+
+////////////////////////////////////////
+
+
+void *
+Driver::threadEntry( void *arg )
+{
+	Thread *t = reinterpret_cast<Thread *>( arg );
+	t->driver->run( *t );
+	return NULL;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Driver::run( Thread &t )
+{
+	for ( uint64_t k = 0; ! __atomic_load_n( &myStop, __ATOMIC_RELAXED ); ++k )
+	{
+		double start = now();
+		if ( myInterval > 0 )
+		{
+			double due = myStart + t.offset + double( k ) * myInterval;
+			while ( start < due )
+			{
+				if ( __atomic_load_n( &myStop, __ATOMIC_RELAXED ) )
+					return;
+				usleep( static_cast<useconds_t>( std::min( due - start, 0.05 ) * 1e6 ) );
+				start = now();
+			}
+			start = due;
+		}
+
+		Sample s;
+		connectOnce( myAddr, myTimeout, start, s );
+		t.samples.push_back( s );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+jsonString( FILE *f, const std::string &s )
+{
+	fputc( '"', f );
+	for ( size_t i = 0; i != s.size(); ++i )
+	{
+		unsigned char c = static_cast<unsigned char>( s[i] );
+		if ( c == '"' || c == '\\' )
+			fprintf( f, "\\%c", c );
+		else if ( c < 0x20 )
+			fprintf( f, "\\u%04x", unsigned(c) );
+		else
+			fputc( c, f );
+	}
+	fputc( '"', f );
+}
+
+
+////////////////////////////////////////
+
+
+double
+percentile( const std::vector<double> &sorted, double p )
+{
+	if ( sorted.empty() )
+		return 0.0;
+	size_t i = static_cast<size_t>( p * double( sorted.size() - 1 ) + 0.5 );
+	return sorted[std::min( i, sorted.size() - 1 )];
+}
+
+
+////////////////////////////////////////
+
+
+void
+jsonOutcomes( FILE *f, const size_t counts[kOutcomes] )
+{
+	fprintf( f, "{" );
+	for ( int o = 0; o != kOutcomes; ++o )
+		fprintf( f, "%s \"%s\": %lu", o ? "," : "", outcomeName( Outcome( o ) ),
+				 static_cast<unsigned long>( counts[o] ) );
+	fprintf( f, " }" );
+}
+
+
+////////////////////////////////////////
+
+
+void
+jsonPercentiles( FILE *f, const char *name, std::vector<double> &values, bool last, int indent )
+{
+	std::sort( values.begin(), values.end() );
+	double sum = 0;
+	for ( size_t i = 0; i != values.size(); ++i )
+		sum += values[i];
+
+	fprintf( f, "%*s\"%s\": { \"count\": %lu, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+			 "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f }%s\n",
+			 indent, "", name, static_cast<unsigned long>( values.size() ),
+			 values.empty() ? 0.0 : sum / double( values.size() ),
+			 percentile( values, 0.5 ), percentile( values, 0.9 ),
+			 percentile( values, 0.99 ), percentile( values, 0.999 ),
+			 values.empty() ? 0.0 : values.back(), last ? "" : "," );
+}
+
+
+////////////////////////////////////////
+
+
+double
+waitPercentile( const StatsPage &before, const StatsPage &after, double p )
+{
+	uint64_t total = 0;
+	for ( size_t b = 0; b != StatsPage::kWaitBuckets; ++b )
+		total += after.waitHist[b] - before.waitHist[b];
+	if ( total == 0 )
+		return 0.0;
+
+	uint64_t want = static_cast<uint64_t>( p * double( total ) );
+	uint64_t seen = 0;
+	for ( size_t b = 0; b != StatsPage::kWaitBuckets; ++b )
+	{
+		seen += after.waitHist[b] - before.waitHist[b];
+		if ( seen > want )
+			return double( uint64_t( 1 ) << b );
+	}
+	return double( uint64_t( 1 ) << ( StatsPage::kWaitBuckets - 1 ) );
+}
+
+} // namespace LoadGen
+
@@ -0,0 +1,191 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "StatsSegment.h"
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+////////////////////////////////////////
+
+
+/// Shared pieces of the end to end benchmarks: a protector running the
+/// EchoServer sample as its workers, and client threads driving HTTP
+/// requests through it
+namespace LoadGen
+{
+
+/// how a single client connection went
+enum Outcome
+{
+	Completed = 0,
+	/// nothing listening
+	Refused,
+	/// reset before the backend answered
+	Reset,
+	/// closed before the backend answered
+	Closed,
+	/// no answer within the timeout
+	TimedOut,
+	Failed,
+	kOutcomes
+};
+
+const char *outcomeName( Outcome o );
+
+struct Sample
+{
+	/// CLOCK_MONOTONIC seconds the connection was due to start
+	double start;
+	float connectUs;
+	/// from start until the backend's first byte arrived
+	float firstByteUs;
+	uint8_t outcome;
+};
+
+/// CLOCK_MONOTONIC seconds
+double now( void );
+
+/// name as a program next to the benchmark program, which is where the
+/// build puts SocketProtector and EchoServer
+std::string siblingProgram( const char *argv0, const char *name );
+
+/// A loopback port nothing is listening on right now
+uint16_t freePort( void );
+
+/// Connects to the loopback port, sends a keep-alive HTTP request, waits
+/// for the first byte of the answer and resets the connection (so
+/// neither side collects TIME_WAITs)
+Outcome connectOnce( const struct sockaddr_in &addr, double timeout, double start, Sample &s );
+
+
+////////////////////////////////////////
+
+
+/// A SocketProtector started with --stats running a backend (normally
+/// EchoServer) as its workers
+class Protector
+{
+public:
+	Protector( void );
+	~Protector( void );
+
+	/// Starts exe on port with the given extra arguments, with workers
+	/// running backend port. Returns once every worker is connected and
+	/// a request gets through, throws if that doesn't happen
+	void start( const std::string &exe, const std::string &backend, uint16_t port,
+				const std::vector<std::string> &args, bool verbose );
+	/// SIGTERM, then SIGKILL if it doesn't go
+	void stop( void );
+
+	pid_t pid( void ) const { return myPid; }
+	uint16_t port( void ) const { return myPort; }
+
+	/// Latest published counters
+	bool stats( StatsPage &page ) const;
+	/// Waits for the protector's next publish, false if it doesn't come
+	bool freshStats( StatsPage &page, double timeout ) const;
+	/// User + system CPU seconds of the protector itself
+	double cpuSeconds( void ) const;
+
+private:
+	Protector( const Protector & );
+	Protector &operator=( const Protector & );
+
+	pid_t myPid;
+	uint16_t myPort;
+	const StatsPage *myStats;
+};
+
+
+////////////////////////////////////////
+
+
+/// Client threads connecting either in a closed loop (rate 0, each
+/// thread starts a new connection when the last one finishes) or open
+/// loop at a fixed total rate. In the open loop latencies count from
+/// when a connection was due, so a stalled protector can't hide behind
+/// the client waiting on it
+class Driver
+{
+public:
+	Driver( void );
+	~Driver( void );
+
+	void start( uint16_t port, int threads, double rate, double timeout );
+	/// Stops the threads and returns every sample, in no particular order
+	void stop( std::vector<Sample> &samples );
+
+private:
+	Driver( const Driver & );
+	Driver &operator=( const Driver & );
+
+	struct Thread
+	{
+		Driver *driver;
+		pthread_t thread;
+		double offset;
+		std::vector<Sample> samples;
+	};
+
+	static void *threadEntry( void * );
+	void run( Thread &t );
+
+	struct sockaddr_in myAddr;
+	double myInterval;
+	double myTimeout;
+	double myStart;
+	volatile bool myStop;
+	std::vector<Thread *> myThreads;
+};
+
+
+////////////////////////////////////////
+
+
+/// s quoted and escaped for JSON
+void jsonString( FILE *f, const std::string &s );
+
+/// p in [0, 1] of sorted values
+double percentile( const std::vector<double> &sorted, double p );
+
+/// { "completed": .., "refused": .., ... }
+void jsonOutcomes( FILE *f, const size_t counts[kOutcomes] );
+
+/// "name": { "count": .., "p50": .., ... } of the values, which are sorted
+void jsonPercentiles( FILE *f, const char *name, std::vector<double> &values, bool last, int indent = 4 );
+
+/// percentile of the accept to handoff wait histogram between two
+/// reads, as the upper bound in us of its bucket
+double waitPercentile( const StatsPage &before, const StatsPage &after, double p );
+
+} // namespace LoadGen
+
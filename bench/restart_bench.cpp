@@ -0,0 +1,340 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+// What clients see while the protector restarts its workers. Drives
+// steady open loop load through Build/SocketProtector (with EchoServer
+// workers, as in load_bench) and periodically sends it SIGHUP, to
+// respawn every worker, and/or SIGKILLs one worker, to exercise crash
+// recovery.
+//
+// For the window after each event it counts refused, reset, closed and
+// timed out connections and reports the connect to first byte latency,
+// next to the same numbers for the load away from any event. The run
+// fails (exit status 1) when more connections failed around the events
+// than allowed, or their p99 latency is over the limit. Results are
+// JSON.
+//
+// Usage: restart_bench [-d seconds] [-r rate] [-c threads] [-t timeout]
+//                      [-w workers] [--hup-every sec] [--kill-every sec]
+//                      [--window msec] [--max-failed N] [--max-p99 msec]
+//                      [-p port] [-o file] [-v] [--protector path]
+//                      [--backend path] [-- protector args...]
+
+#include "load_gen.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+struct Event
+{
+	double at;
+	int signal;
+	pid_t pid;
+	size_t outcomes[LoadGen::kOutcomes];
+	std::vector<double> firstByteUs;
+};
+
+void
+usage( const char *argv0 )
+{
+	fprintf( stderr, "Usage: %s [-d seconds] [-r rate] [-c threads] [-t timeout] [-w workers] [--hup-every sec] [--kill-every sec] [--window msec] [--max-failed N] [--max-p99 msec] [-p port] [-o file] [-v] [--protector path] [--backend path] [-- protector args...]\n", argv0 );
+	exit( -1 );
+}
+
+size_t
+failures( const size_t outcomes[LoadGen::kOutcomes] )
+{
+	size_t n = 0;
+	for ( int o = 0; o != LoadGen::kOutcomes; ++o )
+		n += o == LoadGen::Completed ? 0 : outcomes[o];
+	return n;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	double seconds = 10.0;
+	double rate = 1000.0;
+	int threads = 4;
+	double timeout = 1.0;
+	int workers = 2;
+	double hupEvery = 2.0;
+	double killEvery = 0.0;
+	double window = 1.0;
+	long maxFailed = 0;
+	double maxP99 = 0.0;
+	int port = 0;
+	bool verbose = false;
+	std::string outFile;
+	std::string protector = LoadGen::siblingProgram( argv[0], "SocketProtector" );
+	std::string backend = LoadGen::siblingProgram( argv[0], "EchoServer" );
+	std::vector<std::string> protArgs;
+
+	for ( int a = 1; a < argc; ++a )
+	{
+		std::string curarg = argv[a];
+		if ( curarg == "--" )
+		{
+			for ( ++a; a < argc; ++a )
+				protArgs.push_back( argv[a] );
+			break;
+		}
+		else if ( curarg == "-v" )
+			verbose = true;
+		else if ( a + 1 == argc )
+			usage( argv[0] );
+		else if ( curarg == "-d" )
+			seconds = atof( argv[++a] );
+		else if ( curarg == "-r" )
+			rate = atof( argv[++a] );
+		else if ( curarg == "-c" )
+			threads = atoi( argv[++a] );
+		else if ( curarg == "-t" )
+			timeout = atof( argv[++a] );
+		else if ( curarg == "-w" )
+			workers = atoi( argv[++a] );
+		else if ( curarg == "--hup-every" )
+			hupEvery = atof( argv[++a] );
+		else if ( curarg == "--kill-every" )
+			killEvery = atof( argv[++a] );
+		else if ( curarg == "--window" )
+			window = atof( argv[++a] ) * 1e-3;
+		else if ( curarg == "--max-failed" )
+			maxFailed = atol( argv[++a] );
+		else if ( curarg == "--max-p99" )
+			maxP99 = atof( argv[++a] ) * 1e3;
+		else if ( curarg == "-p" )
+			port = atoi( argv[++a] );
+		else if ( curarg == "-o" )
+			outFile = argv[++a];
+		else if ( curarg == "--protector" )
+			protector = argv[++a];
+		else if ( curarg == "--backend" )
+			backend = argv[++a];
+		else
+			usage( argv[0] );
+	}
+	if ( seconds <= 0 || rate <= 0 || threads <= 0 || timeout <= 0 || workers <= 0 ||
+		 hupEvery < 0 || killEvery < 0 || ( hupEvery == 0 && killEvery == 0 ) ||
+		 window <= 0 || maxFailed < 0 || maxP99 < 0 || port < 0 || port > 65535 )
+		usage( argv[0] );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	char wbuf[16];
+	snprintf( wbuf, sizeof(wbuf), "%d", workers );
+	std::vector<std::string> args;
+	args.push_back( "-w" );
+	args.push_back( wbuf );
+	args.insert( args.end(), protArgs.begin(), protArgs.end() );
+
+	LoadGen::Protector prot;
+	std::vector<LoadGen::Sample> samples;
+	std::vector<Event> events;
+	double start = 0.0, elapsed = 0.0;
+	try
+	{
+		prot.start( protector, backend, port ? static_cast<uint16_t>( port ) : LoadGen::freePort(), args, verbose );
+
+		LoadGen::Driver driver;
+		start = LoadGen::now();
+		driver.start( prot.port(), threads, rate, timeout );
+
+		// no events in the last window, so each one is seen through
+		double nextHup = hupEvery > 0 ? start + hupEvery : 0.0;
+		double nextKill = killEvery > 0 ? start + killEvery : 0.0;
+		double lastEvent = start + seconds - window;
+		size_t victim = 0;
+		while ( true )
+		{
+			double next = nextHup;
+			if ( next == 0.0 || ( nextKill != 0.0 && nextKill < next ) )
+				next = nextKill;
+			if ( next > lastEvent )
+				break;
+
+			double wait = next - LoadGen::now();
+			if ( wait > 0 )
+				usleep( static_cast<useconds_t>( wait * 1e6 ) );
+
+			Event e;
+			memset( e.outcomes, 0, sizeof(e.outcomes) );
+			if ( next == nextHup )
+			{
+				e.signal = SIGHUP;
+				e.pid = prot.pid();
+				nextHup += hupEvery;
+			}
+			else
+			{
+				// a worker that is itself still respawning won't have a
+				// pid to kill, take the next one
+				StatsPage page;
+				e.signal = SIGKILL;
+				e.pid = -1;
+				if ( prot.stats( page ) && page.nWorkers > 0 )
+				{
+					for ( uint32_t i = 0; i != page.nWorkers && e.pid <= 0; ++i, ++victim )
+						e.pid = page.workers[victim % page.nWorkers].pid;
+				}
+				nextKill += killEvery;
+				if ( e.pid <= 0 )
+					continue;
+			}
+			e.at = LoadGen::now();
+			kill( e.pid, e.signal );
+			events.push_back( e );
+		}
+
+		double wait = start + seconds - LoadGen::now();
+		if ( wait > 0 )
+			usleep( static_cast<useconds_t>( wait * 1e6 ) );
+		driver.stop( samples );
+		elapsed = LoadGen::now() - start;
+		prot.stop();
+	}
+	catch ( const std::exception &e )
+	{
+		fprintf( stderr, "%s: %s\n", argv[0], e.what() );
+		return -1;
+	}
+
+	size_t baseOutcomes[LoadGen::kOutcomes] = { 0 };
+	size_t nearOutcomes[LoadGen::kOutcomes] = { 0 };
+	std::vector<double> baseUs, nearUs;
+	for ( size_t i = 0; i != samples.size(); ++i )
+	{
+		const LoadGen::Sample &s = samples[i];
+		Event *e = NULL;
+		for ( size_t j = 0; j != events.size() && ! e; ++j )
+		{
+			if ( s.start >= events[j].at && s.start < events[j].at + window )
+				e = &events[j];
+		}
+
+		if ( e )
+		{
+			++e->outcomes[s.outcome];
+			++nearOutcomes[s.outcome];
+			if ( s.outcome == LoadGen::Completed )
+			{
+				e->firstByteUs.push_back( s.firstByteUs );
+				nearUs.push_back( s.firstByteUs );
+			}
+		}
+		else
+		{
+			++baseOutcomes[s.outcome];
+			if ( s.outcome == LoadGen::Completed )
+				baseUs.push_back( s.firstByteUs );
+		}
+	}
+
+	std::sort( nearUs.begin(), nearUs.end() );
+	size_t failed = failures( nearOutcomes );
+	double p99 = LoadGen::percentile( nearUs, 0.99 );
+	bool pass = failed <= size_t( maxFailed ) && ( maxP99 == 0.0 || p99 <= maxP99 );
+
+	FILE *f = stdout;
+	if ( ! outFile.empty() )
+	{
+		f = fopen( outFile.c_str(), "w" );
+		if ( ! f )
+		{
+			perror( outFile.c_str() );
+			return -1;
+		}
+	}
+
+	fprintf( f, "{\n  \"benchmark\": \"restart\",\n  \"version\": 1,\n" );
+	fprintf( f, "  \"config\": {\n    \"protector\": " );
+	LoadGen::jsonString( f, protector );
+	fprintf( f, ",\n    \"backend\": " );
+	LoadGen::jsonString( f, backend );
+	fprintf( f, ",\n    \"args\": [" );
+	for ( size_t i = 0; i != args.size(); ++i )
+	{
+		fprintf( f, i ? ", " : " " );
+		LoadGen::jsonString( f, args[i] );
+	}
+	fprintf( f, " ],\n    \"threads\": %d,\n    \"rate\": %.1f,\n    \"duration_s\": %.3f,\n"
+			 "    \"timeout_s\": %.3f,\n    \"hup_every_s\": %.3f,\n    \"kill_every_s\": %.3f,\n"
+			 "    \"window_s\": %.3f,\n    \"max_failed\": %ld,\n    \"max_p99_us\": %.0f\n  },\n",
+			 threads, rate, seconds, timeout, hupEvery, killEvery, window, maxFailed, maxP99 );
+
+	fprintf( f, "  \"elapsed_s\": %.3f,\n", elapsed );
+	fprintf( f, "  \"pass\": %s,\n", pass ? "true" : "false" );
+
+	fprintf( f, "  \"baseline\": {\n    \"connections\": " );
+	LoadGen::jsonOutcomes( f, baseOutcomes );
+	fprintf( f, ",\n" );
+	LoadGen::jsonPercentiles( f, "first_byte_us", baseUs, true );
+	fprintf( f, "  },\n" );
+
+	fprintf( f, "  \"around_events\": {\n    \"failed\": %lu,\n    \"connections\": ",
+			 static_cast<unsigned long>( failed ) );
+	LoadGen::jsonOutcomes( f, nearOutcomes );
+	fprintf( f, ",\n" );
+	LoadGen::jsonPercentiles( f, "first_byte_us", nearUs, true );
+	fprintf( f, "  },\n" );
+
+	fprintf( f, "  \"events\": [\n" );
+	for ( size_t j = 0; j != events.size(); ++j )
+	{
+		Event &e = events[j];
+		fprintf( f, "    {\n      \"type\": \"%s\",\n      \"pid\": %d,\n      \"at_s\": %.3f,\n"
+				 "      \"failed\": %lu,\n      \"connections\": ",
+				 e.signal == SIGHUP ? "hup" : "kill", int(e.pid), e.at - start,
+				 static_cast<unsigned long>( failures( e.outcomes ) ) );
+		LoadGen::jsonOutcomes( f, e.outcomes );
+		fprintf( f, ",\n" );
+		LoadGen::jsonPercentiles( f, "first_byte_us", e.firstByteUs, true, 6 );
+		fprintf( f, "    }%s\n", j + 1 == events.size() ? "" : "," );
+	}
+	fprintf( f, "  ]\n}\n" );
+
+	if ( f != stdout )
+		fclose( f );
+	return pass ? 0 : 1;
+}
+
@@ -0,0 +1,294 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+// Compares socket tuning profiles over loopback. For each profile the
+// server side of a connection is tuned exactly as SocketServer would
+// before handing it off, then we time:
+//
+//   pingpong  64 byte request / 64 byte response round trips
+//   split     64 byte request answered with two writes (header + body),
+//             which is where Nagle and delayed acks interact
+//   bulk      one way transfer from the tuned side
+//
+// Usage: tuning_bench [profile-spec ...]
+
+#include "SocketTuning.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+const int kPingPongRounds = 20000;
+const int kSplitRounds = 200;
+const size_t kBulkBytes = 256 * 1024 * 1024;
+
+double
+now( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return double( tv.tv_sec ) + double( tv.tv_usec ) * 1e-6;
+}
+
+bool
+readFull( int fd, char *buf, size_t n )
+{
+	while ( n > 0 )
+	{
+		ssize_t r = read( fd, buf, n );
+		if ( r <= 0 )
+		{
+			if ( r < 0 && errno == EINTR )
+				continue;
+			return false;
+		}
+		buf += r;
+		n -= static_cast<size_t>( r );
+	}
+	return true;
+}
+
+bool
+writeFull( int fd, const char *buf, size_t n )
+{
+	while ( n > 0 )
+	{
+		ssize_t w = write( fd, buf, n );
+		if ( w <= 0 )
+		{
+			if ( w < 0 && errno == EINTR )
+				continue;
+			return false;
+		}
+		buf += w;
+		n -= static_cast<size_t>( w );
+	}
+	return true;
+}
+
+struct Server
+{
+	int fd;
+	int mode;
+};
+
+void *
+serve( void *arg )
+{
+	Server *s = reinterpret_cast<Server *>( arg );
+	std::vector<char> buf( 1024 * 1024 );
+	if ( s->mode == 0 )
+	{
+		// echo
+		for ( int i = 0; i != kPingPongRounds; ++i )
+		{
+			if ( ! readFull( s->fd, &buf[0], 64 ) || ! writeFull( s->fd, &buf[0], 64 ) )
+				break;
+		}
+	}
+	else if ( s->mode == 1 )
+	{
+		for ( int i = 0; i != kSplitRounds; ++i )
+		{
+			if ( ! readFull( s->fd, &buf[0], 64 ) ||
+				 ! writeFull( s->fd, &buf[0], 32 ) ||
+				 ! writeFull( s->fd, &buf[0], 200 ) )
+				break;
+		}
+	}
+	else
+	{
+		size_t left = kBulkBytes;
+		while ( left > 0 )
+		{
+			size_t n = std::min( left, buf.size() );
+			if ( ! writeFull( s->fd, &buf[0], n ) )
+				break;
+			left -= n;
+		}
+		shutdown( s->fd, SHUT_WR );
+	}
+	return NULL;
+}
+
+/// connects a client to a tuned server socket, as a handed off
+/// connection would be tuned
+bool
+makePair( const SocketTuning &t, int &client, int &server )
+{
+	int lsock = socket( AF_INET, SOCK_STREAM, 0 );
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	socklen_t len = sizeof(addr);
+	try
+	{
+		t.applyListener( lsock );
+	}
+	catch ( ... )
+	{
+		close( lsock );
+		return false;
+	}
+	if ( bind( lsock, (struct sockaddr *)&addr, sizeof(addr) ) != 0 ||
+		 listen( lsock, 1 ) != 0 ||
+		 getsockname( lsock, (struct sockaddr *)&addr, &len ) != 0 )
+	{
+		close( lsock );
+		return false;
+	}
+
+	client = socket( AF_INET, SOCK_STREAM, 0 );
+	if ( connect( client, (struct sockaddr *)&addr, sizeof(addr) ) != 0 )
+	{
+		close( lsock );
+		close( client );
+		return false;
+	}
+	server = accept( lsock, NULL, NULL );
+	close( lsock );
+	if ( server < 0 )
+	{
+		close( client );
+		return false;
+	}
+	t.applyAccepted( server );
+	return true;
+}
+
+bool
+runMode( const SocketTuning &t, int mode, double &result, double &p99 )
+{
+	int client = -1, server = -1;
+	if ( ! makePair( t, client, server ) )
+		return false;
+
+	Server s;
+	s.fd = server;
+	s.mode = mode;
+	pthread_t thr;
+	pthread_create( &thr, NULL, &serve, &s );
+
+	std::vector<char> buf( 1024 * 1024, 'x' );
+	std::vector<double> lat;
+	bool ok = true;
+	double start = now();
+	if ( mode == 0 || mode == 1 )
+	{
+		int rounds = mode == 0 ? kPingPongRounds : kSplitRounds;
+		size_t respLen = mode == 0 ? 64 : 232;
+		lat.reserve( static_cast<size_t>( rounds ) );
+		for ( int i = 0; ok && i != rounds; ++i )
+		{
+			double t0 = now();
+			ok = writeFull( client, &buf[0], 64 ) && readFull( client, &buf[0], respLen );
+			lat.push_back( ( now() - t0 ) * 1e6 );
+		}
+		std::sort( lat.begin(), lat.end() );
+		result = lat.empty() ? 0.0 : lat[lat.size() / 2];
+		p99 = lat.empty() ? 0.0 : lat[lat.size() * 99 / 100];
+	}
+	else
+	{
+		size_t total = 0;
+		while ( true )
+		{
+			ssize_t r = read( client, &buf[0], buf.size() );
+			if ( r <= 0 )
+				break;
+			total += static_cast<size_t>( r );
+		}
+		double secs = now() - start;
+		result = double( total ) / ( 1024.0 * 1024.0 ) / secs;
+		p99 = 0.0;
+		ok = total == kBulkBytes;
+	}
+
+	close( client );
+	pthread_join( thr, NULL );
+	close( server );
+	return ok;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	openlog( "tuning_bench", LOG_PERROR, LOG_USER );
+	( void )setlogmask( LOG_UPTO( LOG_ERR ) );
+
+	std::vector<std::string> specs;
+	for ( int a = 1; a < argc; ++a )
+		specs.push_back( argv[a] );
+	if ( specs.empty() )
+	{
+		specs.push_back( "default" );
+		specs.push_back( "latency" );
+		specs.push_back( "throughput" );
+	}
+
+	printf( "%-32s %12s %12s %12s %12s %12s\n", "profile", "pingpong-p50", "pingpong-p99", "split-p50", "split-p99", "bulk-MB/s" );
+	for ( size_t i = 0; i != specs.size(); ++i )
+	{
+		SocketTuning t;
+		if ( ! t.parse( specs[i] ) )
+		{
+			fprintf( stderr, "invalid profile spec '%s'\n", specs[i].c_str() );
+			return -1;
+		}
+
+		double pp50 = 0, pp99 = 0, sp50 = 0, sp99 = 0, bulk = 0, dummy = 0;
+		bool ok = runMode( t, 0, pp50, pp99 );
+		ok = runMode( t, 1, sp50, sp99 ) && ok;
+		ok = runMode( t, 2, bulk, dummy ) && ok;
+
+		printf( "%-32s %10.1fus %10.1fus %10.1fus %10.1fus %12.1f%s\n", t.name().c_str(),
+				pp50, pp99, sp50, sp99, bulk, ok ? "" : "  (errors)" );
+	}
+
+	return 0;
+}
@@ -0,0 +1,465 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+
+#pragma once
+
+// Header-only client, configured at compile time instead of through the
+// C API:
+//
+//   typedef basic_socket_protector< SocketProtectorPolicy<false, 64> > Protector;
+//   Protector pt( port );
+//   if ( pt.error() ) ... // errno from connecting
+//   for ( int fd; ( fd = pt.try_accept() ) >= 0; ) ...
+//
+// Nothing is allocated: constructing one opens the terminate pipe and
+// connects to the protector, and accept is a recvmsg (recvmmsg when
+// batching) straight into the object. The C API in SocketProtector.h
+// is an instantiation of this with the default policy, plus the
+// concurrent mode and serve() on top. Uses FDPassing.h, the protector's
+// wire format.
+
+#include "FDPassing.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+/// How a blocking accept waits: wait() returns a mask of Connection
+/// and Terminate for whichever of the two descriptors can be read, or
+/// -1 with errno set
+struct SocketProtectorPollWait
+{
+	enum { Connection = 1, Terminate = 2 };
+
+	static int wait( int conn, int term )
+	{
+		struct pollfd p[2];
+		p[0].fd = conn;
+		p[0].events = POLLIN;
+		p[0].revents = 0;
+		p[1].fd = term;
+		p[1].events = POLLIN;
+		p[1].revents = 0;
+		if ( poll( p, 2, -1 ) == -1 )
+			return -1;
+		return ( p[0].revents ? Connection : 0 ) | ( p[1].revents ? Terminate : 0 );
+	}
+};
+
+/// What the client library always did, for systems where poll on a
+/// UNIX socket misbehaves. Limited to descriptors below FD_SETSIZE
+struct SocketProtectorSelectWait
+{
+	enum { Connection = 1, Terminate = 2 };
+
+	static int wait( int conn, int term )
+	{
+		fd_set fds;
+		FD_ZERO( &fds );
+		FD_SET( conn, &fds );
+		FD_SET( term, &fds );
+		if ( ::select( std::max( conn, term ) + 1, &fds, NULL, NULL, NULL ) == -1 )
+			return -1;
+		return ( FD_ISSET( conn, &fds ) ? Connection : 0 ) | ( FD_ISSET( term, &fds ) ? Terminate : 0 );
+	}
+};
+
+/// tag for the constructor taking over an already connected channel
+enum SocketProtectorAdopt { AdoptChannel };
+
+/// The choices basic_socket_protector takes:
+///
+///  - Blocking: accept() waits, using Wait, for a connection or
+///    terminate(). Otherwise accept() is try_accept(), for daemons
+///    watching fd() in their own event loop.
+///  - Batch: descriptors taken off the channel per system call, at
+///    least 1. Beyond the first they wait in the object for the next
+///    accepts.
+///  - Metadata: whether to look at what comes without a descriptor,
+///    the drain request. Without it a drain request reads as the
+///    protector going away, and drain_remaining() is always -1.
+template <bool Blocking = true, size_t Batch = 1, bool Metadata = true, typename Wait = SocketProtectorPollWait>
+struct SocketProtectorPolicy
+{
+	static const bool blocking = Blocking;
+	static const size_t batch = Batch;
+	static const bool metadata = Metadata;
+	typedef Wait wait_type;
+};
+
+
+////////////////////////////////////////
+
+
+/// One accepting thread at a time. terminate() is signal safe and may
+/// come from any thread
+template <typename Policy>
+class basic_socket_protector
+{
+public:
+	typedef void (*drain_callback)( int msecLeft, void *arg );
+
+	explicit basic_socket_protector( uint16_t serverport )
+			: myServerConnection( -1 ), myTerminated( false ), myGone( false ),
+			  myError( 0 ), myDrainMsec( 0 ), myDrainAt( 0 ),
+			  myDrainCallback( NULL ), myDrainArg( NULL ), myNext( 0 ), myHave( 0 )
+	{
+		if ( ! setUp() )
+			return;
+
+		myServerConnection = socket( PF_LOCAL, SOCK_STREAM, 0 );
+		if ( myServerConnection < 0 )
+		{
+			myError = errno;
+			return;
+		}
+
+		struct sockaddr_un local;
+		memset( &local, 0, sizeof(local) );
+		local.sun_family = PF_UNIX;
+		// linux has abstract sockets that don't need unlinking
+#ifdef __linux__
+		snprintf( local.sun_path + 1, sizeof(local.sun_path) - 1, "sock_srv_%u", unsigned( serverport ) );
+#else
+		snprintf( local.sun_path, sizeof(local.sun_path), "/tmp/sock_srv_%u", unsigned( serverport ) );
+#endif
+#ifdef __APPLE__
+		local.sun_len = SUN_LEN( &local );
+#endif
+
+		int rv;
+		do
+		{
+			rv = connect( myServerConnection, (struct sockaddr *)&local, sizeof(local) );
+		} while ( rv == -1 && errno == EINTR );
+		if ( rv == -1 )
+		{
+			myError = errno;
+			close( myServerConnection );
+			myServerConnection = -1;
+		}
+	}
+
+	/// over a channel that's already connected, which it takes over: a
+	/// sub-worker's end from socket_protector_fanout_add
+	basic_socket_protector( SocketProtectorAdopt, int channel )
+			: myServerConnection( -1 ), myTerminated( false ), myGone( false ),
+			  myError( 0 ), myDrainMsec( 0 ), myDrainAt( 0 ),
+			  myDrainCallback( NULL ), myDrainArg( NULL ), myNext( 0 ), myHave( 0 )
+	{
+		if ( setUp() )
+			myServerConnection = channel;
+		else
+			close( channel );
+	}
+
+	~basic_socket_protector( void )
+	{
+		while ( myNext != myHave )
+			close( myBatch[myNext++] );
+		if ( myTermPipe[0] != -1 )
+			close( myTermPipe[0] );
+		if ( myTermPipe[1] != -1 )
+			close( myTermPipe[1] );
+		if ( myServerConnection != -1 )
+			close( myServerConnection );
+	}
+
+	/// 0 once connected to the protector, otherwise the errno that
+	/// stopped it
+	int error( void ) const { return myError; }
+
+	void terminate( void )
+	{
+		if ( myTermPipe[1] != -1 )
+		{
+			__atomic_store_n( &myTerminated, true, __ATOMIC_RELEASE );
+			char b = 'x';
+			if ( write( myTermPipe[1], &b, sizeof(char) ) != 1 )
+				syslog( LOG_ERR, "Unable to signal accept function to terminate" );
+		}
+	}
+
+	bool is_terminated( void ) const { return __atomic_load_n( &myTerminated, __ATOMIC_ACQUIRE ); }
+
+	/// A connection, or -1 with errno: ESHUTDOWN after terminate() or a
+	/// drain request, ECONNRESET once the protector has gone away, and
+	/// EAGAIN when not blocking and nothing is waiting
+	int accept( void )
+	{
+		if ( ! Policy::blocking )
+			return try_accept();
+
+		while ( true )
+		{
+			int fd = try_accept();
+			if ( fd >= 0 || ( errno != EAGAIN && errno != EWOULDBLOCK ) )
+				return fd;
+
+			int ready = Policy::wait_type::wait( myServerConnection, myTermPipe[0] );
+			if ( ready == -1 )
+			{
+				if ( errno == EINTR )
+					continue;
+				int err = errno;
+				__atomic_store_n( &myTerminated, true, __ATOMIC_RELEASE );
+				syslog( LOG_NOTICE, "waiting on connection failed, terminate requested" );
+				errno = err;
+				return -1;
+			}
+
+			if ( ready & Policy::wait_type::Terminate )
+			{
+				char b;
+				if ( read( myTermPipe[0], &b, sizeof(char) ) == 1 )
+					syslog( LOG_DEBUG, "Internal signal got '%c' message", b );
+				__atomic_store_n( &myTerminated, true, __ATOMIC_RELEASE );
+			}
+		}
+	}
+
+	/// Never blocks
+	int try_accept( void )
+	{
+		if ( myNext != myHave )
+			return myBatch[myNext++];
+		if ( is_terminated() || myServerConnection == -1 )
+		{
+			errno = ESHUTDOWN;
+			return -1;
+		}
+		if ( __atomic_load_n( &myGone, __ATOMIC_ACQUIRE ) )
+		{
+			errno = isDraining() ? ESHUTDOWN : ECONNRESET;
+			return -1;
+		}
+		return receive();
+	}
+
+	/// polls readable when a connection is waiting or the protector has
+	/// gone away; owned by the object. With a batch, connections already
+	/// taken off it don't show here, so call try_accept() until EAGAIN
+	int fd( void ) const { return myServerConnection; }
+
+	/// msec left to finish up after a drain request, 0 once past, -1
+	/// when not draining
+	int drain_remaining( void ) const
+	{
+		int64_t at = __atomic_load_n( &myDrainAt, __ATOMIC_ACQUIRE );
+		if ( at == 0 )
+			return -1;
+		return static_cast<int>( std::max( at - monotonicMsec(), int64_t( 0 ) ) );
+	}
+
+	/// called on the accepting thread when the drain request arrives,
+	/// with the msec left
+	void on_drain( drain_callback cb, void *arg )
+	{
+		myDrainArg = arg;
+		myDrainCallback = cb;
+	}
+
+	/// tells the protector how many connections are still being served,
+	/// for its logs. Never blocks
+	int report_in_flight( int count )
+	{
+		uint32_t n = static_cast<uint32_t>( std::max( count, 0 ) );
+		ssize_t w;
+		do
+		{
+			w = ::send( myServerConnection, &n, sizeof(n), MSG_DONTWAIT | MSG_NOSIGNAL );
+		} while ( w == -1 && errno == EINTR );
+		return w == sizeof(n) ? 0 : -1;
+	}
+
+	/// hands an idle connection back to the protector, closing it here
+	/// on success. Never blocks
+	int park( int fd )
+	{
+		if ( myServerConnection < 0 )
+		{
+			errno = ENOTCONN;
+			return -1;
+		}
+		int err = FDPassing::sendPark( myServerConnection, fd, MSG_DONTWAIT | MSG_NOSIGNAL );
+		if ( err != 0 )
+		{
+			errno = err;
+			return -1;
+		}
+		close( fd );
+		return 0;
+	}
+
+protected:
+	/// what both ways of connecting need first
+	bool setUp( void )
+	{
+		myTermPipe[0] = -1;
+		myTermPipe[1] = -1;
+
+		if ( Policy::metadata )
+		{
+			const char *drain = getenv( "SOCKET_PROTECTOR_DRAIN_MSEC" );
+			if ( drain )
+				myDrainMsec = std::max( atoi( drain ), 0 );
+		}
+
+		if ( pipe( myTermPipe ) < 0 )
+		{
+			myError = errno;
+			myTermPipe[0] = -1;
+			myTermPipe[1] = -1;
+			return false;
+		}
+		return true;
+	}
+
+	static int64_t monotonicMsec( void )
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return int64_t( ts.tv_sec ) * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	bool isDraining( void ) const { return Policy::metadata && __atomic_load_n( &myDrainAt, __ATOMIC_ACQUIRE ) != 0; }
+
+	/// the protector's drain request arrived: nothing more is coming
+	void startDrain( void )
+	{
+		int64_t at = monotonicMsec() + myDrainMsec;
+		int64_t none = 0;
+		if ( ! __atomic_compare_exchange_n( &myDrainAt, &none, at, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+			return;
+		__atomic_store_n( &myGone, true, __ATOMIC_RELEASE );
+		syslog( LOG_NOTICE, "asked to drain, %d msec to finish up", myDrainMsec );
+		if ( myDrainCallback )
+			myDrainCallback( myDrainMsec, myDrainArg );
+	}
+
+	/// the next descriptor off the channel, without waiting
+	int receive( void )
+	{
+		ssize_t n;
+		int fd = -1;
+		bool drain = false;
+		if ( Policy::batch > 1 )
+		{
+			n = FDPassing::receiveMany( myServerConnection, myBatch, Policy::batch, MSG_DONTWAIT,
+										Policy::metadata ? &drain : NULL );
+			if ( n > 0 )
+			{
+				fd = myBatch[0];
+				myNext = 1;
+				myHave = static_cast<size_t>( n );
+			}
+		}
+		else
+		{
+			char data = 0;
+			n = FDPassing::receive( myServerConnection, fd, MSG_DONTWAIT, &data );
+			drain = Policy::metadata && n > 0 && fd == -1 && data == FDPassing::kDrain;
+		}
+
+		// whatever came before the drain request still gets taken
+		if ( drain )
+			startDrain();
+		if ( fd >= 0 )
+			return fd;
+		if ( drain )
+		{
+			errno = ESHUTDOWN;
+			return -1;
+		}
+
+		if ( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			return -1;
+		return lostChannel( n );
+	}
+
+	/// a receive got n back that wasn't a descriptor, a drain request
+	/// or EAGAIN: the protector is gone. Always -1, errno set
+	int lostChannel( ssize_t n )
+	{
+		if ( n == -1 )
+		{
+			int err = errno;
+			if ( err == ECONNRESET || err == ENOTCONN )
+				syslog( LOG_NOTICE, "remote server disconnected, terminating" );
+			else
+				syslog( LOG_ERR, "unhandled error attempting to receive a socket: %s", strerror( err ) );
+			errno = err;
+		}
+		else
+		{
+			syslog( LOG_NOTICE, "empty message from server, terminating" );
+			errno = ECONNRESET;
+		}
+		__atomic_store_n( &myGone, true, __ATOMIC_RELEASE );
+		return -1;
+	}
+
+	int myServerConnection;
+	int myTermPipe[2];
+	bool myTerminated;
+	bool myGone;
+	int myError;
+
+	/// the protector gives us this long to finish up once it asks us to
+	/// drain, after which it signals us
+	int myDrainMsec;
+	/// CLOCK_MONOTONIC msec that runs out, 0 until asked
+	int64_t myDrainAt;
+	drain_callback myDrainCallback;
+	void *myDrainArg;
+
+	/// descriptors taken off the channel and not yet handed out
+	int myBatch[Policy::batch];
+	size_t myNext;
+	size_t myHave;
+
+private:
+	basic_socket_protector( const basic_socket_protector & );
+	basic_socket_protector &operator=( const basic_socket_protector & );
+};
+
+
+////////////////////////////////////////
+
+
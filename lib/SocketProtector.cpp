@@ -25,6 +25,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <errno.h>
@@ -33,6 +36,31 @@
 #include <memory>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <deque>
+#include <set>
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <linux/sockios.h>
+#endif
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "Probes.h"
+#include "BasicSocketProtector.h"
+#include "BoundedQueue.h"
+
+
+////////////////////////////////////////
+
+
+SP_PROBE_SEMAPHORE( client_accept );
+SP_PROBE_SEMAPHORE( client_getsocket );
 
 
 ////////////////////////////////////////
@@ -41,197 +69,981 @@
 namespace
 {
 
-struct SocketProtectorImpl
+/// most descriptors taken off the channel at once in concurrent mode
+const size_t kReceiveBatch = 64;
+
+/// sleeps while *word is still seen, until woken (or spuriously)
+void
+parkWait( uint32_t *word, uint32_t seen )
+{
+#ifdef __linux__
+	syscall( SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0 );
+#else
+	if ( __atomic_load_n( word, __ATOMIC_ACQUIRE ) == seen )
+		usleep( 1000 );
+#endif
+}
+
+void
+parkWake( uint32_t *word, int n )
+{
+#ifdef __linux__
+	syscall( SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0 );
+#else
+	( void )word;
+	( void )n;
+#endif
+}
+
+/// the C API: a blocking accept polling the channel and the terminate
+/// pipe, a descriptor per recvmsg, drain requests honoured. Concurrent
+/// mode shares the channel between accepting threads on top of that
+struct SocketProtectorImpl : public basic_socket_protector< SocketProtectorPolicy<> >
 {
-	int myServerConnection;
-	int myTermPipe[2];
-	bool myTerminated;
-	char __padding[3];
+	typedef basic_socket_protector< SocketProtectorPolicy<> > Base;
+	using Base::myServerConnection;
+	using Base::myTermPipe;
+	using Base::isDraining;
+
+	/// concurrent mode: descriptors received but not yet taken. One
+	/// accepting thread at a time (the receiver) fills it from the
+	/// channel a batch per system call, the others take from it or
+	/// sleep on myWakeSeq until the receiver wakes as many of them as
+	/// it queued descriptors, plus one to take over receiving
+	BoundedQueue<int> *myQueue;
+	int myReceiving;
+	int myWaiters;
+	uint32_t myWakeSeq;
 
-	SocketProtectorImpl( uint16_t port )
-			: myServerConnection( -1 ), myTerminated( false )
+	/// connections serve() has taken and not yet closed
+	int myInFlight;
+
+	SocketProtectorImpl( uint16_t port, bool concurrent )
+			: Base( port ), myQueue( NULL ), myReceiving( 0 ), myWaiters( 0 ), myWakeSeq( 0 ),
+			  myInFlight( 0 )
+	{
+		if ( error() != 0 )
+			throw std::runtime_error( strerror( error() ) );
+
+		if ( concurrent )
+			myQueue = new BoundedQueue<int>( 4 * kReceiveBatch );
+	}
+
+	/// a sub-worker's end of a fanout channel
+	explicit SocketProtectorImpl( int channel )
+			: Base( AdoptChannel, channel ), myQueue( NULL ), myReceiving( 0 ), myWaiters( 0 ),
+			  myWakeSeq( 0 ), myInFlight( 0 )
 	{
-		myTermPipe[0] = -1;
-		myTermPipe[1] = -1;
+		if ( error() != 0 )
+			throw std::runtime_error( strerror( error() ) );
+	}
 
-		if ( pipe( myTermPipe ) < 0 )
+	~SocketProtectorImpl( void )
+	{
+		if ( myQueue )
 		{
-			myTermPipe[0] = -1;
-			myTermPipe[1] = -1;
-			throw std::runtime_error( strerror( errno ) );
+			int fd;
+			while ( myQueue->pop( fd ) )
+				close( fd );
+			delete myQueue;
 		}
+	}
+	
+	void terminate( void )
+	{
+		Base::terminate();
+		if ( myQueue )
+			wakeAccepters( INT_MAX );
+	}
 
-		myServerConnection = socket( PF_LOCAL, SOCK_STREAM, 0 );
-		if ( myServerConnection < 0 )
-			throw std::runtime_error( strerror( errno ) );
+	bool isTerminated( void ) const { return is_terminated(); }
+	bool isGone( void ) const { return __atomic_load_n( &myGone, __ATOMIC_ACQUIRE ); }
 
-		struct sockaddr_un local;
-		memset( &local, 0, sizeof(local) );
-		local.sun_family = PF_UNIX;
+	/// descriptors waiting for this process, for the probes: a byte
+	/// each unread on the channel, plus the concurrent queue
+	int queueDepth( void ) const
+	{
+		int unread = 0;
+		if ( myServerConnection == -1 || ioctl( myServerConnection, FIONREAD, &unread ) != 0 )
+			unread = 0;
+		if ( myQueue )
+			unread += static_cast<int>( myQueue->size() );
+		return unread;
+	}
 
-		std::stringstream pBuf;
-		// linux has abstract sockets that don't need unlinking
-#ifdef __linux__
-		pBuf << "sock_srv_" << port;
-		std::string pName = pBuf.str();
-		strncpy( local.sun_path + 1, pName.c_str(), std::min( pName.size(), sizeof(local.sun_path) - 2 ) );
-#else
-		pBuf << "/tmp/sock_srv_" << port;
-		std::string pName = pBuf.str();
-		strncpy( local.sun_path, pName.c_str(), std::min( pName.size(), sizeof(local.sun_path) - 1 ) );
-#endif
-#ifdef __APPLE__
-		local.sun_len = SUN_LEN( &local );
-#endif
+	int accept( void )
+	{
+		if ( myServerConnection == -1 )
+			return -1;
+
+		int64_t start = SP_PROBE_ENABLED( client_accept ) ? probeTime() : 0;
+		int fd = myQueue ? acceptShared( true ) : Base::accept();
+		if ( ! myQueue && fd >= 0 )
+			SP_PROBE5( client_getsocket, fd, getpid(), myServerConnection, queueDepth(), probeTime() );
+		SP_PROBE5( client_accept, fd, getpid(), queueDepth(), probeTime() - start, probeTime() );
+		return fd;
+	}
+
+	int tryAccept( void )
+	{
+		if ( ! myQueue )
+		{
+			int fd = try_accept();
+			if ( fd >= 0 )
+				SP_PROBE5( client_getsocket, fd, getpid(), myServerConnection, queueDepth(), probeTime() );
+			return fd;
+		}
+
+		if ( isTerminated() || myServerConnection == -1 )
+		{
+			errno = ESHUTDOWN;
+			return -1;
+		}
+		return acceptShared( false );
+	}
+
+	/// up to max descriptors without waiting, for serve(): in one
+	/// recvmmsg straight off the channel, or from the queue in
+	/// concurrent mode. How many, or -1 with errno set
+	int tryAcceptMany( int *fds, int max )
+	{
+		if ( myQueue )
+		{
+			int n = 0;
+			while ( n < max && ( fds[n] = tryAccept() ) >= 0 )
+				++n;
+			return n > 0 ? n : -1;
+		}
 
-		do
+		if ( isTerminated() || myServerConnection == -1 )
 		{
-			if ( connect( myServerConnection, (struct sockaddr *)&local, sizeof(local) ) == -1 )
+			errno = ESHUTDOWN;
+			return -1;
+		}
+		if ( __atomic_load_n( &myGone, __ATOMIC_ACQUIRE ) )
+		{
+			errno = isDraining() ? ESHUTDOWN : ECONNRESET;
+			return -1;
+		}
+
+		bool drain = false;
+		ssize_t n = FDPassing::receiveMany( myServerConnection, fds, static_cast<size_t>( max ), MSG_DONTWAIT, &drain );
+		for ( ssize_t i = 0; i < n; ++i )
+			SP_PROBE5( client_getsocket, fds[i], getpid(), myServerConnection, queueDepth() + int( n - 1 - i ), probeTime() );
+
+		// whatever came before the drain request still gets taken
+		if ( drain )
+			startDrain();
+		if ( n > 0 )
+			return static_cast<int>( n );
+		if ( drain )
+		{
+			errno = ESHUTDOWN;
+			return -1;
+		}
+		if ( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			return -1;
+		return lostChannel( n );
+	}
+
+	void wakeAccepters( int n )
+	{
+		__atomic_add_fetch( &myWakeSeq, 1, __ATOMIC_SEQ_CST );
+		if ( __atomic_load_n( &myWaiters, __ATOMIC_SEQ_CST ) > 0 )
+			parkWake( &myWakeSeq, n );
+	}
+
+	int acceptShared( bool block )
+	{
+		while ( true )
+		{
+			int fd;
+			if ( myQueue->pop( fd ) )
+				return fd;
+			if ( isTerminated() || __atomic_load_n( &myGone, __ATOMIC_ACQUIRE ) )
 			{
-				if ( errno == EINTR )
-					continue;
+				errno = ESHUTDOWN;
+				return -1;
+			}
+
+			uint32_t seen = __atomic_load_n( &myWakeSeq, __ATOMIC_ACQUIRE );
+			if ( __atomic_exchange_n( &myReceiving, 1, __ATOMIC_ACQUIRE ) == 0 )
+				return receiveShared( block );
 
-				throw std::runtime_error( strerror( errno ) );
+			if ( ! block )
+			{
+				errno = EAGAIN;
+				return -1;
 			}
-		} while ( false );
+
+			// the receiver bumps the sequence after queueing and again
+			// on leaving, so nothing it does after our look at the queue
+			// can be missed
+			__atomic_add_fetch( &myWaiters, 1, __ATOMIC_SEQ_CST );
+			parkWait( &myWakeSeq, seen );
+			__atomic_sub_fetch( &myWaiters, 1, __ATOMIC_ACQ_REL );
+		}
 	}
 
-	~SocketProtectorImpl( void )
+	/// called holding the receiver role, which it gives up. Keeps the
+	/// first descriptor of a batch for the caller and queues the rest
+	int receiveShared( bool block )
 	{
-		if ( myTermPipe[0] != -1 )
-			close( myTermPipe[0] );
-		if ( myTermPipe[1] != -1 )
-			close( myTermPipe[1] );
-		if ( myServerConnection != -1 )
-			close( myServerConnection );
+		int fds[kReceiveBatch];
+		ssize_t n;
+		bool drain = false;
+		while ( true )
+		{
+			n = FDPassing::receiveMany( myServerConnection, fds, kReceiveBatch, MSG_DONTWAIT, &drain );
+			if ( n != -1 || ( errno != EAGAIN && errno != EWOULDBLOCK ) || ! block )
+				break;
+
+			struct pollfd p[2];
+			p[0].fd = myServerConnection;
+			p[0].events = POLLIN;
+			p[1].fd = myTermPipe[0];
+			p[1].events = POLLIN;
+			if ( poll( p, 2, -1 ) == -1 && errno != EINTR )
+				break;
+			if ( isTerminated() || ( p[1].revents & POLLIN ) )
+			{
+				__atomic_store_n( &myTerminated, true, __ATOMIC_RELEASE );
+				n = -1;
+				errno = ESHUTDOWN;
+				break;
+			}
+		}
+		int err = errno;
+
+		int first = -1;
+		int wake = 1;
+		if ( n > 0 )
+		{
+			first = fds[0];
+			SP_PROBE5( client_getsocket, fds[0], getpid(), myServerConnection, queueDepth() + int( n - 1 ), probeTime() );
+			for ( ssize_t i = 1; i < n; ++i )
+			{
+				SP_PROBE5( client_getsocket, fds[i], getpid(), myServerConnection, queueDepth() + int( n - 1 - i ), probeTime() );
+				// we only receive into an empty queue, so it has room
+				if ( ! myQueue->push( fds[i] ) )
+					close( fds[i] );
+			}
+			wake += static_cast<int>( n - 1 );
+		}
+		if ( drain )
+		{
+			// whatever came before it still gets taken, then everyone
+			// finds nothing more to wait for
+			startDrain();
+			err = ESHUTDOWN;
+			wake = INT_MAX;
+		}
+		else if ( n == 0 || ( n < 0 && err != EAGAIN && err != EWOULDBLOCK ) )
+		{
+			if ( err != ESHUTDOWN )
+			{
+				syslog( LOG_NOTICE, "remote server disconnected, terminating" );
+				err = ECONNRESET;
+			}
+			__atomic_store_n( &myGone, true, __ATOMIC_RELEASE );
+			wake = INT_MAX;
+		}
+
+		__atomic_store_n( &myReceiving, 0, __ATOMIC_RELEASE );
+		wakeAccepters( wake );
+		if ( first == -1 )
+			errno = err;
+		return first;
 	}
-	
-	void terminate( void )
+};
+
+#ifdef __linux__
+
+/// most connections taken off the protector per wakeup in serve()
+const int kServeBatch = 64;
+
+struct ServePool;
+
+/// One serve() thread. It owns an epoll reactor holding the connections
+/// it took that haven't sent anything yet, and a queue of the ones that
+/// have, which idle threads steal from
+struct ServeWorker
+{
+	ServePool *pool;
+	size_t index;
+	pthread_t thread;
+	int epfd;
+	int wakefd;
+	int idle;
+	pthread_mutex_t lock;
+	std::deque<int> ready;
+	std::set<int> parked;
+};
+
+struct ServePool
+{
+	SocketProtectorImpl *protector;
+	socket_protector_handler handler;
+	void *arg;
+	std::vector<ServeWorker *> workers;
+	int stopping;
+	int error;
+};
+
+void
+wakeWorker( ServeWorker &w )
+{
+	uint64_t one = 1;
+	if ( write( w.wakefd, &one, sizeof(one) ) != sizeof(one) )
+		syslog( LOG_DEBUG, "unable to wake serve thread %d", int( w.index ) );
+}
+
+void
+stopPool( ServePool &p, int err )
+{
+	if ( __atomic_exchange_n( &p.stopping, 1, __ATOMIC_SEQ_CST ) == 0 )
+	{
+		p.error = err;
+		for ( size_t i = 0; i != p.workers.size(); ++i )
+			wakeWorker( *p.workers[i] );
+	}
+}
+
+/// own queue first, oldest first; then the newest of someone else's
+bool
+takeReady( ServeWorker &w, int &fd )
+{
+	std::vector<ServeWorker *> &all = w.pool->workers;
+	for ( size_t k = 0; k != all.size(); ++k )
 	{
-		if ( myTermPipe[1] != -1 )
+		ServeWorker &o = *all[( w.index + k ) % all.size()];
+		pthread_mutex_lock( &o.lock );
+		bool got = ! o.ready.empty();
+		if ( got )
 		{
-			myTerminated = true;
-			char b = 'x';
-			if ( write( myTermPipe[1], &b, sizeof(char) ) != 1 )
+			if ( k == 0 )
 			{
-				syslog( LOG_ERR, "Unable to signal accept function to terminate" );
+				fd = o.ready.front();
+				o.ready.pop_front();
+			}
+			else
+			{
+				fd = o.ready.back();
+				o.ready.pop_back();
 			}
 		}
+		pthread_mutex_unlock( &o.lock );
+		if ( got )
+			return true;
 	}
+	return false;
+}
 
-	bool isTerminated( void ) const { return myTerminated; }
+void
+finished( SocketProtectorImpl &sp )
+{
+	int left = __atomic_sub_fetch( &sp.myInFlight, 1, __ATOMIC_ACQ_REL );
+	if ( sp.isDraining() )
+		sp.report_in_flight( left );
+}
 
-	int accept( void )
+void
+handle( ServePool &p, int fd )
+{
+	p.handler( fd, p.arg );
+	close( fd );
+	finished( *p.protector );
+}
+
+/// back to the protector, which passes it on once it has something to
+/// read; false if it's still ours
+bool
+giveBack( ServeWorker &w, int fd )
+{
+	epoll_ctl( w.epfd, EPOLL_CTL_DEL, fd, NULL );
+	if ( w.pool->protector->park( fd ) != 0 )
 	{
-		if ( myServerConnection == -1 )
-			return -1;
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		ev.data.fd = fd;
+		epoll_ctl( w.epfd, EPOLL_CTL_ADD, fd, &ev );
+		return false;
+	}
+	finished( *w.pool->protector );
+	return true;
+}
 
-		fd_set fds;
-		FD_ZERO( &fds );
-		FD_SET( myTermPipe[0], &fds );
-		FD_SET( myServerConnection, &fds );
+void
+drop( ServeWorker &w, int fd )
+{
+	epoll_ctl( w.epfd, EPOLL_CTL_DEL, fd, NULL );
+	close( fd );
+	finished( *w.pool->protector );
+}
 
-		int fdmax = std::max( myTermPipe[0], myServerConnection );
+/// takes what's waiting on the protector into our reactor
+void
+acceptBatch( ServeWorker &w )
+{
+	ServePool &p = *w.pool;
+	int fds[kServeBatch];
+	while ( true )
+	{
+		int n = p.protector->tryAcceptMany( fds, kServeBatch );
+		if ( n < 0 )
+		{
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+			{
+				if ( p.protector->isDraining() )
+					p.protector->report_in_flight( __atomic_load_n( &p.protector->myInFlight, __ATOMIC_ACQUIRE ) );
+				stopPool( p, errno == ESHUTDOWN ? 0 : errno );
+			}
+			return;
+		}
+
+		__atomic_add_fetch( &p.protector->myInFlight, n, __ATOMIC_RELEASE );
+		for ( int i = 0; i != n; ++i )
+		{
+			int fd = fds[i];
+			struct epoll_event ev;
+			ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+			ev.data.fd = fd;
+			if ( epoll_ctl( w.epfd, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+			{
+				// let the handler find out what's wrong with it
+				pthread_mutex_lock( &w.lock );
+				w.ready.push_back( fd );
+				pthread_mutex_unlock( &w.lock );
+				continue;
+			}
+			w.parked.insert( fd );
+		}
+
+		// a drain request that came with the batch won't wake us
+		// again, so go round once more to find out
+		if ( ! p.protector->isGone() )
+			return;
+	}
+}
 
-		do
+void *
+serveLoop( void *arg )
+{
+	ServeWorker &w = *reinterpret_cast<ServeWorker *>( arg );
+	ServePool &p = *w.pool;
+	SocketProtectorImpl &sp = *p.protector;
+	struct epoll_event evs[kServeBatch];
+
+	while ( true )
+	{
+		int fd;
+		if ( takeReady( w, fd ) )
 		{
-			int rv = ::select( fdmax + 1, &fds, NULL, NULL, NULL );
+			handle( p, fd );
+			continue;
+		}
 
-			if ( rv == -1 )
+		int timeout = -1;
+		if ( __atomic_load_n( &p.stopping, __ATOMIC_SEQ_CST ) )
+		{
+			// asked to drain, the connections we took that haven't sent
+			// anything go back to the protector, or failing that get
+			// until the deadline to send something
+			timeout = sp.drain_remaining();
+			if ( timeout > 0 && ! sp.isTerminated() )
 			{
-				if ( errno == EINTR )
-					continue;
+				std::set<int> kept;
+				for ( std::set<int>::iterator i = w.parked.begin(); i != w.parked.end(); ++i )
+				{
+					if ( ! giveBack( w, *i ) )
+						kept.insert( *i );
+				}
+				w.parked.swap( kept );
+			}
+			if ( timeout <= 0 || w.parked.empty() || sp.isTerminated() )
+				break;
+		}
 
-				myTerminated = true;
-				syslog( LOG_NOTICE, "waiting on connection failed, terminate requested" );
-				return -1;
+		// announce we're idle before the last look, so whoever queues
+		// work after it sees us and wakes us
+		__atomic_store_n( &w.idle, 1, __ATOMIC_SEQ_CST );
+		if ( takeReady( w, fd ) )
+		{
+			__atomic_store_n( &w.idle, 0, __ATOMIC_SEQ_CST );
+			handle( p, fd );
+			continue;
+		}
+		int n = epoll_wait( w.epfd, evs, kServeBatch, timeout );
+		__atomic_store_n( &w.idle, 0, __ATOMIC_SEQ_CST );
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			syslog( LOG_ERR, "serve thread %d unable to wait: %s", int( w.index ), strerror( errno ) );
+			stopPool( p, errno );
+			break;
+		}
+
+		size_t queued = 0;
+		for ( int i = 0; i < n; ++i )
+		{
+			int efd = evs[i].data.fd;
+			if ( efd == w.wakefd )
+			{
+				uint64_t count;
+				if ( read( w.wakefd, &count, sizeof(count) ) < 0 && errno != EAGAIN )
+					syslog( LOG_DEBUG, "serve thread %d wake read failed", int( w.index ) );
 			}
+			else if ( efd == sp.myTermPipe[0] )
+				stopPool( p, 0 );
+			else if ( efd == sp.myServerConnection )
+			{
+				if ( __atomic_load_n( &p.stopping, __ATOMIC_SEQ_CST ) )
+					epoll_ctl( w.epfd, EPOLL_CTL_DEL, efd, NULL );
+				else
+					acceptBatch( w );
+			}
+			else
+			{
+				w.parked.erase( efd );
+				epoll_ctl( w.epfd, EPOLL_CTL_DEL, efd, NULL );
+				pthread_mutex_lock( &w.lock );
+				w.ready.push_back( efd );
+				pthread_mutex_unlock( &w.lock );
+				++queued;
+			}
+		}
 
-			if ( FD_ISSET( myTermPipe[0], &fds ) )
+		// we take one, hand the rest to whoever is idle
+		for ( size_t i = 1; i < p.workers.size() && queued > 1; ++i )
+		{
+			ServeWorker &o = *p.workers[( w.index + i ) % p.workers.size()];
+			if ( __atomic_load_n( &o.idle, __ATOMIC_SEQ_CST ) )
 			{
-				char b = '\0';
-				do
-				{
-					if ( read( myTermPipe[0], &b, sizeof(char) ) == 1 )
-					{
-						syslog( LOG_DEBUG, "Internal signal got '%c' message", b );
-						// don't actually care what's in the pipe, we're done, but set
-						// the flag again just in case
-						myTerminated = true;
-						break;
-					}
-
-					if ( errno == EINTR )
-						continue;
-
-					syslog( LOG_ERR, "error communicating on internal terminate channel: %s", strerror( errno ) );
-				} while ( false );
+				wakeWorker( o );
+				--queued;
 			}
+		}
+	}
 
-			if ( FD_ISSET( myServerConnection, &fds ) )
-				return getSocket();
+	// connections that never sent anything aren't waited for
+	for ( std::set<int>::iterator i = w.parked.begin(); i != w.parked.end(); ++i )
+		drop( w, *i );
+	w.parked.clear();
+	return NULL;
+}
 
-			if ( myTerminated )
-				break;
+int
+serve( SocketProtectorImpl *sp, socket_protector_handler handler, void *arg, int nthreads )
+{
+	if ( nthreads <= 0 )
+		nthreads = static_cast<int>( sysconf( _SC_NPROCESSORS_ONLN ) );
+	if ( nthreads <= 0 )
+		nthreads = 1;
+
+	ServePool p;
+	p.protector = sp;
+	p.handler = handler;
+	p.arg = arg;
+	p.stopping = 0;
+	p.error = 0;
+
+#ifndef EPOLLEXCLUSIVE
+# define EPOLLEXCLUSIVE 0
+#endif
+	for ( int i = 0; i != nthreads; ++i )
+	{
+		ServeWorker *w = new ServeWorker;
+		w->pool = &p;
+		w->index = static_cast<size_t>( i );
+		w->epfd = epoll_create1( EPOLL_CLOEXEC );
+		w->wakefd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		w->idle = 0;
+		pthread_mutex_init( &w->lock, NULL );
+		p.workers.push_back( w );
+
+		// every thread watches the protector, but only one is woken
+		// per connection burst
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = w->wakefd;
+		epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev );
+		ev.data.fd = sp->myTermPipe[0];
+		epoll_ctl( w->epfd, EPOLL_CTL_ADD, sp->myTermPipe[0], &ev );
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.fd = sp->myServerConnection;
+		epoll_ctl( w->epfd, EPOLL_CTL_ADD, sp->myServerConnection, &ev );
+	}
+
+	// terminate() may already have been called from a signal handler
+	if ( sp->isTerminated() )
+		p.stopping = 1;
+
+	for ( size_t i = 1; i < p.workers.size(); ++i )
+	{
+		if ( pthread_create( &p.workers[i]->thread, NULL, &serveLoop, p.workers[i] ) != 0 )
+		{
+			syslog( LOG_ERR, "unable to start serve thread: %s", strerror( errno ) );
+			p.workers[i]->thread = pthread_self();
 		}
-		while ( true );
+	}
+	serveLoop( p.workers[0] );
+
+	for ( size_t i = 0; i != p.workers.size(); ++i )
+	{
+		ServeWorker *w = p.workers[i];
+		if ( i && ! pthread_equal( w->thread, pthread_self() ) )
+			pthread_join( w->thread, NULL );
+	}
+	// anything still queued: nobody is left to steal it
+	for ( size_t i = 0; i != p.workers.size(); ++i )
+	{
+		ServeWorker *w = p.workers[i];
+		while ( ! w->ready.empty() )
+		{
+			handle( p, w->ready.front() );
+			w->ready.pop_front();
+		}
+		close( w->epfd );
+		close( w->wakefd );
+		pthread_mutex_destroy( &w->lock );
+		delete w;
+	}
+
+	if ( p.error )
+	{
+		errno = p.error;
 		return -1;
 	}
+	return 0;
+}
+
+#endif
+
+/// most connections taken off the protector, and sent on, per wakeup
+/// in a fanout
+const size_t kFanoutBatch = 64;
+
+/// One sub-worker of a fanout: our end of its channel, and what we know
+/// of how busy it is
+struct FanoutChild
+{
+	int conn;
+	/// a record still coming in, and the parked descriptors that came
+	/// ahead of theirs
+	char record[sizeof(uint32_t)];
+	size_t have;
+	std::vector<int> fds;
+	/// connections it last said it had in flight
+	int inFlight;
+	/// sent since its channel was last seen empty
+	int pending;
+	bool drainSent;
+};
+
+struct FanoutImpl
+{
+	SocketProtectorImpl *protector;
+	/// guards added, which any thread may put channels in for run() to
+	/// pick up, waking it through wake
+	pthread_mutex_t lock;
+	std::vector<int> added;
+	int wake[2];
+
+	std::vector<FanoutChild> children;
+	/// taken from the protector and not yet sent on
+	std::deque<int> backlog;
+	size_t next;
+	bool draining;
+	int lastReport;
+};
 
-	int
-	getSocket( void )
+void
+closeChild( FanoutChild &c )
+{
+	close( c.conn );
+	for ( size_t i = 0; i != c.fds.size(); ++i )
+		close( c.fds[i] );
+	c.fds.clear();
+}
+
+/// how far behind child is: what it says it's serving plus what we've
+/// sent it since its channel was last empty, as far as SIOCOUTQ can
+/// tell. Without that pending only ever grows, and the pick becomes a
+/// round robin weighed by the reports
+int
+childLoad( FanoutChild &c )
+{
+#ifdef SIOCOUTQ
+	int outq = 0;
+	if ( c.pending != 0 && ioctl( c.conn, SIOCOUTQ, &outq ) == 0 && outq == 0 )
+		c.pending = 0;
+#endif
+	return c.inFlight + c.pending;
+}
+
+/// sends the backlog on, each connection to whichever sub-worker is
+/// least loaded once the ones before it are counted, and each
+/// sub-worker's share in one batch. What doesn't fit waits at the front
+/// of the backlog for its channel to have room
+void
+fanoutSend( FanoutImpl &f )
+{
+	size_t nc = f.children.size();
+	if ( nc == 0 || f.backlog.empty() )
+		return;
+
+	// only the differences matter, keep them from growing without end
+	int least = INT_MAX;
+	for ( size_t c = 0; c != nc; ++c )
+		least = std::min( least, f.children[c].pending );
+	std::vector<int> load( nc );
+	for ( size_t c = 0; c != nc; ++c )
 	{
-		struct msghdr msg;
-		static const size_t ccmsgBufSz = CMSG_SPACE(sizeof(int));
-		char ccmsg[ccmsgBufSz];
+		f.children[c].pending -= least;
+		load[c] = childLoad( f.children[c] );
+	}
 
-		struct iovec iov;
-		char buf[1];
-		iov.iov_base = buf;
-		iov.iov_len = 1;
+	std::vector<bool> full( nc, false );
+	std::vector< std::vector<int> > batch( nc );
+	while ( ! f.backlog.empty() )
+	{
+		size_t n = std::min( f.backlog.size(), kFanoutBatch );
+		size_t taken = 0;
+		for ( ; taken != n; ++taken )
+		{
+			// ties go round from the last one picked
+			size_t best = nc;
+			for ( size_t k = 0; k != nc; ++k )
+			{
+				size_t c = ( f.next + k ) % nc;
+				if ( ! full[c] && ( best == nc || load[c] < load[best] ) )
+					best = c;
+			}
+			if ( best == nc )
+				break;
+			batch[best].push_back( f.backlog[taken] );
+			++load[best];
+			f.next = ( best + 1 ) % nc;
+		}
+		if ( taken == 0 )
+			break;
+		f.backlog.erase( f.backlog.begin(), f.backlog.begin() + taken );
+
+		for ( size_t c = 0; c != nc; ++c )
+		{
+			std::vector<int> &b = batch[c];
+			if ( b.empty() )
+				continue;
+
+			FanoutChild &child = f.children[c];
+			size_t sent = FDPassing::sendMany( child.conn, &b[0], b.size(), MSG_DONTWAIT | MSG_NOSIGNAL );
+			for ( size_t i = 0; i != sent; ++i )
+				close( b[i] );
+			child.pending += static_cast<int>( sent );
+			if ( sent != b.size() )
+			{
+				// a closed channel shows up when we next read it
+				if ( errno != EAGAIN && errno != EWOULDBLOCK )
+					syslog( LOG_DEBUG, "unable to pass connections to a sub-worker: %s", strerror( errno ) );
+				full[c] = true;
+				load[c] -= static_cast<int>( b.size() - sent );
+				f.backlog.insert( f.backlog.begin(), b.begin() + sent, b.end() );
+			}
+			b.clear();
+		}
+	}
+}
 
-		msg.msg_name = 0;
-		msg.msg_namelen = 0;
-		msg.msg_iov = &iov;
-		msg.msg_iovlen = 1;
-		msg.msg_control = ccmsg;
-		msg.msg_controllen = static_cast<socklen_t>( sizeof(ccmsg) );
+/// takes in what a sub-worker sent back. Counts are kept for its load,
+/// and parked connections go up to the protector. false once its
+/// channel has closed
+bool
+fanoutRead( FanoutImpl &f, FanoutChild &c )
+{
+	while ( true )
+	{
+		char buf[256];
+		ssize_t n = FDPassing::receiveRecords( c.conn, buf, sizeof(buf), c.fds, MSG_DONTWAIT );
+		if ( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			return true;
+		if ( n <= 0 )
+			return false;
 
-		do
+		for ( ssize_t i = 0; i != n; ++i )
 		{
-			ssize_t retval = recvmsg( myServerConnection, &msg, 0 );
-			if ( retval == -1 )
+			c.record[c.have++] = buf[i];
+			if ( c.have != sizeof(c.record) )
+				continue;
+			c.have = 0;
+
+			uint32_t v;
+			memcpy( &v, c.record, sizeof(v) );
+			if ( v != FDPassing::kPark )
+				c.inFlight = static_cast<int>( v );
+			else if ( c.fds.empty() )
+				syslog( LOG_NOTICE, "connection parked by a sub-worker was lost on the way" );
+			else
 			{
-				if ( errno == EINTR )
-					continue;
+				int fd = c.fds.front();
+				c.fds.erase( c.fds.begin() );
+				// failing that, another sub-worker waits on it as it
+				// would a new connection, unless they're all draining
+				if ( f.protector->park( fd ) != 0 )
+				{
+					if ( f.draining )
+						close( fd );
+					else
+						f.backlog.push_back( fd );
+				}
+			}
+		}
+	}
+}
+
+int
+fanoutRun( FanoutImpl &f )
+{
+	SocketProtectorImpl &sp = *f.protector;
+	std::vector<struct pollfd> p;
+	while ( true )
+	{
+		if ( sp.isTerminated() )
+			return 0;
 
-				if ( errno == ECONNRESET || errno == ENOTCONN )
+		pthread_mutex_lock( &f.lock );
+		for ( size_t i = 0; i != f.added.size(); ++i )
+		{
+			FanoutChild c;
+			c.conn = f.added[i];
+			memset( c.record, 0, sizeof(c.record) );
+			c.have = 0;
+			c.inFlight = 0;
+			c.pending = 0;
+			c.drainSent = false;
+			f.children.push_back( c );
+		}
+		f.added.clear();
+		pthread_mutex_unlock( &f.lock );
+
+		fanoutSend( f );
+		if ( f.draining )
+		{
+			if ( f.children.empty() )
+			{
+				while ( ! f.backlog.empty() )
 				{
-					syslog( LOG_NOTICE, "remote server disconnected, terminating" );
-					return -1;
+					close( f.backlog.front() );
+					f.backlog.pop_front();
 				}
+				return 0;
+			}
 
-				syslog( LOG_ERR, "unhandled error attempting to receive a socket: %s", strerror( errno ) );
-				return -1;
+			// the drain request is the last thing on a channel
+			int inFlight = 0;
+			for ( size_t c = 0; c != f.children.size(); ++c )
+			{
+				FanoutChild &child = f.children[c];
+				inFlight += child.inFlight;
+				if ( f.backlog.empty() && ! child.drainSent &&
+					 FDPassing::sendDrain( child.conn, MSG_DONTWAIT | MSG_NOSIGNAL ) != EAGAIN )
+					child.drainSent = true;
+			}
+			if ( inFlight != f.lastReport )
+			{
+				sp.report_in_flight( inFlight );
+				f.lastReport = inFlight;
 			}
-		} while ( false );
-			
-		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-		if ( cmsg == NULL )
+		}
+
+		p.resize( 3 + f.children.size() );
+		p[0].fd = sp.myTermPipe[0];
+		p[1].fd = f.wake[0];
+		// nothing more comes once draining, and a backlog of a batch
+		// is enough to hold while the sub-workers catch up
+		p[2].fd = f.draining || f.backlog.size() >= kFanoutBatch ? -1 : sp.myServerConnection;
+		for ( size_t c = 0; c != f.children.size(); ++c )
 		{
-			syslog( LOG_NOTICE, "empty message from server, terminating" );
-			return -1;
+			p[3 + c].fd = f.children[c].conn;
+			p[3 + c].events = POLLIN;
+			if ( ! f.backlog.empty() || ( f.draining && ! f.children[c].drainSent ) )
+				p[3 + c].events |= POLLOUT;
 		}
-		if ( cmsg->cmsg_type != SCM_RIGHTS )
+		for ( size_t i = 0; i != 3; ++i )
+			p[i].events = POLLIN;
+		for ( size_t i = 0; i != p.size(); ++i )
+			p[i].revents = 0;
+
+		if ( poll( &p[0], p.size(), -1 ) == -1 )
 		{
-			syslog( LOG_ERR, "Unknown control message type %d", cmsg->cmsg_type );
+			if ( errno == EINTR )
+				continue;
 			return -1;
 		}
 
-		int *fd = reinterpret_cast<int *>( CMSG_DATA( cmsg ) );
-		return *fd;
+		if ( p[1].revents & POLLIN )
+		{
+			char b[64];
+			if ( read( f.wake[0], b, sizeof(b) ) < 0 )
+				syslog( LOG_DEBUG, "unable to read fanout wake pipe: %s", strerror( errno ) );
+		}
+
+		if ( p[2].revents )
+		{
+			for ( size_t i = 0; i != kFanoutBatch; ++i )
+			{
+				int fd = sp.tryAccept();
+				if ( fd >= 0 )
+				{
+					f.backlog.push_back( fd );
+					continue;
+				}
+				if ( errno == EAGAIN || errno == EWOULDBLOCK || sp.isTerminated() )
+					break;
+				if ( ! sp.isDraining() )
+					return -1;
+
+				syslog( LOG_NOTICE, "passing the drain request on to %d sub-workers", int( f.children.size() ) );
+				f.draining = true;
+				f.lastReport = -1;
+				break;
+			}
+		}
+
+		for ( size_t c = f.children.size(); c-- != 0; )
+		{
+			if ( ! ( p[3 + c].revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+				continue;
+			if ( fanoutRead( f, f.children[c] ) )
+				continue;
+
+			closeChild( f.children[c] );
+			f.children.erase( f.children.begin() + c );
+			if ( f.next >= f.children.size() )
+				f.next = 0;
+		}
 	}
-};
+}
+
+PrivSocketProtector *
+create( uint16_t serverport, bool concurrent )
+{
+	try
+	{
+		std::auto_ptr<SocketProtectorImpl> tmp( new SocketProtectorImpl( serverport, concurrent ) );
+		return reinterpret_cast<PrivSocketProtector *>( tmp.release() );
+	}
+	catch ( const std::exception &e )
+	{
+		syslog( LOG_ERR, "error creating socket protector: %s", e.what() );
+	}
+	catch ( ... )
+	{
+		syslog( LOG_ERR, "UNNKNOWN error creating socket protector" );
+	}
+
+	return NULL;
+}
 
 } // empty namespace
 
@@ -241,11 +1053,30 @@ struct SocketProtectorImpl
 
 PrivSocketProtector *
 socket_protector_create( uint16_t serverport )
+{
+	return create( serverport, false );
+}
+
+
+////////////////////////////////////////
+
+
+PrivSocketProtector *
+socket_protector_create_concurrent( uint16_t serverport )
+{
+	return create( serverport, true );
+}
+
+
+////////////////////////////////////////
+
+
+PrivSocketProtector *
+socket_protector_create_from_channel( int channel )
 {
 	try
 	{
-		std::auto_ptr<SocketProtectorImpl> tmp( new SocketProtectorImpl( serverport ) );
-		return reinterpret_cast<PrivSocketProtector *>( tmp.release() );
+		return reinterpret_cast<PrivSocketProtector *>( new SocketProtectorImpl( channel ) );
 	}
 	catch ( const std::exception &e )
 	{
@@ -259,7 +1090,6 @@ socket_protector_create( uint16_t serverport )
 	return NULL;
 }
 
-
 ////////////////////////////////////////
 
 
@@ -326,3 +1156,243 @@ socket_protector_accept( PrivSocketProtector *ptr )
 ////////////////////////////////////////
 
 
+int
+socket_protector_fd( PrivSocketProtector *ptr )
+{
+	if ( ptr )
+	{
+		SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+		return rptr->myServerConnection;
+	}
+
+	return -1;
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_try_accept( PrivSocketProtector *ptr )
+{
+	if ( ptr )
+	{
+		SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+		return rptr->tryAccept();
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_serve( PrivSocketProtector *ptr, socket_protector_handler handler, void *arg, int nthreads )
+{
+	if ( ! ptr || ! handler )
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef __linux__
+	SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+	return serve( rptr, handler, arg, nthreads );
+#else
+	( void )nthreads;
+	// one at a time on the calling thread
+	while ( true )
+	{
+		int fd = socket_protector_accept( ptr );
+		if ( fd < 0 )
+			return socket_protector_is_terminated( ptr ) ? 0 : -1;
+		handler( fd, arg );
+		close( fd );
+	}
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_in_flight( PrivSocketProtector *ptr )
+{
+	if ( ptr )
+	{
+		SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+		return __atomic_load_n( &rptr->myInFlight, __ATOMIC_ACQUIRE );
+	}
+
+	return 0;
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_drain_remaining( PrivSocketProtector *ptr )
+{
+	if ( ptr )
+	{
+		SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+		return rptr->drain_remaining();
+	}
+
+	return -1;
+}
+
+
+////////////////////////////////////////
+
+
+void
+socket_protector_on_drain( PrivSocketProtector *ptr, socket_protector_drain_callback cb, void *arg )
+{
+	if ( ptr )
+	{
+		SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+		rptr->on_drain( cb, arg );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_report_in_flight( PrivSocketProtector *ptr, int count )
+{
+	if ( ptr )
+	{
+		SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+		return rptr->report_in_flight( count );
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_park( PrivSocketProtector *ptr, int fd )
+{
+	if ( ptr && fd >= 0 )
+	{
+		SocketProtectorImpl *rptr = reinterpret_cast<SocketProtectorImpl *>( ptr );
+		return rptr->park( fd );
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+
+////////////////////////////////////////
+
+
+PrivSocketProtectorFanout *
+socket_protector_fanout_create( PrivSocketProtector *ptr )
+{
+	if ( ! ptr )
+		return NULL;
+
+	FanoutImpl *f = new FanoutImpl;
+	if ( pipe( f->wake ) < 0 )
+	{
+		syslog( LOG_ERR, "error creating fanout wake pipe: %s", strerror( errno ) );
+		delete f;
+		return NULL;
+	}
+	fcntl( f->wake[0], F_SETFL, fcntl( f->wake[0], F_GETFL, 0 ) | O_NONBLOCK );
+	fcntl( f->wake[1], F_SETFL, fcntl( f->wake[1], F_GETFL, 0 ) | O_NONBLOCK );
+	f->protector = reinterpret_cast<SocketProtectorImpl *>( ptr );
+	pthread_mutex_init( &f->lock, NULL );
+	f->next = 0;
+	f->draining = false;
+	f->lastReport = -1;
+	return reinterpret_cast<PrivSocketProtectorFanout *>( f );
+}
+
+
+////////////////////////////////////////
+
+
+void
+socket_protector_fanout_destroy( PrivSocketProtectorFanout *ptr )
+{
+	FanoutImpl *f = reinterpret_cast<FanoutImpl *>( ptr );
+	if ( ! f )
+		return;
+
+	for ( size_t c = 0; c != f->children.size(); ++c )
+		closeChild( f->children[c] );
+	for ( size_t i = 0; i != f->added.size(); ++i )
+		close( f->added[i] );
+	for ( size_t i = 0; i != f->backlog.size(); ++i )
+		close( f->backlog[i] );
+	close( f->wake[0] );
+	close( f->wake[1] );
+	pthread_mutex_destroy( &f->lock );
+	delete f;
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_fanout_add( PrivSocketProtectorFanout *ptr )
+{
+	FanoutImpl *f = reinterpret_cast<FanoutImpl *>( ptr );
+	if ( ! f )
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	int sv[2];
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 )
+		return -1;
+	// so sub-workers that exec don't hold each other's channels open
+	fcntl( sv[0], F_SETFD, FD_CLOEXEC );
+
+	pthread_mutex_lock( &f->lock );
+	f->added.push_back( sv[0] );
+	pthread_mutex_unlock( &f->lock );
+
+	char b = 'a';
+	if ( write( f->wake[1], &b, sizeof(b) ) < 0 && errno != EAGAIN )
+		syslog( LOG_DEBUG, "unable to wake fanout: %s", strerror( errno ) );
+	return sv[1];
+}
+
+
+////////////////////////////////////////
+
+
+int
+socket_protector_fanout_run( PrivSocketProtectorFanout *ptr )
+{
+	FanoutImpl *f = reinterpret_cast<FanoutImpl *>( ptr );
+	if ( ! f )
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fanoutRun( *f );
+}
+
+
+////////////////////////////////////////
+
+
@@ -34,6 +34,11 @@ extern "C"
 
 struct PrivSocketProtector;
 PrivSocketProtector *socket_protector_create( uint16_t serverport );
+// Any number of threads may call socket_protector_accept (and
+// try_accept) on the result at the same time. Descriptors are taken off
+// the protector's channel in batches, and waiting threads are only
+// woken for connections that are there for them
+PrivSocketProtector *socket_protector_create_concurrent( uint16_t serverport );
 void socket_protector_destroy( PrivSocketProtector * );
 
 // Can (and should be) be called from a signal 
@@ -42,14 +47,103 @@ bool socket_protector_is_terminated( PrivSocketProtector * );
 
 int socket_protector_accept( PrivSocketProtector * );
 
+// For daemons with their own event loop: a descriptor that polls
+// readable when a connection is waiting (or the protector has gone
+// away), to be watched alongside everything else instead of blocking a
+// thread in accept. Owned by the protector object, don't close it
+int socket_protector_fd( PrivSocketProtector * );
+
+// Never blocks. Returns a connection, or -1 with errno EAGAIN when none
+// is waiting yet; any other errno means the protector has gone away or
+// terminate was called, and nothing more will arrive
+int socket_protector_try_accept( PrivSocketProtector * );
+
+// Runs the whole accept loop on a pool of nthreads threads (0 for one
+// per CPU), the calling thread being one of them. Connections are taken
+// off the protector in batches and only handed to handler, on whichever
+// thread is free, once they have something to read. The library closes
+// the descriptor when handler returns. Returns 0 after terminate() once
+// every handler has finished, -1 with errno if the protector went away.
+// Connections taken that hadn't sent anything by then are closed. When
+// asked to drain (below) those are parked with the protector instead
+// (or, if that fails, get until the deadline), and it returns 0 once
+// they're all done
+typedef void (*socket_protector_handler)( int fd, void *arg );
+int socket_protector_serve( PrivSocketProtector *, socket_protector_handler handler, void *arg, int nthreads );
+
+// Connections socket_protector_serve has taken and not yet closed
+int socket_protector_in_flight( PrivSocketProtector * );
+
+// When the protector replaces this process (a respawn, or its own
+// shutdown, if run with --drain-timeout) it first asks it to drain: no
+// more connections will come, accept returns -1 with errno ESHUTDOWN,
+// and the process has until a deadline to finish what it has and exit
+// before being sent SIGTERM. socket_protector_serve handles all of this
+// itself. Otherwise, the callback runs on the accepting thread when the
+// request arrives, given the msec left, and
+// socket_protector_drain_remaining gives the msec left (0 once past),
+// or -1 when not draining
+typedef void (*socket_protector_drain_callback)( int msecLeft, void *arg );
+void socket_protector_on_drain( PrivSocketProtector *, socket_protector_drain_callback cb, void *arg );
+int socket_protector_drain_remaining( PrivSocketProtector * );
+
+// While draining, tells the protector how many connections are still
+// being served, for its logs. Never blocks
+int socket_protector_report_in_flight( PrivSocketProtector *, int count );
+
+// Hands an idle connection (a keep-alive between requests, say) back to
+// the protector, which holds it without any process of ours having to
+// and passes it to whichever daemon is current once the client sends
+// more. Only for connections with nothing read and left unanswered:
+// the next daemon starts from the client's next bytes. On success the
+// descriptor is closed here and 0 is returned. -1 with errno (EAGAIN
+// when the protector is behind) leaves it with the caller. Works while
+// draining too, which is how a replaced daemon keeps its clients'
+// connections alive. Never blocks
+int socket_protector_park( PrivSocketProtector *, int fd );
+
+// For a daemon that is itself a master with sub-worker processes: a
+// fanout takes the connections from the master's protector object and
+// passes them on over a socketpair per sub-worker, the way the
+// protector passes them to the master, so each sub-worker runs the
+// normal accept API on its end. socket_protector_fanout_add returns a
+// new sub-worker's end (-1 with errno on failure). Fork the sub-worker
+// with it and close it in the master. In the sub-worker, destroy the
+// fanout and protector objects it inherited, which only closes its
+// copies of their descriptors, then call
+// socket_protector_create_from_channel on its end, which takes it over.
+// Sub-workers may be added from any thread, while run is going too.
+//
+// socket_protector_fanout_run is the master's accept loop. It sends
+// each connection to the least loaded sub-worker, judged by how many it
+// has yet to take and how many it last reported in flight, in one
+// sendmmsg per sub-worker per batch. A sub-worker that goes away is
+// dropped. What sub-workers park goes up to the protector. A drain
+// request is passed on to every sub-worker, along with their in-flight
+// counts going back, and run returns 0 once they have all gone. It
+// also returns 0 after terminate(), and -1 with errno if the protector
+// went away. Destroying the fanout closes the channels, which
+// sub-workers see as the protector going away
+struct PrivSocketProtectorFanout;
+PrivSocketProtector *socket_protector_create_from_channel( int channel );
+PrivSocketProtectorFanout *socket_protector_fanout_create( PrivSocketProtector * );
+void socket_protector_fanout_destroy( PrivSocketProtectorFanout * );
+int socket_protector_fanout_add( PrivSocketProtectorFanout * );
+int socket_protector_fanout_run( PrivSocketProtectorFanout * );
+
 #ifdef __cplusplus
 }
 
 class SocketProtector
 {
 public:
-	inline SocketProtector( uint16_t serverport )
-			: myPriv( socket_protector_create( serverport ) )
+	inline SocketProtector( uint16_t serverport, bool concurrent = false )
+			: myPriv( concurrent ? socket_protector_create_concurrent( serverport ) : socket_protector_create( serverport ) )
+	{}
+
+	/// takes over priv, socket_protector_create_from_channel's say
+	inline explicit SocketProtector( PrivSocketProtector *priv )
+			: myPriv( priv )
 	{}
 
 	inline ~SocketProtector( void )
@@ -72,9 +166,85 @@ public:
 		return socket_protector_accept( myPriv );
 	}
 
+	inline int fd( void ) const
+	{
+		return socket_protector_fd( myPriv );
+	}
+
+	inline int try_accept( void )
+	{
+		return socket_protector_try_accept( myPriv );
+	}
+
+	/// handler is anything callable as handler( fd )
+	template <typename Handler>
+	inline int serve( Handler handler, int nthreads = 0 )
+	{
+		return socket_protector_serve( myPriv, &callHandler<Handler>, &handler, nthreads );
+	}
+
+	inline int in_flight( void ) const
+	{
+		return socket_protector_in_flight( myPriv );
+	}
+
+	inline void on_drain( socket_protector_drain_callback cb, void *arg )
+	{
+		socket_protector_on_drain( myPriv, cb, arg );
+	}
+
+	inline int drain_remaining( void ) const
+	{
+		return socket_protector_drain_remaining( myPriv );
+	}
+
+	inline int report_in_flight( int count )
+	{
+		return socket_protector_report_in_flight( myPriv, count );
+	}
+
+	inline int park( int fd )
+	{
+		return socket_protector_park( myPriv, fd );
+	}
+
 private:
+	friend class SocketProtectorFanout;
+
+	template <typename Handler>
+	static void callHandler( int fd, void *arg )
+	{
+		( *static_cast<Handler *>( arg ) )( fd );
+	}
+
 	PrivSocketProtector *myPriv;
 };
+
+class SocketProtectorFanout
+{
+public:
+	inline explicit SocketProtectorFanout( SocketProtector &pt )
+			: myPriv( socket_protector_fanout_create( pt.myPriv ) )
+	{}
+
+	inline ~SocketProtectorFanout( void )
+	{
+		socket_protector_fanout_destroy( myPriv );
+	}
+
+	inline int add( void )
+	{
+		return socket_protector_fanout_add( myPriv );
+	}
+
+	inline int run( void )
+	{
+		return socket_protector_fanout_run( myPriv );
+	}
+
+private:
+	PrivSocketProtectorFanout *myPriv;
+};
 #endif
 
 
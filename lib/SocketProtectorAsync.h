@@ -0,0 +1,471 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+// Header-only C++20 coroutine layer over the SocketProtector wrapper, so
+// coroutine servers can take handed off connections without a thread
+// blocked in accept:
+//
+//   SocketProtectorTask serve( AsyncSocketProtector &p )
+//   {
+//       while ( true )
+//       {
+//           int fd = co_await p.async_accept();
+//           if ( fd < 0 )
+//               break;
+//           ...
+//       }
+//   }
+//
+// Waiting goes through a SocketProtectorReactor. An epoll one is built in
+// and used unless the constructor is handed another (an adapter onto an
+// existing event loop, say). Everything here is single threaded: the
+// awaits and the reactor's run belong to one thread, and only
+// terminate() may come from elsewhere, a signal handler included.
+
+#if ! defined(__cpp_impl_coroutine) || __cplusplus < 202002L
+# error "SocketProtectorAsync.h needs C++20 coroutines"
+#endif
+
+#include "SocketProtector.h"
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+/// Something that calls back once a descriptor can be read or written
+class SocketProtectorReactor
+{
+public:
+	class Waiter
+	{
+	public:
+		virtual void ready( void ) = 0;
+
+	protected:
+		~Waiter( void ) {}
+	};
+
+	virtual ~SocketProtectorReactor( void ) {}
+
+	/// one shot: w->ready() is called from run_once when fd is readable
+	/// (writable if forWrite), has an error, or interrupt() was called
+	virtual void wait( int fd, bool forWrite, Waiter *w ) = 0;
+	/// forgets a wait that hasn't been called back yet
+	virtual void cancel( int fd, Waiter *w ) = 0;
+	/// calls back every pending waiter. Safe from a signal handler
+	virtual void interrupt( void ) = 0;
+
+	/// waits up to timeoutMsec (-1 forever) and makes the calls back.
+	/// false when nothing is waiting any more
+	virtual bool run_once( int timeoutMsec ) = 0;
+
+	/// until every coroutine has stopped waiting
+	void run( void )
+	{
+		while ( run_once( -1 ) )
+			;
+	}
+};
+
+
+////////////////////////////////////////
+
+
+#ifdef __linux__
+class SocketProtectorEpoll : public SocketProtectorReactor
+{
+public:
+	SocketProtectorEpoll( void )
+			: myEpoll( epoll_create1( EPOLL_CLOEXEC ) ),
+			  myWake( eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ), myRunning( NULL )
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = myWake;
+		epoll_ctl( myEpoll, EPOLL_CTL_ADD, myWake, &ev );
+	}
+
+	virtual ~SocketProtectorEpoll( void )
+	{
+		close( myWake );
+		close( myEpoll );
+	}
+
+	virtual void wait( int fd, bool forWrite, Waiter *w )
+	{
+		Entry &e = myFds[fd];
+		e.waiters.push_back( Pending( w, forWrite ) );
+		if ( ! update( fd, e ) )
+		{
+			// not something epoll can watch, let it find out for itself
+			myFds.erase( fd );
+			myDispatch.push_back( w );
+		}
+	}
+
+	virtual void cancel( int fd, Waiter *w )
+	{
+		std::map<int, Entry>::iterator i = myFds.find( fd );
+		if ( i != myFds.end() )
+		{
+			for ( size_t k = 0; k != i->second.waiters.size(); ++k )
+			{
+				if ( i->second.waiters[k].first == w )
+				{
+					i->second.waiters.erase( i->second.waiters.begin() + k );
+					break;
+				}
+			}
+			if ( ! update( fd, i->second ) || i->second.waiters.empty() )
+				myFds.erase( i );
+		}
+		std::replace( myDispatch.begin(), myDispatch.end(), w, static_cast<Waiter *>( NULL ) );
+		if ( myRunning )
+			std::replace( myRunning->begin(), myRunning->end(), w, static_cast<Waiter *>( NULL ) );
+	}
+
+	virtual void interrupt( void )
+	{
+		uint64_t one = 1;
+		ssize_t r = write( myWake, &one, sizeof(one) );
+		( void )r;
+	}
+
+	virtual bool run_once( int timeoutMsec )
+	{
+		if ( myFds.empty() && myDispatch.empty() )
+			return false;
+
+		struct epoll_event evs[64];
+		int n = epoll_wait( myEpoll, evs, 64, myDispatch.empty() ? timeoutMsec : 0 );
+		for ( int i = 0; i < n; ++i )
+		{
+			if ( evs[i].data.fd == myWake )
+			{
+				uint64_t count;
+				ssize_t r = read( myWake, &count, sizeof(count) );
+				( void )r;
+				for ( std::map<int, Entry>::iterator f = myFds.begin(); f != myFds.end(); ++f )
+				{
+					for ( size_t k = 0; k != f->second.waiters.size(); ++k )
+						myDispatch.push_back( f->second.waiters[k].first );
+					f->second.waiters.clear();
+					update( f->first, f->second );
+				}
+				myFds.clear();
+				continue;
+			}
+
+			std::map<int, Entry>::iterator f = myFds.find( evs[i].data.fd );
+			if ( f == myFds.end() )
+				continue;
+			uint32_t got = evs[i].events;
+			bool anything = ( got & ( EPOLLERR | EPOLLHUP ) ) != 0;
+			std::vector<Pending> &w = f->second.waiters;
+			for ( size_t k = 0; k != w.size(); )
+			{
+				if ( anything || ( got & ( w[k].second ? EPOLLOUT : EPOLLIN ) ) )
+				{
+					myDispatch.push_back( w[k].first );
+					w.erase( w.begin() + k );
+				}
+				else
+					++k;
+			}
+			if ( ! update( f->first, f->second ) || w.empty() )
+				myFds.erase( f );
+		}
+
+		// callbacks wait again, and may cancel ones still to come
+		std::vector<Waiter *> now;
+		now.swap( myDispatch );
+		myRunning = &now;
+		for ( size_t k = 0; k != now.size(); ++k )
+		{
+			Waiter *w = now[k];
+			now[k] = NULL;
+			if ( w )
+				w->ready();
+		}
+		myRunning = NULL;
+		return true;
+	}
+
+private:
+	typedef std::pair<Waiter *, bool> Pending;
+	struct Entry
+	{
+		Entry( void ) : events( 0 ) {}
+		std::vector<Pending> waiters;
+		uint32_t events;
+	};
+
+	/// brings epoll's interest in fd into line with e's waiters
+	bool update( int fd, Entry &e )
+	{
+		uint32_t want = 0;
+		for ( size_t k = 0; k != e.waiters.size(); ++k )
+			want |= e.waiters[k].second ? EPOLLOUT : EPOLLIN;
+		if ( want == e.events )
+			return true;
+
+		struct epoll_event ev;
+		ev.events = want;
+		ev.data.fd = fd;
+		int op = want == 0 ? EPOLL_CTL_DEL : ( e.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD );
+		int rv = epoll_ctl( myEpoll, op, fd, &ev );
+		e.events = want;
+		return rv == 0 || op == EPOLL_CTL_DEL;
+	}
+
+	int myEpoll;
+	int myWake;
+	std::map<int, Entry> myFds;
+	std::vector<Waiter *> myDispatch;
+	std::vector<Waiter *> *myRunning;
+};
+#endif
+
+
+////////////////////////////////////////
+
+
+/// co_await'ed to suspend until a descriptor is ready (or the reactor
+/// is interrupted, so look again either way)
+class SocketProtectorWait : private SocketProtectorReactor::Waiter
+{
+public:
+	SocketProtectorWait( SocketProtectorReactor &r, int fd, bool forWrite )
+			: myReactor( r ), myFd( fd ), myWrite( forWrite ), myPending( false )
+	{}
+	SocketProtectorWait( const SocketProtectorWait &o )
+			: myReactor( o.myReactor ), myFd( o.myFd ), myWrite( o.myWrite ), myPending( false )
+	{}
+	~SocketProtectorWait( void )
+	{
+		if ( myPending )
+			myReactor.cancel( myFd, this );
+	}
+
+	bool await_ready( void ) const { return false; }
+	void await_suspend( std::coroutine_handle<> h )
+	{
+		myHandle = h;
+		myPending = true;
+		myReactor.wait( myFd, myWrite, this );
+	}
+	void await_resume( void ) const {}
+
+private:
+	virtual void ready( void )
+	{
+		myPending = false;
+		myHandle.resume();
+	}
+
+	SocketProtectorReactor &myReactor;
+	int myFd;
+	bool myWrite;
+	bool myPending;
+	std::coroutine_handle<> myHandle;
+};
+
+
+////////////////////////////////////////
+
+
+/// co_await'ed for the next connection(s) from the protector. Gives the
+/// connection, or the count appended for a batch, or -1 with errno:
+/// ESHUTDOWN after terminate(), anything else once the protector has
+/// gone away
+class SocketProtectorAccept : private SocketProtectorReactor::Waiter
+{
+public:
+	SocketProtectorAccept( SocketProtector &p, SocketProtectorReactor &r, std::vector<int> *batch, size_t max )
+			: myProtector( p ), myReactor( r ), myBatch( batch ), myMax( max ),
+			  myCount( 0 ), myFd( -1 ), myErr( 0 ), myPending( false )
+	{}
+	SocketProtectorAccept( const SocketProtectorAccept &o )
+			: myProtector( o.myProtector ), myReactor( o.myReactor ), myBatch( o.myBatch ), myMax( o.myMax ),
+			  myCount( 0 ), myFd( -1 ), myErr( 0 ), myPending( false )
+	{}
+	~SocketProtectorAccept( void )
+	{
+		if ( myPending )
+			myReactor.cancel( myProtector.fd(), this );
+	}
+
+	bool await_ready( void ) { return take(); }
+	void await_suspend( std::coroutine_handle<> h )
+	{
+		myHandle = h;
+		myPending = true;
+		myReactor.wait( myProtector.fd(), false, this );
+	}
+	int await_resume( void ) const
+	{
+		if ( myCount == 0 )
+		{
+			errno = myErr;
+			return -1;
+		}
+		return myBatch ? static_cast<int>( myCount ) : myFd;
+	}
+
+private:
+	/// true when there's something to hand back, connections or an error
+	bool take( void )
+	{
+		while ( myCount < myMax )
+		{
+			int fd = myProtector.try_accept();
+			if ( fd < 0 )
+			{
+				if ( errno == EAGAIN || errno == EWOULDBLOCK )
+					return myCount > 0;
+				// anything taken goes back first, the error comes next time
+				myErr = errno;
+				return true;
+			}
+			if ( myBatch )
+				myBatch->push_back( fd );
+			else
+				myFd = fd;
+			++myCount;
+		}
+		return true;
+	}
+
+	virtual void ready( void )
+	{
+		if ( take() )
+		{
+			myPending = false;
+			myHandle.resume();
+		}
+		else
+			myReactor.wait( myProtector.fd(), false, this );
+	}
+
+	SocketProtector &myProtector;
+	SocketProtectorReactor &myReactor;
+	std::vector<int> *myBatch;
+	size_t myMax;
+	size_t myCount;
+	int myFd;
+	int myErr;
+	bool myPending;
+	std::coroutine_handle<> myHandle;
+};
+
+
+////////////////////////////////////////
+
+
+class AsyncSocketProtector : public SocketProtector
+{
+public:
+	/// without a reactor of its own, uses the built in epoll one (linux)
+	explicit AsyncSocketProtector( uint16_t serverport, SocketProtectorReactor *reactor = NULL, bool concurrent = false )
+			: SocketProtector( serverport, concurrent ), myReactor( reactor ), myOwned( NULL )
+	{
+#ifdef __linux__
+		if ( ! myReactor )
+			myReactor = myOwned = new SocketProtectorEpoll;
+#endif
+	}
+
+	~AsyncSocketProtector( void )
+	{
+		delete myOwned;
+	}
+
+	SocketProtectorReactor &reactor( void ) { return *myReactor; }
+
+	/// as SocketProtector::terminate, and every suspended async_accept
+	/// wakes up to return -1 with ESHUTDOWN. Safe from a signal handler
+	void terminate( void )
+	{
+		SocketProtector::terminate();
+		myReactor->interrupt();
+	}
+
+	SocketProtectorAccept async_accept( void )
+	{
+		return SocketProtectorAccept( *this, *myReactor, NULL, 1 );
+	}
+
+	/// appends up to max connections to fds, as many as are waiting
+	/// once there's at least one
+	SocketProtectorAccept async_accept( std::vector<int> &fds, size_t max )
+	{
+		return SocketProtectorAccept( *this, *myReactor, &fds, max > 0 ? max : 1 );
+	}
+
+	/// for the coroutine's other descriptors, the connections it serves
+	SocketProtectorWait async_wait( int fd, bool forWrite = false )
+	{
+		return SocketProtectorWait( *myReactor, fd, forWrite );
+	}
+
+	void run( void ) { myReactor->run(); }
+
+private:
+	AsyncSocketProtector( const AsyncSocketProtector & );
+	AsyncSocketProtector &operator=( const AsyncSocketProtector & );
+
+	SocketProtectorReactor *myReactor;
+	SocketProtectorReactor *myOwned;
+};
+
+
+////////////////////////////////////////
+
+
+/// Return type for fire and forget coroutines: runs straight away up to
+/// its first suspension and frees itself when it finishes
+struct SocketProtectorTask
+{
+	struct promise_type
+	{
+		SocketProtectorTask get_return_object( void ) { return SocketProtectorTask(); }
+		std::suspend_never initial_suspend( void ) noexcept { return std::suspend_never(); }
+		std::suspend_never final_suspend( void ) noexcept { return std::suspend_never(); }
+		void return_void( void ) {}
+		void unhandled_exception( void ) { std::terminate(); }
+	};
+};
@@ -0,0 +1,152 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+// The smallest coroutine server on SocketProtectorAsync.h: one thread,
+// one coroutine taking connections off the protector in batches, and
+// one coroutine per connection echoing back whatever it reads. Nothing
+// blocks; every wait is a co_await on the protector's reactor.
+//
+// Usage: coro_echo <port>
+
+#include <SocketProtectorAsync.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+AsyncSocketProtector *theProtector = NULL;
+volatile sig_atomic_t theStopping = 0;
+
+void
+handleTerm( int )
+{
+	theStopping = 1;
+	if ( theProtector )
+		theProtector->terminate();
+}
+
+SocketProtectorTask
+serve( AsyncSocketProtector &pt, int fd )
+{
+	fcntl( fd, F_SETFL, fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+	char buf[16384];
+	while ( ! theStopping )
+	{
+		ssize_t n = read( fd, buf, sizeof(buf) );
+		if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+		{
+			co_await pt.async_wait( fd );
+			continue;
+		}
+		if ( n <= 0 )
+			break;
+
+		const char *p = buf;
+		size_t left = static_cast<size_t>( n );
+		while ( left > 0 && ! theStopping )
+		{
+			ssize_t w = write( fd, p, left );
+			if ( w > 0 )
+			{
+				p += w;
+				left -= static_cast<size_t>( w );
+			}
+			else if ( w < 0 && errno == EINTR )
+				continue;
+			else if ( w < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+				co_await pt.async_wait( fd, true );
+			else
+				break;
+		}
+		if ( left > 0 )
+			break;
+	}
+	close( fd );
+}
+
+SocketProtectorTask
+acceptLoop( AsyncSocketProtector &pt )
+{
+	std::vector<int> fds;
+	while ( true )
+	{
+		fds.clear();
+		if ( co_await pt.async_accept( fds, 64 ) < 0 )
+		{
+			if ( errno != ESHUTDOWN )
+				syslog( LOG_NOTICE, "protector went away: %s", strerror( errno ) );
+			break;
+		}
+		for ( size_t i = 0; i != fds.size(); ++i )
+			serve( pt, fds[i] );
+	}
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	long port = argc == 2 ? strtol( argv[1], NULL, 10 ) : -1;
+	if ( port <= 0 || port > 65535 )
+	{
+		std::cerr << "Usage: coro_echo <port>" << std::endl;
+		return -1;
+	}
+
+	openlog( "coro_echo", LOG_PID | LOG_NOWAIT | LOG_CONS | LOG_PERROR, LOG_DAEMON );
+	( void )setlogmask( LOG_UPTO( LOG_NOTICE ) );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	AsyncSocketProtector pt( static_cast<uint16_t>( port ) );
+	theProtector = &pt;
+	signal( SIGTERM, &handleTerm );
+	signal( SIGQUIT, &handleTerm );
+	signal( SIGHUP, &handleTerm );
+	signal( SIGINT, &handleTerm );
+
+	acceptLoop( pt );
+	pt.run();
+
+	theProtector = NULL;
+	return 0;
+}
@@ -0,0 +1,666 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+// A multi-threaded reference server on libSocketProtector, for use as a
+// benchmark backend or a starting point for a real daemon. A number of
+// epoll loop threads own their connections; the first one also watches
+// the protector's descriptor and deals new connections out to the rest
+// as they arrive, without a thread of its own blocked in accept.
+//
+// Connections that open with an HTTP request method get a small fixed
+// HTTP response per request (keep-alive and pipelining included);
+// anything else is echoed back. Reads and writes are non-blocking and
+// go through large per-thread buffers with readv / writev, so a loop
+// thread handles thousands of connections and many requests per system
+// call.
+//
+// When the protector asks it to drain, it stops taking connections,
+// parks the ones between requests with the protector (so keep-alive
+// clients carry on with its replacement) and exits once the rest are
+// done, or the deadline passes.
+//
+// Usage: echo_server [-t threads] <port>
+
+#include <SocketProtector.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <iostream>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+const size_t kReadSize = 64 * 1024;
+/// output held for a slow reader before we stop reading from it
+const size_t kMaxBacklog = 1024 * 1024;
+const int kMaxEvents = 256;
+
+const char theBody[] = "Hello from SocketProtector\n";
+
+struct Loop;
+
+SocketProtector *theProtector = NULL;
+std::vector<Loop *> theLoops;
+size_t theNextLoop = 0;
+volatile sig_atomic_t theStop = 0;
+volatile sig_atomic_t theDraining = 0;
+/// connections open across every loop
+int theOpen = 0;
+/// epoll tag for the protector's descriptor
+char theProtectorTag;
+
+struct Connection
+{
+	enum Mode { Unknown, Echo, Http };
+
+	int fd;
+	Mode mode;
+	/// unparsed request bytes (HTTP)
+	std::vector<char> in;
+	/// output the socket hasn't taken yet
+	std::vector<char> out;
+	size_t outOff;
+	bool closeAfter;
+	bool reading;
+	bool writing;
+};
+
+struct Loop
+{
+	pthread_t thread;
+	int epfd;
+	int wakefd;
+	pthread_mutex_t lock;
+	std::vector<int> incoming;
+	std::set<Connection *> connections;
+	char scratch[2][kReadSize];
+};
+
+/// signal safe
+void
+stopLoops( void )
+{
+	theStop = 1;
+	for ( size_t i = 0; i != theLoops.size(); ++i )
+	{
+		uint64_t one = 1;
+		if ( write( theLoops[i]->wakefd, &one, sizeof(one) ) < 0 )
+			continue;
+	}
+}
+
+void
+handleTerm( int )
+{
+	if ( theProtector )
+		theProtector->terminate();
+	stopLoops();
+}
+
+bool
+startsWithMethod( const char *p, size_t n, bool &partial )
+{
+	static const char *methods[] = { "GET ", "HEAD ", "POST ", "PUT ", "DELETE ", "OPTIONS ", NULL };
+	partial = false;
+	for ( const char **m = methods; *m; ++m )
+	{
+		size_t len = strlen( *m );
+		if ( n >= len && ! memcmp( p, *m, len ) )
+			return true;
+		if ( n < len && ! memcmp( p, *m, n ) )
+			partial = true;
+	}
+	return false;
+}
+
+/// case insensitive search for a header line, returning its value
+const char *
+findHeader( const char *begin, const char *end, const char *name )
+{
+	size_t len = strlen( name );
+	for ( const char *p = begin; p + len < end; ++p )
+	{
+		if ( ( p == begin || p[-1] == '\n' ) && ! strncasecmp( p, name, len ) && p[len] == ':' )
+		{
+			p += len + 1;
+			while ( p < end && *p == ' ' )
+				++p;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+void
+updateEvents( Loop &loop, Connection *c )
+{
+	struct epoll_event ev;
+	ev.events = ( c->reading ? EPOLLIN | EPOLLRDHUP : 0 ) | ( c->writing ? EPOLLOUT : 0 );
+	ev.data.ptr = c;
+	epoll_ctl( loop.epfd, EPOLL_CTL_MOD, c->fd, &ev );
+}
+
+/// between requests, with nothing of the client's held here
+bool
+isIdle( const Connection *c )
+{
+	return c->mode != Connection::Echo && c->in.empty() && c->outOff >= c->out.size() && ! c->closeAfter;
+}
+
+void
+closeConnection( Loop &loop, Connection *c )
+{
+	epoll_ctl( loop.epfd, EPOLL_CTL_DEL, c->fd, NULL );
+	// while draining, an idle connection goes back to the protector for
+	// our replacement to pick up when the client sends more
+	if ( ! theDraining || ! isIdle( c ) || theProtector->park( c->fd ) != 0 )
+		close( c->fd );
+	loop.connections.erase( c );
+	delete c;
+	int left = __atomic_sub_fetch( &theOpen, 1, __ATOMIC_ACQ_REL );
+	if ( theDraining )
+		theProtector->report_in_flight( left );
+}
+
+/// writes as much of iov as the socket takes, keeping the rest. false
+/// if the connection is gone
+bool
+sendOut( Connection *c, struct iovec *iov, int n )
+{
+	// anything already waiting has to go first
+	struct iovec all[3];
+	int nAll = 0;
+	if ( c->outOff < c->out.size() )
+	{
+		all[nAll].iov_base = &c->out[c->outOff];
+		all[nAll].iov_len = c->out.size() - c->outOff;
+		++nAll;
+	}
+	for ( int i = 0; i != n && nAll != 3; ++i )
+	{
+		if ( iov[i].iov_len )
+			all[nAll++] = iov[i];
+	}
+	if ( nAll == 0 )
+		return true;
+
+	ssize_t w;
+	do
+	{
+		w = writev( c->fd, all, nAll );
+	} while ( w < 0 && errno == EINTR );
+	if ( w < 0 )
+	{
+		if ( errno != EAGAIN && errno != EWOULDBLOCK )
+			return false;
+		w = 0;
+	}
+
+	// keep whatever didn't make it
+	std::vector<char> rest;
+	size_t skip = static_cast<size_t>( w );
+	for ( int i = 0; i != nAll; ++i )
+	{
+		size_t len = all[i].iov_len;
+		if ( skip >= len )
+		{
+			skip -= len;
+			continue;
+		}
+		const char *p = static_cast<const char *>( all[i].iov_base );
+		rest.insert( rest.end(), p + skip, p + len );
+		skip = 0;
+	}
+	c->out.swap( rest );
+	c->outOff = 0;
+	return true;
+}
+
+/// answers every complete request in c->in
+bool
+serveHttp( Connection *c )
+{
+	std::vector<char> responses;
+	size_t used = 0;
+	while ( true )
+	{
+		const char *begin = c->in.empty() ? NULL : &c->in[0] + used;
+		const char *end = c->in.empty() ? NULL : &c->in[0] + c->in.size();
+		if ( ! begin || begin == end )
+			break;
+
+		const char *hdrEnd = NULL;
+		for ( const char *p = begin; p + 3 < end; ++p )
+		{
+			if ( p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n' )
+			{
+				hdrEnd = p + 4;
+				break;
+			}
+		}
+		if ( ! hdrEnd )
+			break;
+
+		size_t bodyLen = 0;
+		const char *cl = findHeader( begin, hdrEnd, "Content-Length" );
+		if ( cl )
+			bodyLen = strtoul( cl, NULL, 10 );
+		if ( size_t( end - hdrEnd ) < bodyLen )
+			break;
+
+		const char *lineEnd = static_cast<const char *>( memchr( begin, '\r', hdrEnd - begin ) );
+		bool http10 = lineEnd && lineEnd - begin >= 8 && ! memcmp( lineEnd - 8, "HTTP/1.0", 8 );
+		const char *conn = findHeader( begin, hdrEnd, "Connection" );
+		if ( conn && ! strncasecmp( conn, "close", 5 ) )
+			c->closeAfter = true;
+		else if ( http10 && ! ( conn && ! strncasecmp( conn, "keep-alive", 10 ) ) )
+			c->closeAfter = true;
+		bool head = ! memcmp( begin, "HEAD ", 5 );
+
+		char hdr[160];
+		int n = snprintf( hdr, sizeof(hdr),
+						  "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %u\r\nConnection: %s\r\n\r\n",
+						  unsigned( sizeof(theBody) - 1 ), c->closeAfter ? "close" : "keep-alive" );
+		responses.insert( responses.end(), hdr, hdr + n );
+		if ( ! head )
+			responses.insert( responses.end(), theBody, theBody + sizeof(theBody) - 1 );
+
+		used = static_cast<size_t>( hdrEnd - &c->in[0] ) + bodyLen;
+		if ( c->closeAfter )
+		{
+			used = c->in.size();
+			c->reading = false;
+			break;
+		}
+	}
+	c->in.erase( c->in.begin(), c->in.begin() + used );
+
+	struct iovec iov;
+	iov.iov_base = responses.empty() ? NULL : &responses[0];
+	iov.iov_len = responses.size();
+	return sendOut( c, &iov, 1 );
+}
+
+/// false if the connection should be closed
+bool
+onReadable( Loop &loop, Connection *c )
+{
+	while ( c->reading )
+	{
+		struct iovec iov[2];
+		iov[0].iov_base = loop.scratch[0];
+		iov[0].iov_len = kReadSize;
+		iov[1].iov_base = loop.scratch[1];
+		iov[1].iov_len = kReadSize;
+
+		ssize_t n = readv( c->fd, iov, 2 );
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if ( n == 0 )
+		{
+			// the client is done sending, finish what it's owed
+			c->reading = false;
+			c->closeAfter = true;
+			break;
+		}
+
+		size_t got = static_cast<size_t>( n );
+		iov[0].iov_len = std::min( got, kReadSize );
+		iov[1].iov_len = got - iov[0].iov_len;
+
+		if ( c->mode == Connection::Unknown || c->mode == Connection::Http )
+		{
+			c->in.insert( c->in.end(), loop.scratch[0], loop.scratch[0] + iov[0].iov_len );
+			c->in.insert( c->in.end(), loop.scratch[1], loop.scratch[1] + iov[1].iov_len );
+			if ( c->mode == Connection::Unknown )
+			{
+				bool partial;
+				if ( startsWithMethod( &c->in[0], c->in.size(), partial ) )
+					c->mode = Connection::Http;
+				else if ( ! partial )
+				{
+					c->mode = Connection::Echo;
+					struct iovec whole;
+					whole.iov_base = &c->in[0];
+					whole.iov_len = c->in.size();
+					bool ok = sendOut( c, &whole, 1 );
+					std::vector<char>().swap( c->in );
+					if ( ! ok )
+						return false;
+				}
+			}
+			if ( c->mode == Connection::Http && ! serveHttp( c ) )
+				return false;
+		}
+		else if ( ! sendOut( c, iov, 2 ) )
+			return false;
+
+		// a reader that doesn't keep up gets paused
+		if ( c->out.size() > kMaxBacklog )
+			c->reading = false;
+		if ( got < 2 * kReadSize )
+			break;
+	}
+
+	if ( c->out.empty() && c->closeAfter )
+		return false;
+	if ( theDraining && isIdle( c ) )
+		return false;
+	c->writing = ! c->out.empty();
+	if ( ! c->writing && ! c->closeAfter )
+		c->reading = true;
+	updateEvents( loop, c );
+	return true;
+}
+
+bool
+onWritable( Loop &loop, Connection *c )
+{
+	if ( ! sendOut( c, NULL, 0 ) )
+		return false;
+	if ( c->out.empty() && c->closeAfter )
+		return false;
+	if ( theDraining && isIdle( c ) )
+		return false;
+
+	c->writing = ! c->out.empty();
+	if ( ! c->writing && ! c->closeAfter )
+		c->reading = true;
+	updateEvents( loop, c );
+	return true;
+}
+
+void
+addConnection( Loop &loop, int fd )
+{
+	fcntl( fd, F_SETFL, fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+
+	Connection *c = new Connection;
+	c->fd = fd;
+	c->mode = Connection::Unknown;
+	c->outOff = 0;
+	c->closeAfter = false;
+	c->reading = true;
+	c->writing = false;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	if ( epoll_ctl( loop.epfd, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+	{
+		syslog( LOG_ERR, "Unable to watch connection: %s", strerror( errno ) );
+		close( fd );
+		delete c;
+		return;
+	}
+	loop.connections.insert( c );
+	__atomic_add_fetch( &theOpen, 1, __ATOMIC_ACQ_REL );
+}
+
+/// everyone stops taking connections, and the loops run until theirs
+/// are done
+void
+startDrain( Loop &first )
+{
+	theDraining = 1;
+	epoll_ctl( first.epfd, EPOLL_CTL_DEL, theProtector->fd(), NULL );
+	theProtector->report_in_flight( __atomic_load_n( &theOpen, __ATOMIC_ACQUIRE ) );
+	for ( size_t i = 0; i != theLoops.size(); ++i )
+	{
+		uint64_t one = 1;
+		if ( write( theLoops[i]->wakefd, &one, sizeof(one) ) < 0 )
+			syslog( LOG_ERR, "wake write failed: %s", strerror( errno ) );
+	}
+}
+
+/// keep-alive connections between requests would otherwise sit out
+/// the whole drain, closing them parks them
+void
+parkIdle( Loop &loop )
+{
+	std::vector<Connection *> idle;
+	for ( std::set<Connection *>::iterator i = loop.connections.begin(); i != loop.connections.end(); ++i )
+	{
+		if ( isIdle( *i ) )
+			idle.push_back( *i );
+	}
+	for ( size_t i = 0; i != idle.size(); ++i )
+		closeConnection( loop, idle[i] );
+}
+
+/// round robin, the loops balance themselves well enough with the
+/// protector spreading load across processes
+void
+dealConnection( Loop &from, int sock )
+{
+	Loop &l = *theLoops[theNextLoop];
+	theNextLoop = ( theNextLoop + 1 ) % theLoops.size();
+	if ( &l == &from )
+	{
+		addConnection( l, sock );
+		return;
+	}
+
+	pthread_mutex_lock( &l.lock );
+	bool wake = l.incoming.empty();
+	l.incoming.push_back( sock );
+	pthread_mutex_unlock( &l.lock );
+	if ( wake )
+	{
+		uint64_t one = 1;
+		if ( write( l.wakefd, &one, sizeof(one) ) < 0 )
+			syslog( LOG_ERR, "wake write failed: %s", strerror( errno ) );
+	}
+}
+
+void *
+runLoop( void *arg )
+{
+	Loop &loop = *reinterpret_cast<Loop *>( arg );
+	struct epoll_event events[kMaxEvents];
+	while ( ! theStop )
+	{
+		int timeout = -1;
+		if ( theDraining )
+		{
+			timeout = theProtector->drain_remaining();
+			if ( timeout == 0 )
+				break;
+			pthread_mutex_lock( &loop.lock );
+			bool incoming = ! loop.incoming.empty();
+			pthread_mutex_unlock( &loop.lock );
+			if ( loop.connections.empty() && ! incoming )
+				break;
+		}
+
+		int n = epoll_wait( loop.epfd, events, kMaxEvents, timeout );
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			syslog( LOG_ERR, "epoll_wait failed: %s", strerror( errno ) );
+			break;
+		}
+
+		for ( int i = 0; i != n; ++i )
+		{
+			if ( events[i].data.ptr == &theProtectorTag )
+			{
+				while ( true )
+				{
+					int sock = theProtector->try_accept();
+					if ( sock != -1 )
+					{
+						dealConnection( loop, sock );
+						continue;
+					}
+					if ( errno == EAGAIN || errno == EWOULDBLOCK )
+						break;
+					if ( theProtector->drain_remaining() >= 0 )
+						startDrain( loop );
+					else
+						stopLoops();
+					break;
+				}
+				continue;
+			}
+
+			if ( events[i].data.ptr == NULL )
+			{
+				uint64_t v;
+				if ( read( loop.wakefd, &v, sizeof(v) ) < 0 && errno != EAGAIN )
+					syslog( LOG_ERR, "wake read failed: %s", strerror( errno ) );
+
+				std::vector<int> fds;
+				pthread_mutex_lock( &loop.lock );
+				fds.swap( loop.incoming );
+				pthread_mutex_unlock( &loop.lock );
+				for ( size_t f = 0; f != fds.size(); ++f )
+					addConnection( loop, fds[f] );
+				if ( theDraining )
+					parkIdle( loop );
+				continue;
+			}
+
+			Connection *c = reinterpret_cast<Connection *>( events[i].data.ptr );
+			bool keep = true;
+			if ( events[i].events & ( EPOLLERR | EPOLLHUP ) )
+				keep = false;
+			if ( keep && ( events[i].events & EPOLLOUT ) )
+				keep = onWritable( loop, c );
+			if ( keep && ( events[i].events & ( EPOLLIN | EPOLLRDHUP ) ) )
+				keep = onReadable( loop, c );
+			if ( ! keep )
+				closeConnection( loop, c );
+		}
+	}
+
+	while ( ! loop.connections.empty() )
+		closeConnection( loop, *loop.connections.begin() );
+	return NULL;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	long threads = sysconf( _SC_NPROCESSORS_ONLN );
+	long port = -1;
+	for ( int a = 1; a < argc; ++a )
+	{
+		if ( ! strcmp( argv[a], "-t" ) && a + 1 < argc )
+			threads = strtol( argv[++a], NULL, 10 );
+		else if ( port == -1 )
+			port = strtol( argv[a], NULL, 10 );
+		else
+			port = 0;
+	}
+	if ( port <= 0 || port > 65535 || threads <= 0 )
+	{
+		std::cerr << "Usage: echo_server [-t threads] <port>" << std::endl;
+		return -1;
+	}
+
+	openlog( "echo_server", LOG_PID | LOG_NOWAIT | LOG_CONS | LOG_PERROR, LOG_DAEMON );
+	( void )setlogmask( LOG_UPTO( LOG_NOTICE ) );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	SocketProtector pt( static_cast<uint16_t>( port ) );
+	theProtector = &pt;
+
+	// set up every loop before any signal can try to stop them
+	for ( long i = 0; i != threads; ++i )
+	{
+		Loop *l = new Loop;
+		l->epfd = epoll_create1( EPOLL_CLOEXEC );
+		l->wakefd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		pthread_mutex_init( &l->lock, NULL );
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl( l->epfd, EPOLL_CTL_ADD, l->wakefd, &ev );
+		theLoops.push_back( l );
+	}
+
+	signal( SIGTERM, &handleTerm );
+	signal( SIGQUIT, &handleTerm );
+	signal( SIGHUP, &handleTerm );
+	signal( SIGINT, &handleTerm );
+
+	// the first loop runs here, and takes the new connections too
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &theProtectorTag;
+	epoll_ctl( theLoops[0]->epfd, EPOLL_CTL_ADD, pt.fd(), &ev );
+	for ( size_t i = 1; i < theLoops.size(); ++i )
+		pthread_create( &theLoops[i]->thread, NULL, &runLoop, theLoops[i] );
+	runLoop( theLoops[0] );
+
+	// a draining loop finishes on its own
+	if ( ! theDraining )
+		stopLoops();
+	for ( size_t i = 0; i != theLoops.size(); ++i )
+	{
+		if ( i )
+			pthread_join( theLoops[i]->thread, NULL );
+		close( theLoops[i]->epfd );
+		close( theLoops[i]->wakefd );
+		pthread_mutex_destroy( &theLoops[i]->lock );
+	}
+	theProtector = NULL;
+	for ( size_t i = 0; i != theLoops.size(); ++i )
+		delete theLoops[i];
+	theLoops.clear();
+	return 0;
+}
+
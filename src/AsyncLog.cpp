@@ -0,0 +1,308 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#include "AsyncLog.h"
+#include "BoundedQueue.h"
+
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+struct Record
+{
+	/// when SP_LOG ran, not when the writer got to it
+	struct timespec when;
+	int priority;
+	char text[236];
+};
+
+BoundedQueue<Record> *theRing = NULL;
+pthread_t theThread;
+bool theRunning = false;
+int theStop = 0;
+int theMask = 0xff;
+unsigned theRateLimit = 20;
+uint64_t theDropped = 0;
+uint64_t theLimited = 0;
+FILE *theFile = NULL;
+
+uint32_t
+coarseSeconds( void )
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+	// served from the vDSO, no system call
+	struct timespec ts;
+	if ( clock_gettime( CLOCK_MONOTONIC_COARSE, &ts ) == 0 )
+		return static_cast<uint32_t>( ts.tv_sec );
+#endif
+	return static_cast<uint32_t>( time( NULL ) );
+}
+
+void
+stampNow( Record &r )
+{
+	// also from the vDSO, and fine grained enough to tell a burst apart
+	if ( clock_gettime( CLOCK_REALTIME, &r.when ) != 0 )
+	{
+		r.when.tv_sec = time( NULL );
+		r.when.tv_nsec = 0;
+	}
+}
+
+const char *
+priorityName( int priority )
+{
+	static const char *names[] =
+	{
+		"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+	};
+	return names[LOG_PRI( priority )];
+}
+
+void
+emit( const Record &r )
+{
+	if ( ! theFile )
+	{
+		syslog( r.priority, "%s", r.text );
+		return;
+	}
+
+	struct tm tmWhen;
+	time_t secs = r.when.tv_sec;
+	localtime_r( &secs, &tmWhen );
+	char stamp[32];
+	strftime( stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tmWhen );
+	fprintf( theFile, "%s.%06d %s: %s\n", stamp, int( r.when.tv_nsec / 1000 ), priorityName( r.priority ), r.text );
+}
+
+bool
+push( const Record &r )
+{
+	if ( ! __atomic_load_n( &theRunning, __ATOMIC_ACQUIRE ) )
+	{
+		syslog( r.priority, "%s", r.text );
+		return true;
+	}
+
+	if ( theRing->push( r ) )
+		return true;
+
+	__atomic_fetch_add( &theDropped, 1, __ATOMIC_RELAXED );
+	return false;
+}
+
+void *
+drain( void * )
+{
+	uint64_t reported = 0;
+	Record r;
+	while ( true )
+	{
+		bool stopping = __atomic_load_n( &theStop, __ATOMIC_ACQUIRE );
+
+		size_t n = 0;
+		while ( theRing->pop( r ) )
+		{
+			emit( r );
+			++n;
+		}
+
+		uint64_t dropped = __atomic_load_n( &theDropped, __ATOMIC_RELAXED );
+		if ( dropped != reported )
+		{
+			stampNow( r );
+			r.priority = LOG_WARNING;
+			snprintf( r.text, sizeof(r.text), "Log ring full, dropped %llu messages",
+					  static_cast<unsigned long long>( dropped - reported ) );
+			emit( r );
+			reported = dropped;
+		}
+
+		if ( n > 0 && theFile )
+			fflush( theFile );
+
+		if ( stopping )
+			break;
+
+		// polling keeps the writers free of wake up calls
+		if ( n == 0 )
+			usleep( 10000 );
+	}
+	return NULL;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace AsyncLog
+{
+
+
+////////////////////////////////////////
+
+
+void
+start( const std::string &path )
+{
+	if ( theRunning )
+		return;
+
+	theMask = setlogmask( 0 );
+	if ( ! path.empty() )
+	{
+		theFile = fopen( path.c_str(), "a" );
+		if ( ! theFile )
+			syslog( LOG_ERR, "Unable to open log file '%s', using syslog: %s", path.c_str(), strerror( errno ) );
+	}
+
+	if ( ! theRing )
+		theRing = new BoundedQueue<Record>( 1024 );
+
+	theStop = 0;
+	int rv = pthread_create( &theThread, NULL, &drain, NULL );
+	if ( rv != 0 )
+	{
+		syslog( LOG_ERR, "Unable to start log thread, logging directly: %s", strerror( rv ) );
+		return;
+	}
+	__atomic_store_n( &theRunning, true, __ATOMIC_RELEASE );
+}
+
+
+////////////////////////////////////////
+
+
+void
+stop( void )
+{
+	if ( ! theRunning )
+		return;
+
+	__atomic_store_n( &theStop, 1, __ATOMIC_RELEASE );
+	pthread_join( theThread, NULL );
+	__atomic_store_n( &theRunning, false, __ATOMIC_RELEASE );
+
+	// anything that raced in after the last pass
+	Record r;
+	while ( theRing->pop( r ) )
+		emit( r );
+
+	uint64_t limited = __atomic_load_n( &theLimited, __ATOMIC_RELAXED );
+	if ( limited > 0 )
+		syslog( LOG_INFO, "Rate limiting suppressed %llu log messages", static_cast<unsigned long long>( limited ) );
+
+	if ( theFile )
+	{
+		fclose( theFile );
+		theFile = NULL;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+setRateLimit( unsigned perSecond )
+{
+	theRateLimit = perSecond;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+wants( int priority )
+{
+	return ( LOG_MASK( LOG_PRI( priority ) ) & theMask ) != 0;
+}
+
+
+////////////////////////////////////////
+
+
+void
+write( Site &site, int priority, const char *fmt, ... )
+{
+	if ( theRateLimit > 0 )
+	{
+		uint32_t now = coarseSeconds();
+		uint32_t window = __atomic_load_n( &site.window, __ATOMIC_RELAXED );
+		if ( window != now &&
+			 __atomic_compare_exchange_n( &site.window, &window, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+		{
+			__atomic_store_n( &site.count, 0, __ATOMIC_RELAXED );
+			uint32_t suppressed = __atomic_exchange_n( &site.suppressed, 0, __ATOMIC_RELAXED );
+			if ( suppressed > 0 )
+			{
+				Record note;
+				stampNow( note );
+				note.priority = LOG_NOTICE;
+				snprintf( note.text, sizeof(note.text), "%s:%d: suppressed %u similar messages",
+						  site.file, site.line, suppressed );
+				push( note );
+			}
+		}
+
+		if ( __atomic_fetch_add( &site.count, 1, __ATOMIC_RELAXED ) >= theRateLimit )
+		{
+			__atomic_fetch_add( &site.suppressed, 1, __ATOMIC_RELAXED );
+			__atomic_fetch_add( &theLimited, 1, __ATOMIC_RELAXED );
+			return;
+		}
+	}
+
+	Record r;
+	stampNow( r );
+	r.priority = priority;
+	va_list ap;
+	va_start( ap, fmt );
+	vsnprintf( r.text, sizeof(r.text), fmt, ap );
+	va_end( ap );
+
+	push( r );
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace AsyncLog
+
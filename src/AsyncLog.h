@@ -0,0 +1,84 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+
+////////////////////////////////////////
+
+
+/// Logging stage that keeps syslog (or a file) off the calling thread.
+/// SP_LOG formats the message into a lock-free ring and returns; a
+/// background thread writes the ring out. Each call site is limited to
+/// a number of messages per second, and anything over the limit, or
+/// that doesn't fit in the ring, is counted and reported rather than
+/// written. Before start (or after stop) messages go straight to
+/// syslog, still rate limited
+namespace AsyncLog
+{
+
+/// per call site state, see SP_LOG
+struct Site
+{
+	const char *file;
+	int line;
+	uint32_t window;
+	uint32_t count;
+	uint32_t suppressed;
+};
+
+/// Starts the writer thread. Messages are appended to path if given,
+/// otherwise sent to syslog. Picks up the current syslog mask, so call
+/// after setlogmask
+void start( const std::string &path = std::string() );
+
+/// Writes out everything queued and stops the writer thread
+void stop( void );
+
+/// Messages per second allowed from one call site (default 20), 0
+/// for no limit
+void setRateLimit( unsigned perSecond );
+
+bool wants( int priority );
+
+void write( Site &site, int priority, const char *fmt, ... ) __attribute__(( format( printf, 3, 4 ) ));
+
+} // namespace AsyncLog
+
+
+/// syslog replacement for anything that might be on a busy path
+#define SP_LOG( priority, ... ) \
+	do \
+	{ \
+		static AsyncLog::Site spLogSite = { __FILE__, __LINE__, 0, 0, 0 }; \
+		if ( AsyncLog::wants( priority ) ) \
+			AsyncLog::write( spLogSite, priority, __VA_ARGS__ ); \
+	} while ( false )
+
+
+////////////////////////////////////////
+
+
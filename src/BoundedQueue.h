@@ -0,0 +1,137 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+////////////////////////////////////////
+
+
+/// Fixed size multi-producer, multi-consumer queue that never blocks or
+/// takes a lock (Vyukov's bounded queue). Each cell carries a sequence
+/// number saying whose turn it is, so producers and consumers only
+/// contend on their own index. push fails when the queue is full and
+/// pop when it is empty; waiting is up to the caller
+template <typename T>
+class BoundedQueue
+{
+public:
+	/// capacity is rounded up to a power of 2
+	explicit BoundedQueue( size_t capacity )
+			: myMask( 0 ), myEnqueue( 0 ), myDequeue( 0 )
+	{
+		size_t n = 2;
+		while ( n < capacity )
+			n *= 2;
+		myCells.resize( n );
+		for ( size_t i = 0; i != n; ++i )
+			myCells[i].seq = i;
+		myMask = n - 1;
+	}
+
+	bool push( const T &v )
+	{
+		Cell *c = NULL;
+		size_t pos = __atomic_load_n( &myEnqueue, __ATOMIC_RELAXED );
+		while ( true )
+		{
+			c = &myCells[pos & myMask];
+			size_t seq = __atomic_load_n( &c->seq, __ATOMIC_ACQUIRE );
+			intptr_t dif = static_cast<intptr_t>( seq ) - static_cast<intptr_t>( pos );
+			if ( dif == 0 )
+			{
+				if ( __atomic_compare_exchange_n( &myEnqueue, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+					break;
+			}
+			else if ( dif < 0 )
+				return false;
+			else
+				pos = __atomic_load_n( &myEnqueue, __ATOMIC_RELAXED );
+		}
+
+		c->value = v;
+		__atomic_store_n( &c->seq, pos + 1, __ATOMIC_RELEASE );
+		return true;
+	}
+
+	bool pop( T &v )
+	{
+		Cell *c = NULL;
+		size_t pos = __atomic_load_n( &myDequeue, __ATOMIC_RELAXED );
+		while ( true )
+		{
+			c = &myCells[pos & myMask];
+			size_t seq = __atomic_load_n( &c->seq, __ATOMIC_ACQUIRE );
+			intptr_t dif = static_cast<intptr_t>( seq ) - static_cast<intptr_t>( pos + 1 );
+			if ( dif == 0 )
+			{
+				if ( __atomic_compare_exchange_n( &myDequeue, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+					break;
+			}
+			else if ( dif < 0 )
+				return false;
+			else
+				pos = __atomic_load_n( &myDequeue, __ATOMIC_RELAXED );
+		}
+
+		v = c->value;
+		__atomic_store_n( &c->seq, pos + myMask + 1, __ATOMIC_RELEASE );
+		return true;
+	}
+
+	/// how many are queued, only a snapshot while others push or pop
+	size_t size( void ) const
+	{
+		size_t in = __atomic_load_n( &myEnqueue, __ATOMIC_RELAXED );
+		size_t out = __atomic_load_n( &myDequeue, __ATOMIC_RELAXED );
+		return in > out ? in - out : 0;
+	}
+
+private:
+	BoundedQueue( const BoundedQueue & );
+	BoundedQueue &operator=( const BoundedQueue & );
+
+	struct Cell
+	{
+		size_t seq;
+		T value;
+	};
+
+	std::vector<Cell> myCells;
+	size_t myMask;
+	// the two ends on their own cache lines
+	char myPad0[64];
+	size_t myEnqueue;
+	char myPad1[64];
+	size_t myDequeue;
+	char myPad2[64];
+};
+
+
+////////////////////////////////////////
+
+
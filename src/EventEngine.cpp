@@ -0,0 +1,766 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "EventEngine.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <poll.h>
+# if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#   include <linux/io_uring.h>
+#  endif
+# endif
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdexcept>
+#include <algorithm>
+#include <deque>
+
+#include "AsyncLog.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_FEAT_EXT_ARG)
+# define HAVE_IO_URING 1
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+class SelectEngine : public EventEngine
+{
+public:
+	SelectEngine( void )
+	{
+		reset();
+	}
+
+	virtual Type type( void ) const { return EngineSelect; }
+	virtual const char *name( void ) const { return "select"; }
+
+	virtual void reset( void )
+	{
+		FD_ZERO( &myRead );
+		FD_ZERO( &myWrite );
+		myMax = -1;
+	}
+
+	virtual void add( int fd, int want )
+	{
+		if ( fd < 0 || fd >= FD_SETSIZE )
+			return;
+		if ( want & WantRead )
+			FD_SET( fd, &myRead );
+		if ( want & WantWrite )
+			FD_SET( fd, &myWrite );
+		myMax = std::max( myMax, fd );
+	}
+
+	virtual int wait( const struct timeval *timeout )
+	{
+		struct timeval t;
+		struct timeval *tp = NULL;
+		if ( timeout )
+		{
+			t = *timeout;
+			tp = &t;
+		}
+		int rv = select( myMax + 1, &myRead, &myWrite, NULL, tp );
+		if ( rv <= 0 )
+		{
+			// select leaves the sets undefined on error
+			FD_ZERO( &myRead );
+			FD_ZERO( &myWrite );
+		}
+		return rv;
+	}
+
+	virtual bool ready( int fd, int want ) const
+	{
+		if ( fd < 0 || fd >= FD_SETSIZE )
+			return false;
+		return ( ( want & WantRead ) && FD_ISSET( fd, &myRead ) ) ||
+			( ( want & WantWrite ) && FD_ISSET( fd, &myWrite ) );
+	}
+
+private:
+	fd_set myRead;
+	fd_set myWrite;
+	int myMax;
+};
+
+
+////////////////////////////////////////
+
+
+#ifdef __linux__
+
+class EpollEngine : public EventEngine
+{
+public:
+	EpollEngine( void )
+	{
+		myEpoll = epoll_create( 64 );
+		if ( myEpoll < 0 )
+			throw std::runtime_error( std::string( "Unable to create epoll descriptor: " ) + strerror( errno ) );
+		fcntl( myEpoll, F_SETFD, FD_CLOEXEC );
+	}
+
+	virtual ~EpollEngine( void )
+	{
+		close( myEpoll );
+	}
+
+	virtual Type type( void ) const { return EngineEpoll; }
+	virtual const char *name( void ) const { return "epoll"; }
+
+	int fd( void ) const { return myEpoll; }
+
+	virtual void reset( void )
+	{
+		for ( size_t i = 0; i != myWantedFDs.size(); ++i )
+			myWanted[myWantedFDs[i]] = 0;
+		myWantedFDs.clear();
+		for ( size_t i = 0; i != myReadyFDs.size(); ++i )
+			myReady[myReadyFDs[i]] = 0;
+		myReadyFDs.clear();
+	}
+
+	virtual void add( int fd, int want )
+	{
+		if ( fd < 0 || want == 0 )
+			return;
+		grow( fd );
+		if ( myWanted[fd] == 0 )
+			myWantedFDs.push_back( fd );
+		myWanted[fd] |= static_cast<uint8_t>( want );
+	}
+
+	virtual void forget( int fd )
+	{
+		if ( fd < 0 || static_cast<size_t>( fd ) >= myRegistered.size() || myRegistered[fd] == 0 )
+			return;
+		epoll_ctl( myEpoll, EPOLL_CTL_DEL, fd, NULL );
+		myRegistered[fd] = 0;
+		myRegisteredFDs.erase( std::find( myRegisteredFDs.begin(), myRegisteredFDs.end(), fd ) );
+	}
+
+	virtual int wait( const struct timeval *timeout )
+	{
+		sync();
+		int msec = -1;
+		if ( timeout )
+			msec = static_cast<int>( timeout->tv_sec * 1000 + ( timeout->tv_usec + 999 ) / 1000 );
+		return collect( msec );
+	}
+
+	virtual bool ready( int fd, int want ) const
+	{
+		if ( fd < 0 || static_cast<size_t>( fd ) >= myReady.size() )
+			return false;
+		return ( myReady[fd] & want ) != 0;
+	}
+
+	/// passes the changes since the last pass along to the kernel
+	void sync( void )
+	{
+		// anything no longer wanted leaves the set
+		size_t keep = 0;
+		for ( size_t i = 0; i != myRegisteredFDs.size(); ++i )
+		{
+			int fd = myRegisteredFDs[i];
+			if ( myWanted[fd] == 0 )
+			{
+				epoll_ctl( myEpoll, EPOLL_CTL_DEL, fd, NULL );
+				myRegistered[fd] = 0;
+				continue;
+			}
+			myRegisteredFDs[keep++] = fd;
+		}
+		myRegisteredFDs.resize( keep );
+
+		for ( size_t i = 0; i != myWantedFDs.size(); ++i )
+		{
+			int fd = myWantedFDs[i];
+			if ( myRegistered[fd] == myWanted[fd] )
+				continue;
+
+			struct epoll_event ev;
+			memset( &ev, 0, sizeof(ev) );
+			ev.events = ( ( myWanted[fd] & WantRead ) ? EPOLLIN : 0 ) | ( ( myWanted[fd] & WantWrite ) ? EPOLLOUT : 0 );
+			ev.data.fd = fd;
+			int op = myRegistered[fd] == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+			if ( epoll_ctl( myEpoll, op, fd, &ev ) != 0 )
+			{
+				SP_LOG( LOG_ERR, "Unable to watch descriptor %d: %s", fd, strerror( errno ) );
+				continue;
+			}
+			if ( myRegistered[fd] == 0 )
+				myRegisteredFDs.push_back( fd );
+			myRegistered[fd] = myWanted[fd];
+		}
+	}
+
+	int collect( int msec )
+	{
+		struct epoll_event events[64];
+		int n = epoll_wait( myEpoll, events, 64, msec );
+		if ( n <= 0 )
+			return n;
+
+		for ( int i = 0; i != n; ++i )
+		{
+			int fd = events[i].data.fd;
+			uint8_t r = 0;
+			// errors and hangups show up as whatever was asked for, the
+			// same as select, so the following call reports them
+			if ( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) )
+				r |= WantRead;
+			if ( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) )
+				r |= WantWrite;
+			r &= myWanted[fd];
+			if ( r != 0 && myReady[fd] == 0 )
+				myReadyFDs.push_back( fd );
+			myReady[fd] |= r;
+		}
+		return n;
+	}
+
+private:
+	void grow( int fd )
+	{
+		size_t need = static_cast<size_t>( fd ) + 1;
+		if ( need <= myWanted.size() )
+			return;
+		need = std::max( need, myWanted.size() * 2 );
+		myWanted.resize( need, 0 );
+		myRegistered.resize( need, 0 );
+		myReady.resize( need, 0 );
+	}
+
+	int myEpoll;
+	std::vector<uint8_t> myWanted;
+	std::vector<uint8_t> myRegistered;
+	std::vector<uint8_t> myReady;
+	std::vector<int> myWantedFDs;
+	std::vector<int> myRegisteredFDs;
+	std::vector<int> myReadyFDs;
+};
+
+#endif
+
+
+////////////////////////////////////////
+
+
+#ifdef HAVE_IO_URING
+
+/// Accepts with one multishot accept per listener and sends with
+/// batches of sendmsg submissions. Everything else is watched by an
+/// epoll set, which the ring polls, so the control descriptors work the
+/// same as with the other engines.
+class UringEngine : public EventEngine
+{
+public:
+	UringEngine( void )
+			: myRing( -1 ), myRingMem( MAP_FAILED ), myRingSize( 0 ), mySQEs( MAP_FAILED ), mySQESize( 0 ),
+			  myPollArmed( false ), myControlReady( false ), myUnsubmitted( 0 ), mySends( NULL ), mySendsLeft( 0 )
+	{
+		struct io_uring_params p;
+		memset( &p, 0, sizeof(p) );
+		myRing = static_cast<int>( syscall( __NR_io_uring_setup, 256, &p ) );
+		if ( myRing < 0 )
+			throw std::runtime_error( std::string( "io_uring_setup: " ) + strerror( errno ) );
+		fcntl( myRing, F_SETFD, FD_CLOEXEC );
+
+		if ( ! ( p.features & IORING_FEAT_SINGLE_MMAP ) || ! ( p.features & IORING_FEAT_NODROP ) ||
+			 ! ( p.features & IORING_FEAT_EXT_ARG ) )
+		{
+			close( myRing );
+			throw std::runtime_error( "io_uring is missing required features" );
+		}
+
+		// there's no feature bit for multishot accept, but it arrived in
+		// the same release as the socket opcode
+		if ( ! supported( IORING_OP_SOCKET ) || ! supported( IORING_OP_SENDMSG ) || ! supported( IORING_OP_POLL_ADD ) )
+		{
+			close( myRing );
+			throw std::runtime_error( "io_uring does not support multishot accept" );
+		}
+
+		size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		myRingSize = std::max( sqSize, cqSize );
+		myRingMem = mmap( NULL, myRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, myRing, IORING_OFF_SQ_RING );
+		mySQESize = p.sq_entries * sizeof(struct io_uring_sqe);
+		mySQEs = mmap( NULL, mySQESize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, myRing, IORING_OFF_SQES );
+		if ( myRingMem == MAP_FAILED || mySQEs == MAP_FAILED )
+		{
+			int err = errno;
+			unmap();
+			close( myRing );
+			throw std::runtime_error( std::string( "Unable to map io_uring: " ) + strerror( err ) );
+		}
+
+		char *base = static_cast<char *>( myRingMem );
+		mySQHead = reinterpret_cast<unsigned *>( base + p.sq_off.head );
+		mySQTail = reinterpret_cast<unsigned *>( base + p.sq_off.tail );
+		mySQMask = *reinterpret_cast<unsigned *>( base + p.sq_off.ring_mask );
+		mySQEntries = p.sq_entries;
+		mySQArray = reinterpret_cast<unsigned *>( base + p.sq_off.array );
+		myCQHead = reinterpret_cast<unsigned *>( base + p.cq_off.head );
+		myCQTail = reinterpret_cast<unsigned *>( base + p.cq_off.tail );
+		myCQMask = *reinterpret_cast<unsigned *>( base + p.cq_off.ring_mask );
+		myCQEs = reinterpret_cast<struct io_uring_cqe *>( base + p.cq_off.cqes );
+		mySQLocalTail = *mySQTail;
+	}
+
+	virtual ~UringEngine( void )
+	{
+		unmap();
+		if ( myRing >= 0 )
+			close( myRing );
+		while ( ! myAccepted.empty() )
+		{
+			close( myAccepted.front().second );
+			myAccepted.pop_front();
+		}
+	}
+
+	virtual Type type( void ) const { return EngineUring; }
+	virtual const char *name( void ) const { return "io_uring"; }
+
+	virtual void watchListeners( const std::vector<int> &socks )
+	{
+		myListeners = socks;
+		myArmed.assign( socks.size(), false );
+	}
+
+	virtual bool acceptsDirectly( void ) const { return true; }
+	virtual bool hasAccepted( void ) const { return ! myAccepted.empty(); }
+
+	virtual bool popAccepted( size_t &listener, int &fd )
+	{
+		if ( myAccepted.empty() )
+			return false;
+		listener = myAccepted.front().first;
+		fd = myAccepted.front().second;
+		myAccepted.pop_front();
+		return true;
+	}
+
+	virtual void reset( void ) { myPolled.reset(); }
+	virtual void add( int fd, int want ) { myPolled.add( fd, want ); }
+	virtual void forget( int fd ) { myPolled.forget( fd ); }
+
+	virtual int wait( const struct timeval *timeout )
+	{
+		myPolled.sync();
+		arm();
+
+		// anything already completed means we don't need to sleep
+		reap();
+		bool block = myAccepted.empty() && ! myControlReady;
+		if ( ! block || ( timeout && timeout->tv_sec == 0 && timeout->tv_usec == 0 ) )
+		{
+			if ( myUnsubmitted > 0 && enter( 0, NULL ) < 0 )
+				return -1;
+		}
+		else
+		{
+			struct __kernel_timespec ts;
+			if ( timeout )
+			{
+				ts.tv_sec = timeout->tv_sec;
+				ts.tv_nsec = timeout->tv_usec * 1000LL;
+			}
+			if ( enter( 1, timeout ? &ts : NULL ) < 0 && errno != ETIME )
+				return -1;
+		}
+		reap();
+
+		int n = static_cast<int>( myAccepted.size() );
+		if ( myControlReady )
+		{
+			myControlReady = false;
+			int c = myPolled.collect( 0 );
+			if ( c > 0 )
+				n += c;
+		}
+		return n;
+	}
+
+	virtual bool ready( int fd, int want ) const { return myPolled.ready( fd, want ); }
+
+	virtual bool batchesSends( void ) const { return true; }
+
+	virtual void sendBatch( Send *sends, size_t n )
+	{
+		mySends = sends;
+		mySendsLeft = n;
+		for ( size_t i = 0; i != n; ++i )
+		{
+			sends[i].result = -1;
+			struct io_uring_sqe *sqe = getSQE();
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = sends[i].sock;
+			sqe->addr = reinterpret_cast<uintptr_t>( sends[i].msg );
+			sqe->len = 1;
+			// MSG_DONTWAIT makes a full socket fail with EAGAIN rather
+			// than the ring waiting for room
+			sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			sqe->user_data = tag( kSend, i );
+		}
+
+		while ( mySendsLeft > 0 )
+		{
+			if ( enter( static_cast<unsigned>( mySendsLeft ), NULL ) < 0 && errno != EINTR )
+			{
+				// nothing we can do with a broken ring but report it
+				int err = errno;
+				for ( size_t i = 0; i != n; ++i )
+				{
+					if ( sends[i].result == -1 )
+						sends[i].result = err;
+				}
+				break;
+			}
+			reap();
+		}
+		mySends = NULL;
+		mySendsLeft = 0;
+	}
+
+private:
+	enum Kind
+	{
+		kAccept = 1,
+		kPoll,
+		kSend
+	};
+
+	static uint64_t tag( Kind k, size_t idx ) { return ( uint64_t( k ) << 32 ) | uint64_t( idx ); }
+
+	bool supported( int op )
+	{
+		size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+		std::vector<char> buf( len, 0 );
+		struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>( &buf[0] );
+		if ( syscall( __NR_io_uring_register, myRing, IORING_REGISTER_PROBE, probe, 256 ) < 0 )
+			return false;
+		return op <= probe->last_op && ( probe->ops[op].flags & IO_URING_OP_SUPPORTED );
+	}
+
+	void unmap( void )
+	{
+		if ( myRingMem != MAP_FAILED )
+			munmap( myRingMem, myRingSize );
+		if ( mySQEs != MAP_FAILED )
+			munmap( mySQEs, mySQESize );
+		myRingMem = MAP_FAILED;
+		mySQEs = MAP_FAILED;
+	}
+
+	struct io_uring_sqe *getSQE( void )
+	{
+		if ( mySQLocalTail - __atomic_load_n( mySQHead, __ATOMIC_ACQUIRE ) >= mySQEntries )
+			enter( 0, NULL );
+
+		unsigned idx = mySQLocalTail & mySQMask;
+		struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>( mySQEs ) + idx;
+		memset( sqe, 0, sizeof(*sqe) );
+		mySQArray[idx] = idx;
+		++mySQLocalTail;
+		++myUnsubmitted;
+		return sqe;
+	}
+
+	int enter( unsigned minComplete, struct __kernel_timespec *ts )
+	{
+		__atomic_store_n( mySQTail, mySQLocalTail, __ATOMIC_RELEASE );
+
+		unsigned flags = 0;
+		struct io_uring_getevents_arg arg;
+		memset( &arg, 0, sizeof(arg) );
+		if ( minComplete > 0 )
+		{
+			flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+			arg.ts = reinterpret_cast<uintptr_t>( ts );
+		}
+
+		long rv = syscall( __NR_io_uring_enter, myRing, myUnsubmitted, minComplete, flags,
+						   minComplete > 0 ? &arg : NULL, minComplete > 0 ? sizeof(arg) : 0 );
+		if ( rv >= 0 )
+			myUnsubmitted -= std::min( myUnsubmitted, static_cast<unsigned>( rv ) );
+		return static_cast<int>( rv );
+	}
+
+	void arm( void )
+	{
+		if ( ! myPollArmed )
+		{
+			// one shot, so it's checked against the current state every
+			// time, as a level triggered wait would be
+			struct io_uring_sqe *sqe = getSQE();
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = myPolled.fd();
+			sqe->poll32_events = POLLIN;
+			sqe->user_data = tag( kPoll, 0 );
+			myPollArmed = true;
+		}
+
+		for ( size_t l = 0; l != myListeners.size(); ++l )
+		{
+			if ( myArmed[l] )
+				continue;
+			struct io_uring_sqe *sqe = getSQE();
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->fd = myListeners[l];
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			sqe->user_data = tag( kAccept, l );
+			myArmed[l] = true;
+		}
+	}
+
+	void reap( void )
+	{
+		unsigned head = *myCQHead;
+		unsigned tail = __atomic_load_n( myCQTail, __ATOMIC_ACQUIRE );
+		for ( ; head != tail; ++head )
+		{
+			const struct io_uring_cqe &cqe = myCQEs[head & myCQMask];
+			size_t idx = static_cast<size_t>( cqe.user_data & 0xffffffffULL );
+			switch ( static_cast<Kind>( cqe.user_data >> 32 ) )
+			{
+				case kAccept:
+					if ( cqe.res >= 0 )
+						myAccepted.push_back( std::make_pair( idx, cqe.res ) );
+					else if ( cqe.res != -ECANCELED )
+						SP_LOG( LOG_DEBUG, "Socket accept returned an error: (%d) '%s'", -cqe.res, strerror( -cqe.res ) );
+					// the kernel stops a multishot accept on errors and
+					// when it runs out of room, so start another
+					if ( ! ( cqe.flags & IORING_CQE_F_MORE ) && idx < myArmed.size() )
+						myArmed[idx] = false;
+					break;
+
+				case kPoll:
+					myPollArmed = false;
+					myControlReady = true;
+					break;
+
+				case kSend:
+					if ( mySends && mySendsLeft > 0 )
+					{
+						mySends[idx].result = cqe.res < 0 ? -cqe.res : 0;
+						--mySendsLeft;
+					}
+					break;
+			}
+		}
+		__atomic_store_n( myCQHead, head, __ATOMIC_RELEASE );
+	}
+
+	int myRing;
+	void *myRingMem;
+	size_t myRingSize;
+	void *mySQEs;
+	size_t mySQESize;
+
+	unsigned *mySQHead;
+	unsigned *mySQTail;
+	unsigned mySQMask;
+	unsigned mySQEntries;
+	unsigned *mySQArray;
+	unsigned mySQLocalTail;
+	unsigned *myCQHead;
+	unsigned *myCQTail;
+	unsigned myCQMask;
+	struct io_uring_cqe *myCQEs;
+
+	EpollEngine myPolled;
+	bool myPollArmed;
+	bool myControlReady;
+	unsigned myUnsubmitted;
+
+	std::vector<int> myListeners;
+	std::vector<bool> myArmed;
+	std::deque< std::pair<size_t, int> > myAccepted;
+
+	Send *mySends;
+	size_t mySendsLeft;
+};
+
+#endif
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+EventEngine *
+EventEngine::create( Type t )
+{
+#ifdef HAVE_IO_URING
+	if ( t == EngineUring )
+	{
+		try
+		{
+			return new UringEngine;
+		}
+		catch ( const std::exception &e )
+		{
+			syslog( LOG_NOTICE, "io_uring unavailable (%s), using epoll", e.what() );
+		}
+		t = EngineEpoll;
+	}
+#endif
+
+#ifdef __linux__
+	if ( t != EngineSelect )
+		return new EpollEngine;
+#else
+	if ( t != EngineSelect )
+		syslog( LOG_NOTICE, "Only the select engine is supported on this platform" );
+#endif
+
+	return new SelectEngine;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+EventEngine::parseType( const std::string &name, Type &t )
+{
+	if ( name == "select" )
+		t = EngineSelect;
+	else if ( name == "epoll" )
+		t = EngineEpoll;
+	else if ( name == "uring" || name == "io_uring" )
+		t = EngineUring;
+	else
+		return false;
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+EventEngine::~EventEngine( void )
+{
+}
+
+
+////////////////////////////////////////
+
+
+void
+EventEngine::watchListeners( const std::vector<int> & )
+{
+}
+
+
+////////////////////////////////////////
+
+
+bool
+EventEngine::acceptsDirectly( void ) const
+{
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+EventEngine::hasAccepted( void ) const
+{
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+EventEngine::popAccepted( size_t &, int & )
+{
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+EventEngine::forget( int )
+{
+}
+
+
+////////////////////////////////////////
+
+
+bool
+EventEngine::batchesSends( void ) const
+{
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+EventEngine::sendBatch( Send *sends, size_t n )
+{
+	for ( size_t i = 0; i != n; ++i )
+	{
+		ssize_t rv = -1;
+		do
+		{
+			rv = sendmsg( sends[i].sock, sends[i].msg, MSG_DONTWAIT );
+		} while ( rv == -1 && errno == EINTR );
+		sends[i].result = rv == -1 ? errno : 0;
+	}
+}
+
+
+////////////////////////////////////////
+
@@ -0,0 +1,102 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <vector>
+#include <string>
+
+
+////////////////////////////////////////
+
+
+/// What SocketServer's run loop waits with.
+///
+/// Each pass through the loop calls reset(), add()s every descriptor
+/// it cares about, then wait()s and asks which are ready, the same way
+/// it would build fd_sets for select. Engines that keep kernel state
+/// between passes only pass along what changed, so a descriptor must be
+/// forget()ten before it is closed.
+///
+/// Engines that can accept connections themselves (io_uring) do so for
+/// the listeners given to watchListeners, and hand back the new
+/// descriptors from popAccepted instead of reporting the listeners
+/// readable.
+class EventEngine
+{
+public:
+	enum Type
+	{
+		EngineSelect,
+		EngineEpoll,
+		EngineUring
+	};
+
+	enum
+	{
+		WantRead = 1,
+		WantWrite = 2
+	};
+
+	/// one sendmsg( sock, msg, MSG_DONTWAIT ), result is 0 or an errno
+	struct Send
+	{
+		int sock;
+		struct msghdr *msg;
+		int result;
+	};
+
+	/// Creates the requested engine, or the best one the kernel supports
+	/// if it is not available (io_uring falls back to epoll)
+	static EventEngine *create( Type t );
+	static bool parseType( const std::string &name, Type &t );
+
+	virtual ~EventEngine( void );
+
+	virtual Type type( void ) const = 0;
+	virtual const char *name( void ) const = 0;
+
+	virtual void watchListeners( const std::vector<int> &socks );
+	virtual bool acceptsDirectly( void ) const;
+	virtual bool hasAccepted( void ) const;
+	virtual bool popAccepted( size_t &listener, int &fd );
+
+	virtual void reset( void ) = 0;
+	virtual void add( int fd, int want ) = 0;
+	virtual void forget( int fd );
+
+	/// Waits for something added to be ready, or the timeout (NULL
+	/// waits forever). Returns -1 with errno set on error
+	virtual int wait( const struct timeval *timeout ) = 0;
+	virtual bool ready( int fd, int want ) const = 0;
+
+	/// Whether sendBatch costs less than one call per message
+	virtual bool batchesSends( void ) const;
+	virtual void sendBatch( Send *sends, size_t n );
+};
+
+
+////////////////////////////////////////
+
@@ -0,0 +1,406 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+// Passing accepted sockets from the protector to its workers over the
+// UNIX channel: every descriptor travels as SCM_RIGHTS on a message
+// carrying one byte of data, since a message with no data isn't sent.
+// Shared by the server, the client library and the benchmarks, so they
+// all measure and use the same path.
+//
+// The one message without a descriptor is the drain request, kDrain,
+// the last thing the server sends on a channel.
+//
+// What a worker sends back is a stream of native uint32_t records:
+// while draining, how many connections it still has in flight, and at
+// any time kPark with an idle connection attached, handing it back to
+// the server to hold until the client sends more.
+namespace FDPassing
+{
+
+/// data byte of the drain request
+const char kDrain = 'D';
+
+/// record of a parked connection, never a real in-flight count
+const uint32_t kPark = 0xFFFFFFFFU;
+
+/// a single descriptor, with the one byte of data that has to go along
+/// with it. Ready for sendmsg or a batch send once init'd
+struct Message
+{
+	struct msghdr msg;
+	struct iovec vec;
+	char byte;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	void init( int fd )
+	{
+		byte = 'x';
+		vec.iov_base = &byte;
+		vec.iov_len = 1;
+
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = &vec;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = static_cast<socklen_t>( sizeof(control.buf) );
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+		memcpy( CMSG_DATA(cmsg), &fd, sizeof(fd) );
+		msg.msg_controllen = cmsg->cmsg_len;
+	}
+};
+
+/// Sends fd over sock, retrying on EINTR. 0 when sent, otherwise the
+/// errno (EAGAIN when sock is non-blocking, or flags has MSG_DONTWAIT,
+/// and the receiver has fallen behind)
+inline int
+send( int sock, int fd, int flags )
+{
+	Message m;
+	m.init( fd );
+	while ( sendmsg( sock, &m.msg, flags ) == -1 )
+	{
+		if ( errno != EINTR )
+			return errno;
+	}
+	return 0;
+}
+
+/// Sends each of fds over sock as its own message, as send() does, in
+/// as few system calls as the platform allows (one sendmmsg per 64 on
+/// linux). Returns how many went, from the front. When that's short of
+/// n, errno says why: EAGAIN when the receiver has fallen behind
+inline size_t
+sendMany( int sock, const int *fds, size_t n, int flags )
+{
+	size_t sent = 0;
+#ifdef __linux__
+	const size_t kMaxBatch = 64;
+	Message msgs[kMaxBatch];
+	struct mmsghdr mm[kMaxBatch];
+	while ( sent != n )
+	{
+		size_t batch = std::min( n - sent, kMaxBatch );
+		for ( size_t i = 0; i != batch; ++i )
+		{
+			msgs[i].init( fds[sent + i] );
+			mm[i].msg_hdr = msgs[i].msg;
+			mm[i].msg_len = 0;
+		}
+
+		int rv;
+		do
+		{
+			rv = sendmmsg( sock, mm, static_cast<unsigned int>( batch ), flags );
+		} while ( rv == -1 && errno == EINTR );
+		if ( rv <= 0 )
+			break;
+		sent += static_cast<size_t>( rv );
+		if ( static_cast<size_t>( rv ) != batch )
+		{
+			// the rest didn't fit, find out why
+			int err = send( sock, fds[sent], flags );
+			if ( err != 0 )
+			{
+				errno = err;
+				break;
+			}
+			++sent;
+		}
+	}
+#else
+	for ( ; sent != n; ++sent )
+	{
+		int err = send( sock, fds[sent], flags );
+		if ( err != 0 )
+		{
+			errno = err;
+			break;
+		}
+	}
+#endif
+	return sent;
+}
+
+/// Asks the worker on sock to drain. 0 when sent, otherwise the errno
+inline int
+sendDrain( int sock, int flags )
+{
+	char b = kDrain;
+	while ( ::send( sock, &b, 1, flags ) == -1 )
+	{
+		if ( errno != EINTR )
+			return errno;
+	}
+	return 0;
+}
+
+/// Hands fd back to the server on sock. 0 when sent, otherwise the
+/// errno. The caller still owns fd either way
+inline int
+sendPark( int sock, int fd, int flags )
+{
+	uint32_t rec = kPark;
+	struct iovec vec;
+	vec.iov_base = &rec;
+	vec.iov_len = sizeof(rec);
+
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = static_cast<socklen_t>( sizeof(control.buf) );
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy( CMSG_DATA(cmsg), &fd, sizeof(fd) );
+	msg.msg_controllen = cmsg->cmsg_len;
+
+	while ( sendmsg( sock, &msg, flags ) == -1 )
+	{
+		if ( errno != EINTR )
+			return errno;
+	}
+	return 0;
+}
+
+/// Reads up to len bytes of a worker's records from sock, retrying on
+/// EINTR, and appends any descriptors that came along to fds in the
+/// order they were sent. A descriptor arrives no later than the last
+/// byte of the record it belongs to, so the records can be matched up
+/// with fds first in, first out. Returns what recvmsg did
+inline ssize_t
+receiveRecords( int sock, char *buf, size_t len, std::vector<int> &fds, int flags )
+{
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(8 * sizeof(int))];
+	} control;
+	struct iovec vec;
+	vec.iov_base = buf;
+	vec.iov_len = len;
+
+	struct msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = static_cast<socklen_t>( sizeof(control.buf) );
+
+	ssize_t n;
+	do
+	{
+		n = recvmsg( sock, &msg, flags );
+	} while ( n == -1 && errno == EINTR );
+	if ( n <= 0 )
+		return n;
+
+	for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+	{
+		if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+			continue;
+		size_t nfd = ( cmsg->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+		for ( size_t i = 0; i != nfd; ++i )
+		{
+			int fd;
+			memcpy( &fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int) );
+			fds.push_back( fd );
+		}
+	}
+	return n;
+}
+
+/// Receives one message from sock, retrying on EINTR. Returns what
+/// recvmsg did (0 when the sender went away), with fd set to the
+/// descriptor the message carried, or -1 if it had none, and the data
+/// byte in *data if given. Descriptors beyond the first are closed
+/// rather than leaked
+inline ssize_t
+receive( int sock, int &fd, int flags, char *data = NULL )
+{
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	char byte;
+	struct iovec vec;
+	vec.iov_base = &byte;
+	vec.iov_len = 1;
+
+	struct msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = static_cast<socklen_t>( sizeof(control.buf) );
+
+	fd = -1;
+	ssize_t n;
+	do
+	{
+		n = recvmsg( sock, &msg, flags );
+	} while ( n == -1 && errno == EINTR );
+	if ( n <= 0 )
+		return n;
+	if ( data )
+		*data = byte;
+
+	for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+	{
+		if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+			continue;
+
+		size_t nfd = ( cmsg->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+		for ( size_t i = 0; i != nfd; ++i )
+		{
+			int got;
+			memcpy( &got, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int) );
+			if ( fd == -1 )
+				fd = got;
+			else
+				close( got );
+		}
+	}
+	return n;
+}
+
+/// Receives up to max messages' worth of descriptors from sock in as
+/// few system calls as the platform allows (one recvmmsg on linux),
+/// retrying on EINTR. Returns how many descriptors were stored in fds,
+/// 0 when the sender went away (or sent a message without one), or -1
+/// with errno set, EAGAIN when flags didn't block and nothing was there.
+/// *drain, if given, is set when the drain request came with them
+inline ssize_t
+receiveMany( int sock, int *fds, size_t max, int flags, bool *drain = NULL )
+{
+#ifdef __linux__
+	const size_t kMaxBatch = 64;
+	size_t batch = max < kMaxBatch ? max : kMaxBatch;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control[kMaxBatch];
+	char bytes[kMaxBatch];
+	struct iovec vecs[kMaxBatch];
+	struct mmsghdr msgs[kMaxBatch];
+	for ( size_t i = 0; i != batch; ++i )
+	{
+		vecs[i].iov_base = &bytes[i];
+		vecs[i].iov_len = 1;
+		memset( &msgs[i], 0, sizeof(msgs[i]) );
+		msgs[i].msg_hdr.msg_iov = &vecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = control[i].buf;
+		msgs[i].msg_hdr.msg_controllen = static_cast<socklen_t>( sizeof(control[i].buf) );
+	}
+
+	int n;
+	do
+	{
+		n = recvmmsg( sock, msgs, static_cast<unsigned int>( batch ), flags | MSG_WAITFORONE, NULL );
+	} while ( n == -1 && errno == EINTR );
+	if ( n <= 0 )
+		return n;
+
+	ssize_t got = 0;
+	for ( int i = 0; i != n && msgs[i].msg_len > 0; ++i )
+	{
+		struct msghdr &msg = msgs[i].msg_hdr;
+		if ( drain && bytes[i] == kDrain && ! CMSG_FIRSTHDR(&msg) )
+			*drain = true;
+		for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+		{
+			if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+				continue;
+			size_t nfd = ( cmsg->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+			for ( size_t f = 0; f != nfd; ++f )
+			{
+				int fd;
+				memcpy( &fd, CMSG_DATA(cmsg) + f * sizeof(int), sizeof(int) );
+				if ( f == 0 )
+					fds[got++] = fd;
+				else
+					close( fd );
+			}
+		}
+	}
+	return got;
+#else
+	ssize_t got = 0;
+	while ( size_t( got ) < max )
+	{
+		int fd;
+		char data = 0;
+		ssize_t n = receive( sock, fd, got ? flags | MSG_DONTWAIT : flags, &data );
+		if ( n < 0 && got )
+			break;
+		if ( n <= 0 )
+			return n;
+		if ( fd == -1 )
+		{
+			if ( drain && data == kDrain )
+				*drain = true;
+			break;
+		}
+		fds[got++] = fd;
+	}
+	return got;
+#endif
+}
+
+} // namespace FDPassing
+
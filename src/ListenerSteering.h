@@ -0,0 +1,91 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef __linux__
+# include <linux/filter.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+/// Has the kernel pick a listener in a SO_REUSEPORT group of nListeners
+/// with a classic BPF program, attached through fd (any member of the
+/// group): by the CPU the packet arrived on, or by a hash of the IPv4
+/// source address, so the connections from one client all go to the
+/// same listener. Returns 0, or the errno from attaching it, ENOPROTOOPT
+/// where there is no such thing
+inline int
+attachListenerSteering( int fd, bool byCPU, uint32_t nListeners )
+{
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_filter cpuProg[] =
+	{
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t( SKF_AD_OFF + SKF_AD_CPU ) },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nListeners },
+		{ BPF_RET | BPF_A, 0, 0, 0 }
+	};
+	// SKF_NET_OFF + 12 is the IPv4 source address. The multiply spreads
+	// neighbouring addresses before taking the modulus
+	struct sock_filter hashProg[] =
+	{
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t( SKF_NET_OFF + 12 ) },
+		{ BPF_ALU | BPF_MUL | BPF_K, 0, 0, 2654435761U },
+		{ BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nListeners },
+		{ BPF_RET | BPF_A, 0, 0, 0 }
+	};
+
+	struct sock_fprog prog;
+	if ( byCPU )
+	{
+		prog.len = sizeof(cpuProg) / sizeof(cpuProg[0]);
+		prog.filter = cpuProg;
+	}
+	else
+	{
+		prog.len = sizeof(hashProg) / sizeof(hashProg[0]);
+		prog.filter = hashProg;
+	}
+
+	if ( setsockopt( fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog) ) < 0 )
+		return errno;
+	return 0;
+#else
+	( void )fd;
+	( void )byCPU;
+	( void )nListeners;
+	return ENOPROTOOPT;
+#endif
+}
+
+
+////////////////////////////////////////
+
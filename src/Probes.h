@@ -0,0 +1,120 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+
+////////////////////////////////////////
+
+
+// USDT (systemtap / dtrace style) probes under the socket_protector
+// provider, for bpftrace, perf and friends:
+//
+//   bpftrace -e 'usdt:./Build/SocketProtector:socket_protector:handoff { ... }'
+//
+// Each probe has an is-enabled semaphore, so the arguments (timestamps
+// included) are only computed while a tracer is attached; otherwise a
+// probe site is a test of a zero word and a nop. Every probe used in a
+// file needs a SP_PROBE_SEMAPHORE at file scope in that file. Without
+// <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel) the probes
+// compile away to nothing.
+//
+// The probes and their arguments, times being probeTime() below:
+//
+//   the protector (SocketServer.cpp)
+//     accept( conn id, fd, listener, time )
+//     enqueue( conn id, fd, handoff queue depth, time )
+//     handoff( conn id, fd, worker pid, time )
+//     handoff_fail( conn id, fd, worker pid, errno )
+//     respawn( worker, old pid, respawn count ), worker -1 for all
+//     child_connect( worker, pid, channel fd )
+//     child_exit( pid, wait status, worker )
+//
+//   the client library (SocketProtector.cpp), pid being the worker's
+//     client_getsocket( fd, pid, channel fd, queue depth, time ) as a
+//       descriptor comes off the channel
+//     client_accept( fd, pid, queue depth, ns spent waiting, time ) as
+//       accept returns it (fd -1 when it fails)
+//
+// A client's queue depth is the descriptors still waiting for that
+// worker after this one: one byte each unread on its channel, plus its
+// concurrent queue.
+
+#if defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  define SP_HAVE_SDT 1
+# endif
+#endif
+
+#ifdef SP_HAVE_SDT
+
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+
+# define SP_PROBE_SEMAPHORE( name ) \
+	__extension__ unsigned short socket_protector_##name##_semaphore __attribute__(( unused )) __attribute__(( section( ".probes" ) ))
+# define SP_PROBE_ENABLED( name ) __builtin_expect( socket_protector_##name##_semaphore != 0, 0 )
+
+# define SP_PROBE2( name, a, b ) \
+	do { if ( SP_PROBE_ENABLED( name ) ) DTRACE_PROBE2( socket_protector, name, a, b ); } while ( false )
+# define SP_PROBE3( name, a, b, c ) \
+	do { if ( SP_PROBE_ENABLED( name ) ) DTRACE_PROBE3( socket_protector, name, a, b, c ); } while ( false )
+# define SP_PROBE4( name, a, b, c, d ) \
+	do { if ( SP_PROBE_ENABLED( name ) ) DTRACE_PROBE4( socket_protector, name, a, b, c, d ); } while ( false )
+# define SP_PROBE5( name, a, b, c, d, e ) \
+	do { if ( SP_PROBE_ENABLED( name ) ) DTRACE_PROBE5( socket_protector, name, a, b, c, d, e ); } while ( false )
+
+#else
+
+# define SP_PROBE_SEMAPHORE( name ) extern int socket_protector_##name##_unused
+# define SP_PROBE_ENABLED( name ) false
+
+// sizeof keeps the arguments "used" without evaluating them
+# define SP_PROBE2( name, a, b ) \
+	do { ( void )sizeof( a ); ( void )sizeof( b ); } while ( false )
+# define SP_PROBE3( name, a, b, c ) \
+	do { ( void )sizeof( a ); ( void )sizeof( b ); ( void )sizeof( c ); } while ( false )
+# define SP_PROBE4( name, a, b, c, d ) \
+	do { ( void )sizeof( a ); ( void )sizeof( b ); ( void )sizeof( c ); ( void )sizeof( d ); } while ( false )
+# define SP_PROBE5( name, a, b, c, d, e ) \
+	do { ( void )sizeof( a ); ( void )sizeof( b ); ( void )sizeof( c ); ( void )sizeof( d ); ( void )sizeof( e ); } while ( false )
+
+#endif
+
+
+/// CLOCK_MONOTONIC in ns, the timestamp argument probes pass
+inline int64_t
+probeTime( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return int64_t( ts.tv_sec ) * 1000000000LL + ts.tv_nsec;
+}
+
+
+////////////////////////////////////////
+
+
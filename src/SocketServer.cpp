@@ -25,31 +25,71 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/select.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#ifdef __linux__
+# include <linux/sockios.h>
+#endif
 #include <unistd.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
+#include <string.h>
 #include <stdexcept>
+#include <algorithm>
 
+#include "AsyncLog.h"
+#include "FDPassing.h"
 #include "Daemon.h"
+#include "Probes.h"
+#include "SpliceProxy.h"
+#include "ListenerSteering.h"
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
+
+extern char **environ;
+
+
+////////////////////////////////////////
+
+
+SP_PROBE_SEMAPHORE( accept );
+SP_PROBE_SEMAPHORE( enqueue );
+SP_PROBE_SEMAPHORE( handoff );
+SP_PROBE_SEMAPHORE( handoff_fail );
+SP_PROBE_SEMAPHORE( respawn );
+SP_PROBE_SEMAPHORE( child_connect );
+SP_PROBE_SEMAPHORE( child_exit );
 
 
 ////////////////////////////////////////
 
 
 SocketServer::SocketServer( const std::vector<std::string> &subDaemonCommands, uint16_t port )
-		: myTCPSocket( -1 ), myUnixSocket( -1 ), myCmdLine( subDaemonCommands ), myConnectedDaemon( -1 ), myLastPID( -1 ), myRespawnCount( 0 ), myTCPPort( port ), myTerminated( false )
+		: mySteering( SteerKernel ), myListenerCount( 1 ), myNextListener( 0 ), myDeferAccept( 0 ), myFastOpen( 0 ), myDeferDropBase( 0 ), myHandoffCount( 0 ), myAvoidedHandoffs( 0 ), myUnixSocket( -1 ), myWorkersPerPool( 1 ), myDispatchMode( DispatchRoundRobin ), myPinWorkers( false ), mySniffTimeout( 500 ), mySniffLength( 0 ), mySniffLimitWarned( false ), myRespawnCount( 0 ), myProxy( NULL ), myProxySerial( 0 ), myDrainMsec( 0 ), myParkTimeout( 60 ), myEngineType( EventEngine::EngineSelect ), myEngine( NULL ), myThreaded( false ), mySnapshot( NULL ), myEpoch( 1 ), myWorkersChanged( false ), myHandBacks( 4096 ), myHandBackSignalled( 0 ), myAcceptHandedOff( 0 ), myTraceRecords( 0 ), myNextConnId( 0 ), myRespawnTotal( 0 ), myTCPPort( port ), myTerminated( false )
 {
+	Pool def;
+	def.name = "default";
+	def.cmdLine = subDaemonCommands;
+	def.firstWorker = 0;
+	def.nextWorker = 0;
+	myPools.push_back( def );
+
 	myTriggerPipe[0] = -1;
 	myTriggerPipe[1] = -1;
+	myStatsDue.tv_sec = 0;
+	myStatsDue.tv_usec = 0;
+	memset( myWaitHist, 0, sizeof(myWaitHist) );
 
 	if ( ::pipe( myTriggerPipe ) < 0 )
 	{
@@ -74,9 +114,14 @@ SocketServer::SocketServer( const std::vector<std::string> &subDaemonCommands, u
 
 SocketServer::~SocketServer( void )
 {
-	if ( myTCPSocket >= 0 )
-		::close( myTCPSocket );
-	myTCPSocket = -1;
+	delete myProxy;
+	myProxy = NULL;
+	delete myEngine;
+	myEngine = NULL;
+
+	for ( size_t l = 0; l != myTCPSockets.size(); ++l )
+		::close( myTCPSockets[l] );
+	myTCPSockets.clear();
 
 	if ( myTriggerPipe[0] >= 0 )
 		::close( myTriggerPipe[0] );
@@ -90,6 +135,392 @@ SocketServer::~SocketServer( void )
 ////////////////////////////////////////
 
 
+void
+SocketServer::setWorkerCount( size_t n )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change worker count while running" );
+	if ( n == 0 )
+		throw std::runtime_error( "Need at least one worker" );
+
+	myWorkersPerPool = n;
+}
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+bool
+parseHex( const std::string &hex, std::string &bytes )
+{
+	if ( hex.empty() || ( hex.size() % 2 ) != 0 )
+		return false;
+
+	bytes.clear();
+	for ( size_t i = 0; i != hex.size(); i += 2 )
+	{
+		char *end = NULL;
+		std::string byte = hex.substr( i, 2 );
+		long v = strtol( byte.c_str(), &end, 16 );
+		if ( *end != '\0' )
+			return false;
+		bytes.push_back( static_cast<char>( v ) );
+	}
+	return true;
+}
+
+bool
+parseMatcher( const std::string &matcher, std::vector<std::string> &prefixes )
+{
+	prefixes.clear();
+	if ( matcher == "tls" )
+	{
+		// handshake record, SSL 3.0 / TLS 1.x record version
+		prefixes.push_back( std::string( "\x16\x03", 2 ) );
+	}
+	else if ( matcher == "http" )
+	{
+		static const char *methods[] =
+		{
+			"GET ", "HEAD ", "POST ", "PUT ", "DELETE ", "OPTIONS ",
+			"PATCH ", "CONNECT ", "TRACE ", "PRI * HTTP/2", NULL
+		};
+		for ( const char **m = methods; *m; ++m )
+			prefixes.push_back( *m );
+	}
+	else if ( matcher.compare( 0, 7, "prefix:" ) == 0 && matcher.size() > 7 )
+		prefixes.push_back( matcher.substr( 7 ) );
+	else if ( matcher.compare( 0, 4, "hex:" ) == 0 )
+	{
+		std::string bytes;
+		if ( ! parseHex( matcher.substr( 4 ), bytes ) )
+			return false;
+		prefixes.push_back( bytes );
+	}
+	else
+		return false;
+
+	return true;
+}
+
+
+/// reads a counter from the TcpExt section of /proc/net/netstat, which
+/// is a line of names followed by a line of values
+unsigned long long
+readTcpExtCounter( const char *name )
+{
+	std::ifstream netstat( "/proc/net/netstat" );
+	std::string names, values;
+	while ( std::getline( netstat, names ) && std::getline( netstat, values ) )
+	{
+		if ( names.compare( 0, 7, "TcpExt:" ) != 0 )
+			continue;
+
+		std::istringstream n( names ), v( values );
+		std::string key;
+		unsigned long long val = 0;
+		while ( n >> key && v >> val )
+		{
+			if ( key == name )
+				return val;
+		}
+	}
+	return 0;
+}
+
+
+/// msec from now until tv, negative once past
+long long
+msecUntil( const struct timeval &tv )
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+	return ( ( tv.tv_sec - now.tv_sec ) * 1000000LL + ( tv.tv_usec - now.tv_usec ) ) / 1000;
+}
+
+void
+addMsec( struct timeval &tv, long long msec )
+{
+	long long us = tv.tv_usec + ( msec % 1000 ) * 1000;
+	tv.tv_sec += static_cast<time_t>( msec / 1000 + us / 1000000 );
+	tv.tv_usec = static_cast<suseconds_t>( us % 1000000 );
+}
+
+/// FNV-1a over the client address only (not the port), so every
+/// connection from one host shares an affinity key
+uint64_t
+affinityKey( const struct sockaddr_in &peer )
+{
+	uint64_t key = 0xCBF29CE484222325ULL;
+	if ( peer.sin_family == AF_INET )
+	{
+		const unsigned char *a = reinterpret_cast<const unsigned char *>( &peer.sin_addr );
+		for ( size_t i = 0; i != sizeof(peer.sin_addr); ++i )
+			key = ( key ^ a[i] ) * 0x100000001B3ULL;
+	}
+	return key;
+}
+
+/// sets name=value in env, a copy of environ, replacing what it had
+void
+setEnv( std::vector<std::string> &env, const char *name, const std::string &value )
+{
+	std::string prefix = std::string( name ) + '=';
+	std::vector<std::string>::iterator i = env.begin();
+	while ( i != env.end() )
+	{
+		if ( i->compare( 0, prefix.size(), prefix ) == 0 )
+			i = env.erase( i );
+		else
+			++i;
+	}
+	env.push_back( prefix + value );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::addRoute( const std::string &matcher, const std::vector<std::string> &cmdargs )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to add routes while running" );
+	if ( cmdargs.empty() )
+		throw std::runtime_error( "Missing command for route" );
+
+	Pool p;
+	if ( ! parseMatcher( matcher, p.prefixes ) )
+		throw std::runtime_error( "Invalid route matcher: " + matcher );
+
+	p.name = matcher;
+	p.cmdLine = cmdargs;
+	p.firstWorker = 0;
+	p.nextWorker = 0;
+	myPools.push_back( p );
+
+	for ( size_t i = 0; i != p.prefixes.size(); ++i )
+		mySniffLength = std::max( mySniffLength, p.prefixes[i].size() );
+	mySniffBuf.resize( mySniffLength );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setSniffTimeout( int msec )
+{
+	mySniffTimeout = std::max( msec, 0 );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketServer::isValidMatcher( const std::string &matcher )
+{
+	std::vector<std::string> prefixes;
+	return parseMatcher( matcher, prefixes );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setDeferAccept( int seconds )
+{
+	myDeferAccept = std::max( seconds, 0 );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setFastOpen( int queueLen )
+{
+	myFastOpen = std::max( queueLen, 0 );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setDispatchMode( DispatchMode m )
+{
+	myDispatchMode = m;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setCPUAffinity( const std::vector< std::vector<int> > &cpuSets )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change CPU affinity while running" );
+
+	myPinWorkers = true;
+	myCPUSets = cpuSets;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setListenerCount( size_t n, ListenerSteering steering )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change listener count while running" );
+	if ( n == 0 )
+		throw std::runtime_error( "Need at least one listener" );
+
+	myListenerCount = n;
+	mySteering = steering;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setTuning( const SocketTuning &t )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change socket tuning while running" );
+
+	myTunings.assign( std::max( myListenerCount, myTunings.size() ), t );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setListenerTuning( size_t l, const SocketTuning &t )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change socket tuning while running" );
+
+	if ( l >= myTunings.size() )
+		myTunings.resize( l + 1, myTunings.empty() ? SocketTuning() : myTunings.back() );
+	myTunings[l] = t;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setProxyPath( const std::string &prefix )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change proxy mode while running" );
+
+	// leave room for the ".<worker>.<launch>" suffix
+	struct sockaddr_un addr;
+	if ( prefix.size() + 24 > sizeof(addr.sun_path) )
+		throw std::runtime_error( "Proxy socket path prefix too long: " + prefix );
+
+	myProxyPrefix = prefix;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setEngine( EventEngine::Type t )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change engine while running" );
+
+	myEngineType = t;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setAcceptThreads( bool on )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change accept threads while running" );
+
+	myThreaded = on;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setTraceFile( const std::string &path, size_t records )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change trace file while running" );
+	if ( records == 0 )
+		throw std::runtime_error( "Trace needs room for at least one record" );
+
+	myTracePath = path;
+	myTraceRecords = records;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setStatsSegment( const std::string &name )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change stats segment while running" );
+
+	myStatsName = name;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setDrainTimeout( int msec )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change drain timeout while running" );
+
+	myDrainMsec = std::max( msec, 0 );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::setParkTimeout( int seconds )
+{
+	if ( ! myTCPSockets.empty() )
+		throw std::runtime_error( "Unable to change park timeout while running" );
+
+	myParkTimeout = std::max( seconds, 1 );
+}
+
+
+////////////////////////////////////////
+
+
 void
 SocketServer::terminate( void )
 {
@@ -144,86 +575,143 @@ SocketServer::childEvent( void )
 void
 SocketServer::run( int retryCount, int retryPauseSec, int backlogSize )
 {
-	if ( myTCPSocket != -1 )
+	if ( ! myTCPSockets.empty() )
 		throw std::runtime_error( "TCP Socket server already appears to be running" );
 
 	try
 	{
 		prepareTCPSocket( backlogSize );
+		layoutWorkers();
+		if ( ! myTracePath.empty() )
+			myTrace.open( myTracePath, myTraceRecords );
+		myHandoffCount = 0;
+		myAvoidedHandoffs = 0;
+		myWorkerHandoffs.assign( myWorkers.size(), 0 );
+		memset( myWaitHist, 0, sizeof(myWaitHist) );
+		if ( ! myStatsName.empty() )
+		{
+			myStats.create( myStatsName );
+			StatsPage *page = myStats.beginUpdate();
+			struct timespec now;
+			clock_gettime( CLOCK_REALTIME, &now );
+			page->started = int64_t( now.tv_sec ) * 1000000000LL + now.tv_nsec;
+			myStats.endUpdate();
+		}
+		assignCPUs();
+		if ( ! myProxyPrefix.empty() && ! myProxy )
+			myProxy = new SpliceProxy;
+		if ( ! myEngine )
+			myEngine = EventEngine::create( myEngineType );
+		myEngine->watchListeners( myThreaded ? std::vector<int>() : myTCPSockets );
+		SP_LOG( LOG_DEBUG, "Using %s engine", myEngine->name() );
 	
 		myRespawnCount = 0;
 		respawnChild();
+		// the first launch isn't a respawn
+		myRespawnTotal = 0;
+		if ( myStats.isOpen() )
+			publishStats();
+		if ( myThreaded )
+			startAcceptThreads();
 
 		do
 		{
 			drainSockets();
 
-			int fd = getNextSocket();
+			PendingSocket ps;
+			ps.fd = getNextSocket( ps );
 
-			if ( fd >= 0 )
+			if ( ps.fd >= 0 )
 			{
-				if ( sendSocket( fd ) )
-					continue;
+				// with routes, hold the connection until we've seen
+				// enough of it to know where it goes
+				ps.pool = 0;
+				bool canSniff = ( ps.fd < FD_SETSIZE || myEngine->type() != EventEngine::EngineSelect );
+				if ( myPools.size() > 1 && ! canSniff && ! mySniffLimitWarned )
+				{
+					SP_LOG( LOG_WARNING, "Connection fd %d is beyond the select engine's limit of %d, routing it and any others like it to the default command without sniffing (use --engine epoll to avoid this)", ps.fd, int( FD_SETSIZE ) );
+					mySniffLimitWarned = true;
+				}
 
-				mySendFDs.push_back( fd );
-				if ( myConnectedDaemon == -1 )
+				if ( myPools.size() > 1 && canSniff )
+					mySniffFDs.push_back( ps );
+				else if ( myEngine->batchesSends() && ! myProxy )
 				{
-					struct timeval curwaittime;
-					if ( gettimeofday( &curwaittime, NULL ) != 0 )
-					{
-						syslog( LOG_CRIT, "Unable to retrieve time of day: %s", strerror( errno ) );
-						continue;
-					}
-
-					if ( ( curwaittime.tv_sec - myLastStartTime.tv_sec ) > retryPauseSec )
-					{
-						syslog( LOG_NOTICE, "Child didn't respond after %d seconds, restarting", retryPauseSec );
-						if ( myRespawnCount > retryCount )
-						{
-							syslog( LOG_CRIT, "Child process didn't connect after %d retries, terminating", myRespawnCount );
-							myTerminated = true;
-							break;
-						}
-						respawnChild();
-					}
+					// hand off a burst of accepts together
+					mySendFDs.push_back( ps );
+					myTrace.record( TraceQueued, ps.id, ps.fd, -1, 0, int64_t( mySendFDs.size() ) );
+					SP_PROBE4( enqueue, ps.id, ps.fd, mySendFDs.size(), probeTime() );
+					if ( ! myEngine->hasAccepted() )
+						drainSockets();
 				}
 				else
+					routeSocket( ps );
+
+				if ( ! mySendFDs.empty() && ! checkWorkerStartup( retryCount, retryPauseSec ) )
 				{
-					myRespawnCount = 0;
+					myTerminated = true;
+					break;
 				}
 			}
 			else
 			{
 				// we were terminated, break out
-				syslog( LOG_INFO, "Terminate request received, forwarder stopping" );
+				SP_LOG( LOG_INFO, "Terminate request received, forwarder stopping" );
 				break;
 			}
 		} while ( true );
 	}
 	catch ( const std::exception &e )
 	{
-		syslog( LOG_CRIT, "Unhandled exception, terminating: %s", e.what() );
+		SP_LOG( LOG_CRIT, "Unhandled exception, terminating: %s", e.what() );
 	}
 	catch ( ... )
 	{
-		syslog( LOG_CRIT, "Unknown exception, terminating" );
+		SP_LOG( LOG_CRIT, "Unknown exception, terminating" );
 	}
 
-	closeHandles();
+	stopAcceptThreads();
+
+	SP_LOG( LOG_INFO, "Handed off %llu connections, avoided %llu handoffs of connections closed without sending data",
+			static_cast<unsigned long long>( myHandoffCount ), static_cast<unsigned long long>( myAvoidedHandoffs ) );
+	if ( myDeferAccept > 0 )
+		SP_LOG( LOG_INFO, "Kernel held back %llu data-less ACKs for deferred accept (TCPDeferAcceptDrop, system wide)",
+				readTcpExtCounter( "TCPDeferAcceptDrop" ) - myDeferDropBase );
 
+	if ( myAcceptCounts.size() > 1 )
+	{
+		for ( size_t l = 0; l != myAcceptCounts.size(); ++l )
+			SP_LOG( LOG_INFO, "Listener %d accepted %llu connections", int(l), static_cast<unsigned long long>( myAcceptCounts[l] ) );
+	}
+
+	// with a drain timeout the workers get to finish up first, with no
+	// more connections coming now that the listeners are closed
 	myTerminated = true;
-	myLastPID = -1;
+	if ( myDrainMsec > 0 && ! myProxy )
+	{
+		for ( size_t w = 0; w != myWorkers.size(); ++w )
+		{
+			if ( myWorkers[w].conn >= 0 && myWorkers[w].pid > 0 )
+				drainWorker( w );
+		}
+	}
+	closeHandles();
+	waitForDrain();
+	myStats.destroy();
+
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
+		myWorkers[w].pid = -1;
 	if ( ! myChildList.empty() )
 	{
 		size_t N = myChildList.size();
 		size_t nLeft = N;
 		for ( size_t i = 0; i != nLeft; ++i )
 		{
-			syslog( LOG_DEBUG, "Sending kill signal to pid %d", int(myChildList[i]) );
+			SP_LOG( LOG_DEBUG, "Sending kill signal to pid %d", int(myChildList[i]) );
 			int rv = kill( myChildList[i], SIGTERM );
 			if ( rv == -1 )
 			{
-				syslog( LOG_ERR, "kill signal to pid %d failed: %s", int(myChildList[i]), strerror( errno ) );
+				SP_LOG( LOG_ERR, "kill signal to pid %d failed: %s", int(myChildList[i]), strerror( errno ) );
 				--nLeft;
 			}
 		}
@@ -235,10 +723,10 @@ SocketServer::run( int retryCount, int retryPauseSec, int backlogSize )
 			pid_t cpid = waitpid( -1, &status, 0 );
 			if ( cpid < 0 )
 			{
-				syslog( LOG_DEBUG, "error waiting for sub daemons to exit: %s", strerror( errno ) );
+				SP_LOG( LOG_DEBUG, "error waiting for sub daemons to exit: %s", strerror( errno ) );
 				break;
 			}
-			syslog( LOG_DEBUG, "Child pid %d exited", int(cpid) );
+			SP_LOG( LOG_DEBUG, "Child pid %d exited", int(cpid) );
 			--nLeft;
 		}
 	}
@@ -249,24 +737,25 @@ SocketServer::run( int retryCount, int retryPauseSec, int backlogSize )
 
 
 void
-SocketServer::drainSockets( void )
+SocketServer::layoutWorkers( void )
 {
-	if ( myConnectedDaemon == -1 )
-		return;
-
-	while ( ! mySendFDs.empty() )
+	Worker w;
+	w.pid = -1;
+	w.conn = -1;
+	w.startTime.tv_sec = 0;
+	w.startTime.tv_usec = 0;
+	w.sessions = 0;
+	w.proxyReady = false;
+	w.inbound.have = 0;
+	w.inbound.closed = false;
+
+	myWorkers.clear();
+	for ( size_t p = 0; p != myPools.size(); ++p )
 	{
-		int fd = mySendFDs.front();
-		if ( sendSocket( fd ) )
-		{
-			mySendFDs.pop_front();
-		}
-		else
-		{
-			syslog( LOG_ERR, "Lost child process or couldn't send socket, respawning: %s", strerror( errno ) );
-			respawnChild();
-			return;
-		}
+		myPools[p].firstWorker = myWorkers.size();
+		myPools[p].nextWorker = 0;
+		w.pool = p;
+		myWorkers.insert( myWorkers.end(), myWorkersPerPool, w );
 	}
 }
 
@@ -274,92 +763,2024 @@ SocketServer::drainSockets( void )
 ////////////////////////////////////////
 
 
+void
+SocketServer::drainSockets( void )
+{
+	if ( mySendFDs.empty() )
+		return;
+
+	if ( myEngine && myEngine->batchesSends() && ! myProxy )
+		sendQueuedBatch();
+
+	// keep each pool's connections in order, but don't let a pool with
+	// no room hold up the others
+	std::vector<bool> blocked( myPools.size(), false );
+	std::deque<PendingSocket>::iterator i = mySendFDs.begin();
+	while ( i != mySendFDs.end() )
+	{
+		if ( ! blocked[i->pool] && dispatchSocket( *i ) )
+		{
+			i = mySendFDs.erase( i );
+			myRespawnCount = 0;
+			continue;
+		}
+
+		blocked[i->pool] = true;
+		++i;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::sendQueuedBatch( void )
+{
+	const size_t kMaxBatch = 64;
+	size_t n = std::min( mySendFDs.size(), kMaxBatch );
+	FDPassing::Message msgs[kMaxBatch];
+	EventEngine::Send sends[kMaxBatch];
+	size_t workers[kMaxBatch];
+	size_t order[myWorkersPerPool];
+
+	// every connection goes to its first choice, anything that doesn't
+	// fit is left for the one at a time path to place
+	size_t nSend = 0;
+	for ( ; nSend != n; ++nSend )
+	{
+		const PendingSocket &ps = mySendFDs[nSend];
+		size_t nCand = rankWorkers( ps, myPools[ps.pool].nextWorker, order );
+		size_t w = myWorkers.size();
+		for ( size_t i = 0; i != nCand; ++i )
+		{
+			if ( myWorkers[order[i]].conn != -1 )
+			{
+				w = order[i];
+				break;
+			}
+		}
+		if ( w == myWorkers.size() )
+			break;
+
+		if ( myDispatchMode != DispatchAffinity )
+		{
+			Pool &pool = myPools[ps.pool];
+			pool.nextWorker = ( w - pool.firstWorker + 1 ) % myWorkersPerPool;
+		}
+
+		workers[nSend] = w;
+		msgs[nSend].init( ps.fd );
+		sends[nSend].sock = myWorkers[w].conn;
+		sends[nSend].msg = &msgs[nSend].msg;
+	}
+
+	if ( nSend == 0 )
+		return;
+
+	myEngine->sendBatch( sends, nSend );
+
+	std::vector<bool> sent( nSend, false );
+	for ( size_t i = 0; i != nSend; ++i )
+	{
+		size_t w = workers[i];
+		if ( sends[i].result == 0 )
+		{
+			myTrace.record( TraceHandedOff, mySendFDs[i].id, mySendFDs[i].fd, myWorkers[w].pid, w, 0 );
+			noteHandoff( mySendFDs[i], w );
+			SP_PROBE4( handoff, mySendFDs[i].id, mySendFDs[i].fd, myWorkers[w].pid, probeTime() );
+			close( mySendFDs[i].fd );
+			__atomic_fetch_add( &myHandoffCount, 1, __ATOMIC_RELAXED );
+			myRespawnCount = 0;
+			sent[i] = true;
+		}
+		else if ( sends[i].result != EAGAIN && sends[i].result != EWOULDBLOCK &&
+				  myWorkers[w].conn == sends[i].sock )
+		{
+			myTrace.record( TraceHandoffFailed, mySendFDs[i].id, mySendFDs[i].fd, myWorkers[w].pid, w, sends[i].result );
+			SP_PROBE4( handoff_fail, mySendFDs[i].id, mySendFDs[i].fd, myWorkers[w].pid, sends[i].result );
+			SP_LOG( LOG_ERR, "Lost worker %d or couldn't send socket, respawning: %s", int(w), strerror( sends[i].result ) );
+			respawnWorker( w );
+		}
+	}
+
+	size_t keep = 0;
+	for ( size_t i = 0; i != mySendFDs.size(); ++i )
+	{
+		if ( i < nSend && sent[i] )
+			continue;
+		mySendFDs[keep++] = mySendFDs[i];
+	}
+	mySendFDs.resize( keep );
+}
+
+
+////////////////////////////////////////
+
+
 void
 SocketServer::acceptChild( void )
 {
+	int conn = -1;
 	do
 	{
-		myConnectedDaemon = accept( myUnixSocket, NULL, NULL );
-		if ( myConnectedDaemon == -1 )
+		conn = accept( myUnixSocket, NULL, NULL );
+		if ( conn == -1 )
 		{
 			if ( errno == EINTR )
 				continue;
-			syslog( LOG_ERR, "Error accepting child socket, restarting child" );
+			SP_LOG( LOG_ERR, "Error accepting child socket, restarting children" );
 			respawnChild();
 			return;
 		}
 	} while ( false );
 
-	close( myUnixSocket );
-	myUnixSocket = -1;
-#ifndef __linux__
-	if ( unlink( myUnixSockPath.c_str() ) == -1 )
-	{
-		if ( errno != ENOENT )
-			throw std::runtime_error( strerror( errno ) );
-	}
+	size_t N = myWorkers.size();
+	size_t w = N;
+
+#ifdef SO_PEERCRED
+	// match the connection up with the worker we forked so a respawned
+	// worker takes over its old slot (and hence its share of clients)
+	struct ucred cred;
+	socklen_t credLen = sizeof(cred);
+	if ( getsockopt( conn, SOL_SOCKET, SO_PEERCRED, &cred, &credLen ) == 0 )
+	{
+		for ( size_t i = 0; i != N; ++i )
+		{
+			if ( myWorkers[i].pid == cred.pid && myWorkers[i].conn == -1 )
+			{
+				w = i;
+				break;
+			}
+		}
+	}
+#endif
+
+	// the child may be a wrapper script or otherwise not the process
+	// we forked, so just fill the first slot that's waiting
+	for ( size_t i = 0; w == N && i != N; ++i )
+	{
+		if ( myWorkers[i].conn == -1 )
+			w = i;
+	}
+
+	if ( w == N )
+	{
+		SP_LOG( LOG_NOTICE, "Unexpected child connection, all workers connected, ignoring" );
+		close( conn );
+		return;
+	}
+
+	myWorkers[w].conn = conn;
+	clearInbound( myWorkers[w].inbound );
+	myWorkersChanged = true;
+	myTrace.record( TraceConnected, 0, conn, myWorkers[w].pid, w, 0 );
+	SP_PROBE3( child_connect, w, myWorkers[w].pid, conn );
+	SP_LOG( LOG_DEBUG, "Worker %d (pid %d) connected", int(w), int(myWorkers[w].pid) );
+
+	bool allConnected = true;
+	for ( size_t i = 0; i != N; ++i )
+	{
+		if ( myWorkers[i].conn == -1 )
+			allConnected = false;
+	}
+
+	if ( allConnected )
+	{
+		if ( myEngine )
+			myEngine->forget( myUnixSocket );
+		close( myUnixSocket );
+		myUnixSocket = -1;
+#ifndef __linux__
+		if ( unlink( myUnixSockPath.c_str() ) == -1 )
+		{
+			if ( errno != ENOENT )
+				throw std::runtime_error( strerror( errno ) );
+		}
+#endif
+	}
+
+	drainSockets();
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketServer::dispatchSocket( const PendingSocket &ps )
+{
+	size_t order[myWorkersPerPool];
+	size_t nCand = rankWorkers( ps, myPools[ps.pool].nextWorker, order );
+
+	for ( size_t i = 0; i != nCand; ++i )
+	{
+		size_t w = order[i];
+		if ( myProxy ? myWorkers[w].pid == -1 : myWorkers[w].conn == -1 )
+			continue;
+
+		switch ( sendSocket( w, ps.fd ) )
+		{
+			case SendOK:
+				myTrace.record( TraceHandedOff, ps.id, ps.fd, myWorkers[w].pid, w, 0 );
+				noteHandoff( ps, w );
+				SP_PROBE4( handoff, ps.id, ps.fd, myWorkers[w].pid, probeTime() );
+				if ( myDispatchMode != DispatchAffinity )
+				{
+					Pool &pool = myPools[ps.pool];
+					pool.nextWorker = ( w - pool.firstWorker + 1 ) % myWorkersPerPool;
+				}
+				return true;
+
+			case SendBusy:
+				// out of credit, try the next choice
+				break;
+
+			case SendFailed:
+				myTrace.record( TraceHandoffFailed, ps.id, ps.fd, myWorkers[w].pid, w, errno );
+				SP_PROBE4( handoff_fail, ps.id, ps.fd, myWorkers[w].pid, errno );
+				SP_LOG( LOG_ERR, "Lost worker %d or couldn't send socket, respawning: %s", int(w), strerror( errno ) );
+				respawnWorker( w );
+				break;
+		}
+	}
+
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+size_t
+SocketServer::rankWorkers( const PendingSocket &ps, size_t start, size_t *order ) const
+{
+	// rank slots within the pool, then offset to the worker table
+	const Pool &pool = myPools[ps.pool];
+	size_t N = myWorkersPerPool;
+	size_t base = pool.firstWorker;
+
+	if ( myDispatchMode == DispatchAffinity && N > 1 )
+	{
+		// rendezvous (highest random weight) hashing: every worker slot
+		// gets a score for the client and we try them from highest to
+		// lowest. Resizing the pool or respawning a worker only moves the
+		// clients whose top choice changed
+		uint64_t score[N];
+		for ( size_t i = 0; i != N; ++i )
+		{
+			uint64_t x = ps.affinity ^ ( ( uint64_t( i ) + 1 ) * 0x9E3779B97F4A7C15ULL );
+			x = ( x ^ ( x >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+			x = ( x ^ ( x >> 27 ) ) * 0x94D049BB133111EBULL;
+			score[i] = x ^ ( x >> 31 );
+			order[i] = i;
+		}
+
+		for ( size_t i = 1; i < N; ++i )
+		{
+			size_t cur = order[i];
+			size_t j = i;
+			for ( ; j > 0 && score[order[j - 1]] < score[cur]; --j )
+				order[j] = order[j - 1];
+			order[j] = cur;
+		}
+		for ( size_t i = 0; i != N; ++i )
+			order[i] += base;
+		return N;
+	}
+
+	if ( myDispatchMode == DispatchCPU && ps.cpu >= 0 &&
+		 static_cast<size_t>( ps.cpu ) < myCPUToWorker.size() &&
+		 myCPUToWorker[ps.cpu] >= 0 )
+	{
+		// the worker sharing the core (and so the cache and NUMA node)
+		// the packets were processed on first, then everyone else
+		size_t pref = static_cast<size_t>( myCPUToWorker[ps.cpu] );
+		order[0] = base + pref;
+		size_t n = 1;
+		for ( size_t i = 0; i != N; ++i )
+		{
+			size_t slot = ( start + i ) % N;
+			if ( slot != pref )
+				order[n++] = base + slot;
+		}
+		return N;
+	}
+
+	for ( size_t i = 0; i != N; ++i )
+		order[i] = base + ( start + i ) % N;
+	return N;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::routeSocket( PendingSocket &ps )
+{
+	if ( dispatchSocket( ps ) )
+		myRespawnCount = 0;
+	else
+	{
+		mySendFDs.push_back( ps );
+		myTrace.record( TraceQueued, ps.id, ps.fd, -1, 0, int64_t( mySendFDs.size() ) );
+		SP_PROBE4( enqueue, ps.id, ps.fd, mySendFDs.size(), probeTime() );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::sniffSockets( void )
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+
+	size_t keep = 0;
+	for ( size_t i = 0; i != mySniffFDs.size(); ++i )
+	{
+		PendingSocket &ps = mySniffFDs[i];
+		long long waited = ( ( now.tv_sec - ps.accepted.tv_sec ) * 1000000LL +
+							 ( now.tv_usec - ps.accepted.tv_usec ) );
+		bool expired = waited >= mySniffTimeout * 1000LL;
+
+		bool readable = myEngine->ready( ps.fd, EventEngine::WantRead );
+		if ( readable || expired )
+		{
+			bool decided = false;
+			int pool = sniffPool( ps, readable, decided );
+			if ( pool < 0 )
+			{
+				myTrace.record( TraceDropped, ps.id, ps.fd, -1, 0, 0 );
+				__atomic_fetch_add( &myAvoidedHandoffs, 1, __ATOMIC_RELAXED );
+				myEngine->forget( ps.fd );
+				close( ps.fd );
+				continue;
+			}
+
+			if ( decided || expired )
+			{
+				// on timeout, assume a protocol where the server speaks
+				// first and hand it to the default command
+				ps.pool = decided ? static_cast<size_t>( pool ) : 0;
+				myTrace.record( decided ? TraceRouted : TraceExpired, ps.id, ps.fd, -1, 0, int64_t( ps.pool ) );
+				if ( ps.sniffed > 0 )
+				{
+					int lowat = 1;
+					setsockopt( ps.fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat) );
+				}
+				SP_LOG( LOG_DEBUG, "Routing fd %d to %s", ps.fd, myPools[ps.pool].name.c_str() );
+				myEngine->forget( ps.fd );
+				routeSocket( ps );
+				continue;
+			}
+		}
+
+		mySniffFDs[keep++] = ps;
+	}
+	mySniffFDs.resize( keep );
+}
+
+
+////////////////////////////////////////
+
+
+int
+SocketServer::sniffPool( PendingSocket &ps, bool readable, bool &decided )
+{
+	char *buf = &mySniffBuf[0];
+	ssize_t n = -1;
+	do
+	{
+		n = recv( ps.fd, buf, mySniffLength, MSG_PEEK | MSG_DONTWAIT );
+	} while ( n == -1 && errno == EINTR );
+
+	decided = false;
+	if ( n == 0 )
+	{
+		SP_LOG( LOG_DEBUG, "Connection closed before sending anything, dropping" );
+		return -1;
+	}
+	if ( n < 0 )
+	{
+		if ( errno == EAGAIN || errno == EWOULDBLOCK )
+			return 0;
+		SP_LOG( LOG_DEBUG, "Error peeking at connection: %s", strerror( errno ) );
+		return -1;
+	}
+
+	size_t got = static_cast<size_t>( n );
+	for ( size_t p = 1; p < myPools.size(); ++p )
+	{
+		const std::vector<std::string> &prefixes = myPools[p].prefixes;
+		for ( size_t i = 0; i != prefixes.size(); ++i )
+		{
+			const std::string &pre = prefixes[i];
+			if ( memcmp( buf, pre.data(), std::min( got, pre.size() ) ) != 0 )
+				continue;
+
+			// an earlier route that might still match takes precedence
+			if ( got < pre.size() )
+			{
+				// SO_RCVLOWAT only lets it wake without more data when
+				// the peer has shut down its side, so nothing more is
+				// coming; don't leave it waking us up until the timeout
+				if ( readable && got == ps.sniffed )
+				{
+					SP_LOG( LOG_DEBUG, "Connection fd %d stopped part way into a route prefix, routing to the default command", ps.fd );
+					decided = true;
+					return 0;
+				}
+
+				if ( got != ps.sniffed )
+				{
+					// don't wake up again until there's more to look at
+					int lowat = static_cast<int>( got + 1 );
+					setsockopt( ps.fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat) );
+					ps.sniffed = got;
+				}
+				return 0;
+			}
+
+			decided = true;
+			return static_cast<int>( p );
+		}
+	}
+
+	decided = true;
+	return 0;
+}
+
+
+////////////////////////////////////////
+
+
+SocketServer::SendResult
+SocketServer::sendSocket( size_t w, int fd )
+{
+	if ( myProxy )
+		return proxySocket( w, fd );
+
+	SendResult r = passSocket( myWorkers[w].conn, fd );
+	if ( r == SendOK )
+		__atomic_fetch_add( &myHandoffCount, 1, __ATOMIC_RELAXED );
+	else if ( r == SendFailed )
+	{
+		int err = errno;
+		SP_LOG( LOG_DEBUG, "Failed to send fd %d to child %d: %s", fd, int(myWorkers[w].pid), strerror( err ) );
+		errno = err;
+	}
+	return r;
+}
+
+
+////////////////////////////////////////
+
+
+SocketServer::SendResult
+SocketServer::passSocket( int conn, int fd )
+{
+	if ( conn == -1 )
+	{
+		errno = ENOTCONN;
+		return SendFailed;
+	}
+
+	int err = FDPassing::send( conn, fd, MSG_DONTWAIT );
+	if ( err == 0 )
+	{
+		close( fd );
+		return SendOK;
+	}
+
+	errno = err;
+	if ( err == EAGAIN || err == EWOULDBLOCK )
+		return SendBusy;
+
+	return SendFailed;
+}
+
+
+////////////////////////////////////////
+
+
+SocketServer::SendResult
+SocketServer::proxySocket( size_t w, int fd )
+{
+	Worker &wk = myWorkers[w];
+
+	int backend = socket( PF_LOCAL, SOCK_STREAM, 0 );
+	if ( backend < 0 )
+	{
+		SP_LOG( LOG_ERR, "Unable to create proxy socket: %s", strerror( errno ) );
+		return SendBusy;
+	}
+	fcntl( backend, F_SETFL, fcntl( backend, F_GETFL, 0 ) | O_NONBLOCK );
+
+	struct sockaddr_un addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = PF_UNIX;
+	strncpy( addr.sun_path, wk.proxyPath.c_str(), sizeof(addr.sun_path) - 1 );
+#ifdef __APPLE__
+	addr.sun_len = SUN_LEN( &addr );
+#endif
+
+	int rv = -1;
+	do
+	{
+		rv = connect( backend, (struct sockaddr *)&addr, sizeof(addr) );
+	} while ( rv == -1 && errno == EINTR );
+
+	if ( rv == -1 )
+	{
+		int err = errno;
+		close( backend );
+		// not listening yet, or its backlog is full
+		if ( err == ENOENT || err == ECONNREFUSED || err == EAGAIN || err == EWOULDBLOCK )
+			return SendBusy;
+
+		SP_LOG( LOG_DEBUG, "Failed to connect to child %d at %s: %s", int(wk.pid), wk.proxyPath.c_str(), strerror( err ) );
+		errno = err;
+		return SendFailed;
+	}
+
+	if ( ! myProxy->addSession( fd, backend, wk.pid ) )
+	{
+		close( backend );
+		return SendBusy;
+	}
+
+	if ( ! wk.proxyReady )
+	{
+		wk.proxyReady = true;
+		myTrace.record( TraceReady, 0, backend, wk.pid, w, 0 );
+		SP_LOG( LOG_DEBUG, "Worker %d (pid %d) accepting proxied connections", int(w), int(wk.pid) );
+	}
+	++wk.sessions;
+	__atomic_fetch_add( &myHandoffCount, 1, __ATOMIC_RELAXED );
+	return SendOK;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::processProxy( void )
+{
+	std::vector<pid_t> finished;
+	myProxy->process( finished );
+
+	for ( size_t i = 0; i != finished.size(); ++i )
+	{
+		pid_t pid = finished[i];
+		bool found = false;
+		for ( size_t w = 0; ! found && w != myWorkers.size(); ++w )
+		{
+			if ( myWorkers[w].pid == pid && myWorkers[w].sessions > 0 )
+			{
+				--myWorkers[w].sessions;
+				found = true;
+			}
+		}
+
+		for ( size_t r = 0; ! found && r != myRetirees.size(); ++r )
+		{
+			if ( myRetirees[r].pid != pid )
+				continue;
+
+			found = true;
+			if ( --myRetirees[r].sessions == 0 )
+				stopRetiree( r );
+		}
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::retireWorker( size_t w )
+{
+	Worker &wk = myWorkers[w];
+
+	Retiree r;
+	r.pid = wk.pid;
+	r.pool = wk.pool;
+	r.proxyPath = wk.proxyPath;
+	r.sessions = wk.sessions;
+	r.conn = -1;
+	r.deadline.tv_sec = 0;
+	r.deadline.tv_usec = 0;
+	r.signalled = 0;
+	r.inFlight = -1;
+	r.inbound.have = 0;
+	r.inbound.closed = false;
+	myRetirees.push_back( r );
+
+	SP_LOG( LOG_DEBUG, "Worker %d (pid %d) retiring with %d open sessions", int(w), int(wk.pid), int(wk.sessions) );
+	wk.pid = -1;
+	wk.sessions = 0;
+	wk.proxyPath.clear();
+
+	if ( r.sessions == 0 )
+		stopRetiree( myRetirees.size() - 1 );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::stopRetiree( size_t r )
+{
+	Retiree &rt = myRetirees[r];
+
+	// the daemon doesn't know about us, so it only learns it's been
+	// replaced from the signal
+	SP_LOG( LOG_DEBUG, "Stopping retired child pid %d", int(rt.pid) );
+	if ( kill( rt.pid, SIGTERM ) == -1 && errno != ESRCH )
+		SP_LOG( LOG_ERR, "kill signal to pid %d failed: %s", int(rt.pid), strerror( errno ) );
+	unlink( rt.proxyPath.c_str() );
+
+	myRetirees.erase( myRetirees.begin() + r );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::drainWorker( size_t w )
+{
+	Worker &wk = myWorkers[w];
+
+	// whatever it had part sent goes along with the channel
+	Retiree r;
+	r.pid = wk.pid;
+	r.pool = wk.pool;
+	r.sessions = 0;
+	r.conn = wk.conn;
+	gettimeofday( &r.deadline, NULL );
+	addMsec( r.deadline, myDrainMsec );
+	r.signalled = 0;
+	r.inFlight = -1;
+	r.inbound = wk.inbound;
+	myRetirees.push_back( r );
+	wk.inbound.fds.clear();
+	wk.inbound.have = 0;
+	wk.inbound.closed = false;
+
+	SP_LOG( LOG_DEBUG, "Worker %d (pid %d) draining", int(w), int(wk.pid) );
+	if ( myEngine )
+		myEngine->forget( wk.conn );
+	// an accept thread may be about to hand it a connection, which would
+	// be lost behind the request, so that waits until none can be
+	if ( myAcceptThreads.empty() )
+		sendDrain( wk.conn );
+	else
+		myDeferredDrains.push_back( wk.conn );
+
+	wk.conn = -1;
+	wk.pid = -1;
+	myWorkersChanged = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::sendDrain( int conn )
+{
+	// a worker too far behind to take it will hear from the deadline
+	int err = FDPassing::sendDrain( conn, MSG_DONTWAIT | MSG_NOSIGNAL );
+	if ( err != 0 )
+		SP_LOG( LOG_NOTICE, "Unable to send drain request: %s", strerror( err ) );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::readDrainReport( Retiree &rt )
+{
+	int before = rt.inFlight;
+	bool open = readChannel( rt.conn, rt.inbound, rt.pool, rt.pid, rt.inFlight );
+	if ( rt.inFlight != before )
+		SP_LOG( LOG_DEBUG, "Draining pid %d has %d connections in flight", int(rt.pid), rt.inFlight );
+
+	// done with it, or gone; either way it's down to the deadline
+	if ( ! open )
+		closeRetireeConn( rt );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketServer::readChannel( int conn, Inbound &in, size_t pool, pid_t pid, int &inFlight )
+{
+	while ( true )
+	{
+		char buf[256];
+		ssize_t n = FDPassing::receiveRecords( conn, buf, sizeof(buf), in.fds, MSG_DONTWAIT );
+		if ( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			return true;
+		if ( n <= 0 )
+			return false;
+
+		for ( ssize_t i = 0; i != n; ++i )
+		{
+			in.record[in.have++] = buf[i];
+			if ( in.have != sizeof(in.record) )
+				continue;
+			in.have = 0;
+
+			uint32_t v;
+			memcpy( &v, in.record, sizeof(v) );
+			if ( v != FDPassing::kPark )
+				inFlight = static_cast<int>( v );
+			else if ( in.fds.empty() )
+				SP_LOG( LOG_NOTICE, "Connection parked by pid %d was lost on the way", int(pid) );
+			else
+			{
+				parkSocket( in.fds.front(), pool, pid );
+				in.fds.erase( in.fds.begin() );
+			}
+		}
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::clearInbound( Inbound &in )
+{
+	for ( size_t i = 0; i != in.fds.size(); ++i )
+		close( in.fds[i] );
+	in.fds.clear();
+	in.have = 0;
+	in.closed = false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::parkSocket( int fd, size_t pool, pid_t pid )
+{
+	// nobody left to pass it to, or no way to watch it
+	if ( myTerminated || ! myEngine ||
+		 ( fd >= FD_SETSIZE && myEngine->type() == EventEngine::EngineSelect ) )
+	{
+		close( fd );
+		return;
+	}
+
+	PendingSocket ps;
+	ps.id = __atomic_add_fetch( &myNextConnId, 1, __ATOMIC_RELAXED );
+	ps.fd = fd;
+	ps.cpu = -1;
+	ps.pool = pool;
+	ps.sniffed = 0;
+	ps.affinity = 0;
+	if ( myDispatchMode == DispatchAffinity )
+	{
+		struct sockaddr_in peer;
+		socklen_t peerLen = sizeof(peer);
+		if ( getpeername( fd, (struct sockaddr *)&peer, &peerLen ) != 0 )
+			peer.sin_family = AF_UNSPEC;
+		ps.affinity = affinityKey( peer );
+	}
+	gettimeofday( &ps.accepted, NULL );
+	myParkedFDs.push_back( ps );
+
+	myTrace.record( TraceParked, ps.id, fd, pid, 0, int64_t( myParkedFDs.size() ) );
+	SP_LOG( LOG_DEBUG, "Pid %d parked fd %d", int(pid), fd );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::wakeParked( void )
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+
+	// a failed handoff respawns the worker, which can park more as it
+	// goes, so only the ones here now are looked at
+	size_t n = myParkedFDs.size();
+	size_t keep = 0;
+	for ( size_t i = 0; i != n; ++i )
+	{
+		PendingSocket ps = myParkedFDs[i];
+		bool ready = myEngine->ready( ps.fd, EventEngine::WantRead );
+		if ( ready || msecUntil( ps.accepted ) + myParkTimeout * 1000LL <= 0 )
+		{
+			myEngine->forget( ps.fd );
+			if ( ! ready || isEmptyConnection( ps.fd ) )
+			{
+				myTrace.record( TraceDropped, ps.id, ps.fd, -1, 0, 0 );
+				if ( ready )
+					__atomic_fetch_add( &myAvoidedHandoffs, 1, __ATOMIC_RELAXED );
+				close( ps.fd );
+				continue;
+			}
+
+			// it waits from now, not from when it was parked
+			ps.accepted = now;
+			routeSocket( ps );
+			continue;
+		}
+
+		myParkedFDs[keep++] = ps;
+	}
+	myParkedFDs.erase( myParkedFDs.begin() + keep, myParkedFDs.begin() + n );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::closeRetireeConn( Retiree &rt )
+{
+	if ( rt.conn < 0 )
+		return;
+
+	// anything it parked on the way out still counts
+	int inFlight = rt.inFlight;
+	readChannel( rt.conn, rt.inbound, rt.pool, rt.pid, inFlight );
+	clearInbound( rt.inbound );
+
+	if ( myEngine )
+		myEngine->forget( rt.conn );
+	// same as a worker channel, its drain request may not be out yet
+	if ( myAcceptThreads.empty() )
+		close( rt.conn );
+	else
+	{
+		myDeferredCloses.push_back( rt.conn );
+		myWorkersChanged = true;
+	}
+	rt.conn = -1;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::checkDrainDeadlines( void )
+{
+	for ( size_t r = 0; r != myRetirees.size(); ++r )
+	{
+		Retiree &rt = myRetirees[r];
+		if ( rt.deadline.tv_sec == 0 || msecUntil( rt.deadline ) > 0 )
+			continue;
+
+		if ( rt.signalled == 0 )
+		{
+			SP_LOG( LOG_NOTICE, "Draining pid %d missed its deadline with %d connections in flight, sending SIGTERM",
+					int(rt.pid), rt.inFlight );
+			if ( kill( rt.pid, SIGTERM ) == -1 && errno != ESRCH )
+				SP_LOG( LOG_ERR, "kill signal to pid %d failed: %s", int(rt.pid), strerror( errno ) );
+			rt.signalled = 1;
+			gettimeofday( &rt.deadline, NULL );
+			addMsec( rt.deadline, 1000 );
+		}
+		else
+		{
+			SP_LOG( LOG_NOTICE, "Draining pid %d ignored SIGTERM, sending SIGKILL", int(rt.pid) );
+			if ( kill( rt.pid, SIGKILL ) == -1 && errno != ESRCH )
+				SP_LOG( LOG_ERR, "kill signal to pid %d failed: %s", int(rt.pid), strerror( errno ) );
+			rt.signalled = 2;
+			rt.deadline.tv_sec = 0;
+			rt.deadline.tv_usec = 0;
+		}
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::waitForDrain( void )
+{
+	while ( true )
+	{
+		bool draining = false;
+		long long wait = 100;
+		std::vector<struct pollfd> fds;
+		for ( size_t r = 0; r != myRetirees.size(); ++r )
+		{
+			const Retiree &rt = myRetirees[r];
+			if ( rt.conn < 0 && rt.signalled == 0 && rt.deadline.tv_sec == 0 )
+				continue;
+			draining = true;
+			if ( rt.deadline.tv_sec != 0 )
+				wait = std::min( wait, std::max( msecUntil( rt.deadline ), 0LL ) );
+			if ( rt.conn >= 0 )
+			{
+				struct pollfd p;
+				p.fd = rt.conn;
+				p.events = POLLIN;
+				p.revents = 0;
+				fds.push_back( p );
+			}
+		}
+		if ( ! draining )
+			break;
+
+		// SIGCHLD no longer wakes us, hence the short waits
+		if ( poll( fds.empty() ? NULL : &fds[0], fds.size(), static_cast<int>( wait ) ) > 0 )
+		{
+			for ( size_t r = 0; r != myRetirees.size(); ++r )
+			{
+				for ( size_t f = 0; f != fds.size(); ++f )
+				{
+					if ( fds[f].fd == myRetirees[r].conn && fds[f].revents )
+						readDrainReport( myRetirees[r] );
+				}
+			}
+		}
+		handleChildEvent();
+		checkDrainDeadlines();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::closeHandles( void )
+{
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
+		disconnectWorker( w );
+
+	if ( myUnixSocket != -1 )
+	{
+		if ( myEngine )
+			myEngine->forget( myUnixSocket );
+		close( myUnixSocket );
+		myUnixSocket = -1;
+	}
+
+	if ( myProxy )
+	{
+		myProxy->closeAll();
+		for ( size_t w = 0; w != myWorkers.size(); ++w )
+		{
+			if ( ! myWorkers[w].proxyPath.empty() )
+				unlink( myWorkers[w].proxyPath.c_str() );
+		}
+		for ( size_t r = 0; r != myRetirees.size(); ++r )
+			unlink( myRetirees[r].proxyPath.c_str() );
+		myRetirees.clear();
+	}
+
+	for ( size_t l = 0; l != myTCPSockets.size(); ++l )
+		close( myTCPSockets[l] );
+	myTCPSockets.clear();
+
+	for ( size_t i = 0; i != mySniffFDs.size(); ++i )
+	{
+		if ( myEngine )
+			myEngine->forget( mySniffFDs[i].fd );
+		myTrace.record( TraceDropped, mySniffFDs[i].id, mySniffFDs[i].fd, -1, 0, 0 );
+		close( mySniffFDs[i].fd );
+	}
+	mySniffFDs.clear();
+
+	for ( size_t i = 0; i != myParkedFDs.size(); ++i )
+	{
+		if ( myEngine )
+			myEngine->forget( myParkedFDs[i].fd );
+		myTrace.record( TraceDropped, myParkedFDs[i].id, myParkedFDs[i].fd, -1, 0, 0 );
+		close( myParkedFDs[i].fd );
+	}
+	myParkedFDs.clear();
+
+	while ( ! myHandedBack.empty() )
+	{
+		myTrace.record( TraceDropped, myHandedBack.front().id, myHandedBack.front().fd, -1, 0, 0 );
+		close( myHandedBack.front().fd );
+		myHandedBack.pop_front();
+	}
+
+	while ( ! mySendFDs.empty() )
+	{
+		myTrace.record( TraceDropped, mySendFDs.front().id, mySendFDs.front().fd, -1, 0, 0 );
+		close( mySendFDs.front().fd );
+		mySendFDs.pop_front();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+int
+SocketServer::getNextSocket( PendingSocket &ps )
+{
+	size_t listener = 0;
+	while ( waitForEvent( listener ) )
+	{
+		// passed back by an accept thread, already looked over
+		if ( ! myHandedBack.empty() )
+		{
+			ps = myHandedBack.front();
+			myHandedBack.pop_front();
+			return ps.fd;
+		}
+
+		do
+		{
+			struct sockaddr_in peer;
+			socklen_t peerLen = sizeof(peer);
+			int fd = -1;
+			if ( myEngine->acceptsDirectly() )
+			{
+				// already accepted, the address is only needed for affinity
+				if ( ! myEngine->popAccepted( listener, fd ) )
+					break;
+				peer.sin_family = AF_UNSPEC;
+				if ( myDispatchMode == DispatchAffinity && getpeername( fd, (struct sockaddr *)&peer, &peerLen ) != 0 )
+					peer.sin_family = AF_UNSPEC;
+			}
+			else
+				fd = accept( myTCPSockets[listener], (struct sockaddr *)&peer, &peerLen );
+
+			if ( fd == -1 )
+			{
+				SP_LOG( LOG_DEBUG, "Socket accept returned an error: (%d) '%s'", errno, strerror( errno ) );
+				// Reading accept (2), linux passes already-pending network errors on the new socket
+				// via accept. for reliability, treat these as EAGAIN and retry...
+				switch ( errno )
+				{
+					case ENETDOWN:
+					case EPROTO:
+					case ENOPROTOOPT:
+					case EHOSTDOWN:
+#ifdef ENONET
+					case ENONET:
+#endif
+					case EHOSTUNREACH:
+					case EOPNOTSUPP:
+					case ENETUNREACH:
+					case EAGAIN:
+						continue;
+
+					case EINTR:
+						continue;
+
+					default:
+						SP_LOG( LOG_CRIT, "Received unknown / unhandled error accepting connection on TCP socket: (%d) %s", errno, strerror(errno) );
+				}
+			}
+
+			if ( fd >= 0 && ! prepareAccepted( listener, fd, peer, ps ) )
+				break;
+
+			return fd;
+		} while ( true );
+	}
+
+	return -1;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketServer::prepareAccepted( size_t listener, int fd, const struct sockaddr_in &peer, PendingSocket &ps )
+{
+	// with accept threads, each listener only has the one thread
+	// counting for it
+	__atomic_fetch_add( &myAcceptCounts[listener], 1, __ATOMIC_RELAXED );
+	ps.id = __atomic_add_fetch( &myNextConnId, 1, __ATOMIC_RELAXED );
+	myTrace.record( TraceAccepted, ps.id, fd, -1, 0, int64_t( listener ) );
+	SP_PROBE4( accept, ps.id, fd, listener, probeTime() );
+
+	// a deferred accept only surfaces without data when the
+	// defer period ran out, so it's worth checking for a
+	// client that already gave up before waking a worker
+	if ( myDeferAccept > 0 && isEmptyConnection( fd ) )
+	{
+		myTrace.record( TraceDropped, ps.id, fd, -1, 0, 0 );
+		__atomic_fetch_add( &myAvoidedHandoffs, 1, __ATOMIC_RELAXED );
+		close( fd );
+		return false;
+	}
+
+	myTunings[listener].applyAccepted( fd );
+
+	ps.fd = fd;
+	ps.pool = 0;
+	ps.sniffed = 0;
+	if ( gettimeofday( &ps.accepted, NULL ) != 0 )
+	{
+		ps.accepted.tv_sec = 0;
+		ps.accepted.tv_usec = 0;
+	}
+
+	ps.affinity = affinityKey( peer );
+
+	ps.cpu = -1;
+#ifdef SO_INCOMING_CPU
+	if ( myDispatchMode == DispatchCPU )
+	{
+		int cpu = -1;
+		socklen_t cpuLen = sizeof(cpu);
+		if ( getsockopt( fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpuLen ) == 0 )
+			ps.cpu = cpu;
+	}
+#endif
+
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketServer::isEmptyConnection( int fd )
+{
+	char b;
+	ssize_t n = -1;
+	do
+	{
+		n = recv( fd, &b, 1, MSG_PEEK | MSG_DONTWAIT );
+	} while ( n == -1 && errno == EINTR );
+
+	if ( n == 0 || ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) )
+	{
+		SP_LOG( LOG_DEBUG, "Connection closed before sending anything, dropping" );
+		return true;
+	}
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketServer::waitForEvent( size_t &listener )
+{
+
+	do
+	{
+		if ( myTerminated )
+			break;
+
+		drainSockets();
+
+		if ( ! myAcceptThreads.empty() )
+		{
+			if ( __atomic_exchange_n( &myAcceptHandedOff, 0, __ATOMIC_RELAXED ) )
+				myRespawnCount = 0;
+			if ( myWorkersChanged )
+				publishWorkers();
+			else
+				reclaimSnapshots( false );
+		}
+
+		myEngine->reset();
+		myEngine->add( myTriggerPipe[0], EventEngine::WantRead );
+		if ( ! myEngine->acceptsDirectly() && myAcceptThreads.empty() )
+		{
+			for ( size_t l = 0; l != myTCPSockets.size(); ++l )
+				myEngine->add( myTCPSockets[l], EventEngine::WantRead );
+		}
+		if ( myUnixSocket != -1 )
+			myEngine->add( myUnixSocket, EventEngine::WantRead );
+		if ( myProxy )
+			myEngine->add( myProxy->fd(), EventEngine::WantRead );
+		for ( size_t r = 0; r != myRetirees.size(); ++r )
+		{
+			if ( myRetirees[r].conn >= 0 )
+				myEngine->add( myRetirees[r].conn, EventEngine::WantRead );
+		}
+
+		// workers hand back idle connections, which we hold until
+		// their clients send more
+		for ( size_t w = 0; w != myWorkers.size(); ++w )
+		{
+			if ( myWorkers[w].conn != -1 && ! myWorkers[w].inbound.closed )
+				myEngine->add( myWorkers[w].conn, EventEngine::WantRead );
+		}
+		for ( size_t i = 0; i != myParkedFDs.size(); ++i )
+			myEngine->add( myParkedFDs[i].fd, EventEngine::WantRead );
+
+		// anything still queued is waiting for a worker with room
+		if ( ! mySendFDs.empty() )
+		{
+			for ( size_t w = 0; w != myWorkers.size(); ++w )
+			{
+				if ( myWorkers[w].conn != -1 )
+					myEngine->add( myWorkers[w].conn, EventEngine::WantWrite );
+			}
+		}
+
+		// connections being sniffed wake us when more data arrives, or
+		// when the oldest one runs out of time
+		struct timeval timeout;
+		struct timeval *timeoutPtr = NULL;
+		if ( ! mySniffFDs.empty() )
+		{
+			for ( size_t i = 0; i != mySniffFDs.size(); ++i )
+				myEngine->add( mySniffFDs[i].fd, EventEngine::WantRead );
+
+			struct timeval now;
+			gettimeofday( &now, NULL );
+			const struct timeval &oldest = mySniffFDs.front().accepted;
+			long long remain = ( ( oldest.tv_sec - now.tv_sec ) * 1000000LL +
+								 ( oldest.tv_usec - now.tv_usec ) +
+								 mySniffTimeout * 1000LL );
+			remain = std::max( remain, 0LL );
+			timeout.tv_sec = static_cast<time_t>( remain / 1000000 );
+			timeout.tv_usec = static_cast<suseconds_t>( remain % 1000000 );
+			timeoutPtr = &timeout;
+		}
+
+		// a proxied child gives no sign it has started listening, so
+		// keep retrying while connections are waiting for one
+		if ( myProxy && ! mySendFDs.empty() &&
+			 ( ! timeoutPtr || timeout.tv_sec > 0 || timeout.tv_usec > 50000 ) )
+		{
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 50000;
+			timeoutPtr = &timeout;
+		}
+
+		// an old snapshot waits on an accept thread that was partway
+		// through a handoff, which won't be for long
+		if ( ! myRetiredSnapshots.empty() &&
+			 ( ! timeoutPtr || timeout.tv_sec > 0 || timeout.tv_usec > 10000 ) )
+		{
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 10000;
+			timeoutPtr = &timeout;
+		}
+
+		// wake up in time to publish the counters
+		if ( myStats.isOpen() )
+		{
+			struct timeval now;
+			gettimeofday( &now, NULL );
+			long long remain = ( ( myStatsDue.tv_sec - now.tv_sec ) * 1000000LL +
+								 ( myStatsDue.tv_usec - now.tv_usec ) );
+			remain = std::max( remain, 0LL );
+			if ( ! timeoutPtr || remain < timeout.tv_sec * 1000000LL + timeout.tv_usec )
+			{
+				timeout.tv_sec = static_cast<time_t>( remain / 1000000 );
+				timeout.tv_usec = static_cast<suseconds_t>( remain % 1000000 );
+				timeoutPtr = &timeout;
+			}
+		}
+
+		// and to close the longest parked connection
+		if ( ! myParkedFDs.empty() )
+		{
+			long long remain = std::max( msecUntil( myParkedFDs.front().accepted ) + myParkTimeout * 1000LL, 0LL ) * 1000LL;
+			if ( ! timeoutPtr || remain < timeout.tv_sec * 1000000LL + timeout.tv_usec )
+			{
+				timeout.tv_sec = static_cast<time_t>( remain / 1000000 );
+				timeout.tv_usec = static_cast<suseconds_t>( remain % 1000000 );
+				timeoutPtr = &timeout;
+			}
+		}
+
+		// and to signal draining workers that run out of time
+		for ( size_t r = 0; r != myRetirees.size(); ++r )
+		{
+			if ( myRetirees[r].deadline.tv_sec == 0 )
+				continue;
+			long long remain = std::max( msecUntil( myRetirees[r].deadline ), 0LL ) * 1000LL;
+			if ( ! timeoutPtr || remain < timeout.tv_sec * 1000000LL + timeout.tv_usec )
+			{
+				timeout.tv_sec = static_cast<time_t>( remain / 1000000 );
+				timeout.tv_usec = static_cast<suseconds_t>( remain % 1000000 );
+				timeoutPtr = &timeout;
+			}
+		}
+
+		// connections the engine already accepted still get handed out,
+		// just without sleeping first
+		if ( myEngine->hasAccepted() || ! myHandedBack.empty() )
+		{
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 0;
+			timeoutPtr = &timeout;
+		}
+
+		int rv = myEngine->wait( timeoutPtr );
+		if ( rv == -1 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			SP_LOG( LOG_ERR, "Error trying to wait for activity: %s", strerror( errno ) );
+			throw std::runtime_error( "select error" );
+		}
+
+		if ( myUnixSocket != -1 && myEngine->ready( myUnixSocket, EventEngine::WantRead ) )
+		{
+			try
+			{
+				acceptChild();
+			}
+			catch ( const std::exception &e )
+			{
+				SP_LOG( LOG_ERR, "error accepting child process: %s", e.what() );
+			}
+		}
+
+		if ( myProxy && myEngine->ready( myProxy->fd(), EventEngine::WantRead ) )
+			processProxy();
+
+		if ( ! myRetirees.empty() )
+		{
+			for ( size_t r = 0; r != myRetirees.size(); ++r )
+			{
+				if ( myRetirees[r].conn >= 0 && myEngine->ready( myRetirees[r].conn, EventEngine::WantRead ) )
+					readDrainReport( myRetirees[r] );
+			}
+			checkDrainDeadlines();
+		}
+
+		for ( size_t w = 0; w != myWorkers.size(); ++w )
+		{
+			Worker &wk = myWorkers[w];
+			if ( wk.conn == -1 || wk.inbound.closed || ! myEngine->ready( wk.conn, EventEngine::WantRead ) )
+				continue;
+			int inFlight = -1;
+			if ( ! readChannel( wk.conn, wk.inbound, wk.pool, wk.pid, inFlight ) )
+				wk.inbound.closed = true;
+		}
+
+		if ( ! myParkedFDs.empty() )
+			wakeParked();
+
+		if ( myStats.isOpen() )
+		{
+			struct timeval now;
+			gettimeofday( &now, NULL );
+			if ( timercmp( &now, &myStatsDue, >= ) )
+				publishStats();
+		}
+
+		if ( ! mySniffFDs.empty() )
+			sniffSockets();
+
+		if ( myEngine->ready( myTriggerPipe[0], EventEngine::WantRead ) )
+		{
+			char b = '\0';
+			if ( read( myTriggerPipe[0], &b, sizeof(char) ) < 1 )
+			{
+				SP_LOG( LOG_CRIT, "Attempting to read from internal communication pipe, but failed, terminating" );
+				myTerminated = true;
+			}
+
+			SP_LOG( LOG_DEBUG, "Got notification byte '%c' on communication pipe", b );
+			switch ( b )
+			{
+				case 'x':
+					myTerminated = true;
+					break;
+				case 'r':
+					respawnChild();
+					break;
+				case 'c':
+					handleChildEvent();
+					break;
+				case 'q':
+					takeHandBacks();
+					break;
+
+				default:
+					SP_LOG( LOG_DEBUG, "Got weird byte on communication pipe" );
+					break;
+			}
+		}
+
+		if ( myTerminated )
+		{
+			SP_LOG( LOG_DEBUG, "terminate flag has been set..." );
+			break;
+		}
+
+		// NB: EXIT POINT
+		if ( myEngine->hasAccepted() || ! myHandedBack.empty() )
+			return true;
+
+		// rotate the starting point so a busy listener can't starve the rest
+		size_t nL = myTCPSockets.size();
+		for ( size_t i = 0; i != nL; ++i )
+		{
+			size_t l = ( myNextListener + i ) % nL;
+			if ( myEngine->ready( myTCPSockets[l], EventEngine::WantRead ) )
+			{
+				listener = l;
+				myNextListener = l + 1;
+				return true;
+			}
+		}
+
+	} while ( true );
+
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketServer::checkWorkerStartup( int retryCount, int retryPauseSec )
+{
+	struct timeval curwaittime;
+	if ( gettimeofday( &curwaittime, NULL ) != 0 )
+	{
+		SP_LOG( LOG_CRIT, "Unable to retrieve time of day: %s", strerror( errno ) );
+		return true;
+	}
+
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
+	{
+		if ( myWorkers[w].conn != -1 || myWorkers[w].proxyReady )
+			continue;
+
+		if ( ( curwaittime.tv_sec - myWorkers[w].startTime.tv_sec ) > retryPauseSec )
+		{
+			SP_LOG( LOG_NOTICE, "Worker %d didn't respond after %d seconds, restarting", int(w), retryPauseSec );
+			if ( myRespawnCount > retryCount )
+			{
+				SP_LOG( LOG_CRIT, "Child process didn't connect after %d retries, terminating", myRespawnCount );
+				return false;
+			}
+			respawnWorker( w );
+		}
+	}
+
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::respawnChild( void )
+{
+	SP_LOG( LOG_NOTICE, "Respawning child process..." );
+	SP_PROBE3( respawn, -1, -1, myRespawnCount );
+	++myRespawnTotal;
+
+	// closing the channel (or the drain request) is what tells the old
+	// children to finish up
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
+	{
+		if ( myDrainMsec > 0 && ! myProxy && myWorkers[w].conn >= 0 && myWorkers[w].pid > 0 )
+			drainWorker( w );
+		else
+			disconnectWorker( w );
+	}
+
+	if ( ! myProxy )
+		restartUnixSocket();
+
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
+		launchWorker( w );
+
+	++myRespawnCount;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::respawnWorker( size_t w )
+{
+	SP_LOG( LOG_NOTICE, "Respawning worker %d...", int(w) );
+	SP_PROBE3( respawn, int(w), myWorkers[w].pid, myRespawnCount );
+	++myRespawnTotal;
+
+	disconnectWorker( w );
+	if ( ! myProxy && myUnixSocket == -1 )
+		restartUnixSocket();
+
+	launchWorker( w );
+
+	++myRespawnCount;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::assignCPUs( void )
+{
+	myCPUToWorker.clear();
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
+		myWorkers[w].cpus.clear();
+
+	if ( ! myPinWorkers )
+		return;
+
+#ifdef __linux__
+	// every pool pins its slot i the same way
+	size_t N = myWorkersPerPool;
+	std::vector< std::vector<int> > slotCPUs( N );
+	if ( myCPUSets.empty() )
+	{
+		cpu_set_t allowed;
+		CPU_ZERO( &allowed );
+		if ( sched_getaffinity( 0, sizeof(allowed), &allowed ) != 0 )
+		{
+			SP_LOG( LOG_ERR, "Unable to retrieve CPU affinity, workers will not be pinned: %s", strerror( errno ) );
+			return;
+		}
+
+		std::vector<int> cpus;
+		for ( int c = 0; c < CPU_SETSIZE; ++c )
+		{
+			if ( CPU_ISSET( c, &allowed ) )
+				cpus.push_back( c );
+		}
+
+		// contiguous blocks, since neighbouring CPU numbers normally
+		// share a cache and NUMA node
+		size_t nCPU = cpus.size();
+		for ( size_t w = 0; w != N; ++w )
+		{
+			if ( N >= nCPU )
+				slotCPUs[w].push_back( cpus[w % nCPU] );
+			else
+			{
+				for ( size_t c = w * nCPU / N; c != ( w + 1 ) * nCPU / N; ++c )
+					slotCPUs[w].push_back( cpus[c] );
+			}
+		}
+	}
+	else
+	{
+		for ( size_t w = 0; w != N; ++w )
+			slotCPUs[w] = myCPUSets[w % myCPUSets.size()];
+	}
+
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
+		myWorkers[w].cpus = slotCPUs[w - myPools[myWorkers[w].pool].firstWorker];
+
+	// first slot listed for a CPU owns the connections arriving there
+	for ( size_t w = 0; w != N; ++w )
+	{
+		const std::vector<int> &cpus = slotCPUs[w];
+		for ( size_t c = 0; c != cpus.size(); ++c )
+		{
+			size_t cpu = static_cast<size_t>( cpus[c] );
+			if ( cpu >= myCPUToWorker.size() )
+				myCPUToWorker.resize( cpu + 1, -1 );
+			if ( myCPUToWorker[cpu] < 0 )
+				myCPUToWorker[cpu] = static_cast<int>( w );
+		}
+	}
+#else
+	SP_LOG( LOG_NOTICE, "Worker CPU pinning is not supported on this platform" );
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::launchWorker( size_t w )
+{
+	Worker &wk = myWorkers[w];
+	std::vector<std::string> cmdLine = myPools[wk.pool].cmdLine;
+
+	if ( myProxy )
+	{
+		if ( wk.pid != -1 )
+			retireWorker( w );
+
+		// a fresh path each launch, so connections meant for the new
+		// process can't reach the old one (or the other way round)
+		std::stringstream path;
+		path << myProxyPrefix << '.' << w << '.' << myProxySerial++;
+		wk.proxyPath = path.str();
+		wk.sessions = 0;
+		unlink( wk.proxyPath.c_str() );
+
+		for ( size_t i = 0; i != cmdLine.size(); ++i )
+		{
+			std::string::size_type pos = 0;
+			while ( ( pos = cmdLine[i].find( "%P", pos ) ) != std::string::npos )
+			{
+				cmdLine[i].replace( pos, 2, wk.proxyPath );
+				pos += wk.proxyPath.size();
+			}
+		}
+	}
+	wk.proxyReady = false;
+
+	size_t N = cmdLine.size();
+	char *argdata[N + 1];
+	for ( size_t i = 0; i != N; ++i )
+		argdata[i] = const_cast<char *>( cmdLine[i].c_str() );
+	argdata[N] = NULL;
+
+	// the child of a threaded process may only make async-signal-safe
+	// calls before it execs, so its environment is put together here
+	std::vector<std::string> env;
+	for ( char **e = environ; *e; ++e )
+		env.push_back( *e );
+	if ( ! wk.proxyPath.empty() )
+		setEnv( env, "SOCKET_PROTECTOR_PROXY_PATH", wk.proxyPath );
+	if ( myDrainMsec > 0 )
+	{
+		std::stringstream drain;
+		drain << myDrainMsec;
+		setEnv( env, "SOCKET_PROTECTOR_DRAIN_MSEC", drain.str() );
+	}
+	size_t E = env.size();
+	char *envdata[E + 1];
+	for ( size_t i = 0; i != E; ++i )
+		envdata[i] = const_cast<char *>( env[i].c_str() );
+	envdata[E] = NULL;
+
+	wk.pid = -1;
+
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO( &cpus );
+	for ( size_t c = 0; c != wk.cpus.size(); ++c )
+		CPU_SET( wk.cpus[c], &cpus );
+#endif
+
+	pid_t pid = fork();
+
+	if ( pid < 0 )
+	{
+		SP_LOG( LOG_CRIT, "Unable to fork child process" );
+		throw std::runtime_error( "Unable to fork child process" );
+	}
+
+	if ( pid == 0 )
+	{
+		//child process, exec off the command
+		// first close any extra open descriptors
+		Daemon::closeFileDescriptors( 3 );
+#ifdef __linux__
+		// no logging here, the parent tries again below and says why
+		if ( ! wk.cpus.empty() )
+			sched_setaffinity( 0, sizeof(cpus), &cpus );
+#endif
+#ifdef __linux__
+		execvpe( argdata[0], argdata, envdata );
+#else
+		environ = envdata;
+		execvp( argdata[0], argdata );
+#endif
+		_exit( -1 );
+	}
+
+	wk.pid = pid;
+#ifdef __linux__
+	// the child set its own before exec, so whatever it starts is
+	// pinned too. Setting it again from here reports why that failed
+	if ( ! wk.cpus.empty() && sched_setaffinity( pid, sizeof(cpus), &cpus ) != 0 && errno != ESRCH )
+		SP_LOG( LOG_ERR, "Unable to set CPU affinity for worker %d: %s", int(w), strerror( errno ) );
+#endif
+	myWorkersChanged = true;
+	myTrace.record( TraceSpawned, 0, -1, pid, w, 0 );
+	myChildList.push_back( pid );
+	if ( gettimeofday( &wk.startTime, NULL ) != 0 )
+	{
+		wk.startTime.tv_sec = 0;
+		wk.startTime.tv_usec = 0;
+		SP_LOG( LOG_CRIT, "Unable to retrieve time of day: %s", strerror( errno ) );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::disconnectWorker( size_t w )
+{
+	if ( myWorkers[w].conn >= 0 )
+	{
+		Worker &wk = myWorkers[w];
+		int inFlight = -1;
+		if ( ! wk.inbound.closed )
+			readChannel( wk.conn, wk.inbound, wk.pool, wk.pid, inFlight );
+		clearInbound( wk.inbound );
+
+		if ( myEngine )
+			myEngine->forget( myWorkers[w].conn );
+		// an accept thread may be sending on it right now, so the
+		// descriptor can't be closed (and reused) until it's done
+		if ( myAcceptThreads.empty() )
+			close( myWorkers[w].conn );
+		else
+			myDeferredCloses.push_back( myWorkers[w].conn );
+		myWorkers[w].conn = -1;
+		myWorkersChanged = true;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::handleChildEvent( void )
+{
+	do
+	{
+		int status = 0;
+		pid_t cpid = waitpid( -1, &status, WNOHANG );
+
+		if ( cpid <= 0 )
+			return;
+
+		if ( WIFEXITED( status ) )
+			SP_LOG( LOG_INFO, "child process %d exited with status %d", cpid, WEXITSTATUS( status ) );
+		else if ( WIFSIGNALED( status ) )
+			SP_LOG( LOG_INFO, "child process %d terminated due to signal %d", cpid, WTERMSIG( status ) );
+		else if ( WIFSTOPPED( status ) )
+		{
+			SP_LOG( LOG_DEBUG, "child process %d stopped due to signal %d", cpid, WSTOPSIG( status ) );
+			continue;
+		}
+
+		size_t traceW = 0;
+		for ( size_t w = 0; w != myWorkers.size(); ++w )
+		{
+			if ( myWorkers[w].pid == cpid )
+				traceW = w;
+		}
+		myTrace.record( TraceExited, 0, -1, cpid, traceW, status );
+		SP_PROBE3( child_exit, cpid, status, traceW );
+
+		for ( size_t i = 0, N = myChildList.size(); i != N; ++i )
+		{
+			if ( myChildList[i] == cpid )
+			{
+				myChildList.erase( myChildList.begin() + i );
+				break;
+			}
+		}
+
+		for ( size_t r = 0; r != myRetirees.size(); ++r )
+		{
+			if ( myRetirees[r].pid == cpid )
+			{
+				if ( myRetirees[r].deadline.tv_sec != 0 || myRetirees[r].signalled )
+					SP_LOG( LOG_DEBUG, "Draining pid %d finished", int(cpid) );
+				closeRetireeConn( myRetirees[r] );
+				if ( ! myRetirees[r].proxyPath.empty() )
+					unlink( myRetirees[r].proxyPath.c_str() );
+				myRetirees.erase( myRetirees.begin() + r );
+				break;
+			}
+		}
+
+		for ( size_t w = 0; w != myWorkers.size(); ++w )
+		{
+			if ( cpid != myWorkers[w].pid )
+				continue;
+
+			disconnectWorker( w );
+			myWorkers[w].pid = -1;
+			myWorkersChanged = true;
+			if ( ! myWorkers[w].proxyPath.empty() )
+				unlink( myWorkers[w].proxyPath.c_str() );
+
+			if ( ! myTerminated )
+			{
+				SP_LOG( LOG_INFO, "Respawning worker %d after unexpected exit", int(w) );
+				respawnWorker( w );
+			}
+			break;
+		}
+	} while ( true );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::restartUnixSocket( void )
+{
+	if ( myUnixSocket != -1 )
+	{
+		if ( myEngine )
+			myEngine->forget( myUnixSocket );
+		close( myUnixSocket );
+		myUnixSocket = -1;
+	}
+
+	myUnixSocket = socket( PF_LOCAL, SOCK_STREAM, 0 );
+	if ( myUnixSocket < 0 )
+		throw std::runtime_error( "Unable to create UNIX socket" );
+
+	struct sockaddr_un local;
+	memset( &local, 0, sizeof(local) );
+	local.sun_family = PF_UNIX;
+
+#ifdef __linux__
+	// linux has abstract sockets that don't need unlinking
+	strncpy( local.sun_path + 1, myUnixSockPath.c_str(), std::min( myUnixSockPath.size(), sizeof(local.sun_path) - 2 ) );
+#else
+	strncpy( local.sun_path, myUnixSockPath.c_str(), std::min( myUnixSockPath.size(), sizeof(local.sun_path) - 1 ) );
+	if ( unlink( myUnixSockPath.c_str() ) == -1 )
+	{
+		if ( errno != ENOENT )
+			throw std::runtime_error( "unable to remove socket path" );
+	}
+#endif
+
+#ifdef __APPLE__
+	local.sun_len = SUN_LEN( &local );
+#endif
+
+	if ( bind( myUnixSocket, (struct sockaddr *)&local, sizeof(local) ) == -1 )
+		throw std::runtime_error( std::string( "Unable to bind local unix socket: " ) + strerror( errno ) );
+
+	if ( listen( myUnixSocket, static_cast<int>( myWorkers.size() ) ) == -1 )
+		throw std::runtime_error( "Unable to start listening on a socket" );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketServer::prepareTCPSocket( int backlog )
+{
+#ifndef SO_REUSEPORT
+	if ( myListenerCount > 1 )
+	{
+		SP_LOG( LOG_NOTICE, "SO_REUSEPORT not available, using a single listener" );
+		myListenerCount = 1;
+	}
+#endif
+
+	myTunings.resize( myListenerCount, myTunings.empty() ? SocketTuning() : myTunings.back() );
+
+	// each listener joins the reuseport group as it starts listening, so
+	// the group index the steering program returns is our index
+	for ( size_t l = 0; l != myListenerCount; ++l )
+	{
+		int sock = socket( AF_INET, SOCK_STREAM, 0 );
+		if ( sock < 0 )
+		{
+			SP_LOG( LOG_ERR, "Unable to create AF_INET socket: %s", strerror( errno ) );
+			throw std::runtime_error( "error creating socket" );
+		}
+		myTCPSockets.push_back( sock );
+
+		int on = 1;
+		if ( setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) ) < 0 )
+		{
+			SP_LOG( LOG_ERR, "Unable to set SO_REUSEADDR on TCP socket: %s", strerror( errno ) );
+			throw std::runtime_error( "error setting socket option" );
+		}
+
+#ifdef SO_REUSEPORT
+		if ( myListenerCount > 1 && setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) ) < 0 )
+		{
+			SP_LOG( LOG_ERR, "Unable to set SO_REUSEPORT on TCP socket: %s", strerror( errno ) );
+			throw std::runtime_error( "error setting socket option" );
+		}
+#endif
+
+		myTunings[l].applyListener( sock );
+
+#ifdef TCP_DEFER_ACCEPT
+		if ( myDeferAccept > 0 && setsockopt( sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &myDeferAccept, sizeof(myDeferAccept) ) < 0 )
+		{
+			SP_LOG( LOG_ERR, "Unable to set TCP_DEFER_ACCEPT: %s", strerror( errno ) );
+			throw std::runtime_error( "error setting socket option" );
+		}
 #endif
 
-	while ( ! mySendFDs.empty() )
-	{
-		int fd = mySendFDs.front();
-		if ( sendSocket( fd ) )
+#ifdef TCP_FASTOPEN
+		if ( myFastOpen > 0 && setsockopt( sock, IPPROTO_TCP, TCP_FASTOPEN, &myFastOpen, sizeof(myFastOpen) ) < 0 )
 		{
-			mySendFDs.pop_front();
-			continue;
+			SP_LOG( LOG_ERR, "Unable to set TCP_FASTOPEN: %s", strerror( errno ) );
+			throw std::runtime_error( "error setting socket option" );
 		}
+#endif
+
+		struct sockaddr_in local;
+		memset( &local, 0, sizeof(local) );
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl( INADDR_ANY );
+		local.sin_port = htons( myTCPPort );
 		
-		syslog( LOG_INFO, "Failed to send after initial child connection" );
-		break;
+		if ( bind( sock, (struct sockaddr *)&local, sizeof(local) ) == -1 )
+		{
+			SP_LOG( LOG_ERR, "Unable to bind to the socket: %s", strerror( errno ) );
+			throw std::runtime_error( "error binding to socket" );
+		}
+
+		if ( listen( sock, backlog ) )
+		{
+			SP_LOG( LOG_ERR, "Unable to listen the socket: %s", strerror( errno ) );
+			throw std::runtime_error( "error listening on socket" );
+		}
 	}
+
+	myAcceptCounts.assign( myTCPSockets.size(), 0 );
+	myNextListener = 0;
+	if ( myDeferAccept > 0 )
+		myDeferDropBase = readTcpExtCounter( "TCPDeferAcceptDrop" );
+
+	if ( myTCPSockets.size() > 1 )
+		attachSteeringProgram();
 }
 
 
 ////////////////////////////////////////
 
 
-bool
-SocketServer::sendSocket( int fd )
+void
+SocketServer::attachSteeringProgram( void )
 {
-	if ( myConnectedDaemon == -1 )
-		return false;
+	if ( mySteering == SteerKernel )
+		return;
+
+	uint32_t nL = static_cast<uint32_t>( myTCPSockets.size() );
+	int err = attachListenerSteering( myTCPSockets[0], mySteering == SteerCPU, nL );
+	if ( err == ENOPROTOOPT )
+		SP_LOG( LOG_NOTICE, "Listener steering programs not supported on this platform, using kernel default" );
+	else if ( err != 0 )
+		SP_LOG( LOG_ERR, "Unable to attach listener steering program, using kernel default: %s", strerror( err ) );
+	else
+		SP_LOG( LOG_DEBUG, "Attached %s steering program to %d listeners", mySteering == SteerCPU ? "cpu" : "hash", int(nL) );
+}
+
 
-	struct msghdr msg;
-	static const size_t ccmsgBufSz = CMSG_SPACE(sizeof(int));
-	char ccmsg[ccmsgBufSz];
-	struct cmsghdr *cmsg;
+////////////////////////////////////////
 
-	// Apparently you have to at least send 1 byte...
-	char buf[1];
-	buf[0] = 'x';
-	struct iovec vec;
-	vec.iov_base = buf;
-	vec.iov_len = 1;
 
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-	msg.msg_iov = &vec;
-	msg.msg_iovlen = 1;
-	msg.msg_control = ccmsg;
-	msg.msg_controllen = static_cast<socklen_t>( sizeof(ccmsg) );
+void
+SocketServer::startAcceptThreads( void )
+{
+	publishWorkers();
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
-	memcpy( CMSG_DATA(cmsg), &fd, sizeof(fd) );
+	// the threads keep pointers into this, so it can't grow once
+	// they're running
+	myAcceptThreads.resize( myTCPSockets.size() );
 
-	msg.msg_controllen = cmsg->cmsg_len;
-	msg.msg_flags = 0;
+	// signals stay with the supervisor
+	sigset_t all, old;
+	sigfillset( &all );
+	pthread_sigmask( SIG_BLOCK, &all, &old );
 
-	if ( sendmsg( myConnectedDaemon, &msg, 0 ) != -1 )
+	for ( size_t l = 0; l != myAcceptThreads.size(); ++l )
 	{
-		close( fd );
-		return true;
+		AcceptThread &t = myAcceptThreads[l];
+		t.server = this;
+		t.listener = l;
+		t.epoch = 0;
+		int rv = pthread_create( &t.thread, NULL, &SocketServer::acceptThreadEntry, &t );
+		if ( rv != 0 )
+		{
+			pthread_sigmask( SIG_SETMASK, &old, NULL );
+			myAcceptThreads.resize( l );
+			SP_LOG( LOG_ERR, "Unable to start accept thread: %s", strerror( rv ) );
+			throw std::runtime_error( "Unable to start accept thread" );
+		}
 	}
 
-	syslog( LOG_DEBUG, "Failed to send fd %d to child %d: %s", fd, myLastPID, strerror( errno ) );
-	return false;
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+	SP_LOG( LOG_DEBUG, "Started %d accept threads", int(myAcceptThreads.size()) );
 }
 
 
@@ -367,176 +2788,172 @@ SocketServer::sendSocket( int fd )
 
 
 void
-SocketServer::closeHandles( void )
+SocketServer::stopAcceptThreads( void )
 {
-	if ( myConnectedDaemon != -1 )
-	{
-		close( myConnectedDaemon );
-		myConnectedDaemon = -1;
-	}
+	if ( myAcceptThreads.empty() )
+		return;
 
-	if ( myUnixSocket != -1 )
-	{
-		close( myUnixSocket );
-		myUnixSocket = -1;
-	}
+	__atomic_store_n( &myTerminated, true, __ATOMIC_RELEASE );
 
-	if ( myTCPSocket != -1 )
-	{
-		close( myTCPSocket );
-		myTCPSocket = -1;
-	}
+	// wakes up a thread blocked in accept, which then fails with EINVAL
+	for ( size_t l = 0; l != myTCPSockets.size(); ++l )
+		shutdown( myTCPSockets[l], SHUT_RD );
+	for ( size_t t = 0; t != myAcceptThreads.size(); ++t )
+		pthread_join( myAcceptThreads[t].thread, NULL );
+	myAcceptThreads.clear();
 
-	while ( ! mySendFDs.empty() )
+	// whatever they passed back since we last looked
+	HandBack hb;
+	while ( myHandBacks.pop( hb ) )
 	{
-		int fd = mySendFDs.front();
-		close( fd );
-		mySendFDs.pop_front();
+		if ( hb.kind == HandBack::Connection )
+			close( hb.ps.fd );
 	}
+
+	reclaimSnapshots( true );
+	delete mySnapshot;
+	mySnapshot = NULL;
+	for ( size_t i = 0; i != myDeferredDrains.size(); ++i )
+		sendDrain( myDeferredDrains[i] );
+	myDeferredDrains.clear();
+	for ( size_t i = 0; i != myDeferredCloses.size(); ++i )
+		close( myDeferredCloses[i] );
+	myDeferredCloses.clear();
 }
 
 
 ////////////////////////////////////////
 
 
-int
-SocketServer::getNextSocket( void )
+void *
+SocketServer::acceptThreadEntry( void *arg )
 {
-	if ( waitForEvent() )
-	{
-		do
-		{
-			int fd = accept( myTCPSocket, NULL, NULL );
-
-			if ( fd == -1 )
-			{
-				syslog( LOG_DEBUG, "Socket accept returned an error: (%d) '%s'", errno, strerror( errno ) );
-				// Reading accept (2), linux passes already-pending network errors on the new socket
-				// via accept. for reliability, treat these as EAGAIN and retry...
-				switch ( errno )
-				{
-					case ENETDOWN:
-					case EPROTO:
-					case ENOPROTOOPT:
-					case EHOSTDOWN:
-#ifdef ENONET
-					case ENONET:
-#endif
-					case EHOSTUNREACH:
-					case EOPNOTSUPP:
-					case ENETUNREACH:
-					case EAGAIN:
-						continue;
-
-					case EINTR:
-						continue;
-
-					default:
-						syslog( LOG_CRIT, "Received unknown / unhandled error accepting connection on TCP socket: (%d) %s", errno, strerror(errno) );
-				}
-			}
-
-			return fd;
-		} while ( true );
-	}
-
-	return -1;
+	AcceptThread *t = reinterpret_cast<AcceptThread *>( arg );
+	t->server->acceptLoop( *t );
+	return NULL;
 }
 
 
 ////////////////////////////////////////
 
 
-bool
-SocketServer::waitForEvent( void )
+void
+SocketServer::acceptLoop( AcceptThread &t )
 {
+	int sock = myTCPSockets[t.listener];
 
-	do
-	{
-		if ( myTerminated )
-			break;
-
-		drainSockets();
-
-		fd_set fds;
-		FD_ZERO( &fds );
-		FD_SET( myTriggerPipe[0], &fds );
-		FD_SET( myTCPSocket, &fds );
-		int fdmax = std::max( myTriggerPipe[0], myTCPSocket );
-		if ( myUnixSocket != -1 )
-		{
-			FD_SET( myUnixSocket, &fds );
-			fdmax = std::max( std::max( myTriggerPipe[0], myTCPSocket ), myUnixSocket );
-		}
+	// our own place in each pool's rotation, staggered so the threads
+	// don't all start on the same worker
+	std::vector<size_t> next( myPools.size(), t.listener );
+	size_t order[myWorkersPerPool];
 
-		int rv = select( fdmax + 1, &fds, NULL, NULL, NULL );
-		if ( rv == -1 )
+	while ( ! __atomic_load_n( &myTerminated, __ATOMIC_ACQUIRE ) )
+	{
+		struct sockaddr_in peer;
+		socklen_t peerLen = sizeof(peer);
+		int fd = accept( sock, (struct sockaddr *)&peer, &peerLen );
+		if ( fd == -1 )
 		{
-			if ( errno == EINTR )
-				continue;
+			switch ( errno )
+			{
+				case EINVAL:
+					// listener shut down
+					return;
+
+				case EINTR:
+				case EAGAIN:
+				case ECONNABORTED:
+				case ENETDOWN:
+				case EPROTO:
+				case ENOPROTOOPT:
+				case EHOSTDOWN:
+#ifdef ENONET
+				case ENONET:
+#endif
+				case EHOSTUNREACH:
+				case EOPNOTSUPP:
+				case ENETUNREACH:
+					continue;
 
-			syslog( LOG_ERR, "Error trying to wait for activity: %s", strerror( errno ) );
-			throw std::runtime_error( "select error" );
+				default:
+					// out of descriptors or similar, give it a moment
+					SP_LOG( LOG_CRIT, "Received unknown / unhandled error accepting connection on TCP socket: (%d) %s", errno, strerror(errno) );
+					usleep( 10000 );
+					continue;
+			}
 		}
 
-		if ( myUnixSocket != -1 && FD_ISSET( myUnixSocket, &fds ) )
+		HandBack hb;
+		hb.kind = HandBack::Connection;
+		hb.worker = 0;
+		hb.pid = -1;
+		if ( ! prepareAccepted( t.listener, fd, peer, hb.ps ) )
+			continue;
+
+		// sniffing and proxying keep per connection state, which lives
+		// with the supervisor
+		if ( myPools.size() > 1 || myProxy )
 		{
-			try
-			{
-				acceptChild();
-			}
-			catch ( const std::exception &e )
-			{
-				if ( myConnectedDaemon != -1 )
-				{
-					close( myConnectedDaemon );
-					myConnectedDaemon = -1;
-				}
-				syslog( LOG_ERR, "error accepting child process: %s", e.what() );
-			}
+			handBack( hb );
+			continue;
 		}
 
-		if ( FD_ISSET( myTriggerPipe[0], &fds ) )
+		const PendingSocket &ps = hb.ps;
+		size_t nCand = rankWorkers( ps, next[ps.pool], order );
+		bool sent = false;
+
+		// announce the epoch before loading the pointer, so the
+		// supervisor knows we may hold anything retired after it
+		__atomic_store_n( &t.epoch, __atomic_load_n( &myEpoch, __ATOMIC_SEQ_CST ), __ATOMIC_SEQ_CST );
+		const Snapshot *snap = __atomic_load_n( &mySnapshot, __ATOMIC_SEQ_CST );
+
+		for ( size_t i = 0; ! sent && i != nCand; ++i )
 		{
-			char b = '\0';
-			if ( read( myTriggerPipe[0], &b, sizeof(char) ) < 1 )
-			{
-				syslog( LOG_CRIT, "Attempting to read from internal communication pipe, but failed, terminating" );
-				myTerminated = true;
-			}
+			const WorkerView &wv = snap->workers[order[i]];
+			if ( wv.conn == -1 )
+				continue;
 
-			syslog( LOG_DEBUG, "Got notification byte '%c' on communication pipe", b );
-			switch ( b )
+			switch ( passSocket( wv.conn, ps.fd ) )
 			{
-				case 'x':
-					myTerminated = true;
-					break;
-				case 'r':
-					respawnChild();
+				case SendOK:
+					sent = true;
+					myTrace.record( TraceHandedOff, ps.id, ps.fd, wv.pid, order[i], 0 );
+					noteHandoff( ps, order[i] );
+					SP_PROBE4( handoff, ps.id, ps.fd, wv.pid, probeTime() );
+					if ( myDispatchMode != DispatchAffinity )
+						next[ps.pool] = ( order[i] - myPools[ps.pool].firstWorker + 1 ) % myWorkersPerPool;
 					break;
-				case 'c':
-					handleChildEvent();
+
+				case SendBusy:
 					break;
 
-				default:
-					syslog( LOG_DEBUG, "Got weird byte on communication pipe" );
+				case SendFailed:
+				{
+					// the supervisor decides whether it's still the
+					// same worker and respawns it
+					myTrace.record( TraceHandoffFailed, ps.id, ps.fd, wv.pid, order[i], errno );
+					SP_PROBE4( handoff_fail, ps.id, ps.fd, wv.pid, errno );
+					HandBack f;
+					f.kind = HandBack::WorkerFailed;
+					f.ps.fd = -1;
+					f.worker = order[i];
+					f.pid = wv.pid;
+					handBack( f );
 					break;
+				}
 			}
 		}
 
-		if ( myTerminated )
+		__atomic_store_n( &t.epoch, 0, __ATOMIC_RELEASE );
+
+		if ( sent )
 		{
-			syslog( LOG_DEBUG, "terminate flag has been set..." );
-			break;
+			__atomic_fetch_add( &myHandoffCount, 1, __ATOMIC_RELAXED );
+			__atomic_store_n( &myAcceptHandedOff, 1, __ATOMIC_RELAXED );
 		}
-
-		// NB: EXIT POINT
-		if ( FD_ISSET( myTCPSocket, &fds ) )
-			return true;
-
-	} while ( true );
-
-	return false;
+		else
+			handBack( hb );
+	}
 }
 
 
@@ -544,45 +2961,29 @@ SocketServer::waitForEvent( void )
 
 
 void
-SocketServer::respawnChild( void )
+SocketServer::handBack( const HandBack &hb )
 {
-	syslog( LOG_NOTICE, "Respawning child process..." );
-	restartUnixSocket();
-
-	size_t N = myCmdLine.size();
-	char *argdata[N + 1];
-	for ( size_t i = 0; i != N; ++i )
-		argdata[i] = const_cast<char *>( myCmdLine[i].c_str() );
-	argdata[N] = NULL;
-
-	myLastPID = -1;
-	pid_t pid = fork();
-
-	if ( pid < 0 )
-	{
-		syslog( LOG_CRIT, "Unable to fork child process" );
-		throw std::runtime_error( "Unable to fork child process" );
-	}
-
-	if ( pid == 0 )
+	// the supervisor empties the queue every time it wakes, so a full
+	// queue only means it's momentarily behind
+	while ( ! myHandBacks.push( hb ) )
 	{
-		//child process, exec off the command
-		// first close any extra open descriptors
-		Daemon::closeFileDescriptors( 3 );
-		execvp( argdata[0], argdata );
-		_exit( -1 );
+		if ( __atomic_load_n( &myTerminated, __ATOMIC_ACQUIRE ) )
+		{
+			if ( hb.kind == HandBack::Connection )
+				close( hb.ps.fd );
+			return;
+		}
+		sched_yield();
 	}
 
-	myLastPID = pid;
-	myChildList.push_back( pid );
-	if ( gettimeofday( &myLastStartTime, NULL ) != 0 )
+	// one wake up outstanding is enough, the supervisor clears the flag
+	// before emptying the queue
+	if ( __atomic_exchange_n( &myHandBackSignalled, 1, __ATOMIC_ACQ_REL ) == 0 )
 	{
-		myLastStartTime.tv_sec = 0;
-		myLastStartTime.tv_usec = 0;
-		syslog( LOG_CRIT, "Unable to retrieve time of day: %s", strerror( errno ) );
+		char b = 'q';
+		if ( write( myTriggerPipe[1], &b, sizeof(char) ) != 1 )
+			SP_LOG( LOG_ERR, "Unable to write to internal communication pipe" );
 	}
-
-	++myRespawnCount;
 }
 
 
@@ -590,46 +2991,25 @@ SocketServer::respawnChild( void )
 
 
 void
-SocketServer::handleChildEvent( void )
+SocketServer::takeHandBacks( void )
 {
-	int status = 0;
-	pid_t cpid = waitpid( -1, &status, WNOHANG );
-
-	if ( cpid <= 0 )
-		return;
-
-	if ( WIFEXITED( status ) )
-		syslog( LOG_INFO, "child process %d exited with status %d", cpid, WEXITSTATUS( status ) );
-	else if ( WIFSIGNALED( status ) )
-		syslog( LOG_INFO, "child process %d terminated due to signal %d", cpid, WTERMSIG( status ) );
-	else if ( WIFSTOPPED( status ) )
-	{
-		syslog( LOG_DEBUG, "child process %d stopped due to signal %d", cpid, WSTOPSIG( status ) );
-		return;
-	}
-
-	for ( size_t i = 0, N = myChildList.size(); i != N; ++i )
-	{
-		if ( myChildList[i] == cpid )
-		{
-			myChildList.erase( myChildList.begin() + i );
-			break;
-		}
-	}
+	__atomic_exchange_n( &myHandBackSignalled, 0, __ATOMIC_ACQ_REL );
 
-	if ( cpid == myLastPID )
+	HandBack hb;
+	while ( myHandBacks.pop( hb ) )
 	{
-		if ( myConnectedDaemon >= 0 )
+		if ( hb.kind == HandBack::Connection )
 		{
-			close( myConnectedDaemon );
-			myConnectedDaemon = -1;
+			myHandedBack.push_back( hb.ps );
+			continue;
 		}
-		myLastPID = -1;
 
-		if ( ! myTerminated )
+		// the slot may have been replaced since the thread looked
+		const Worker &wk = myWorkers[hb.worker];
+		if ( wk.pid == hb.pid && wk.conn != -1 )
 		{
-			syslog( LOG_INFO, "Respawning child process after unexpected exit" );
-			respawnChild();
+			SP_LOG( LOG_ERR, "Lost worker %d or couldn't send socket, respawning", int(hb.worker) );
+			respawnWorker( hb.worker );
 		}
 	}
 }
@@ -639,49 +3019,88 @@ SocketServer::handleChildEvent( void )
 
 
 void
-SocketServer::restartUnixSocket( void )
+SocketServer::publishWorkers( void )
 {
-	if ( myConnectedDaemon >= 0 )
+	Snapshot *snap = new Snapshot;
+	snap->workers.resize( myWorkers.size() );
+	for ( size_t w = 0; w != myWorkers.size(); ++w )
 	{
-		close( myConnectedDaemon );
-		myConnectedDaemon = -1;
+		snap->workers[w].pid = myWorkers[w].pid;
+		snap->workers[w].conn = myWorkers[w].conn;
 	}
+	snap->retiredAt = 0;
 
-	if ( myUnixSocket != -1 )
+	Snapshot *old = __atomic_exchange_n( &mySnapshot, snap, __ATOMIC_SEQ_CST );
+	if ( old )
 	{
-		close( myUnixSocket );
-		myUnixSocket = -1;
+		// channels dropped since the old one went out may still be in
+		// use through it
+		old->closeOnReclaim.swap( myDeferredCloses );
+		old->drainOnReclaim.swap( myDeferredDrains );
+		old->retiredAt = __atomic_add_fetch( &myEpoch, 1, __ATOMIC_SEQ_CST );
+		myRetiredSnapshots.push_back( old );
 	}
+	myWorkersChanged = false;
 
-	myUnixSocket = socket( PF_LOCAL, SOCK_STREAM, 0 );
-	if ( myUnixSocket < 0 )
-		throw std::runtime_error( "Unable to create UNIX socket" );
+	reclaimSnapshots( false );
+}
 
-	struct sockaddr_un local;
-	memset( &local, 0, sizeof(local) );
-	local.sun_family = PF_UNIX;
 
-#ifdef __linux__
-	// linux has abstract sockets that don't need unlinking
-	strncpy( local.sun_path + 1, myUnixSockPath.c_str(), std::min( myUnixSockPath.size(), sizeof(local.sun_path) - 2 ) );
-#else
-	strncpy( local.sun_path, myUnixSockPath.c_str(), std::min( myUnixSockPath.size(), sizeof(local.sun_path) - 1 ) );
-	if ( unlink( myUnixSockPath.c_str() ) == -1 )
+////////////////////////////////////////
+
+
+void
+SocketServer::reclaimSnapshots( bool all )
+{
+	// a thread that entered at epoch e may have loaded any snapshot
+	// retired after e, but nothing retired at or before it
+	uint64_t oldest = ~uint64_t( 0 );
+	for ( size_t t = 0; t != myAcceptThreads.size(); ++t )
 	{
-		if ( errno != ENOENT )
-			throw std::runtime_error( "unable to remove socket path" );
+		uint64_t e = __atomic_load_n( &myAcceptThreads[t].epoch, __ATOMIC_SEQ_CST );
+		if ( e != 0 && e < oldest )
+			oldest = e;
 	}
-#endif
 
-#ifdef __APPLE__
-	local.sun_len = SUN_LEN( &local );
-#endif
+	size_t keep = 0;
+	for ( size_t i = 0; i != myRetiredSnapshots.size(); ++i )
+	{
+		Snapshot *snap = myRetiredSnapshots[i];
+		if ( ! all && snap->retiredAt > oldest )
+		{
+			myRetiredSnapshots[keep++] = snap;
+			continue;
+		}
 
-	if ( bind( myUnixSocket, (struct sockaddr *)&local, sizeof(local) ) == -1 )
-		throw std::runtime_error( std::string( "Unable to bind local unix socket: " ) + strerror( errno ) );
+		for ( size_t c = 0; c != snap->drainOnReclaim.size(); ++c )
+			sendDrain( snap->drainOnReclaim[c] );
+		for ( size_t c = 0; c != snap->closeOnReclaim.size(); ++c )
+			close( snap->closeOnReclaim[c] );
+		delete snap;
+	}
+	myRetiredSnapshots.resize( keep );
+}
 
-	if ( listen( myUnixSocket, 1 ) == -1 )
-		throw std::runtime_error( "Unable to start listening on a socket" );
+
+////////////////////////////////////////
+
+
+void
+SocketServer::noteHandoff( const PendingSocket &ps, size_t w )
+{
+	if ( ! myStats.isOpen() )
+		return;
+
+	__atomic_fetch_add( &myWorkerHandoffs[w], 1, __ATOMIC_RELAXED );
+
+	struct timeval now;
+	gettimeofday( &now, NULL );
+	long long us = ( ( now.tv_sec - ps.accepted.tv_sec ) * 1000000LL +
+					 ( now.tv_usec - ps.accepted.tv_usec ) );
+	size_t b = 0;
+	while ( b + 1 < StatsPage::kWaitBuckets && ( 1LL << b ) <= us )
+		++b;
+	__atomic_fetch_add( &myWaitHist[b], 1, __ATOMIC_RELAXED );
 }
 
 
@@ -689,65 +3108,63 @@ SocketServer::restartUnixSocket( void )
 
 
 void
-SocketServer::prepareTCPSocket( int backlog )
+SocketServer::publishStats( void )
 {
-	myTCPSocket = socket( AF_INET, SOCK_STREAM, 0 );
-	if ( myTCPSocket < 0 )
-	{
-		syslog( LOG_ERR, "Unable to create AF_INET socket: %s", strerror( errno ) );
-		throw std::runtime_error( "error creating socket" );
-	}
+	StatsPage *page = myStats.beginUpdate();
 
-	int on = 1;
-	if ( setsockopt( myTCPSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) ) < 0 )
-	{
-		syslog( LOG_ERR, "Unable to set SO_REUSEADDR on TCP socket: %s", strerror( errno ) );
-		throw std::runtime_error( "error setting socket option" );
-	}
+	page->pid = static_cast<int32_t>( getpid() );
+	page->port = myTCPPort;
 
-	if ( setsockopt( myTCPSocket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on) ) < 0 )
+	size_t nL = std::min( myAcceptCounts.size(), size_t( StatsPage::kMaxListeners ) );
+	page->nListeners = static_cast<uint32_t>( nL );
+	page->accepted = 0;
+	for ( size_t l = 0; l != myAcceptCounts.size(); ++l )
 	{
-		syslog( LOG_ERR, "Unable to set SO_KEEPALIVE: %s", strerror( errno ) );
-		throw std::runtime_error( "error setting socket option" );
+		uint64_t n = __atomic_load_n( &myAcceptCounts[l], __ATOMIC_RELAXED );
+		page->accepted += n;
+		if ( l < nL )
+			page->listeners[l].accepted = n;
 	}
 
-#ifndef __APPLE__
-	if ( setsockopt( myTCPSocket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on) ) < 0 )
+	page->handedOff = __atomic_load_n( &myHandoffCount, __ATOMIC_RELAXED );
+	page->avoided = __atomic_load_n( &myAvoidedHandoffs, __ATOMIC_RELAXED );
+	page->respawns = myRespawnTotal;
+	page->queued = mySendFDs.size() + myHandedBack.size();
+	page->sniffing = mySniffFDs.size();
+	for ( size_t b = 0; b != StatsPage::kWaitBuckets; ++b )
+		page->waitHist[b] = __atomic_load_n( &myWaitHist[b], __ATOMIC_RELAXED );
+
+	size_t nW = std::min( myWorkers.size(), size_t( StatsPage::kMaxWorkers ) );
+	page->nWorkers = static_cast<uint32_t>( nW );
+	for ( size_t w = 0; w != nW; ++w )
 	{
-		syslog( LOG_ERR, "Unable to set TCP_CORK: %s", strerror( errno ) );
-		throw std::runtime_error( "error setting socket option" );
-	}
+		const Worker &wk = myWorkers[w];
+		StatsPage::Worker &sw = page->workers[w];
+		sw.pid = static_cast<int32_t>( wk.pid );
+		sw.pool = static_cast<int32_t>( wk.pool );
+		sw.connected = wk.conn != -1 || wk.proxyReady;
+		sw.sessions = static_cast<int32_t>( wk.sessions );
+		sw.handedOff = __atomic_load_n( &myWorkerHandoffs[w], __ATOMIC_RELAXED );
+		sw.channelBytes = 0;
+#ifdef SIOCOUTQ
+		int outq = 0;
+		if ( wk.conn != -1 && ioctl( wk.conn, SIOCOUTQ, &outq ) == 0 && outq > 0 )
+			sw.channelBytes = static_cast<uint64_t>( outq );
 #endif
-
-	if ( setsockopt( myTCPSocket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) ) < 0 )
-	{
-		syslog( LOG_ERR, "Unable to set TCP_NODELAY: %s", strerror( errno ) );
-		throw std::runtime_error( "error setting socket option" );
 	}
 
-	int low_delay = IPTOS_LOWDELAY;
-	if ( setsockopt( myTCPSocket, IPPROTO_IP, IP_TOS, &low_delay, sizeof(low_delay) ) < 0 )
-	{
-		syslog( LOG_ERR, "Unable to set IP_TOS IPTOS_LOWDELAY: %s", strerror( errno ) );
-		throw std::runtime_error( "error setting socket option" );
-	}
+	struct timespec mono;
+	clock_gettime( CLOCK_MONOTONIC, &mono );
+	page->updated = int64_t( mono.tv_sec ) * 1000000000LL + mono.tv_nsec;
 
-	struct sockaddr_in local;
-	memset( &local, 0, sizeof(local) );
-	local.sin_family = AF_INET;
-	local.sin_addr.s_addr = htonl( INADDR_ANY );
-	local.sin_port = htons( myTCPPort );
-	
-	if ( bind( myTCPSocket, (struct sockaddr *)&local, sizeof(local) ) == -1 )
-	{
-		syslog( LOG_ERR, "Unable to bind to the socket: %s", strerror( errno ) );
-		throw std::runtime_error( "error binding to socket" );
-	}
+	myStats.endUpdate();
 
-	if ( listen( myTCPSocket, backlog ) )
+	gettimeofday( &myStatsDue, NULL );
+	myStatsDue.tv_usec += 100000;
+	if ( myStatsDue.tv_usec >= 1000000 )
 	{
-		syslog( LOG_ERR, "Unable to listen the socket: %s", strerror( errno ) );
-		throw std::runtime_error( "error listening on socket" );
+		myStatsDue.tv_sec += 1;
+		myStatsDue.tv_usec -= 1000000;
 	}
 }
 
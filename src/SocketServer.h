@@ -28,7 +28,17 @@
 #include <deque>
 #include <memory>
 #include <sys/un.h>
+#include <netinet/in.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#include "SocketTuning.h"
+#include "EventEngine.h"
+#include "BoundedQueue.h"
+#include "TraceFile.h"
+#include "StatsSegment.h"
+
+class SpliceProxy;
 
 
 ////////////////////////////////////////
@@ -37,9 +47,139 @@
 class SocketServer
 {
 public:
+	/// How accepted connections are spread across the worker children
+	enum DispatchMode
+	{
+		/// hand each connection to the next worker in turn
+		DispatchRoundRobin,
+		/// rendezvous hash of the peer address, so a given client
+		/// keeps landing on the same worker
+		DispatchAffinity,
+		/// send to the worker pinned to the CPU that processed the
+		/// connection's packets (SO_INCOMING_CPU), see setCPUAffinity
+		DispatchCPU
+	};
+
+	/// How the kernel picks a listener when there are several
+	enum ListenerSteering
+	{
+		/// default SO_REUSEPORT behaviour (hash of the 4-tuple)
+		SteerKernel,
+		/// listener = CPU handling the SYN modulo listener count
+		SteerCPU,
+		/// listener = hash of the client address modulo listener count
+		SteerHash
+	};
+
 	SocketServer( const std::vector<std::string> &cmdargs, uint16_t port );
 	~SocketServer( void );
 
+	/// Number of copies of the child command to keep running (default 1).
+	/// When routes are in use, each route gets this many workers.
+	/// Must be called prior to run
+	void setWorkerCount( size_t n );
+
+	/// Adds a pool of workers running cmdargs which receives the
+	/// connections whose first bytes match. Once a route is added, each
+	/// accepted connection is held (without consuming anything) until
+	/// enough data has arrived to pick a route, or the sniff timeout
+	/// passes, in which case the default command gets it. Routes are
+	/// tried in the order added.
+	///
+	/// matcher is one of "tls", "http", "prefix:<text>" or "hex:<bytes>"
+	void addRoute( const std::string &matcher, const std::vector<std::string> &cmdargs );
+
+	/// Maximum time to wait for the first bytes of a connection when
+	/// routing (default 500ms)
+	void setSniffTimeout( int msec );
+
+	static bool isValidMatcher( const std::string &matcher );
+
+	/// Sets TCP_DEFER_ACCEPT on the listeners, so connections are only
+	/// surfaced once data arrives (or after roughly this many seconds).
+	/// Connections that then turn out to be closed with nothing sent are
+	/// dropped rather than handed off. 0 (default) disables
+	void setDeferAccept( int seconds );
+
+	/// Enables TCP Fast Open on the listeners with the given pending
+	/// queue length. 0 (default) disables
+	void setFastOpen( int queueLen );
+
+	/// Selects how connections are assigned to workers. When the
+	/// preferred worker is not connected, or its channel is full, the
+	/// next choice is used
+	void setDispatchMode( DispatchMode m );
+
+	/// Pins each worker to a set of CPUs when it is launched. Entry i
+	/// is the CPU list for worker i (wrapping if there are fewer entries
+	/// than workers). An empty list splits the CPUs we are allowed to
+	/// run on into contiguous blocks, one per worker. Only has an effect
+	/// on linux
+	void setCPUAffinity( const std::vector< std::vector<int> > &cpuSets );
+
+	/// Opens n listening sockets on the port with SO_REUSEPORT instead
+	/// of one (default 1). On linux a classic BPF program is attached to
+	/// the group so the kernel picks the listener according to steering
+	void setListenerCount( size_t n, ListenerSteering steering = SteerKernel );
+
+	/// Socket options for every listener and the connections it
+	/// accepts (default: SocketTuning's default profile)
+	void setTuning( const SocketTuning &t );
+
+	/// Overrides the socket options for one listener. Listeners past
+	/// the last one given use the same tuning as the last one
+	void setListenerTuning( size_t l, const SocketTuning &t );
+
+	/// Instead of handing each connection to a child, forward its bytes
+	/// (with splice, on linux) to the child listening on a private UNIX
+	/// socket. Every launch of a worker gets its own path, prefix plus a
+	/// worker and launch number, which replaces "%P" in the command line
+	/// and is exported as SOCKET_PROTECTOR_PROXY_PATH. This is for
+	/// daemons that can't use the client library. When a worker is
+	/// replaced the old process keeps its open sessions and is sent
+	/// SIGTERM once the last of them closes
+	void setProxyPath( const std::string &prefix );
+
+	/// Selects what the run loop waits with (default: select). io_uring
+	/// also accepts connections with multishot accepts and hands them
+	/// off in batches, and falls back to epoll if the kernel lacks it
+	void setEngine( EventEngine::Type t );
+
+	/// Accepts and hands off connections on a thread per listener,
+	/// leaving this thread to supervise: launching and reaping children,
+	/// timers, signals, plus any connection the accept threads couldn't
+	/// place. The accept threads read the worker table from snapshots
+	/// published without a lock, so a slow fork or syslog call here
+	/// doesn't hold up accepting. Connections that need sniffing or
+	/// proxying are always passed back to this thread
+	void setAcceptThreads( bool on );
+
+	/// Records connection and worker events into a circular binary
+	/// trace at path with room for the given number of records. See
+	/// TraceFile and TraceDump
+	void setTraceFile( const std::string &path, size_t records );
+
+	/// Publishes live counters into the named shared memory segment
+	/// (see StatsSegment::nameForPort) ten times a second, for sp-top
+	/// and other dashboards. Empty (default) disables
+	void setStatsSegment( const std::string &name );
+
+	/// Instead of closing a replaced worker's channel and, on shutdown,
+	/// signalling every worker at once, sends it a drain request and
+	/// gives it msec to finish its connections and exit. It is only sent
+	/// SIGTERM once that runs out, and SIGKILL a second later. The time
+	/// is exported to workers as SOCKET_PROTECTOR_DRAIN_MSEC, and they
+	/// report their in-flight connections back while draining. 0
+	/// (default) disables. Has no effect when proxying
+	void setDrainTimeout( int msec );
+
+	/// How long to hold a connection a worker parked (handed back while
+	/// idle) for its client to send something, before closing it
+	/// (default 60 seconds). Parked connections are watched here and
+	/// passed to a current worker of the same pool once readable, so
+	/// they outlive the worker that parked them
+	void setParkTimeout( int seconds );
+
 	/// Meant to be called from a signal handler or other thread, cancels
 	/// any internal waiting happening
 	/// terminate is async signal safe (SIGINT, SIGTERM, et al.)
@@ -68,34 +208,243 @@ public:
 	void run( int retryCount = 3, int retryPauseSec = 60, int backlogSize = -1 );
 
 private:
+	/// what has arrived from a worker on its channel: a partial record,
+	/// and descriptors waiting for the records they came with
+	struct Inbound
+	{
+		char record[sizeof(uint32_t)];
+		size_t have;
+		std::vector<int> fds;
+		bool closed;
+	};
+
+	struct Worker
+	{
+		pid_t pid;
+		int conn;
+		size_t pool;
+		struct timeval startTime;
+		std::vector<int> cpus;
+		std::string proxyPath;
+		size_t sessions;
+		bool proxyReady;
+		Inbound inbound;
+	};
+
+	/// a replaced worker still serving proxied sessions, or draining
+	struct Retiree
+	{
+		pid_t pid;
+		size_t pool;
+		std::string proxyPath;
+		size_t sessions;
+		/// the rest are for draining: the old channel, still open for
+		/// the worker's in-flight reports and parked connections, -1
+		/// once it has closed it
+		int conn;
+		/// when it gets the next signal, 0 for not draining
+		struct timeval deadline;
+		int signalled;
+		int inFlight;
+		Inbound inbound;
+	};
+
+	struct Pool
+	{
+		std::string name;
+		std::vector<std::string> cmdLine;
+		std::vector<std::string> prefixes;
+		size_t firstWorker;
+		size_t nextWorker;
+	};
+
+	struct PendingSocket
+	{
+		uint64_t id;
+		int fd;
+		int cpu;
+		size_t pool;
+		size_t sniffed;
+		uint64_t affinity;
+		struct timeval accepted;
+	};
+
+	enum SendResult
+	{
+		SendOK,
+		SendBusy,
+		SendFailed
+	};
+
+	/// what the accept threads can see of a worker
+	struct WorkerView
+	{
+		pid_t pid;
+		int conn;
+	};
+
+	/// published copy of the worker table. Replaced, never changed, and
+	/// only deleted once no accept thread can still be reading it
+	struct Snapshot
+	{
+		std::vector<WorkerView> workers;
+		/// worker channels that are gone from newer snapshots, closed
+		/// along with this one
+		std::vector<int> closeOnReclaim;
+		/// channels to send the drain request on, first
+		std::vector<int> drainOnReclaim;
+		uint64_t retiredAt;
+	};
+
+	/// from an accept thread to the supervisor
+	struct HandBack
+	{
+		enum Kind
+		{
+			Connection,
+			WorkerFailed
+		};
+
+		Kind kind;
+		PendingSocket ps;
+		size_t worker;
+		pid_t pid;
+	};
+
+	struct AcceptThread
+	{
+		SocketServer *server;
+		size_t listener;
+		pthread_t thread;
+		/// epoch seen on entering a snapshot read, 0 when outside one
+		uint64_t epoch;
+		char pad[64];
+	};
+
+	void layoutWorkers( void );
 	void drainSockets( void );
+	void sendQueuedBatch( void );
 	void acceptChild( void );
-	bool sendSocket( int fd );
+	bool dispatchSocket( const PendingSocket &ps );
+	SendResult sendSocket( size_t w, int fd );
+	static SendResult passSocket( int conn, int fd );
+	SendResult proxySocket( size_t w, int fd );
+	void processProxy( void );
+	void retireWorker( size_t w );
+	void stopRetiree( size_t r );
+	void drainWorker( size_t w );
+	void sendDrain( int conn );
+	void readDrainReport( Retiree &rt );
+	bool readChannel( int conn, Inbound &in, size_t pool, pid_t pid, int &inFlight );
+	static void clearInbound( Inbound &in );
+	void parkSocket( int fd, size_t pool, pid_t pid );
+	void wakeParked( void );
+	void closeRetireeConn( Retiree &rt );
+	void checkDrainDeadlines( void );
+	void waitForDrain( void );
+	size_t rankWorkers( const PendingSocket &ps, size_t start, size_t *order ) const;
+	void routeSocket( PendingSocket &ps );
+	void sniffSockets( void );
+	int sniffPool( PendingSocket &ps, bool readable, bool &decided );
 	void closeHandles( void );
 
-	int getNextSocket( void );
-	bool waitForEvent( void );
+	int getNextSocket( PendingSocket &ps );
+	bool prepareAccepted( size_t listener, int fd, const struct sockaddr_in &peer, PendingSocket &ps );
+	bool isEmptyConnection( int fd );
+	bool waitForEvent( size_t &listener );
 
+	bool checkWorkerStartup( int retryCount, int retryPauseSec );
 	void respawnChild( void );
+	void respawnWorker( size_t w );
+	void assignCPUs( void );
+	void launchWorker( size_t w );
+	void disconnectWorker( size_t w );
 	void handleChildEvent( void );
 
 	void restartUnixSocket( void );
 	void prepareTCPSocket( int backlog );
+	void attachSteeringProgram( void );
+
+	static void *acceptThreadEntry( void *arg );
+	void acceptLoop( AcceptThread &t );
+	void handBack( const HandBack &hb );
+	void takeHandBacks( void );
+	void startAcceptThreads( void );
+	void stopAcceptThreads( void );
+	void publishWorkers( void );
+	void reclaimSnapshots( bool all );
+
+	void noteHandoff( const PendingSocket &ps, size_t w );
+	void publishStats( void );
 
-	int myTCPSocket;
+	std::vector<int> myTCPSockets;
+	std::vector<uint64_t> myAcceptCounts;
+	std::vector<SocketTuning> myTunings;
+	ListenerSteering mySteering;
+	size_t myListenerCount;
+	size_t myNextListener;
+	int myDeferAccept;
+	int myFastOpen;
+	unsigned long long myDeferDropBase;
+	uint64_t myHandoffCount;
+	uint64_t myAvoidedHandoffs;
 	int myTriggerPipe[2];
 	int myUnixSocket;
 	std::string myUnixSockPath;
 
-	std::vector<std::string> myCmdLine;
-	int myConnectedDaemon;
+	std::vector<Pool> myPools;
+	std::vector<Worker> myWorkers;
+	size_t myWorkersPerPool;
+	DispatchMode myDispatchMode;
+	bool myPinWorkers;
+	std::vector< std::vector<int> > myCPUSets;
+	std::vector<int> myCPUToWorker;
 
-	pid_t myLastPID;
 	std::vector<pid_t> myChildList;
-	std::deque<int> mySendFDs;
-	struct timeval myLastStartTime;
+	std::vector<PendingSocket> mySniffFDs;
+	int mySniffTimeout;
+	size_t mySniffLength;
+	std::vector<char> mySniffBuf;
+	bool mySniffLimitWarned;
+	std::deque<PendingSocket> mySendFDs;
 	int myRespawnCount;
 
+	std::string myProxyPrefix;
+	SpliceProxy *myProxy;
+	std::vector<Retiree> myRetirees;
+	unsigned long myProxySerial;
+	int myDrainMsec;
+	std::vector<PendingSocket> myParkedFDs;
+	int myParkTimeout;
+
+	EventEngine::Type myEngineType;
+	EventEngine *myEngine;
+
+	bool myThreaded;
+	std::vector<AcceptThread> myAcceptThreads;
+	Snapshot *mySnapshot;
+	uint64_t myEpoch;
+	std::vector<Snapshot *> myRetiredSnapshots;
+	std::vector<int> myDeferredCloses;
+	std::vector<int> myDeferredDrains;
+	bool myWorkersChanged;
+	BoundedQueue<HandBack> myHandBacks;
+	int myHandBackSignalled;
+	int myAcceptHandedOff;
+	std::deque<PendingSocket> myHandedBack;
+
+	std::string myTracePath;
+	size_t myTraceRecords;
+	TraceFile myTrace;
+	uint64_t myNextConnId;
+
+	std::string myStatsName;
+	StatsSegment myStats;
+	struct timeval myStatsDue;
+	std::vector<uint64_t> myWorkerHandoffs;
+	uint64_t myWaitHist[StatsPage::kWaitBuckets];
+	uint64_t myRespawnTotal;
+
 	uint16_t myTCPPort;
 	bool myTerminated;
 };
@@ -0,0 +1,348 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "SocketTuning.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdexcept>
+
+#include "AsyncLog.h"
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+bool
+setInt( int fd, int level, int opt, int val, const char *name, int priority )
+{
+	if ( setsockopt( fd, level, opt, &val, sizeof(val) ) < 0 )
+	{
+		SP_LOG( priority, "Unable to set %s: %s", name, strerror( errno ) );
+		return false;
+	}
+	return true;
+}
+
+bool
+parseInt( const std::string &val, int &out )
+{
+	char *end = NULL;
+	long v = strtol( val.c_str(), &end, 10 );
+	if ( val.empty() || *end != '\0' || v < 0 || v > 0x7fffffffL )
+		return false;
+	out = static_cast<int>( v );
+	return true;
+}
+
+bool
+parseBool( const std::string &val, bool &out )
+{
+	if ( val == "1" || val == "on" || val == "yes" )
+		out = true;
+	else if ( val == "0" || val == "off" || val == "no" )
+		out = false;
+	else
+		return false;
+	return true;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+SocketTuning::SocketTuning( void )
+		: myBusyPollDenied( 0 )
+{
+	loadProfile( "default" );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketTuning::parse( const std::string &spec )
+{
+	std::string::size_type start = 0;
+	std::string::size_type comma = spec.find( ',' );
+	std::string profile = spec.substr( 0, comma );
+
+	if ( profile != "default" && profile != "latency" && profile != "throughput" )
+		return false;
+	loadProfile( profile );
+
+	while ( comma != std::string::npos )
+	{
+		start = comma + 1;
+		comma = spec.find( ',', start );
+		std::string kv = spec.substr( start, comma == std::string::npos ? std::string::npos : comma - start );
+		std::string::size_type eq = kv.find( '=' );
+		if ( eq == std::string::npos )
+			return false;
+		if ( ! setOption( kv.substr( 0, eq ), kv.substr( eq + 1 ) ) )
+			return false;
+		myPerConnection = true;
+	}
+
+	myName = spec;
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketTuning::applyListener( int fd ) const
+{
+	if ( ! apply( fd, true, ! myPerConnection, LOG_ERR ) )
+		throw std::runtime_error( "error setting socket option" );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketTuning::applyAccepted( int fd ) const
+{
+	if ( ! myPerConnection )
+		return true;
+
+	return apply( fd, false, true, LOG_DEBUG );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SocketTuning::loadProfile( const std::string &profile )
+{
+	myName = profile;
+	myPerConnection = false;
+
+	myRcvBuf = 0;
+	mySndBuf = 0;
+	myKeepAlive = true;
+	myKeepIdle = 0;
+	myKeepIntvl = 0;
+	myKeepCnt = 0;
+	myNoDelay = true;
+	myCork = false;
+	myQuickAck = false;
+	myUserTimeout = 0;
+	myBusyPoll = 0;
+	myNotSentLowat = 0;
+	myTOS = IPTOS_LOWDELAY;
+	myCongestion.clear();
+
+	if ( profile == "latency" )
+	{
+		// small writes go out immediately, acks aren't delayed, and
+		// dead peers are noticed quickly
+		myPerConnection = true;
+		myQuickAck = true;
+		myKeepIdle = 60;
+		myKeepIntvl = 10;
+		myKeepCnt = 6;
+		myUserTimeout = 30000;
+		myBusyPoll = 50;
+		myNotSentLowat = 16384;
+	}
+	else if ( profile == "throughput" )
+	{
+		// big buffers and full segments
+		myPerConnection = true;
+		myRcvBuf = 4 * 1024 * 1024;
+		mySndBuf = 4 * 1024 * 1024;
+		myNoDelay = false;
+		myTOS = IPTOS_THROUGHPUT;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketTuning::setOption( const std::string &key, const std::string &val )
+{
+	if ( key == "rcvbuf" )
+		return parseInt( val, myRcvBuf );
+	if ( key == "sndbuf" )
+		return parseInt( val, mySndBuf );
+	if ( key == "keepalive" )
+		return parseBool( val, myKeepAlive );
+	if ( key == "keepidle" )
+		return parseInt( val, myKeepIdle );
+	if ( key == "keepintvl" )
+		return parseInt( val, myKeepIntvl );
+	if ( key == "keepcnt" )
+		return parseInt( val, myKeepCnt );
+	if ( key == "nodelay" )
+		return parseBool( val, myNoDelay );
+	if ( key == "cork" )
+		return parseBool( val, myCork );
+	if ( key == "quickack" )
+		return parseBool( val, myQuickAck );
+	if ( key == "user_timeout" )
+		return parseInt( val, myUserTimeout );
+	if ( key == "busy_poll" )
+		return parseInt( val, myBusyPoll );
+	if ( key == "notsent_lowat" )
+		return parseInt( val, myNotSentLowat );
+	if ( key == "congestion" )
+	{
+		myCongestion = val;
+		return ! val.empty();
+	}
+	if ( key == "tos" )
+	{
+		if ( val == "lowdelay" )
+			myTOS = IPTOS_LOWDELAY;
+		else if ( val == "throughput" )
+			myTOS = IPTOS_THROUGHPUT;
+		else if ( val == "reliability" )
+			myTOS = IPTOS_RELIABILITY;
+		else if ( val == "none" )
+			myTOS = 0;
+		else
+			return parseInt( val, myTOS );
+		return true;
+	}
+
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SocketTuning::apply( int fd, bool buffers, bool options, int priority ) const
+{
+	bool ok = true;
+
+	if ( buffers )
+	{
+		if ( myRcvBuf > 0 )
+			ok = setInt( fd, SOL_SOCKET, SO_RCVBUF, myRcvBuf, "SO_RCVBUF", priority ) && ok;
+		if ( mySndBuf > 0 )
+			ok = setInt( fd, SOL_SOCKET, SO_SNDBUF, mySndBuf, "SO_SNDBUF", priority ) && ok;
+	}
+
+	if ( ! options )
+		return ok;
+
+	ok = setInt( fd, SOL_SOCKET, SO_KEEPALIVE, myKeepAlive ? 1 : 0, "SO_KEEPALIVE", priority ) && ok;
+	if ( myKeepAlive )
+	{
+#ifdef TCP_KEEPIDLE
+		if ( myKeepIdle > 0 )
+			ok = setInt( fd, IPPROTO_TCP, TCP_KEEPIDLE, myKeepIdle, "TCP_KEEPIDLE", priority ) && ok;
+#endif
+#ifdef TCP_KEEPINTVL
+		if ( myKeepIntvl > 0 )
+			ok = setInt( fd, IPPROTO_TCP, TCP_KEEPINTVL, myKeepIntvl, "TCP_KEEPINTVL", priority ) && ok;
+#endif
+#ifdef TCP_KEEPCNT
+		if ( myKeepCnt > 0 )
+			ok = setInt( fd, IPPROTO_TCP, TCP_KEEPCNT, myKeepCnt, "TCP_KEEPCNT", priority ) && ok;
+#endif
+	}
+
+	// cork and nodelay pull in opposite directions, cork wins if asked for
+	if ( myCork )
+	{
+#ifdef TCP_CORK
+		ok = setInt( fd, IPPROTO_TCP, TCP_CORK, 1, "TCP_CORK", priority ) && ok;
+#elif defined(TCP_NOPUSH)
+		ok = setInt( fd, IPPROTO_TCP, TCP_NOPUSH, 1, "TCP_NOPUSH", priority ) && ok;
+#endif
+	}
+	else if ( myNoDelay )
+		ok = setInt( fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", priority ) && ok;
+
+#ifdef TCP_QUICKACK
+	if ( myQuickAck )
+		ok = setInt( fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK", priority ) && ok;
+#endif
+#ifdef TCP_USER_TIMEOUT
+	if ( myUserTimeout > 0 )
+		ok = setInt( fd, IPPROTO_TCP, TCP_USER_TIMEOUT, myUserTimeout, "TCP_USER_TIMEOUT", priority ) && ok;
+#endif
+#ifdef SO_BUSY_POLL
+	// raising it past net.core.busy_read takes CAP_NET_ADMIN, which the
+	// latency profile shouldn't need, so without it the option is
+	// dropped for good with a single warning
+	if ( myBusyPoll > 0 && ! __atomic_load_n( &myBusyPollDenied, __ATOMIC_RELAXED ) )
+	{
+		if ( setsockopt( fd, SOL_SOCKET, SO_BUSY_POLL, &myBusyPoll, sizeof(myBusyPoll) ) < 0 )
+		{
+			if ( errno != EPERM )
+			{
+				SP_LOG( priority, "Unable to set SO_BUSY_POLL: %s", strerror( errno ) );
+				ok = false;
+			}
+			else if ( __atomic_exchange_n( &myBusyPollDenied, 1, __ATOMIC_RELAXED ) == 0 )
+				SP_LOG( LOG_WARNING, "SO_BUSY_POLL needs CAP_NET_ADMIN, leaving it off for the '%s' tuning", myName.c_str() );
+		}
+	}
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	if ( myNotSentLowat > 0 )
+		ok = setInt( fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, myNotSentLowat, "TCP_NOTSENT_LOWAT", priority ) && ok;
+#endif
+#ifdef TCP_CONGESTION
+	if ( ! myCongestion.empty() )
+	{
+		if ( setsockopt( fd, IPPROTO_TCP, TCP_CONGESTION, myCongestion.c_str(), static_cast<socklen_t>( myCongestion.size() ) ) < 0 )
+		{
+			SP_LOG( priority, "Unable to set TCP_CONGESTION '%s': %s", myCongestion.c_str(), strerror( errno ) );
+			ok = false;
+		}
+	}
+#endif
+
+	if ( myTOS != 0 )
+		ok = setInt( fd, IPPROTO_IP, IP_TOS, myTOS, "IP_TOS", priority ) && ok;
+
+	return ok;
+}
+
+
+////////////////////////////////////////
+
@@ -0,0 +1,91 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <string>
+
+
+////////////////////////////////////////
+
+
+/// A set of socket options for the TCP connections we accept.
+///
+/// The "default" profile is applied to the listening socket only, and
+/// accepted connections inherit it from there. Any other profile, or
+/// any override, is applied to each accepted connection before it is
+/// handed off, so the child receives a socket that is already tuned.
+/// Buffer sizes always go on the listener as well, since they have to
+/// be in place before the handshake to affect window scaling.
+class SocketTuning
+{
+public:
+	SocketTuning( void );
+
+	/// Loads a named profile ("default", "latency" or "throughput"),
+	/// optionally followed by comma separated key=value overrides, i.e.
+	/// "latency,rcvbuf=262144,congestion=bbr". Returns false on a
+	/// malformed spec
+	bool parse( const std::string &spec );
+
+	const std::string &name( void ) const { return myName; }
+
+	/// Whether applyAccepted needs to be called for each connection
+	bool perConnection( void ) const { return myPerConnection; }
+
+	/// Sets the options a listening socket should carry, throws on error
+	void applyListener( int fd ) const;
+
+	/// Sets the per connection options on an accepted socket. Failures
+	/// are logged, and false returned, but the socket is still usable
+	bool applyAccepted( int fd ) const;
+
+private:
+	void loadProfile( const std::string &profile );
+	bool setOption( const std::string &key, const std::string &val );
+	bool apply( int fd, bool buffers, bool options, int priority ) const;
+
+	std::string myName;
+	bool myPerConnection;
+
+	int myRcvBuf;
+	int mySndBuf;
+	bool myKeepAlive;
+	int myKeepIdle;
+	int myKeepIntvl;
+	int myKeepCnt;
+	bool myNoDelay;
+	bool myCork;
+	bool myQuickAck;
+	int myUserTimeout;
+	int myBusyPoll;
+	/// set once SO_BUSY_POLL has been refused for want of
+	/// CAP_NET_ADMIN, after which it isn't tried again
+	mutable int myBusyPollDenied;
+	int myNotSentLowat;
+	int myTOS;
+	std::string myCongestion;
+};
+
+
+////////////////////////////////////////
+
@@ -0,0 +1,432 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include "SpliceProxy.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+
+#include "AsyncLog.h"
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+bool
+setNonBlocking( int fd )
+{
+	int flags = fcntl( fd, F_GETFL, 0 );
+	return flags != -1 && fcntl( fd, F_SETFL, flags | O_NONBLOCK ) != -1;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+SpliceProxy::SpliceProxy( size_t maxIdlePipes )
+		: myEpoll( -1 ), myMaxIdlePipes( maxIdlePipes ), myPipeSize( 65536 ), mySessionCount( 0 ), mySessions( NULL )
+{
+#ifdef __linux__
+	myEpoll = epoll_create( 64 );
+	if ( myEpoll < 0 )
+		throw std::runtime_error( std::string( "Unable to create epoll descriptor: " ) + strerror( errno ) );
+	fcntl( myEpoll, F_SETFD, FD_CLOEXEC );
+#else
+	throw std::runtime_error( "Splice proxying is only supported on linux" );
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+SpliceProxy::~SpliceProxy( void )
+{
+	closeAll();
+
+	for ( size_t i = 0; i != myIdlePipes.size(); ++i )
+		close( myIdlePipes[i] );
+	myIdlePipes.clear();
+
+	if ( myEpoll >= 0 )
+		close( myEpoll );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SpliceProxy::addSession( int client, int backend, pid_t owner )
+{
+	if ( ! setNonBlocking( client ) || ! setNonBlocking( backend ) )
+	{
+		SP_LOG( LOG_ERR, "Unable to make proxied sockets non-blocking: %s", strerror( errno ) );
+		return false;
+	}
+
+	Session *s = new Session;
+	int fds[2] = { client, backend };
+	for ( int i = 0; i != 2; ++i )
+	{
+		Direction &d = s->dir[i];
+		d.from = fds[i];
+		d.to = fds[1 - i];
+		d.pipe[0] = -1;
+		d.pipe[1] = -1;
+		d.buffered = 0;
+		d.eof = false;
+		d.shut = false;
+
+		s->end[i].session = s;
+		s->end[i].fd = fds[i];
+		s->end[i].events = 0;
+	}
+	s->owner = owner;
+	s->dead = false;
+
+	s->prev = NULL;
+	s->next = mySessions;
+	if ( mySessions )
+		mySessions->prev = s;
+	mySessions = s;
+	++mySessionCount;
+
+	updateInterest( s );
+	if ( s->dead )
+	{
+		// couldn't register, the caller still owns the sockets
+		for ( int i = 0; i != 2; ++i )
+		{
+#ifdef __linux__
+			if ( s->end[i].events != 0 )
+				epoll_ctl( myEpoll, EPOLL_CTL_DEL, s->end[i].fd, NULL );
+#endif
+			s->end[i].fd = -1;
+		}
+		endSession( s );
+		return false;
+	}
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SpliceProxy::process( std::vector<pid_t> &finishedOwners )
+{
+#ifdef __linux__
+	struct epoll_event events[64];
+	int n = -1;
+	do
+	{
+		n = epoll_wait( myEpoll, events, 64, 0 );
+	} while ( n == -1 && errno == EINTR );
+
+	if ( n < 0 )
+	{
+		SP_LOG( LOG_ERR, "Error waiting for proxy events: %s", strerror( errno ) );
+		return;
+	}
+
+	// both ends of a session can show up in one batch, so nothing is
+	// freed until the batch is done
+	std::vector<Session *> done;
+	for ( int i = 0; i != n; ++i )
+	{
+		Endpoint *e = reinterpret_cast<Endpoint *>( events[i].data.ptr );
+		Session *s = e->session;
+		if ( s->dead )
+			continue;
+
+		uint32_t ev = events[i].events;
+		size_t idx = static_cast<size_t>( e - s->end );
+		bool ok = ( ev & EPOLLERR ) == 0;
+
+		// readable: move data from this end, writable: move data to it
+		if ( ok && ( ev & ( EPOLLIN | EPOLLHUP ) ) )
+			ok = pump( s->dir[idx] );
+		if ( ok && ( ev & ( EPOLLOUT | EPOLLHUP ) ) )
+			ok = pump( s->dir[1 - idx] );
+
+		if ( ok && ! finished( s ) )
+		{
+			updateInterest( s );
+			if ( ! s->dead )
+				continue;
+		}
+
+		s->dead = true;
+		done.push_back( s );
+	}
+
+	for ( size_t i = 0; i != done.size(); ++i )
+	{
+		finishedOwners.push_back( done[i]->owner );
+		endSession( done[i] );
+	}
+#else
+	( void )finishedOwners;
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+SpliceProxy::closeAll( void )
+{
+	while ( mySessions )
+		endSession( mySessions );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SpliceProxy::pump( Direction &d )
+{
+#ifdef __linux__
+	// a few rounds so a fast pair doesn't need a trip through epoll
+	// for every pipe full, but not so many one session hogs the loop
+	for ( int round = 0; round != 8; ++round )
+	{
+		bool moved = false;
+
+		if ( ! d.eof && d.buffered < myPipeSize )
+		{
+			if ( d.pipe[0] == -1 && ! getPipe( d.pipe ) )
+				return false;
+
+			ssize_t n = splice( d.from, NULL, d.pipe[1], NULL, myPipeSize - d.buffered,
+								SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+			if ( n > 0 )
+			{
+				d.buffered += static_cast<size_t>( n );
+				moved = true;
+			}
+			else if ( n == 0 )
+				d.eof = true;
+			else if ( errno != EAGAIN && errno != EINTR )
+			{
+				SP_LOG( LOG_DEBUG, "Proxy read failed: %s", strerror( errno ) );
+				return false;
+			}
+		}
+
+		if ( d.buffered > 0 )
+		{
+			ssize_t n = splice( d.pipe[0], NULL, d.to, NULL, d.buffered,
+								SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+			if ( n > 0 )
+			{
+				d.buffered -= static_cast<size_t>( n );
+				moved = true;
+			}
+			else if ( n < 0 && errno != EAGAIN && errno != EINTR )
+			{
+				SP_LOG( LOG_DEBUG, "Proxy write failed: %s", strerror( errno ) );
+				return false;
+			}
+		}
+
+		if ( ! moved || d.buffered > 0 )
+			break;
+	}
+
+	if ( d.buffered == 0 && d.pipe[0] != -1 )
+		releasePipe( d.pipe, true );
+
+	// pass the half close along once everything before it is out
+	if ( d.eof && d.buffered == 0 && ! d.shut )
+	{
+		shutdown( d.to, SHUT_WR );
+		d.shut = true;
+	}
+	return true;
+#else
+	( void )d;
+	return false;
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SpliceProxy::finished( const Session *s ) const
+{
+	return s->dir[0].shut && s->dir[1].shut;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SpliceProxy::getPipe( int p[2] )
+{
+	if ( myIdlePipes.size() >= 2 )
+	{
+		p[1] = myIdlePipes.back();
+		myIdlePipes.pop_back();
+		p[0] = myIdlePipes.back();
+		myIdlePipes.pop_back();
+		return true;
+	}
+
+#ifdef __linux__
+	if ( pipe2( p, O_NONBLOCK | O_CLOEXEC ) != 0 )
+	{
+		SP_LOG( LOG_ERR, "Unable to create proxy pipe: %s", strerror( errno ) );
+		p[0] = -1;
+		p[1] = -1;
+		return false;
+	}
+
+# ifdef F_GETPIPE_SZ
+	int sz = fcntl( p[0], F_GETPIPE_SZ );
+	if ( sz > 0 )
+		myPipeSize = static_cast<size_t>( sz );
+# endif
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+SpliceProxy::releasePipe( int p[2], bool clean )
+{
+	// a pipe with data still in it can't be handed to another session
+	if ( clean && myIdlePipes.size() < myMaxIdlePipes * 2 )
+	{
+		myIdlePipes.push_back( p[0] );
+		myIdlePipes.push_back( p[1] );
+	}
+	else
+	{
+		close( p[0] );
+		close( p[1] );
+	}
+	p[0] = -1;
+	p[1] = -1;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SpliceProxy::updateInterest( Session *s )
+{
+#ifdef __linux__
+	for ( int i = 0; i != 2; ++i )
+	{
+		Endpoint &e = s->end[i];
+		uint32_t want = 0;
+		// only read more once the last chunk is gone, so a slow reader
+		// pushes back on a fast writer instead of filling our pipes
+		if ( ! s->dir[i].eof && s->dir[i].buffered == 0 )
+			want |= EPOLLIN;
+		if ( s->dir[1 - i].buffered > 0 )
+			want |= EPOLLOUT;
+
+		if ( want == e.events )
+			continue;
+
+		// an end we aren't waiting on leaves the set entirely, otherwise
+		// a hung up socket would keep reporting EPOLLHUP
+		struct epoll_event ev;
+		memset( &ev, 0, sizeof(ev) );
+		ev.events = want;
+		ev.data.ptr = &e;
+		int op = want == 0 ? EPOLL_CTL_DEL : ( e.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD );
+		if ( epoll_ctl( myEpoll, op, e.fd, &ev ) != 0 )
+		{
+			SP_LOG( LOG_ERR, "Unable to update proxy events: %s", strerror( errno ) );
+			s->dead = true;
+			return;
+		}
+		e.events = want;
+	}
+#else
+	s->dead = true;
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+SpliceProxy::endSession( Session *s )
+{
+	for ( int i = 0; i != 2; ++i )
+	{
+		if ( s->end[i].fd >= 0 )
+			close( s->end[i].fd );
+		if ( s->dir[i].pipe[0] != -1 )
+			releasePipe( s->dir[i].pipe, s->dir[i].buffered == 0 );
+	}
+
+	if ( s->prev )
+		s->prev->next = s->next;
+	else
+		mySessions = s->next;
+	if ( s->next )
+		s->next->prev = s->prev;
+	--mySessionCount;
+
+	delete s;
+}
+
+
+////////////////////////////////////////
+
@@ -0,0 +1,112 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <sys/types.h>
+#include <vector>
+#include <stdint.h>
+
+
+////////////////////////////////////////
+
+
+/// Forwards bytes between pairs of sockets with splice(2) through
+/// pipes, so the payload never gets copied into user space. Used when
+/// the daemon can't receive descriptors and instead listens on its own
+/// private address.
+///
+/// All sessions are driven by one epoll descriptor, which the owner
+/// waits on along with everything else and then calls process().
+/// Only available on linux, the constructor throws elsewhere.
+class SpliceProxy
+{
+public:
+	/// @param maxIdlePipes Number of drained pipe pairs to keep around
+	///                     for reuse by later sessions
+	SpliceProxy( size_t maxIdlePipes = 64 );
+	~SpliceProxy( void );
+
+	/// descriptor to wait for readability on
+	int fd( void ) const { return myEpoll; }
+
+	/// Takes ownership of both sockets and starts forwarding between
+	/// them. owner is handed back by process() once the session ends
+	bool addSession( int client, int backend, pid_t owner );
+
+	/// Moves whatever data is ready without blocking, appending the
+	/// owner of every session that finished
+	void process( std::vector<pid_t> &finished );
+
+	size_t sessionCount( void ) const { return mySessionCount; }
+
+	/// Closes every session immediately
+	void closeAll( void );
+
+private:
+	struct Session;
+
+	struct Direction
+	{
+		int from;
+		int to;
+		int pipe[2];
+		size_t buffered;
+		bool eof;
+		bool shut;
+	};
+
+	struct Endpoint
+	{
+		Session *session;
+		int fd;
+		uint32_t events;
+	};
+
+	struct Session
+	{
+		Direction dir[2];
+		Endpoint end[2];
+		pid_t owner;
+		bool dead;
+		Session *prev;
+		Session *next;
+	};
+
+	bool pump( Direction &d );
+	bool finished( const Session *s ) const;
+	bool getPipe( int p[2] );
+	void releasePipe( int p[2], bool clean );
+	void updateInterest( Session *s );
+	void endSession( Session *s );
+
+	int myEpoll;
+	size_t myMaxIdlePipes;
+	size_t myPipeSize;
+	size_t mySessionCount;
+	std::vector<int> myIdlePipes;
+	Session *mySessions;
+};
+
+
+////////////////////////////////////////
+
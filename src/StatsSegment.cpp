@@ -0,0 +1,224 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#include "StatsSegment.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+#include <sstream>
+
+
+////////////////////////////////////////
+
+
+const char *StatsSegment::kMagic = "SPSTATS";
+
+
+////////////////////////////////////////
+
+
+std::string
+StatsSegment::nameForPort( uint16_t port )
+{
+	std::stringstream name;
+	name << "/socket_protector." << port;
+	return name.str();
+}
+
+
+////////////////////////////////////////
+
+
+StatsSegment::StatsSegment( void )
+		: myPage( NULL )
+{
+}
+
+
+////////////////////////////////////////
+
+
+StatsSegment::~StatsSegment( void )
+{
+	destroy();
+}
+
+
+////////////////////////////////////////
+
+
+void
+StatsSegment::create( const std::string &name )
+{
+	destroy();
+
+	shm_unlink( name.c_str() );
+	int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644 );
+	if ( fd < 0 )
+		throw std::runtime_error( "Unable to create stats segment " + name + ": " + strerror( errno ) );
+
+	if ( ftruncate( fd, sizeof(StatsPage) ) != 0 )
+	{
+		int err = errno;
+		close( fd );
+		shm_unlink( name.c_str() );
+		throw std::runtime_error( "Unable to size stats segment " + name + ": " + strerror( err ) );
+	}
+
+	void *m = mmap( NULL, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( m == MAP_FAILED )
+	{
+		int err = errno;
+		shm_unlink( name.c_str() );
+		throw std::runtime_error( "Unable to map stats segment " + name + ": " + strerror( err ) );
+	}
+
+	myPage = reinterpret_cast<StatsPage *>( m );
+	myName = name;
+	memset( myPage, 0, sizeof(StatsPage) );
+	memcpy( myPage->magic, kMagic, strlen( kMagic ) );
+	myPage->version = kVersion;
+	myPage->size = sizeof(StatsPage);
+}
+
+
+////////////////////////////////////////
+
+
+void
+StatsSegment::destroy( void )
+{
+	if ( ! myPage )
+		return;
+
+	munmap( myPage, sizeof(StatsPage) );
+	shm_unlink( myName.c_str() );
+	myPage = NULL;
+	myName.clear();
+}
+
+
+////////////////////////////////////////
+
+
+StatsPage *
+StatsSegment::beginUpdate( void )
+{
+	uint32_t s = myPage->seq;
+	__atomic_store_n( &myPage->seq, s + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	return myPage;
+}
+
+
+////////////////////////////////////////
+
+
+void
+StatsSegment::endUpdate( void )
+{
+	__atomic_store_n( &myPage->seq, myPage->seq + 1, __ATOMIC_RELEASE );
+}
+
+
+////////////////////////////////////////
+
+
+const StatsPage *
+StatsSegment::attach( const std::string &name )
+{
+	int fd = shm_open( name.c_str(), O_RDONLY, 0 );
+	if ( fd < 0 )
+		return NULL;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || static_cast<size_t>( st.st_size ) < sizeof(StatsPage) )
+	{
+		close( fd );
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *m = mmap( NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( m == MAP_FAILED )
+		return NULL;
+
+	const StatsPage *page = reinterpret_cast<const StatsPage *>( m );
+	if ( strncmp( page->magic, kMagic, sizeof(page->magic) ) != 0 ||
+		 page->version != kVersion || page->size != sizeof(StatsPage) )
+	{
+		munmap( m, sizeof(StatsPage) );
+		errno = EINVAL;
+		return NULL;
+	}
+	return page;
+}
+
+
+////////////////////////////////////////
+
+
+void
+StatsSegment::detach( const StatsPage *page )
+{
+	if ( page )
+		munmap( const_cast<StatsPage *>( page ), sizeof(StatsPage) );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+StatsSegment::read( const StatsPage *shared, StatsPage &copy )
+{
+	for ( int attempt = 0; attempt != 1000; ++attempt )
+	{
+		uint32_t s1 = __atomic_load_n( &shared->seq, __ATOMIC_ACQUIRE );
+		if ( s1 & 1 )
+		{
+			sched_yield();
+			continue;
+		}
+
+		memcpy( &copy, shared, sizeof(StatsPage) );
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		if ( __atomic_load_n( &shared->seq, __ATOMIC_RELAXED ) == s1 )
+			return true;
+	}
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
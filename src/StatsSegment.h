@@ -0,0 +1,141 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+
+
+////////////////////////////////////////
+
+
+/// Live counters as laid out in the shared memory segment. Everything is
+/// cumulative, readers work out rates from successive reads
+struct StatsPage
+{
+	enum
+	{
+		kMaxListeners = 64,
+		kMaxWorkers = 256,
+		/// wait histogram buckets, bucket b counts waits under 2^b us
+		kWaitBuckets = 32
+	};
+
+	struct Listener
+	{
+		uint64_t accepted;
+	};
+
+	struct Worker
+	{
+		int32_t pid;
+		int32_t pool;
+		int32_t connected;
+		int32_t sessions;
+		/// kernel buffer bytes (SIOCOUTQ) handed to the worker that it
+		/// hasn't read off its channel yet. A stand-in for outstanding
+		/// connections: the protector doesn't see what a worker holds
+		uint64_t channelBytes;
+		uint64_t handedOff;
+	};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	/// seqlock, odd while an update is in progress
+	uint32_t seq;
+	int32_t pid;
+	uint32_t port;
+	uint32_t nListeners;
+	uint32_t nWorkers;
+	uint32_t reserved;
+	/// CLOCK_REALTIME ns the protector started, CLOCK_MONOTONIC ns of
+	/// this update
+	int64_t started;
+	int64_t updated;
+
+	uint64_t accepted;
+	uint64_t handedOff;
+	uint64_t avoided;
+	uint64_t respawns;
+	uint64_t queued;
+	uint64_t sniffing;
+	uint64_t waitHist[kWaitBuckets];
+
+	Listener listeners[kMaxListeners];
+	Worker workers[kMaxWorkers];
+};
+
+
+////////////////////////////////////////
+
+
+/// POSIX shared memory segment holding a StatsPage. The protector is the
+/// only writer and updates it under a seqlock, so any number of readers
+/// can poll it without the protector noticing: no system calls, locks or
+/// shared cache lines other than the page itself
+class StatsSegment
+{
+public:
+	static const char *kMagic;
+	static const uint32_t kVersion = 1;
+
+	/// "/socket_protector.<port>"
+	static std::string nameForPort( uint16_t port );
+
+	StatsSegment( void );
+	~StatsSegment( void );
+
+	/// Creates (replacing) the named segment. Throws on failure
+	void create( const std::string &name );
+	/// Unmaps and removes the segment
+	void destroy( void );
+
+	bool isOpen( void ) const { return myPage != NULL; }
+
+	/// Between these the page may be written
+	StatsPage *beginUpdate( void );
+	void endUpdate( void );
+
+	/// Maps an existing segment read only, NULL on failure
+	static const StatsPage *attach( const std::string &name );
+	static void detach( const StatsPage *page );
+
+	/// Consistent copy of a page being updated, false if the writer
+	/// kept it busy for too long
+	static bool read( const StatsPage *shared, StatsPage &copy );
+
+private:
+	StatsSegment( const StatsSegment & );
+	StatsSegment &operator=( const StatsSegment & );
+
+	StatsPage *myPage;
+	std::string myName;
+};
+
+
+////////////////////////////////////////
+
+
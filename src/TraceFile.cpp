@@ -0,0 +1,158 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#include "TraceFile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+
+
+////////////////////////////////////////
+
+
+const char *TraceFile::kMagic = "SPTRACE";
+
+
+////////////////////////////////////////
+
+
+TraceFile::TraceFile( void )
+		: myHeader( NULL ), myRecords( NULL ), myMask( 0 ), myMapSize( 0 )
+{
+}
+
+
+////////////////////////////////////////
+
+
+TraceFile::~TraceFile( void )
+{
+	close();
+}
+
+
+////////////////////////////////////////
+
+
+void
+TraceFile::open( const std::string &path, size_t records )
+{
+	close();
+
+	uint64_t cap = 2;
+	while ( cap < records )
+		cap *= 2;
+	size_t size = sizeof(TraceHeader) + cap * sizeof(TraceRecord);
+
+	int fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+	if ( fd < 0 )
+		throw std::runtime_error( "Unable to create trace file " + path + ": " + strerror( errno ) );
+
+	// reserve the blocks now, rather than find out the disk is full
+	// with a SIGBUS in the middle of recording
+	int rv = posix_fallocate( fd, 0, static_cast<off_t>( size ) );
+	if ( rv != 0 && ftruncate( fd, static_cast<off_t>( size ) ) != 0 )
+	{
+		int err = errno;
+		::close( fd );
+		throw std::runtime_error( "Unable to size trace file " + path + ": " + strerror( err ) );
+	}
+
+	void *m = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if ( m == MAP_FAILED )
+		throw std::runtime_error( "Unable to map trace file " + path + ": " + strerror( errno ) );
+
+	myMapSize = size;
+	myHeader = reinterpret_cast<TraceHeader *>( m );
+	memset( myHeader, 0, sizeof(TraceHeader) );
+	memcpy( myHeader->magic, kMagic, strlen( kMagic ) );
+	myHeader->version = kVersion;
+	myHeader->recordSize = sizeof(TraceRecord);
+	myHeader->capacity = cap;
+	myHeader->head = 0;
+
+	struct timespec wall, mono;
+	clock_gettime( CLOCK_REALTIME, &wall );
+	clock_gettime( CLOCK_MONOTONIC, &mono );
+	myHeader->wallBase = int64_t( wall.tv_sec ) * 1000000000LL + wall.tv_nsec;
+	myHeader->monoBase = int64_t( mono.tv_sec ) * 1000000000LL + mono.tv_nsec;
+	myHeader->pid = static_cast<int32_t>( getpid() );
+
+	myMask = cap - 1;
+	myRecords = reinterpret_cast<TraceRecord *>( myHeader + 1 );
+}
+
+
+////////////////////////////////////////
+
+
+void
+TraceFile::close( void )
+{
+	if ( ! myHeader )
+		return;
+
+	munmap( myHeader, myMapSize );
+	myHeader = NULL;
+	myRecords = NULL;
+	myMask = 0;
+	myMapSize = 0;
+}
+
+
+////////////////////////////////////////
+
+
+const char *
+TraceFile::eventName( int e )
+{
+	switch ( e )
+	{
+		case TraceAccepted: return "accepted";
+		case TraceQueued: return "queued";
+		case TraceHandedOff: return "handed-off";
+		case TraceHandoffFailed: return "handoff-failed";
+		case TraceExpired: return "expired";
+		case TraceDropped: return "dropped";
+		case TraceRouted: return "routed";
+		case TraceSpawned: return "spawned";
+		case TraceConnected: return "connected";
+		case TraceReady: return "ready";
+		case TraceExited: return "exited";
+		case TraceParked: return "parked";
+		default: break;
+	}
+	return "unknown";
+}
+
+
+////////////////////////////////////////
+
+
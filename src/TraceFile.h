@@ -0,0 +1,164 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+
+////////////////////////////////////////
+
+
+/// What happened, stored in TraceRecord::event
+enum TraceEvent
+{
+	/// conn/fd accepted on listener (arg)
+	TraceAccepted = 1,
+	/// waiting for a worker with room, arg is the queue depth
+	TraceQueued,
+	/// passed to worker/pid
+	TraceHandedOff,
+	/// worker/pid couldn't take it, arg is the errno
+	TraceHandoffFailed,
+	/// sniff timeout passed, sent to the default pool
+	TraceExpired,
+	/// closed without a handoff, usually the client left without
+	/// sending anything
+	TraceDropped,
+	/// sniffing picked pool arg
+	TraceRouted,
+	/// worker launched as pid
+	TraceSpawned,
+	/// worker connected its channel
+	TraceConnected,
+	/// proxied worker accepted its first connection
+	TraceReady,
+	/// pid exited, arg is the wait status
+	TraceExited,
+	/// handed back idle by pid, arg is how many are now parked
+	TraceParked
+};
+
+
+/// Start of a trace file
+struct TraceHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t capacity;
+	/// sequence number the next record gets
+	uint64_t head;
+	/// CLOCK_REALTIME and CLOCK_MONOTONIC (ns) read together when the
+	/// file was opened, to turn record times into wall clock times
+	int64_t wallBase;
+	int64_t monoBase;
+	int32_t pid;
+	uint32_t reserved;
+};
+
+
+/// One fixed size entry in the ring following the header
+struct TraceRecord
+{
+	/// sequence number + 1 once complete, 0 while being written
+	uint64_t seq;
+	/// CLOCK_MONOTONIC ns
+	int64_t time;
+	/// connection id, 0 for worker events
+	uint64_t conn;
+	int64_t arg;
+	uint16_t event;
+	uint16_t worker;
+	int32_t fd;
+	int32_t pid;
+	uint32_t reserved;
+};
+
+
+////////////////////////////////////////
+
+
+/// Circular trace of connection and worker events in a shared file
+/// mapping. Recording is a handful of stores into the mapping, no
+/// system calls, and safe from any thread. Since the pages belong to
+/// the file, whatever was recorded is still there if the process
+/// crashes. TraceDump reads it back
+class TraceFile
+{
+public:
+	static const char *kMagic;
+	static const uint32_t kVersion = 1;
+
+	TraceFile( void );
+	~TraceFile( void );
+
+	/// Creates (or replaces) path with room for records (rounded up to
+	/// a power of 2) entries. Throws on failure
+	void open( const std::string &path, size_t records );
+	void close( void );
+
+	bool isOpen( void ) const { return myRecords != NULL; }
+
+	void record( TraceEvent e, uint64_t conn, int fd, pid_t pid, size_t worker, int64_t arg )
+	{
+		if ( ! myRecords )
+			return;
+
+		uint64_t seq = __atomic_fetch_add( &myHeader->head, 1, __ATOMIC_RELAXED );
+		TraceRecord &r = myRecords[seq & myMask];
+		__atomic_store_n( &r.seq, 0, __ATOMIC_RELAXED );
+
+		// vDSO, no system call
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		r.time = int64_t( ts.tv_sec ) * 1000000000LL + ts.tv_nsec;
+		r.conn = conn;
+		r.arg = arg;
+		r.event = static_cast<uint16_t>( e );
+		r.worker = static_cast<uint16_t>( worker );
+		r.fd = fd;
+		r.pid = static_cast<int32_t>( pid );
+		r.reserved = 0;
+		__atomic_store_n( &r.seq, seq + 1, __ATOMIC_RELEASE );
+	}
+
+	static const char *eventName( int e );
+
+private:
+	TraceFile( const TraceFile & );
+	TraceFile &operator=( const TraceFile & );
+
+	TraceHeader *myHeader;
+	TraceRecord *myRecords;
+	uint64_t myMask;
+	size_t myMapSize;
+};
+
+
+////////////////////////////////////////
+
+
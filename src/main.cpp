@@ -25,12 +25,15 @@
 #include "Semaphore.h"
 #include "Daemon.h"
 #include "SocketServer.h"
+#include "AsyncLog.h"
 
 #include <syslog.h>
 #include <iostream>
 #include <vector>
+#include <sstream>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sched.h>
 #include <pwd.h>
 
 
@@ -89,6 +92,66 @@ fixPath( const std::string &cmd )
 }
 
 
+////////////////////////////////////////
+
+
+/// parses "0-3,8:4-7" style lists, colons separate the per-worker sets.
+/// Ids have to fit a cpu_set_t
+bool
+parseCPUSets( const std::string &spec, std::vector< std::vector<int> > &sets )
+{
+#ifdef CPU_SETSIZE
+	const long kMaxCPU = CPU_SETSIZE;
+#else
+	const long kMaxCPU = 1024;
+#endif
+
+	sets.clear();
+	if ( spec == "auto" )
+		return true;
+
+	std::vector<int> cur;
+	const char *p = spec.c_str();
+	while ( true )
+	{
+		char *end = NULL;
+		long first = strtol( p, &end, 10 );
+		if ( end == p || first < 0 )
+			return false;
+		long last = first;
+		p = end;
+		if ( *p == '-' )
+		{
+			++p;
+			last = strtol( p, &end, 10 );
+			if ( end == p || last < first )
+				return false;
+			p = end;
+		}
+		if ( last >= kMaxCPU )
+			return false;
+		for ( long c = first; c <= last; ++c )
+			cur.push_back( static_cast<int>( c ) );
+
+		if ( *p == ',' )
+		{
+			++p;
+			continue;
+		}
+
+		sets.push_back( cur );
+		cur.clear();
+		if ( *p == ':' )
+		{
+			++p;
+			continue;
+		}
+
+		return *p == '\0';
+	}
+}
+
+
 SocketServer *theSocketServer = NULL;
 
 
@@ -153,10 +216,61 @@ usageAndExit( const char *argv0, const char *errorMsg, int exitStatus )
 
 	std::cerr << "Usage: " << argv0
 			  <<
-		" [-h|--help] [-f|--foreground] [-v|--verbose] [--pid-file filename] portnum -- <daemon command> [daemon arguments...]\n"
+		" [-h|--help] [-f|--foreground] [-v|--verbose] [--pid-file filename] [-w|--workers N] [--dispatch mode] [--cpu-affinity cpus] [--listeners N] [--listener-steering mode] [--route matcher command]... [--sniff-timeout msec] [--defer-accept sec] [--fastopen qlen] [--tuning spec] [--listener-tuning N spec]... [--proxy path] [--engine type] [--accept-threads] [--log-file path] [--log-rate N] [--trace file] [--trace-records N] [--stats] [--drain-timeout msec] [--park-timeout sec] portnum -- <daemon command> [daemon arguments...]\n"
 		"\n  --help:       This message"
 		"\n  --foreground: Run the daemon in foreground (default: false)"
 		"\n  --verbose:     Enables more verbose syslog messages (default: false)"
+		"\n  --workers:    Number of copies of the daemon to run (default: 1)"
+		"\n  --dispatch:   How connections are spread across workers, one of"
+		"\n                'roundrobin', 'affinity' (sticky by client address) or"
+		"\n                'cpu' (worker pinned to the CPU the packets arrived on)"
+		"\n                (default: roundrobin)"
+		"\n  --cpu-affinity: Pin workers to CPUs, either 'auto' to split the"
+		"\n                available CPUs evenly, or a list per worker such as"
+		"\n                '0-3:4-7', ids below 1024 (default: not pinned)"
+		"\n  --listeners:  Number of SO_REUSEPORT listening sockets (default: 1)"
+		"\n  --listener-steering: How the kernel picks a listener, one of 'kernel',"
+		"\n                'cpu' or 'hash' (of the client address) (default: kernel)"
+		"\n  --route:      Send connections whose first bytes match to a separate pool"
+		"\n                running command (a single, space separated argument)."
+		"\n                matcher is 'tls', 'http', 'prefix:<text>' or 'hex:<bytes>'."
+		"\n                May be repeated, the daemon command gets everything else"
+		"\n  --sniff-timeout: How long to wait for a routed connection's first bytes"
+		"\n                before giving it to the daemon command (default: 500)"
+		"\n  --defer-accept: Only surface connections once they have sent data, or"
+		"\n                after this many seconds (TCP_DEFER_ACCEPT) (default: off)"
+		"\n  --fastopen:   Enable TCP Fast Open with this pending queue length"
+		"\n                (default: off)"
+		"\n  --tuning:     Socket options for accepted connections, a profile name"
+		"\n                ('default', 'latency' or 'throughput') followed by optional"
+		"\n                ',key=value' overrides (default: default)"
+		"\n  --listener-tuning: As --tuning, but only for listener N (from 0)"
+		"\n  --proxy:      Forward connections to a daemon that listens on a UNIX"
+		"\n                socket instead of passing it the descriptor. Each daemon"
+		"\n                gets a path starting with this prefix, substituted for"
+		"\n                %P in its arguments and set in SOCKET_PROTECTOR_PROXY_PATH"
+		"\n  --engine:     What the protector waits for events with, one of 'select',"
+		"\n                'epoll' or 'uring' (io_uring, falling back to epoll)"
+		"\n                (default: select)"
+		"\n  --accept-threads: Accept and hand off connections on a thread per"
+		"\n                listener, leaving the main thread to look after the"
+		"\n                daemons"
+		"\n  --log-file:   Write the protector's own messages to this file instead"
+		"\n                of syslog. Either way they are written by a background"
+		"\n                thread"
+		"\n  --log-rate:   Maximum messages per second from any one place in the"
+		"\n                code, the rest are counted and reported (default: 20,"
+		"\n                0 for no limit)"
+		"\n  --trace:      Record connection and daemon events into this file, a"
+		"\n                circular binary trace read back with TraceDump"
+		"\n  --trace-records: Number of events the trace file holds before it"
+		"\n                wraps around (default: 65536)"
+		"\n  --stats:      Publish live counters in shared memory for sp-top"
+		"\n  --drain-timeout: Ask daemons being replaced, or stopped, to drain and"
+		"\n                give them this long to finish their connections before"
+		"\n                SIGTERM (default: 0, close the channel and signal at once)"
+		"\n  --park-timeout: Close connections daemons parked (handed back while"
+		"\n                idle) after this many seconds without data (default: 60)"
 			  << std::endl;
 
 	exit( exitStatus );
@@ -182,6 +296,28 @@ main( int argc, char *argv[] )
 	int port = -1;
 	bool isVerbose = false;
 	bool foregroundDaemon = false;
+	long workerCount = 1;
+	SocketServer::DispatchMode dispatch = SocketServer::DispatchRoundRobin;
+	bool pinWorkers = false;
+	long listenerCount = 1;
+	SocketServer::ListenerSteering steering = SocketServer::SteerKernel;
+	std::vector< std::pair< std::string, std::vector<std::string> > > routes;
+	long sniffTimeout = -1;
+	long deferAccept = 0;
+	long fastOpen = 0;
+	SocketTuning tuning;
+	std::vector< std::pair<size_t, SocketTuning> > listenerTunings;
+	std::vector< std::vector<int> > cpuSets;
+	std::string proxyPrefix;
+	EventEngine::Type engine = EventEngine::EngineSelect;
+	bool acceptThreads = false;
+	std::string logFile;
+	long logRate = -1;
+	std::string traceFile;
+	long traceRecords = 65536;
+	bool stats = false;
+	long drainTimeout = 0;
+	long parkTimeout = 60;
 
 	openlog( "socket_protector", LOG_PID | LOG_NOWAIT | LOG_CONS | LOG_PERROR, LOG_DAEMON );
 
@@ -205,6 +341,222 @@ main( int argc, char *argv[] )
 
 			pidFile = argv[a];
 		}
+		else if ( curarg == "-w" || curarg == "-workers" || curarg == "--workers" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			workerCount = strtol( argv[a], NULL, 10 );
+			if ( workerCount <= 0 || workerCount > 1024 )
+				usageAndExit( argv[0], "Invalid worker count", -1 );
+		}
+		else if ( curarg == "-dispatch" || curarg == "--dispatch" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			std::string mode = argv[a];
+			if ( mode == "roundrobin" )
+				dispatch = SocketServer::DispatchRoundRobin;
+			else if ( mode == "affinity" )
+				dispatch = SocketServer::DispatchAffinity;
+			else if ( mode == "cpu" )
+				dispatch = SocketServer::DispatchCPU;
+			else
+				usageAndExit( argv[0], "Unknown dispatch mode", -1 );
+		}
+		else if ( curarg == "-cpu-affinity" || curarg == "--cpu-affinity" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			if ( ! parseCPUSets( argv[a], cpuSets ) )
+				usageAndExit( argv[0], "Invalid CPU list", -1 );
+			pinWorkers = true;
+		}
+		else if ( curarg == "-listeners" || curarg == "--listeners" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			listenerCount = strtol( argv[a], NULL, 10 );
+			if ( listenerCount <= 0 || listenerCount > 256 )
+				usageAndExit( argv[0], "Invalid listener count", -1 );
+		}
+		else if ( curarg == "-listener-steering" || curarg == "--listener-steering" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			std::string mode = argv[a];
+			if ( mode == "kernel" )
+				steering = SocketServer::SteerKernel;
+			else if ( mode == "cpu" )
+				steering = SocketServer::SteerCPU;
+			else if ( mode == "hash" )
+				steering = SocketServer::SteerHash;
+			else
+				usageAndExit( argv[0], "Unknown listener steering mode", -1 );
+		}
+		else if ( curarg == "-route" || curarg == "--route" )
+		{
+			a += 2;
+			if ( a >= argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			std::string matcher = argv[a - 1];
+			if ( ! SocketServer::isValidMatcher( matcher ) )
+				usageAndExit( argv[0], "Invalid route matcher", -1 );
+
+			std::vector<std::string> routeCmd;
+			std::stringstream cmdStr( argv[a] );
+			std::string word;
+			while ( cmdStr >> word )
+				routeCmd.push_back( word );
+			if ( routeCmd.empty() )
+				usageAndExit( argv[0], "Missing route command", -1 );
+			if ( routeCmd[0][0] != '/' )
+				routeCmd[0] = fixPath( routeCmd[0] );
+
+			routes.push_back( std::make_pair( matcher, routeCmd ) );
+		}
+		else if ( curarg == "-sniff-timeout" || curarg == "--sniff-timeout" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			sniffTimeout = strtol( argv[a], NULL, 10 );
+			if ( sniffTimeout < 0 )
+				usageAndExit( argv[0], "Invalid sniff timeout", -1 );
+		}
+		else if ( curarg == "-defer-accept" || curarg == "--defer-accept" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			deferAccept = strtol( argv[a], NULL, 10 );
+			if ( deferAccept <= 0 || deferAccept > 3600 )
+				usageAndExit( argv[0], "Invalid defer accept timeout", -1 );
+		}
+		else if ( curarg == "-fastopen" || curarg == "--fastopen" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			fastOpen = strtol( argv[a], NULL, 10 );
+			if ( fastOpen <= 0 || fastOpen > 65535 )
+				usageAndExit( argv[0], "Invalid fast open queue length", -1 );
+		}
+		else if ( curarg == "-tuning" || curarg == "--tuning" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			if ( ! tuning.parse( argv[a] ) )
+				usageAndExit( argv[0], "Invalid tuning specification", -1 );
+		}
+		else if ( curarg == "-listener-tuning" || curarg == "--listener-tuning" )
+		{
+			a += 2;
+			if ( a >= argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			long l = strtol( argv[a - 1], NULL, 10 );
+			SocketTuning t;
+			if ( l < 0 || l > 255 || ! t.parse( argv[a] ) )
+				usageAndExit( argv[0], "Invalid listener tuning specification", -1 );
+			listenerTunings.push_back( std::make_pair( static_cast<size_t>( l ), t ) );
+		}
+		else if ( curarg == "-proxy" || curarg == "--proxy" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			proxyPrefix = argv[a];
+			if ( proxyPrefix.empty() )
+				usageAndExit( argv[0], "Invalid proxy path", -1 );
+		}
+		else if ( curarg == "-engine" || curarg == "--engine" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			if ( ! EventEngine::parseType( argv[a], engine ) )
+				usageAndExit( argv[0], "Unknown engine", -1 );
+		}
+		else if ( curarg == "-accept-threads" || curarg == "--accept-threads" )
+			acceptThreads = true;
+		else if ( curarg == "-log-file" || curarg == "--log-file" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			logFile = argv[a];
+		}
+		else if ( curarg == "-log-rate" || curarg == "--log-rate" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			logRate = strtol( argv[a], NULL, 10 );
+			if ( logRate < 0 )
+				usageAndExit( argv[0], "Invalid log rate", -1 );
+		}
+		else if ( curarg == "-trace" || curarg == "--trace" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			traceFile = argv[a];
+		}
+		else if ( curarg == "-trace-records" || curarg == "--trace-records" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			traceRecords = strtol( argv[a], NULL, 10 );
+			if ( traceRecords <= 0 || traceRecords > ( 1L << 26 ) )
+				usageAndExit( argv[0], "Invalid trace record count", -1 );
+		}
+		else if ( curarg == "-stats" || curarg == "--stats" )
+		{
+			stats = true;
+		}
+		else if ( curarg == "-drain-timeout" || curarg == "--drain-timeout" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			drainTimeout = strtol( argv[a], NULL, 10 );
+			if ( drainTimeout < 0 || drainTimeout > 3600000 )
+				usageAndExit( argv[0], "Invalid drain timeout", -1 );
+		}
+		else if ( curarg == "-park-timeout" || curarg == "--park-timeout" )
+		{
+			++a;
+			if ( a == argc )
+				usageAndExit( argv[0], "Invalid arguments", -1 );
+
+			parkTimeout = strtol( argv[a], NULL, 10 );
+			if ( parkTimeout <= 0 || parkTimeout > 86400 )
+				usageAndExit( argv[0], "Invalid park timeout", -1 );
+		}
 		else if ( curarg == "--" )
 		{
 			for ( ++a; a < argc; ++a )
@@ -308,6 +660,32 @@ main( int argc, char *argv[] )
 		setSignalHandlers();
 
 		servPtr.reset( new SocketServer( subCommand, static_cast<uint16_t>( port ) ) );
+		servPtr->setWorkerCount( static_cast<size_t>( workerCount ) );
+		servPtr->setDispatchMode( dispatch );
+		servPtr->setListenerCount( static_cast<size_t>( listenerCount ), steering );
+		for ( size_t r = 0; r != routes.size(); ++r )
+			servPtr->addRoute( routes[r].first, routes[r].second );
+		if ( sniffTimeout >= 0 )
+			servPtr->setSniffTimeout( static_cast<int>( sniffTimeout ) );
+		servPtr->setTuning( tuning );
+		for ( size_t t = 0; t != listenerTunings.size(); ++t )
+			servPtr->setListenerTuning( listenerTunings[t].first, listenerTunings[t].second );
+		servPtr->setDeferAccept( static_cast<int>( deferAccept ) );
+		servPtr->setFastOpen( static_cast<int>( fastOpen ) );
+		if ( ! proxyPrefix.empty() )
+			servPtr->setProxyPath( proxyPrefix );
+		servPtr->setEngine( engine );
+		servPtr->setAcceptThreads( acceptThreads );
+		if ( ! traceFile.empty() )
+			servPtr->setTraceFile( traceFile, static_cast<size_t>( traceRecords ) );
+		if ( stats )
+			servPtr->setStatsSegment( StatsSegment::nameForPort( static_cast<uint16_t>( port ) ) );
+		servPtr->setDrainTimeout( static_cast<int>( drainTimeout ) );
+		servPtr->setParkTimeout( static_cast<int>( parkTimeout ) );
+		if ( pinWorkers )
+			servPtr->setCPUAffinity( cpuSets );
+		else if ( dispatch == SocketServer::DispatchCPU )
+			servPtr->setCPUAffinity( std::vector< std::vector<int> >() );
 		theSocketServer = servPtr.get();
 
 		// ok, we're at a point where we are going to run, so
@@ -319,10 +697,16 @@ main( int argc, char *argv[] )
 			startup.reset();
 		}
 
+		if ( logRate >= 0 )
+			AsyncLog::setRateLimit( static_cast<unsigned>( logRate ) );
+		AsyncLog::start( logFile );
+
 		syslog( LOG_DEBUG, "socket server starting..." );
 
 		theSocketServer->run();
 
+		AsyncLog::stop();
+
 		syslog( LOG_DEBUG, "shutdown requested..." );
 
 		servPtr.reset();
@@ -337,6 +721,8 @@ main( int argc, char *argv[] )
 		syslog( LOG_CRIT, "Unhandled unknown exception" );
 	}
 
+	AsyncLog::stop();
+
 	// failsafe in case we got an exception...
 	if ( startup.get() != NULL )
 		startup->post();
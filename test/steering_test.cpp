@@ -0,0 +1,222 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+
+// Checks that the hash listener steering program does what
+// --listener-steering hash promises: opens a SO_REUSEPORT group of
+// loopback listeners, attaches the program the protector uses, then
+// connects a few times from each of a range of 127.0.0.x source
+// addresses. Fails unless every address lands on the same listener
+// each time, and every listener gets some of the addresses. Passes as
+// skipped where the program can't be attached or the source addresses
+// can't be bound.
+//
+// Usage: steering_test
+
+#include "ListenerSteering.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <vector>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+const int kListeners = 4;
+const int kAddresses = 32;
+const int kConnections = 3;
+
+struct sockaddr_in
+loopback( int host, uint16_t port )
+{
+	struct sockaddr_in a;
+	memset( &a, 0, sizeof(a) );
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl( ( 127U << 24 ) | uint32_t( host ) );
+	a.sin_port = htons( port );
+	return a;
+}
+
+int
+skip( const char *why, int err )
+{
+	printf( "steering_test: skipped, %s: %s\n", why, strerror( err ) );
+	return 0;
+}
+
+/// which listener took a connection from host, -1 if none did, -2 if
+/// the source address couldn't be used
+int
+connectFrom( int host, uint16_t port, const std::vector<int> &listeners )
+{
+	int c = socket( AF_INET, SOCK_STREAM, 0 );
+	if ( c < 0 )
+		return -1;
+
+	struct sockaddr_in from = loopback( host, 0 );
+	if ( bind( c, (struct sockaddr *)&from, sizeof(from) ) != 0 )
+	{
+		int err = errno;
+		close( c );
+		errno = err;
+		return -2;
+	}
+
+	struct sockaddr_in to = loopback( 1, port );
+	if ( connect( c, (struct sockaddr *)&to, sizeof(to) ) != 0 )
+	{
+		close( c );
+		return -1;
+	}
+
+	std::vector<struct pollfd> p( listeners.size() );
+	for ( size_t l = 0; l != listeners.size(); ++l )
+	{
+		p[l].fd = listeners[l];
+		p[l].events = POLLIN;
+		p[l].revents = 0;
+	}
+
+	int which = -1;
+	if ( poll( &p[0], p.size(), 1000 ) > 0 )
+	{
+		for ( size_t l = 0; l != p.size() && which == -1; ++l )
+		{
+			if ( ! ( p[l].revents & POLLIN ) )
+				continue;
+			int fd = accept( listeners[l], NULL, NULL );
+			if ( fd >= 0 )
+			{
+				close( fd );
+				which = static_cast<int>( l );
+			}
+		}
+	}
+	close( c );
+	return which;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( void )
+{
+	std::vector<int> listeners;
+	uint16_t port = 0;
+	for ( int l = 0; l != kListeners; ++l )
+	{
+		int s = socket( AF_INET, SOCK_STREAM, 0 );
+		int on = 1;
+#ifdef SO_REUSEPORT
+		if ( s < 0 || setsockopt( s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) ) != 0 )
+			return skip( "no SO_REUSEPORT", errno );
+#else
+		( void )on;
+		return skip( "no SO_REUSEPORT", ENOPROTOOPT );
+#endif
+
+		struct sockaddr_in a = loopback( 1, port );
+		if ( bind( s, (struct sockaddr *)&a, sizeof(a) ) != 0 || listen( s, 64 ) != 0 )
+		{
+			fprintf( stderr, "steering_test: unable to listen: %s\n", strerror( errno ) );
+			return 1;
+		}
+		if ( port == 0 )
+		{
+			socklen_t len = sizeof(a);
+			getsockname( s, (struct sockaddr *)&a, &len );
+			port = ntohs( a.sin_port );
+		}
+		listeners.push_back( s );
+	}
+
+	int err = attachListenerSteering( listeners[0], false, kListeners );
+	if ( err != 0 )
+		return skip( "unable to attach the steering program", err );
+
+	int failed = 0;
+	int split = 0;
+	std::vector<int> perListener( kListeners, 0 );
+	for ( int h = 2; h != 2 + kAddresses; ++h )
+	{
+		int first = -1;
+		for ( int n = 0; n != kConnections; ++n )
+		{
+			int l = connectFrom( h, port, listeners );
+			if ( l == -2 )
+				return skip( "unable to bind a 127.0.0.x source address", errno );
+			if ( l < 0 )
+			{
+				++failed;
+				continue;
+			}
+			if ( first == -1 )
+			{
+				first = l;
+				++perListener[l];
+			}
+			else if ( l != first )
+			{
+				fprintf( stderr, "steering_test: 127.0.0.%d went to listener %d, then %d\n", h, first, l );
+				++split;
+				break;
+			}
+		}
+	}
+
+	int unused = 0;
+	for ( int l = 0; l != kListeners; ++l )
+	{
+		printf( "listener %d: %d addresses\n", l, perListener[l] );
+		if ( perListener[l] == 0 )
+			++unused;
+	}
+
+	for ( size_t l = 0; l != listeners.size(); ++l )
+		close( listeners[l] );
+
+	if ( failed || split || unused )
+	{
+		fprintf( stderr, "steering_test: FAILED, %d connections failed, %d addresses split, %d listeners unused\n",
+				 failed, split, unused );
+		return 1;
+	}
+
+	printf( "steering_test: ok, %d addresses over %d listeners\n", kAddresses, kListeners );
+	return 0;
+}
@@ -0,0 +1,213 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+
+// Live view of a running SocketProtector started with --stats, read from
+// its shared memory segment. Polling costs the protector nothing, so any
+// number of these can run at once.
+//
+// Usage: sp-top [-i msec] [-n count] port|segment
+//   -i msec   refresh interval (default 1000)
+//   -n count  exit after this many refreshes, without clearing the screen
+//
+// CHAN BYTES is what the kernel still holds of the descriptors handed to
+// a worker, not a count of its connections, which the protector can't see.
+
+#include "StatsSegment.h"
+
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+void
+usage( const char *argv0 )
+{
+	fprintf( stderr, "Usage: %s [-i msec] [-n count] port|segment\n", argv0 );
+	exit( -1 );
+}
+
+double
+rate( uint64_t now, uint64_t before, double secs )
+{
+	if ( secs <= 0 || now < before )
+		return 0.0;
+	return double( now - before ) / secs;
+}
+
+/// upper bound in us of the bucket holding the given fraction of the
+/// waits in (hist - base)
+uint64_t
+percentile( const StatsPage &cur, const StatsPage &base, double frac )
+{
+	uint64_t total = 0;
+	for ( size_t b = 0; b != StatsPage::kWaitBuckets; ++b )
+		total += cur.waitHist[b] - base.waitHist[b];
+	if ( total == 0 )
+		return 0;
+
+	uint64_t want = static_cast<uint64_t>( double( total ) * frac );
+	uint64_t seen = 0;
+	for ( size_t b = 0; b != StatsPage::kWaitBuckets; ++b )
+	{
+		seen += cur.waitHist[b] - base.waitHist[b];
+		if ( seen > want )
+			return uint64_t( 1 ) << b;
+	}
+	return uint64_t( 1 ) << ( StatsPage::kWaitBuckets - 1 );
+}
+
+void
+show( const StatsPage &cur, const StatsPage &prev, bool havePrev )
+{
+	double secs = havePrev ? double( cur.updated - prev.updated ) * 1e-9 : 0.0;
+
+	struct timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	long long up = ( int64_t( now.tv_sec ) * 1000000000LL + now.tv_nsec - cur.started ) / 1000000000LL;
+	printf( "SocketProtector pid %d port %u  up %lld:%02lld:%02lld\n\n",
+			int(cur.pid), unsigned(cur.port), up / 3600, ( up / 60 ) % 60, up % 60 );
+
+	printf( "accepted %llu (%.1f/s)  handed off %llu (%.1f/s)  avoided %llu  respawns %llu\n",
+			(unsigned long long)cur.accepted, rate( cur.accepted, prev.accepted, secs ),
+			(unsigned long long)cur.handedOff, rate( cur.handedOff, prev.handedOff, secs ),
+			(unsigned long long)cur.avoided, (unsigned long long)cur.respawns );
+	printf( "queued %llu  sniffing %llu\n",
+			(unsigned long long)cur.queued, (unsigned long long)cur.sniffing );
+
+	StatsPage zero;
+	memset( &zero, 0, sizeof(zero) );
+	const StatsPage &base = havePrev ? prev : zero;
+	if ( percentile( cur, base, 1.0 ) )
+		printf( "accept to handoff (us)  p50 <%llu  p90 <%llu  p99 <%llu  %s\n\n",
+				(unsigned long long)percentile( cur, base, 0.5 ),
+				(unsigned long long)percentile( cur, base, 0.9 ),
+				(unsigned long long)percentile( cur, base, 0.99 ),
+				havePrev ? "(interval)" : "(since start)" );
+	else
+		printf( "accept to handoff (us)  -\n\n" );
+
+	printf( "%-9s %12s %10s\n", "LISTENER", "ACCEPTED", "RATE/s" );
+	for ( uint32_t l = 0; l != cur.nListeners; ++l )
+		printf( "%-9u %12llu %10.1f\n", unsigned(l),
+				(unsigned long long)cur.listeners[l].accepted,
+				rate( cur.listeners[l].accepted, prev.listeners[l].accepted, secs ) );
+
+	printf( "\n%-7s %7s %5s %5s %9s %10s %12s %10s\n",
+			"WORKER", "PID", "POOL", "CONN", "SESSIONS", "CHAN BYTES", "HANDED OFF", "RATE/s" );
+	for ( uint32_t w = 0; w != cur.nWorkers; ++w )
+	{
+		const StatsPage::Worker &sw = cur.workers[w];
+		printf( "%-7u %7d %5d %5s %9d %10llu %12llu %10.1f\n", unsigned(w),
+				int(sw.pid), int(sw.pool), sw.connected ? "yes" : "no",
+				int(sw.sessions), (unsigned long long)sw.channelBytes,
+				(unsigned long long)sw.handedOff,
+				prev.workers[w].pid == sw.pid ? rate( sw.handedOff, prev.workers[w].handedOff, secs ) : 0.0 );
+	}
+	fflush( stdout );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	long interval = 1000;
+	long count = -1;
+	std::string name;
+	for ( int a = 1; a < argc; ++a )
+	{
+		if ( ! strcmp( argv[a], "-i" ) && a + 1 < argc )
+			interval = strtol( argv[++a], NULL, 10 );
+		else if ( ! strcmp( argv[a], "-n" ) && a + 1 < argc )
+			count = strtol( argv[++a], NULL, 10 );
+		else if ( argv[a][0] == '-' || ! name.empty() )
+			usage( argv[0] );
+		else
+			name = argv[a];
+	}
+	if ( name.empty() || interval <= 0 || count == 0 )
+		usage( argv[0] );
+	if ( name[0] != '/' )
+	{
+		long port = strtol( name.c_str(), NULL, 10 );
+		if ( port <= 0 || port > 65535 )
+			usage( argv[0] );
+		name = StatsSegment::nameForPort( static_cast<uint16_t>( port ) );
+	}
+
+	const StatsPage *shared = StatsSegment::attach( name );
+	if ( ! shared )
+	{
+		fprintf( stderr, "%s: no stats segment %s, is the protector running with --stats?\n",
+				 argv[0], name.c_str() );
+		return -1;
+	}
+
+	std::vector<StatsPage> pages( 2 );
+	memset( &pages[0], 0, sizeof(StatsPage) );
+	memset( &pages[1], 0, sizeof(StatsPage) );
+	bool havePrev = false;
+	size_t cur = 0;
+	for ( long n = 0; count < 0 || n < count; ++n )
+	{
+		if ( n )
+			usleep( static_cast<useconds_t>( interval * 1000 ) );
+
+		if ( ! StatsSegment::read( shared, pages[cur] ) )
+			continue;
+
+		// the mapping outlives the segment, notice the protector going
+		if ( kill( pages[cur].pid, 0 ) != 0 )
+		{
+			fprintf( stderr, "%s: protector %d has exited\n", argv[0], int(pages[cur].pid) );
+			break;
+		}
+
+		if ( count < 0 )
+			printf( "\033[H\033[2J" );
+		show( pages[cur], pages[1 - cur], havePrev );
+		if ( count >= 0 && n + 1 < count )
+			printf( "\n" );
+		havePrev = true;
+		cur = 1 - cur;
+	}
+
+	StatsSegment::detach( shared );
+	return 0;
+}
+
@@ -0,0 +1,285 @@
+//
+// Copyright (c) 2012 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+// Reads a trace written with SocketProtector --trace, including one left
+// behind by a protector that crashed, and prints the events in order
+// followed by a summary: event counts and how long connections waited
+// between being accepted and handed to a worker.
+//
+// Usage: trace_dump [-s] [-c conn] tracefile
+//   -s       summary only
+//   -c conn  only the events for one connection id
+
+#include "TraceFile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+void
+usage( const char *argv0 )
+{
+	fprintf( stderr, "Usage: %s [-s] [-c conn] tracefile\n", argv0 );
+	exit( -1 );
+}
+
+void
+printTime( const TraceHeader &h, int64_t t )
+{
+	int64_t wall = h.wallBase + ( t - h.monoBase );
+	time_t secs = static_cast<time_t>( wall / 1000000000LL );
+	struct tm tmWall;
+	localtime_r( &secs, &tmWall );
+	char stamp[32];
+	strftime( stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tmWall );
+	printf( "%s.%06d", stamp, int( ( wall % 1000000000LL ) / 1000 ) );
+}
+
+void
+printRecord( const TraceHeader &h, const TraceRecord &r, const std::map<uint64_t, int64_t> &acceptTimes )
+{
+	printTime( h, r.time );
+	if ( r.conn )
+		printf( "  conn %-8llu fd %-5d %-15s", static_cast<unsigned long long>( r.conn ), int(r.fd), TraceFile::eventName( r.event ) );
+	else
+		printf( "  %-23s %-15s", "", TraceFile::eventName( r.event ) );
+
+	switch ( r.event )
+	{
+		case TraceAccepted:
+			printf( "listener %lld", static_cast<long long>( r.arg ) );
+			break;
+		case TraceQueued:
+			printf( "queue depth %lld", static_cast<long long>( r.arg ) );
+			break;
+		case TraceHandedOff:
+		{
+			printf( "worker %d pid %d", int(r.worker), int(r.pid) );
+			std::map<uint64_t, int64_t>::const_iterator a = acceptTimes.find( r.conn );
+			if ( a != acceptTimes.end() )
+				printf( " after %.3f ms", double( r.time - a->second ) / 1e6 );
+			break;
+		}
+		case TraceHandoffFailed:
+			printf( "worker %d pid %d: %s", int(r.worker), int(r.pid), strerror( int(r.arg) ) );
+			break;
+		case TraceExpired:
+		case TraceRouted:
+			printf( "pool %lld", static_cast<long long>( r.arg ) );
+			break;
+		case TraceSpawned:
+		case TraceConnected:
+		case TraceReady:
+			printf( "worker %d pid %d", int(r.worker), int(r.pid) );
+			break;
+		case TraceExited:
+			printf( "worker %d pid %d status 0x%llx", int(r.worker), int(r.pid), static_cast<unsigned long long>( r.arg ) );
+			break;
+		case TraceParked:
+			printf( "by pid %d, %lld parked", int(r.pid), static_cast<long long>( r.arg ) );
+			break;
+		default:
+			break;
+	}
+	printf( "\n" );
+}
+
+void
+printSummary( const std::vector<TraceRecord> &recs, const std::map<uint64_t, int64_t> &acceptTimes )
+{
+	std::map<int, size_t> counts;
+	std::vector<int64_t> waits;
+	for ( size_t i = 0; i != recs.size(); ++i )
+	{
+		const TraceRecord &r = recs[i];
+		++counts[r.event];
+		if ( r.event != TraceHandedOff )
+			continue;
+		std::map<uint64_t, int64_t>::const_iterator a = acceptTimes.find( r.conn );
+		if ( a != acceptTimes.end() )
+			waits.push_back( r.time - a->second );
+	}
+
+	printf( "\nEvents:\n" );
+	for ( std::map<int, size_t>::const_iterator c = counts.begin(); c != counts.end(); ++c )
+		printf( "  %-15s %10llu\n", TraceFile::eventName( c->first ), static_cast<unsigned long long>( c->second ) );
+
+	if ( waits.empty() )
+		return;
+
+	std::sort( waits.begin(), waits.end() );
+	size_t n = waits.size();
+	printf( "\nAccept to handoff wait (%llu connections):\n", static_cast<unsigned long long>( n ) );
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+	for ( size_t p = 0; p != sizeof(pcts) / sizeof(pcts[0]); ++p )
+	{
+		size_t idx = std::min( n - 1, static_cast<size_t>( pcts[p] / 100.0 * double( n ) ) );
+		printf( "  p%-6g %12.1f us\n", pcts[p], double( waits[idx] ) / 1e3 );
+	}
+	printf( "  %-7s %12.1f us\n", "max", double( waits.back() ) / 1e3 );
+
+	// power of 2 microsecond buckets
+	std::vector<size_t> buckets;
+	for ( size_t i = 0; i != n; ++i )
+	{
+		int64_t us = std::max( waits[i] / 1000, int64_t( 0 ) );
+		size_t b = 0;
+		while ( ( int64_t( 1 ) << b ) <= us )
+			++b;
+		if ( b >= buckets.size() )
+			buckets.resize( b + 1, 0 );
+		++buckets[b];
+	}
+	size_t most = *std::max_element( buckets.begin(), buckets.end() );
+	printf( "\n" );
+	for ( size_t b = 0; b != buckets.size(); ++b )
+	{
+		int bar = static_cast<int>( buckets[b] * 50 / most );
+		printf( "  < %8lld us %10llu |%.*s\n", 1LL << b, static_cast<unsigned long long>( buckets[b] ), bar,
+				"##################################################" );
+	}
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+int
+main( int argc, char *argv[] )
+{
+	bool summaryOnly = false;
+	uint64_t onlyConn = 0;
+	const char *path = NULL;
+	for ( int a = 1; a < argc; ++a )
+	{
+		if ( strcmp( argv[a], "-s" ) == 0 )
+			summaryOnly = true;
+		else if ( strcmp( argv[a], "-c" ) == 0 )
+		{
+			if ( ++a == argc )
+				usage( argv[0] );
+			onlyConn = strtoull( argv[a], NULL, 10 );
+		}
+		else if ( argv[a][0] == '-' || path )
+			usage( argv[0] );
+		else
+			path = argv[a];
+	}
+	if ( ! path )
+		usage( argv[0] );
+
+	int fd = open( path, O_RDONLY );
+	struct stat st;
+	if ( fd < 0 || fstat( fd, &st ) != 0 )
+	{
+		fprintf( stderr, "Unable to open %s: %s\n", path, strerror( errno ) );
+		return -1;
+	}
+	size_t size = static_cast<size_t>( st.st_size );
+	if ( size < sizeof(TraceHeader) )
+	{
+		fprintf( stderr, "%s is not a trace file\n", path );
+		return -1;
+	}
+	void *m = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( m == MAP_FAILED )
+	{
+		fprintf( stderr, "Unable to map %s: %s\n", path, strerror( errno ) );
+		return -1;
+	}
+
+	const TraceHeader &h = *reinterpret_cast<const TraceHeader *>( m );
+	if ( strncmp( h.magic, TraceFile::kMagic, sizeof(h.magic) ) != 0 ||
+		 h.version != TraceFile::kVersion || h.recordSize != sizeof(TraceRecord) ||
+		 h.capacity == 0 || sizeof(TraceHeader) + h.capacity * sizeof(TraceRecord) > size )
+	{
+		fprintf( stderr, "%s is not a trace file this version understands\n", path );
+		return -1;
+	}
+
+	// the ring holds the last capacity records; a slot that doesn't
+	// carry the sequence we expect was being rewritten when the file
+	// was read (or when the protector died)
+	const TraceRecord *ring = reinterpret_cast<const TraceRecord *>( &h + 1 );
+	uint64_t head = h.head;
+	uint64_t first = head > h.capacity ? head - h.capacity : 0;
+	std::vector<TraceRecord> recs;
+	size_t torn = 0;
+	for ( uint64_t seq = first; seq != head; ++seq )
+	{
+		const TraceRecord &r = ring[seq % h.capacity];
+		if ( r.seq != seq + 1 )
+		{
+			++torn;
+			continue;
+		}
+		recs.push_back( r );
+	}
+
+	std::map<uint64_t, int64_t> acceptTimes;
+	for ( size_t i = 0; i != recs.size(); ++i )
+	{
+		if ( recs[i].event == TraceAccepted )
+			acceptTimes[recs[i].conn] = recs[i].time;
+	}
+
+	printf( "Trace of pid %d, %llu records (%llu written, %llu incomplete)\n", int(h.pid),
+			static_cast<unsigned long long>( recs.size() ), static_cast<unsigned long long>( head ),
+			static_cast<unsigned long long>( torn ) );
+
+	if ( ! summaryOnly )
+	{
+		for ( size_t i = 0; i != recs.size(); ++i )
+		{
+			if ( onlyConn == 0 || recs[i].conn == onlyConn )
+				printRecord( h, recs[i], acceptTimes );
+		}
+	}
+
+	if ( onlyConn == 0 )
+		printSummary( recs, acceptTimes );
+
+	munmap( m, size );
+	return 0;
+}
+